@@ -0,0 +1,191 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Replays a capture made with procd.hotplug_capture=<file> through the
+ * hotplug rule engine, the commands the rules dispatch are counted but not
+ * run. Allocations are counted for the procd code linked in here, the
+ * libraries it calls into are not wrapped.
+ */
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libubox/ulog.h>
+#include <libubox/uloop.h>
+
+#include "../procd.h"
+#include "../plug/hotplug.h"
+
+#define UEVENT_BUFFER_SIZE	4096
+
+unsigned int debug;
+
+struct record {
+	char *data;
+	int len;
+};
+
+static uint64_t allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t nmemb, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	allocs++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	allocs++;
+	return __real_realloc(ptr, size);
+}
+
+uint64_t hotplug_bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct record *capture_load(const char *path, int *n)
+{
+	struct record *r = NULL;
+	struct stat s;
+	uint32_t len;
+	char *buf;
+	size_t off;
+	int fd, cnt = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &s)) {
+		ERROR("Failed to open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	buf = malloc(s.st_size);
+	if (!buf || read(fd, buf, s.st_size) != s.st_size) {
+		ERROR("Failed to read %s\n", path);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	for (off = 0; off + sizeof(len) <= s.st_size; off += sizeof(len) + len) {
+		memcpy(&len, buf + off, sizeof(len));
+		if (!len || len > UEVENT_BUFFER_SIZE || off + sizeof(len) + len > s.st_size) {
+			ERROR("Invalid record at offset %zu of %s\n", off, path);
+			break;
+		}
+
+		r = realloc(r, (cnt + 1) * sizeof(*r));
+		if (!r)
+			return NULL;
+		r[cnt].data = buf + off + sizeof(len);
+		r[cnt].len = len;
+		cnt++;
+	}
+
+	*n = cnt;
+
+	return r;
+}
+
+static int usage(const char *prog)
+{
+	ERROR("Usage: %s [options] <rules> <capture>\n"
+		"Options:\n"
+		"\t-n <loops>\tReplay the capture this many times (default 100)\n"
+		"\t-d <level>\tEnable debug messages\n"
+		"\n", prog);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	static char buf[UEVENT_BUFFER_SIZE + 1];
+	uint64_t start, ns, a, cmds;
+	struct record *r;
+	int loops = 100, ch, n = 0, i, j;
+
+	ulog_open(ULOG_STDIO, LOG_DAEMON, "hotplug-bench");
+
+	while ((ch = getopt(argc, argv, "n:d:")) != -1) {
+		switch (ch) {
+		case 'n':
+			loops = atoi(optarg);
+			break;
+		case 'd':
+			debug = atoi(optarg);
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+
+	if (argc - optind != 2 || loops < 1)
+		return usage(argv[0]);
+
+	r = capture_load(argv[optind + 1], &n);
+	if (!r || !n) {
+		ERROR("No events in %s\n", argv[optind + 1]);
+		return 1;
+	}
+
+	uloop_init();
+	hotplug_bench_init(argv[optind]);
+
+	a = allocs;
+	start = hotplug_bench_ns();
+	for (i = 0; i < loops; i++) {
+		for (j = 0; j < n; j++) {
+			/* parsing the event modifies it */
+			memcpy(buf, r[j].data, r[j].len);
+			buf[r[j].len] = '\0';
+			hotplug_bench_event(buf, r[j].len);
+		}
+	}
+	ns = hotplug_bench_ns() - start;
+	a = allocs - a;
+	cmds = hotplug_bench_cmds();
+
+	printf("events     %" PRIu64 " (%d in the capture, %d loops)\n", (uint64_t) n * loops, n, loops);
+	printf("events/s   %.0f\n", (double) n * loops * 1000000000 / (ns ? ns : 1));
+	printf("ns/event   %.0f\n", (double) ns / ((uint64_t) n * loops));
+	printf("commands   %.2f per event\n", (double) cmds / ((uint64_t) n * loops));
+	printf("allocs     %.2f per event\n", (double) a / ((uint64_t) n * loops));
+	hotplug_bench_rules(stdout);
+
+	return 0;
+}
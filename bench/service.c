@@ -0,0 +1,497 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Drives the service object's methods with synthetic services, each with
+ * a number of instances and triggers, and reports the time spent per call.
+ * ubus is replaced by the stubs below, spawning, kill() and the process
+ * handling of uloop are wrapped at link time: instances get made up pids,
+ * and the ones that were signalled exit on the next bench_reap().
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libubox/blobmsg.h>
+#include <libubox/ulog.h>
+#include <libubox/uloop.h>
+#include <libubus.h>
+
+#include "../procd.h"
+#include "../rcS.h"
+#include "../spawn.h"
+#include "../service/service.h"
+#include "../service/instance.h"
+#include "../service/cgroup.h"
+
+#define BENCH_PID_BASE	100000
+
+unsigned int debug;
+int upgrade_running;
+
+static struct ubus_context bench_ctx;
+static struct ubus_request_data bench_req;
+static struct ubus_object *service_obj;
+static uint64_t reply_bytes;
+
+static LIST_HEAD(procs);
+static pid_t next_pid = BENCH_PID_BASE;
+static bool *killed;
+
+static struct blob_buf b;
+static int n_services = 100, n_instances = 2, n_triggers = 2;
+
+/* ubus */
+
+int ubus_add_object(struct ubus_context *ctx, struct ubus_object *obj)
+{
+	if (!strcmp(obj->name, "service"))
+		service_obj = obj;
+
+	return 0;
+}
+
+int ubus_send_reply(struct ubus_context *ctx, struct ubus_request_data *req,
+		    struct blob_attr *msg)
+{
+	reply_bytes += blob_pad_len(msg);
+
+	return 0;
+}
+
+int ubus_notify(struct ubus_context *ctx, struct ubus_object *obj,
+		const char *type, struct blob_attr *msg, int timeout)
+{
+	return 0;
+}
+
+/* the rest of procd */
+
+int rc(const char *file, char *param)
+{
+	return 0;
+}
+
+void watch_add(const char *_name, void *id)
+{
+}
+
+void watch_del(void *id)
+{
+}
+
+void procd_reexec_keep(int fd)
+{
+}
+
+bool cgroup_valid(struct blob_attr *attr)
+{
+	return true;
+}
+
+int cgroup_instance_open(struct service_instance *in)
+{
+	return -1;
+}
+
+void cgroup_instance_kill(struct service_instance *in)
+{
+}
+
+void cgroup_instance_remove(struct service_instance *in)
+{
+}
+
+int cgroup_instance_stats(struct service_instance *in, uint64_t *user_us,
+			  uint64_t *system_us, uint64_t *memory)
+{
+	return -1;
+}
+
+void cgroup_dump(struct blob_buf *b, struct service_instance *in)
+{
+}
+
+/* fork, kill and the exit of processes */
+
+pid_t __wrap_procd_spawn(struct spawn_opts *o);
+int __wrap_kill(pid_t pid, int sig);
+int __wrap_uloop_process_add(struct uloop_process *p);
+int __wrap_uloop_process_delete(struct uloop_process *p);
+
+pid_t __wrap_procd_spawn(struct spawn_opts *o)
+{
+	int n = next_pid - BENCH_PID_BASE + 1;
+
+	killed = realloc(killed, n * sizeof(*killed));
+	if (!killed)
+		return -1;
+	killed[n - 1] = false;
+
+	return next_pid++;
+}
+
+int __wrap_kill(pid_t pid, int sig)
+{
+	if (pid < 0)
+		pid = -pid;
+
+	if (pid < BENCH_PID_BASE || pid >= next_pid) {
+		errno = ESRCH;
+		return -1;
+	}
+
+	if (sig)
+		killed[pid - BENCH_PID_BASE] = true;
+
+	return 0;
+}
+
+int __wrap_uloop_process_add(struct uloop_process *p)
+{
+	if (p->pending)
+		return -1;
+
+	list_add_tail(&p->list, &procs);
+	p->pending = true;
+
+	return 0;
+}
+
+int __wrap_uloop_process_delete(struct uloop_process *p)
+{
+	if (!p->pending)
+		return -1;
+
+	list_del(&p->list);
+	p->pending = false;
+
+	return 0;
+}
+
+static int bench_reap(void)
+{
+	struct uloop_process *p, *tmp;
+	int n = 0;
+
+	list_for_each_entry_safe(p, tmp, &procs, list) {
+		if (!killed[p->pid - BENCH_PID_BASE])
+			continue;
+
+		list_del(&p->list);
+		p->pending = false;
+		p->cb(p, 0);
+		n++;
+	}
+
+	return n;
+}
+
+/* workload */
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_call(const char *method, struct blob_attr *msg)
+{
+	int i;
+
+	for (i = 0; i < service_obj->n_methods; i++)
+		if (!strcmp(service_obj->methods[i].name, method))
+			return service_obj->methods[i].handler(&bench_ctx, service_obj,
+							       &bench_req, method, msg);
+
+	return UBUS_STATUS_METHOD_NOT_FOUND;
+}
+
+static void bench_name(struct blob_buf *b, int svc)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "bench%d", svc);
+	blobmsg_add_string(b, "name", name);
+}
+
+/* bumping gen changes the environment of every instance */
+static void bench_service(struct blob_buf *b, int svc, int gen)
+{
+	void *instances, *in, *a, *t, *r, *c;
+	char buf[32];
+	int i;
+
+	blob_buf_init(b, 0);
+	bench_name(b, svc);
+	snprintf(buf, sizeof(buf), "/etc/init.d/bench%d", svc);
+	blobmsg_add_string(b, "script", buf);
+
+	instances = blobmsg_open_table(b, "instances");
+	for (i = 0; i < n_instances; i++) {
+		snprintf(buf, sizeof(buf), "instance%d", i);
+		in = blobmsg_open_table(b, buf);
+
+		a = blobmsg_open_array(b, "command");
+		blobmsg_add_string(b, NULL, "/bin/sh");
+		blobmsg_add_string(b, NULL, "-c");
+		blobmsg_add_string(b, NULL, "exec sleep 3600");
+		blobmsg_close_array(b, a);
+
+		a = blobmsg_open_table(b, "env");
+		snprintf(buf, sizeof(buf), "%d", gen);
+		blobmsg_add_string(b, "BENCH_GEN", buf);
+		snprintf(buf, sizeof(buf), "%d", i);
+		blobmsg_add_string(b, "BENCH_INSTANCE", buf);
+		blobmsg_close_table(b, a);
+
+		a = blobmsg_open_array(b, "respawn");
+		blobmsg_add_string(b, NULL, "3600");
+		blobmsg_add_string(b, NULL, "5");
+		blobmsg_add_string(b, NULL, "5");
+		blobmsg_close_array(b, a);
+
+		blobmsg_close_table(b, in);
+	}
+	blobmsg_close_table(b, instances);
+
+	t = blobmsg_open_array(b, "triggers");
+	for (i = 0; i < n_triggers; i++) {
+		a = blobmsg_open_array(b, NULL);
+		blobmsg_add_string(b, NULL, "config.change");
+
+		r = blobmsg_open_array(b, NULL);
+		blobmsg_add_string(b, NULL, "if");
+		c = blobmsg_open_array(b, NULL);
+		blobmsg_add_string(b, NULL, "eq");
+		blobmsg_add_string(b, NULL, "package");
+		snprintf(buf, sizeof(buf), "bench%d_%d", svc, i);
+		blobmsg_add_string(b, NULL, buf);
+		blobmsg_close_array(b, c);
+		c = blobmsg_open_array(b, NULL);
+		blobmsg_add_string(b, NULL, "run_script");
+		snprintf(buf, sizeof(buf), "/etc/init.d/bench%d", svc);
+		blobmsg_add_string(b, NULL, buf);
+		blobmsg_add_string(b, NULL, "reload");
+		blobmsg_close_array(b, c);
+		blobmsg_close_array(b, r);
+
+		blobmsg_add_u32(b, NULL, 1000);
+		blobmsg_close_array(b, a);
+	}
+	blobmsg_close_array(b, t);
+}
+
+static void bench_report(const char *name, int ops, uint64_t ns)
+{
+	printf("%-16s %8d ops %12.1f us/op\n", name, ops, (double) ns / 1000 / (ops ? ops : 1));
+}
+
+static void bench_set(const char *name, int gen)
+{
+	uint64_t ns = 0, start;
+	int i;
+
+	for (i = 0; i < n_services; i++) {
+		bench_service(&b, i, gen);
+		start = bench_now();
+		bench_call("set", b.head);
+		ns += bench_now() - start;
+	}
+	bench_report(name, n_services, ns);
+}
+
+/* a config push by an init script: update_start, set, update_complete */
+static void bench_push(int gen)
+{
+	uint64_t ns = 0, start;
+	static struct blob_buf name;
+	int i;
+
+	for (i = 0; i < n_services; i++) {
+		blob_buf_init(&name, 0);
+		bench_name(&name, i);
+		bench_service(&b, i, gen);
+
+		start = bench_now();
+		bench_call("update_start", name.head);
+		bench_call("set", b.head);
+		bench_call("update_complete", name.head);
+		ns += bench_now() - start;
+	}
+	bench_report("push", n_services, ns);
+}
+
+/* unchanged configs of running instances, instance_update() only compares */
+static void bench_config_changed(int loops)
+{
+	struct service_instance *in, *tmp;
+	struct service *s;
+	uint64_t ns = 0, start;
+	int i, n = 0;
+
+	avl_for_each_element(&services, s, avl) {
+		vlist_for_each_element(&s->instances, in, node) {
+			if (!in->proc.pending)
+				continue;
+
+			tmp = calloc(1, sizeof(*tmp));
+			if (!tmp)
+				return;
+			instance_init(tmp, s, in->config);
+
+			start = bench_now();
+			for (i = 0; i < loops; i++)
+				instance_update(in, tmp);
+			ns += bench_now() - start;
+			n += loops;
+
+			instance_free(tmp);
+		}
+	}
+	bench_report("config_changed", n, ns);
+}
+
+static void bench_list(int loops)
+{
+	uint64_t ns = 0, start;
+	int i;
+
+	blob_buf_init(&b, 0);
+	blobmsg_add_u8(&b, "verbose", true);
+
+	reply_bytes = 0;
+	for (i = 0; i < loops; i++) {
+		start = bench_now();
+		bench_call("list", b.head);
+		ns += bench_now() - start;
+	}
+	bench_report("list", loops, ns);
+	printf("%-16s %8" PRIu64 " bytes per reply\n", "", reply_bytes / loops);
+
+	/* nothing changed, every service dump can be reused */
+	ns = 0;
+	for (i = 0; i < loops; i++) {
+		start = bench_now();
+		bench_call("list", b.head);
+		ns += bench_now() - start;
+	}
+	bench_report("list (cached)", loops, ns);
+}
+
+static void bench_delete(void)
+{
+	uint64_t ns = 0, start;
+	int i;
+
+	for (i = 0; i < n_services; i++) {
+		blob_buf_init(&b, 0);
+		bench_name(&b, i);
+		start = bench_now();
+		bench_call("delete", b.head);
+		ns += bench_now() - start;
+	}
+	bench_report("delete", n_services, ns);
+}
+
+static void bench_rss(void)
+{
+	char line[128];
+	FILE *fp;
+
+	fp = fopen("/proc/self/status", "r");
+	if (!fp)
+		return;
+
+	while (fgets(line, sizeof(line), fp))
+		if (!strncmp(line, "VmHWM:", 6) || !strncmp(line, "VmRSS:", 6))
+			fputs(line, stdout);
+	fclose(fp);
+}
+
+static int usage(const char *prog)
+{
+	ERROR("Usage: %s [options]\n"
+		"Options:\n"
+		"\t-s <n>\t\tNumber of services (default 100)\n"
+		"\t-i <n>\t\tInstances per service (default 2)\n"
+		"\t-t <n>\t\tTriggers per service (default 2)\n"
+		"\t-n <loops>\tRuns of the compare and list benchmarks (default 100)\n"
+		"\t-d <level>\tEnable debug messages\n"
+		"\n", prog);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	int loops = 100, ch;
+
+	ulog_open(ULOG_STDIO, LOG_DAEMON, "service-bench");
+
+	while ((ch = getopt(argc, argv, "s:i:t:n:d:")) != -1) {
+		switch (ch) {
+		case 's':
+			n_services = atoi(optarg);
+			break;
+		case 'i':
+			n_instances = atoi(optarg);
+			break;
+		case 't':
+			n_triggers = atoi(optarg);
+			break;
+		case 'n':
+			loops = atoi(optarg);
+			break;
+		case 'd':
+			debug = atoi(optarg);
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+
+	if (n_services < 1 || n_instances < 0 || n_triggers < 0 || loops < 1)
+		return usage(argv[0]);
+
+	uloop_init();
+	trigger_init();
+	service_init();
+	ubus_init_service(&bench_ctx);
+	service_boot_done();
+	if (!service_obj) {
+		ERROR("The service object was not registered\n");
+		return 1;
+	}
+
+	printf("%d services x %d instances x %d triggers\n", n_services, n_instances, n_triggers);
+
+	bench_set("add", 0);
+	bench_set("set (unchanged)", 0);
+	bench_config_changed(loops);
+	bench_set("set (changed)", 1);
+	printf("%-16s %8d instances restarted\n", "", bench_reap());
+	bench_push(2);
+	printf("%-16s %8d instances restarted\n", "", bench_reap());
+	bench_list(loops);
+	bench_delete();
+	printf("%-16s %8d instances stopped\n", "", bench_reap());
+	bench_rss();
+
+	return 0;
+}
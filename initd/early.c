@@ -20,14 +20,22 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "init.h"
+#include "../utils/utils.h"
 #include "../libc-compat.h"
 
 static void
 early_dev(void)
 {
-	mkdev("*", 0600);
+	/* first match wins, so /dev/null is not left at 0600 */
+	static const struct mkdev_pattern devs[] = {
+		{ "/null", 0666 },
+		{ "", 0600 },
+	};
+
+	mkdev_many(devs, ARRAY_SIZE(devs));
 	mknod("/dev/null", 0666, makedev(1, 3));
 }
 
@@ -58,6 +66,19 @@ early_console(const char *dev)
 	fcntl(STDERR_FILENO, F_SETFL, fcntl(STDERR_FILENO, F_GETFL) | O_NONBLOCK);
 }
 
+/* procd.cgroup=v1 keeps the legacy hierarchy for systems that still need it */
+static void
+early_cgroup(void)
+{
+	char line[8];
+
+	if ((!get_cmdline_val("procd.cgroup", line, sizeof(line)) || strcmp(line, "v1")) &&
+	    !mount("cgroup2", "/sys/fs/cgroup", "cgroup2", MS_NODEV | MS_NOEXEC | MS_NOSUID, "nsdelegate"))
+		return;
+
+	mount("cgroup", "/sys/fs/cgroup", "cgroup",  MS_NODEV | MS_NOEXEC | MS_NOSUID, 0);
+}
+
 static void
 early_mounts(void)
 {
@@ -65,7 +86,7 @@ early_mounts(void)
 
 	mount("proc", "/proc", "proc", MS_NOATIME | MS_NODEV | MS_NOEXEC | MS_NOSUID, 0);
 	mount("sysfs", "/sys", "sysfs", MS_NOATIME | MS_NODEV | MS_NOEXEC | MS_NOSUID, 0);
-	mount("cgroup", "/sys/fs/cgroup", "cgroup",  MS_NODEV | MS_NOEXEC | MS_NOSUID, 0);
+	early_cgroup();
 	mount("tmpfs", "/dev", "tmpfs", MS_NOATIME | MS_NOSUID, "mode=0755,size=512K");
 	ignore(symlink("/tmp/shm", "/dev/shm"));
 	mkdir("/dev/pts", 0755);
@@ -73,6 +94,20 @@ early_mounts(void)
 	early_dev();
 
 	early_console("/dev/console");
+	zram_start();
+	umask(oldumask);
+}
+
+/* after the modules are loaded, zram formats /tmp in the meantime */
+void
+early_tmp(void)
+{
+	unsigned int oldumask;
+
+	if (getpid() != 1)
+		return;
+
+	oldumask = umask(0);
 	if (mount_zram_on_tmp()) {
 		mount("tmpfs", "/tmp", "tmpfs", MS_NOSUID | MS_NODEV | MS_NOATIME, 0);
 		mkdir("/tmp/shm", 01777);
@@ -113,6 +113,7 @@ main(int argc, char **argv)
 			watchdog_ping();
 		}
 	}
+	early_tmp();
 	uloop_init();
 	preinit();
 	uloop_run();
@@ -18,13 +18,24 @@
 
 #include "../log.h"
 
+struct mkdev_pattern {
+	const char *name;
+	int mode;
+};
+
 void preinit(void);
 void early(void);
+void early_tmp(void);
 int mkdev(const char *progname, int progmode);
+int mkdev_many(const struct mkdev_pattern *p, int n);
 
 #ifdef ZRAM_TMPFS
+void zram_start(void);
 int mount_zram_on_tmp(void);
 #else
+static inline void zram_start(void) {
+}
+
 static inline int mount_zram_on_tmp(void) {
 	return -ENOSYS;
 }
@@ -26,26 +26,27 @@
 #include <limits.h>
 #include <fnmatch.h>
 
+#include <libubox/utils.h>
+
 #include "init.h"
 
-static char **patterns;
+static struct mkdev_pattern *patterns;
 static int n_patterns;
 static char buf[PATH_MAX];
 static char buf2[PATH_MAX];
-static unsigned int mode = 0600;
 
-static bool find_pattern(const char *name)
+static int find_pattern(const char *name)
 {
 	int i;
 
 	for (i = 0; i < n_patterns; i++)
-		if (!fnmatch(patterns[i], name, 0))
-			return true;
+		if (!fnmatch(patterns[i].name, name, 0))
+			return i;
 
-	return false;
+	return -1;
 }
 
-static void make_dev(const char *path, bool block, int major, int minor)
+static void make_dev(const char *path, bool block, int major, int minor, unsigned int mode)
 {
 	unsigned int oldumask = umask(0);
 	unsigned int _mode = mode | (block ? S_IFBLK : S_IFCHR);
@@ -72,7 +73,7 @@ static void find_devs(bool block)
 	while ((dp = readdir(dir)) != NULL) {
 		char *c;
 		int major = 0, minor = 0;
-		int len;
+		int len, i;
 
 		if (dp->d_type != DT_LNK)
 			continue;
@@ -86,7 +87,8 @@ static void find_devs(bool block)
 			continue;
 
 		buf[len] = 0;
-		if (!find_pattern(buf))
+		i = find_pattern(buf);
+		if (i < 0)
 			continue;
 
 		c = strrchr(buf, '/');
@@ -94,32 +96,57 @@ static void find_devs(bool block)
 			continue;
 
 		c++;
-		make_dev(c, block, major, minor);
+		make_dev(c, block, major, minor, patterns[i].mode);
 	}
 	closedir(dir);
 }
 
-static char *add_pattern(const char *name)
+/*
+ * Create the nodes for all devices matching any of the patterns with a
+ * single scan of /sys/dev, resolving every link only once. If a device
+ * matches several patterns the mode of the first one is used.
+ */
+int mkdev_many(const struct mkdev_pattern *p, int n)
 {
-	char *str = malloc(strlen(name) + 2);
+	struct mkdev_pattern *pat;
+	char *str;
+	int i, len = 0;
 
-	str[0] = '*';
-	strcpy(str + 1, name);
-	return str;
-}
+	for (i = 0; i < n; i++)
+		len += strlen(p[i].name) + 2;
 
-int mkdev(const char *name, int _mode)
-{
-	char *pattern;
+	pat = calloc_a(n * sizeof(*pat), &str, len);
+	if (!pat)
+		return 1;
+
+	for (i = 0; i < n; i++) {
+		pat[i].name = str;
+		pat[i].mode = p[i].mode;
+		str += sprintf(str, "*%s", p[i].name) + 1;
+	}
 
-	if (chdir("/dev"))
+	if (chdir("/dev")) {
+		free(pat);
 		return 1;
+	}
 
-	pattern = add_pattern(name);
-	patterns = &pattern;
-	mode = _mode;
-	n_patterns = 1;
+	patterns = pat;
+	n_patterns = n;
 	find_devs(true);
 	find_devs(false);
+	patterns = NULL;
+	n_patterns = 0;
+	free(pat);
+
 	return chdir("/");
 }
+
+int mkdev(const char *name, int _mode)
+{
+	struct mkdev_pattern p = {
+		.name = name,
+		.mode = _mode,
+	};
+
+	return mkdev_many(&p, 1);
+}
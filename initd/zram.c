@@ -2,16 +2,19 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <errno.h>
 #include <fcntl.h>
 
 #include <sys/utsname.h>
 #include <sys/mount.h>
+#include <sys/swap.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 
 #include "../log.h"
+#include "../utils/utils.h"
 
 #include "init.h"
 
@@ -20,6 +23,26 @@
 #define ZRAM_MOD_PATH "/lib/modules/%s/zram.ko"
 #define EXT4_MOD_PATH "/lib/modules/%s/ext4.ko"
 
+/* without procd.zram_size, /tmp gets half of the RAM, up to 16 MB */
+#define ZRAM_TMP_DEFAULT_MAX	KB(32)
+#define ZRAM_SWAP_PRIO		100
+
+/*
+ * Set from the kernel command line:
+ *   procd.zram_algo=<algorithm>	compression algorithm, e.g. lz4 or zstd
+ *   procd.zram_streams=<n>		compression streams per cpu
+ *   procd.zram_size=<percent>		size of /tmp as a percentage of the RAM
+ *   procd.zram_swap=<percent>		add a swap device of that size
+ */
+struct zram_config {
+	char algo[16];
+	long streams;
+	long size;
+	long swap;
+};
+
+static pid_t zram_pid;
+
 static long
 proc_meminfo(void)
 {
@@ -31,7 +54,7 @@ proc_meminfo(void)
 	fp = fopen("/proc/meminfo", "r");
 	if (fp == NULL) {
 		ERROR("Can't open /proc/meminfo: %s\n", strerror(errno));
-		return errno;
+		return val;
 	}
 
 	while (fgets(line, sizeof(line), fp)) {
@@ -43,24 +66,49 @@ proc_meminfo(void)
 	}
 	fclose(fp);
 
-	if (val > KB(32))
-		val = KB(32);
+	return val;
+}
+
+static long
+zram_cmdline_num(const char *name, long def, long max)
+{
+	char line[16];
+	long val;
+
+	if (!get_cmdline_val(name, line, sizeof(line)))
+		return def;
+
+	val = atol(line);
+	if (val <= 0 || val > max) {
+		ERROR("Ignoring %s=%s\n", name, line);
+		return def;
+	}
 
 	return val;
 }
 
+static void
+zram_config_load(struct zram_config *cfg)
+{
+	if (!get_cmdline_val("procd.zram_algo", cfg->algo, sizeof(cfg->algo)))
+		cfg->algo[0] = 0;
+	cfg->streams = zram_cmdline_num("procd.zram_streams", 1, 16);
+	cfg->size = zram_cmdline_num("procd.zram_size", 0, 90);
+	cfg->swap = zram_cmdline_num("procd.zram_swap", 0, 90);
+}
+
 static int
-early_insmod(char *module)
+early_insmod(char *module, char *arg)
 {
 	pid_t pid = fork();
 
 	if (!pid) {
-		char *modprobe[] = { "/usr/sbin/modprobe", NULL, NULL };
+		char *modprobe[] = { "/usr/sbin/modprobe", NULL, arg, NULL };
 		char *path;
 		struct utsname ver;
 
 		uname(&ver);
-		path = alloca(sizeof(module) + strlen(ver.release) + 1);
+		path = alloca(strlen(module) + strlen(ver.release) + 1);
 		sprintf(path, module, ver.release);
 		modprobe[1] = path;
 		execvp(modprobe[0], modprobe);
@@ -78,31 +126,125 @@ early_insmod(char *module)
 	return 0;
 }
 
-
-int
-mount_zram_on_tmp(void)
+static int
+zram_write(int dev, const char *attr, const char *val)
 {
-	char *mkfs[] = { "/usr/sbin/mkfs.ext4", "-b", "4096", "-F", "-L", "TEMP", "-m", "0", "/dev/zram0", NULL };
+	char path[64];
 	FILE *fp;
-	long zramsize;
-	pid_t pid;
 	int ret;
 
-	if (early_insmod(ZRAM_MOD_PATH) || early_insmod(EXT4_MOD_PATH)) {
-		ERROR("failed to insmod zram support\n");
+	snprintf(path, sizeof(path), "/sys/block/zram%d/%s", dev, attr);
+	fp = fopen(path, "r+");
+	if (fp == NULL) {
+		ERROR("Can't open %s: %s\n", path, strerror(errno));
 		return -1;
 	}
 
-	mkdev("*", 0600);
+	ret = fputs(val, fp);
+	if (fclose(fp) || ret < 0) {
+		ERROR("Can't write %s: %s\n", path, strerror(errno));
+		return -1;
+	}
 
-	zramsize = proc_meminfo() / 2;
-	fp = fopen("/sys/block/zram0/disksize", "r+");
-	if (fp == NULL) {
-		ERROR("Can't open /sys/block/zram0/disksize: %s\n", strerror(errno));
-		return errno;
+	return 0;
+}
+
+/* the algorithm and the streams have to be set before the disksize */
+static int
+zram_configure(int dev, struct zram_config *cfg, long kb)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	char buf[24];
+
+	if (cpus < 1)
+		cpus = 1;
+
+	if (cfg->algo[0])
+		zram_write(dev, "comp_algorithm", cfg->algo);
+
+	snprintf(buf, sizeof(buf), "%ld", cfg->streams * cpus);
+	zram_write(dev, "max_comp_streams", buf);
+
+	snprintf(buf, sizeof(buf), "%ld", KB(kb));
+	return zram_write(dev, "disksize", buf);
+}
+
+/* the header mkswap would write, a version 1 swap area without bad pages */
+static int
+zram_mkswap(const char *dev, long kb)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	uint32_t info[3] = { 1, KB(kb) / pagesize - 1, 0 };
+	char *page;
+	int fd, ret = -1;
+
+	page = calloc(1, pagesize);
+	if (!page)
+		return -1;
+
+	memcpy(page + 1024, info, sizeof(info));
+	memcpy(page + pagesize - 10, "SWAPSPACE2", 10);
+
+	fd = open(dev, O_WRONLY);
+	if (fd >= 0) {
+		if (write(fd, page, pagesize) == pagesize && !fsync(fd))
+			ret = 0;
+		close(fd);
 	}
-	fprintf(fp, "%ld", KB(zramsize));
-	fclose(fp);
+	free(page);
+
+	if (ret)
+		ERROR("Can't write the swap header to %s: %s\n", dev, strerror(errno));
+
+	return ret;
+}
+
+static void
+zram_swap(struct zram_config *cfg, long kb)
+{
+	if (zram_configure(1, cfg, kb) || zram_mkswap("/dev/zram1", kb))
+		return;
+
+	if (swapon("/dev/zram1", SWAP_FLAG_PREFER |
+		   ((ZRAM_SWAP_PRIO << SWAP_FLAG_PRIO_SHIFT) & SWAP_FLAG_PRIO_MASK))) {
+		ERROR("Can't enable swap on /dev/zram1: %s\n", strerror(errno));
+		return;
+	}
+
+	LOG("Using up to %ld kB of RAM as ZRAM swap\n", kb);
+}
+
+static int
+zram_setup(void)
+{
+	char *mkfs[] = { "/usr/sbin/mkfs.ext4", "-b", "4096", "-F", "-L", "TEMP", "-m", "0",
+		"-E", "lazy_itable_init=1,nodiscard", "/dev/zram0", NULL };
+	struct zram_config cfg;
+	long mem, zramsize;
+	int status;
+	pid_t pid;
+
+	zram_config_load(&cfg);
+
+	if (early_insmod(ZRAM_MOD_PATH, cfg.swap ? "num_devices=2" : NULL) ||
+	    early_insmod(EXT4_MOD_PATH, NULL)) {
+		ERROR("failed to insmod zram support\n");
+		return -1;
+	}
+
+	/* everything else got its node in early_dev() already */
+	mkdev("/zram*", 0600);
+
+	mem = proc_meminfo();
+	if (cfg.size)
+		zramsize = mem * cfg.size / 100;
+	else if (mem > ZRAM_TMP_DEFAULT_MAX)
+		zramsize = ZRAM_TMP_DEFAULT_MAX / 2;
+	else
+		zramsize = mem / 2;
+
+	if (zram_configure(0, &cfg, zramsize))
+		return -1;
 
 	pid = fork();
 	if (!pid) {
@@ -112,17 +254,57 @@ mount_zram_on_tmp(void)
 	} else if (pid <= 0) {
 		ERROR("Can't exec /sbin/mkfs.ext4\n");
 		return -1;
-	} else {
-		waitpid(pid, NULL, 0);
 	}
 
+	/* swap is not needed by anything early, set it up while mkfs runs */
+	if (cfg.swap)
+		zram_swap(&cfg, mem * cfg.swap / 100);
+
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		ERROR("Failed to format /dev/zram0\n");
+		return -1;
+	}
+
+	LOG("Using up to %ld kB of RAM as ZRAM storage on /tmp\n", zramsize);
+
+	return 0;
+}
+
+/*
+ * Loading the modules and formatting run in a child, next to the rest of
+ * the early init, mount_zram_on_tmp() only waits for it to be done.
+ */
+void
+zram_start(void)
+{
+	zram_pid = fork();
+	if (!zram_pid)
+		exit(zram_setup() ? EXIT_FAILURE : EXIT_SUCCESS);
+
+	if (zram_pid < 0)
+		ERROR("Failed to start the zram setup: %s\n", strerror(errno));
+}
+
+int
+mount_zram_on_tmp(void)
+{
+	int status, ret;
+
+	if (zram_pid <= 0)
+		return -1;
+
+	while ((ret = waitpid(zram_pid, &status, 0)) < 0 && errno == EINTR)
+		;
+	zram_pid = 0;
+
+	if (ret < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+		return -1;
+
 	ret = mount("/dev/zram0", "/tmp", "ext4", MS_NOSUID | MS_NODEV | MS_NOATIME, "errors=continue,noquota");
 	if (ret < 0) {
 		ERROR("Can't mount /dev/zram0 on /tmp: %s\n", strerror(errno));
 		return errno;
 	}
 
-	LOG("Using up to %ld kB of RAM as ZRAM storage on /mnt\n", zramsize);
-
 	return 0;
 }
@@ -28,6 +28,8 @@
 
 #include "utils/utils.h"
 #include "procd.h"
+#include "profiler.h"
+#include "spawn.h"
 #include "rcS.h"
 
 #define TAG_ID		0
@@ -58,6 +60,9 @@ struct init_action {
 
 	int respawn;
 	struct uloop_timeout tout;
+
+	/* process left running by the previous procd image, see procd_reexec() */
+	pid_t adopt;
 };
 
 static const char *tab = "/etc/inittab";
@@ -93,36 +98,35 @@ static int dev_exist(const char *dev)
 
 static void fork_worker(struct init_action *a)
 {
-	int fd;
-	pid_t p;
-
-	a->proc.pid = fork();
-	if (!a->proc.pid) {
-		p = setsid();
-
-		fd = dev_open(a->id);
-		if (fd != -1)
-		{
-			dup2(fd, STDIN_FILENO);
-			dup2(fd, STDOUT_FILENO);
-			dup2(fd, STDERR_FILENO);
-			if (fd > STDERR_FILENO)
-				close(fd);
-		}
+	struct spawn_opts o;
+	char tty[64];
 
-		ioctl(STDIN_FILENO, TIOCSCTTY, 1);
-		tcsetpgrp(STDIN_FILENO, p);
+	if (a->adopt > 0) {
+		a->proc.pid = a->adopt;
+		a->adopt = 0;
+		DEBUG(4, "Adopted %s action, pid=%d\n", a->handler->name, (int) a->proc.pid);
+		uloop_process_add(&a->proc);
+		return;
+	}
 
-		execvp(a->argv[0], a->argv);
-		ERROR("Failed to execute %s\n", a->argv[0]);
-		exit(-1);
+	spawn_opts_init(&o);
+	o.argv = a->argv;
+	o.setsid = true;
+	o.ctty = true;
+	if (a->id) {
+		snprintf(tty, sizeof(tty), "%s%s", *a->id == '/' ? "" : "/dev/", a->id);
+		o.tty = tty;
 	}
 
+	a->proc.pid = procd_spawn(&o);
 	if (a->proc.pid > 0) {
 		DEBUG(4, "Launched new %s action, pid=%d\n",
 					a->handler->name,
 					(int) a->proc.pid);
 		uloop_process_add(&a->proc);
+	} else {
+		/* retried just like a worker that exited */
+		uloop_timeout_set(&a->tout, a->respawn);
 	}
 }
 
@@ -142,18 +146,24 @@ static void respawn(struct uloop_timeout *tout)
 
 static void rcdone(struct runqueue *q)
 {
+	PROF_SCOPE();
 	procd_state_next();
 }
 
 static void runrc(struct init_action *a)
 {
+	int jobs = 0;
+
 	if (!a->argv[1] || !a->argv[2]) {
-		ERROR("valid format is rcS <S|K> <param>\n");
+		ERROR("valid format is rcS <S|K> <param> [jobs]\n");
 		return;
 	}
 
+	if (a->argv[3])
+		jobs = atoi(a->argv[3]);
+
 	/* proceed even if no init or shutdown scripts run */
-	if (rcS(a->argv[1], a->argv[2], rcdone))
+	if (rcS(a->argv[1], a->argv[2], jobs, rcdone))
 		rcdone(NULL);
 }
 
@@ -333,3 +343,72 @@ void procd_inittab(void)
 	free(a);
 	regfree(&pat_inittab);
 }
+
+/* the running inittab processes, by their position in /etc/inittab */
+void procd_inittab_dump(struct blob_buf *b)
+{
+	struct init_action *a;
+	void *c, *t;
+	int i = 0;
+
+	c = blobmsg_open_array(b, "inittab");
+	list_for_each_entry(a, &actions, list) {
+		if (a->proc.pending) {
+			t = blobmsg_open_table(b, NULL);
+			blobmsg_add_u32(b, "index", i);
+			blobmsg_add_string(b, "action", a->handler->name);
+			blobmsg_add_u32(b, "pid", a->proc.pid);
+			blobmsg_close_table(b, t);
+		}
+		i++;
+	}
+	blobmsg_close_array(b, c);
+}
+
+enum {
+	INITTAB_INDEX,
+	INITTAB_ACTION,
+	INITTAB_PID,
+	__INITTAB_MAX
+};
+
+static const struct blobmsg_policy inittab_attrs[__INITTAB_MAX] = {
+	[INITTAB_INDEX] = { "index", BLOBMSG_TYPE_INT32 },
+	[INITTAB_ACTION] = { "action", BLOBMSG_TYPE_STRING },
+	[INITTAB_PID] = { "pid", BLOBMSG_TYPE_INT32 },
+};
+
+/*
+ * Runs the respawning actions like the init state does, the ones that
+ * still have a process of the previous procd image adopt it. Entries whose
+ * line moved or changed its action are started anew.
+ */
+void procd_inittab_adopt(struct blob_attr *attr)
+{
+	struct blob_attr *tb[__INITTAB_MAX], *cur;
+	struct init_action *a;
+	int rem, i;
+
+	if (!attr)
+		goto run;
+
+	blobmsg_for_each_attr(cur, attr, rem) {
+		blobmsg_parse(inittab_attrs, __INITTAB_MAX, tb, blobmsg_data(cur), blobmsg_data_len(cur));
+		if (!tb[INITTAB_INDEX] || !tb[INITTAB_ACTION] || !tb[INITTAB_PID])
+			continue;
+
+		i = 0;
+		list_for_each_entry(a, &actions, list) {
+			if (i++ != blobmsg_get_u32(tb[INITTAB_INDEX]))
+				continue;
+			if (!strcmp(a->handler->name, blobmsg_get_string(tb[INITTAB_ACTION])))
+				a->adopt = blobmsg_get_u32(tb[INITTAB_PID]);
+			break;
+		}
+	}
+
+run:
+	procd_inittab_run("respawn");
+	procd_inittab_run("askconsole");
+	procd_inittab_run("askfirst");
+}
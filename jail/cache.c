@@ -0,0 +1,396 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <linux/limits.h>
+
+#include <libubox/list.h>
+#include <libubox/utils.h>
+
+#include "cache.h"
+#include "elf.h"
+#include "fs.h"
+#include "log.h"
+
+#define DEPS_CACHE_MAGIC	"ujail-deps 1"
+
+/*
+ * The dependency closure of a binary is stored in JAIL_CACHE_DIR, one file
+ * per binary. Every line is a tab separated
+ *
+ *   <type> <dev> <ino> <size> <mtime sec> <mtime nsec> <name> <path>
+ *
+ * where type is B for the binary itself, M for any other file that gets
+ * mounted (interpreters), L for a library found by its soname and D for a
+ * library search directory, so that new libraries shadowing old ones
+ * invalidate the entry as well. The entry is only used if every member
+ * still has the same identity, otherwise it gets rebuilt.
+ */
+struct deps_entry {
+	struct list_head list;
+	char type;
+	char *name;
+	char *path;
+	struct stat st;
+};
+
+static struct {
+	bool active;
+	bool partial;
+	char *path;
+	struct list_head entries;
+} rec;
+
+/*
+ * Everything below JAIL_CACHE_DIR is trusted, so the directory has to be
+ * ours and closed to everybody else, no matter who created it.
+ */
+int jail_cache_dir(void)
+{
+	struct stat s;
+
+	if (mkdir(JAIL_CACHE_DIR, 0700) && errno != EEXIST)
+		goto error;
+
+	if (lstat(JAIL_CACHE_DIR, &s))
+		goto error;
+
+	if (!S_ISDIR(s.st_mode) || s.st_uid != geteuid() || (s.st_mode & 077)) {
+		ERROR("refusing to use %s, not a private directory\n", JAIL_CACHE_DIR);
+		return -1;
+	}
+
+	return 0;
+
+error:
+	ERROR("failed to create %s: %s\n", JAIL_CACHE_DIR, strerror(errno));
+	return -1;
+}
+
+static unsigned int deps_cache_hash(const char *path)
+{
+	unsigned int h = 5381;
+
+	while (*path)
+		h = h * 33 + (unsigned char) *path++;
+
+	return h;
+}
+
+static void deps_cache_file(char *buf, int len, const char *path)
+{
+	snprintf(buf, len, "%s/%08x", JAIL_CACHE_DIR, deps_cache_hash(path));
+}
+
+static bool deps_stat_equal(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+		a->st_size == b->st_size &&
+		a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+		a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static void deps_entries_free(struct list_head *head)
+{
+	struct deps_entry *e, *tmp;
+
+	list_for_each_entry_safe(e, tmp, head, list) {
+		list_del(&e->list);
+		free(e);
+	}
+}
+
+static struct deps_entry *deps_entry_add(struct list_head *head, char type,
+					 const char *name, const char *path)
+{
+	struct deps_entry *e;
+	char *_name, *_path;
+
+	e = calloc_a(sizeof(*e),
+		&_name, strlen(name) + 1,
+		&_path, strlen(path) + 1);
+	if (!e)
+		return NULL;
+
+	e->type = type;
+	e->name = strcpy(_name, name);
+	e->path = strcpy(_path, path);
+	list_add_tail(&e->list, head);
+
+	return e;
+}
+
+static struct deps_entry *deps_entry_find(char type, const char *key)
+{
+	struct deps_entry *e;
+
+	list_for_each_entry(e, &rec.entries, list) {
+		if (e->type == 'D' || (type == 'L') != (e->type == 'L'))
+			continue;
+		if (!strcmp(type == 'L' ? e->name : e->path, key))
+			return e;
+	}
+
+	return NULL;
+}
+
+static int deps_cache_parse(FILE *fp, struct list_head *head)
+{
+	char line[2 * PATH_MAX + 128];
+	unsigned long long dev, ino, size;
+	long sec, nsec;
+	char type, *name, *path, *sptr;
+	struct deps_entry *e;
+
+	while (fgets(line, sizeof(line), fp)) {
+		char *f[8];
+		int i;
+
+		f[0] = strtok_r(line, "\t\n", &sptr);
+		for (i = 1; i < ARRAY_SIZE(f) && f[i - 1]; i++)
+			f[i] = strtok_r(NULL, "\t\n", &sptr);
+		if (!f[ARRAY_SIZE(f) - 1])
+			return -1;
+
+		type = f[0][0];
+		dev = strtoull(f[1], NULL, 10);
+		ino = strtoull(f[2], NULL, 10);
+		size = strtoull(f[3], NULL, 10);
+		sec = strtol(f[4], NULL, 10);
+		nsec = strtol(f[5], NULL, 10);
+		name = f[6];
+		path = f[7];
+
+		e = deps_entry_add(head, type, name, path);
+		if (!e)
+			return -1;
+
+		e->st.st_dev = dev;
+		e->st.st_ino = ino;
+		e->st.st_size = size;
+		e->st.st_mtim.tv_sec = sec;
+		e->st.st_mtim.tv_nsec = nsec;
+	}
+
+	return 0;
+}
+
+static bool deps_cache_valid(struct list_head *head)
+{
+	struct deps_entry *e;
+	struct stat st;
+
+	list_for_each_entry(e, head, list) {
+		if (stat(e->path, &st) || !deps_stat_equal(&e->st, &st)) {
+			DEBUG("dependency cache: %s changed\n", e->path);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* add the cached closure of path, returns -1 if there is no valid entry */
+int deps_cache_load(const char *path, int readonly, int error)
+{
+	char file[PATH_MAX], line[PATH_MAX + 32];
+	LIST_HEAD(entries);
+	struct deps_entry *e;
+	int ret = -1;
+	FILE *fp;
+	int fd;
+
+	if (jail_cache_dir())
+		return -1;
+
+	deps_cache_file(file, sizeof(file), path);
+	fd = open(file, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	fp = fdopen(fd, "r");
+	if (!fp) {
+		close(fd);
+		return -1;
+	}
+
+	if (!fgets(line, sizeof(line), fp) ||
+	    strncmp(line, DEPS_CACHE_MAGIC "\t", sizeof(DEPS_CACHE_MAGIC)) ||
+	    !strchr(line, '\n'))
+		goto out;
+
+	*strchr(line, '\n') = 0;
+	if (strcmp(line + sizeof(DEPS_CACHE_MAGIC), path))
+		goto out;
+
+	if (deps_cache_parse(fp, &entries) || !deps_cache_valid(&entries))
+		goto out;
+
+	list_for_each_entry(e, &entries, list) {
+		switch (e->type) {
+		case 'B':
+			add_mount(e->path, readonly, error);
+			break;
+		case 'M':
+			add_mount(e->path, 1, -1);
+			break;
+		case 'L':
+			if (!find_lib(e->name))
+				alloc_library(e->path, e->name);
+			break;
+		}
+	}
+
+	DEBUG("dependency cache hit for %s\n", path);
+	ret = 0;
+
+out:
+	deps_entries_free(&entries);
+	fclose(fp);
+
+	return ret;
+}
+
+void deps_cache_begin(const char *path)
+{
+	struct library_path *p;
+
+	INIT_LIST_HEAD(&rec.entries);
+	rec.path = strdup(path);
+	rec.active = !!rec.path;
+	rec.partial = false;
+
+	list_for_each_entry(p, &library_paths, list)
+		deps_entry_add(&rec.entries, 'D', "-", p->path);
+}
+
+static void deps_cache_note(char type, const char *name, const char *path, bool known)
+{
+	if (!rec.active || rec.partial)
+		return;
+
+	if (deps_entry_find(type, type == 'L' ? name : path))
+		return;
+
+	/*
+	 * Resolved before we started recording, its own dependencies are
+	 * unknown, so the closure can't be stored.
+	 */
+	if (known || strpbrk(path, "\t\n") || strpbrk(name, "\t\n")) {
+		rec.partial = true;
+		return;
+	}
+
+	deps_entry_add(&rec.entries, type, name, path);
+}
+
+void deps_cache_mount(const char *path, bool known)
+{
+	bool root = rec.active && !strcmp(path, rec.path);
+
+	deps_cache_note(root ? 'B' : 'M', "-", path, known);
+}
+
+void deps_cache_library(const char *name, const char *path, bool known)
+{
+	if (!path)
+		path = find_lib(name);
+	if (!path) {
+		rec.partial = true;
+		return;
+	}
+
+	deps_cache_note('L', name, path, known);
+}
+
+static int deps_cache_write(void)
+{
+	char file[PATH_MAX], tmp[PATH_MAX];
+	struct deps_entry *e;
+	FILE *fp;
+	int fd;
+
+	if (jail_cache_dir())
+		return -1;
+
+	deps_cache_file(file, sizeof(file), rec.path);
+	snprintf(tmp, sizeof(tmp), "%s.%d", file, getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -1;
+
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+
+	fprintf(fp, "%s\t%s\n", DEPS_CACHE_MAGIC, rec.path);
+	list_for_each_entry(e, &rec.entries, list) {
+		if (stat(e->path, &e->st))
+			goto error;
+
+		fprintf(fp, "%c\t%llu\t%llu\t%llu\t%ld\t%ld\t%s\t%s\n", e->type,
+			(unsigned long long) e->st.st_dev,
+			(unsigned long long) e->st.st_ino,
+			(unsigned long long) e->st.st_size,
+			(long) e->st.st_mtim.tv_sec, (long) e->st.st_mtim.tv_nsec,
+			e->name, e->path);
+	}
+
+	if (fclose(fp) || rename(tmp, file)) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+
+error:
+	fclose(fp);
+	unlink(tmp);
+	return -1;
+}
+
+/* plain files and static binaries are cheap enough without a cache */
+static bool deps_cache_worth(void)
+{
+	struct deps_entry *e;
+	int n = 0;
+
+	list_for_each_entry(e, &rec.entries, list)
+		if (e->type != 'D' && e->type != 'B')
+			n++;
+
+	return n > 0;
+}
+
+void deps_cache_end(int ret)
+{
+	if (!rec.active)
+		return;
+
+	if (!ret && !rec.partial && deps_cache_worth() && deps_cache_write())
+		DEBUG("failed to write dependency cache for %s\n", rec.path);
+
+	deps_entries_free(&rec.entries);
+	free(rec.path);
+	rec.path = NULL;
+	rec.active = false;
+}
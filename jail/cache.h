@@ -0,0 +1,25 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#ifndef _JAIL_CACHE_H_
+#define _JAIL_CACHE_H_
+
+#include <stdbool.h>
+
+#define JAIL_CACHE_DIR	"/var/run/ujail"
+
+int jail_cache_dir(void);
+int deps_cache_load(const char *path, int readonly, int error);
+void deps_cache_begin(const char *path);
+void deps_cache_mount(const char *path, bool known);
+void deps_cache_library(const char *name, const char *path, bool known);
+void deps_cache_end(int ret);
+
+#endif
@@ -21,6 +21,7 @@
 #include "log.h"
 #include "../capabilities-names.h"
 #include "capabilities.h"
+#include "profile.h"
 
 static int find_capabilities(const char *name)
 {
@@ -33,7 +34,8 @@ static int find_capabilities(const char *name)
 	return -1;
 }
 
-int drop_capabilities(const char *file)
+/* bits set in *keep are the capabilities to keep in the bounding set */
+int parse_capabilities(const char *file, uint64_t *keep)
 {
 	enum {
 		CAP_KEEP,
@@ -51,8 +53,6 @@ int drop_capabilities(const char *file)
 	char *name;
 	uint64_t capdrop = 0LLU;
 
-	DEBUG("dropping capabilities\n");
-
 	blob_buf_init(&b, 0);
 	if (!blobmsg_add_json_from_file(&b, file)) {
 		ERROR("failed to load %s\n", file);
@@ -100,6 +100,15 @@ int drop_capabilities(const char *file)
 		capdrop &= ~(1LLU << cap);
 	}
 
+	*keep = capdrop;
+
+	return 0;
+}
+
+int apply_capabilities(uint64_t capdrop)
+{
+	int cap;
+
 	for (cap = 0; cap <= CAP_LAST_CAP; cap++) {
 		if ( (capdrop & (1LLU << cap)) == 0) {
 			DEBUG("dropping capability %s (%d)\n", capabilities_names[cap], cap);
@@ -114,3 +123,25 @@ int drop_capabilities(const char *file)
 
 	return 0;
 }
+
+int drop_capabilities(const char *file)
+{
+	const struct jail_profile *p;
+	uint64_t keep;
+	size_t size;
+
+	DEBUG("dropping capabilities\n");
+
+	p = jail_profile_open(file, JAIL_PROFILE_CAPS, &size);
+	if (p) {
+		DEBUG("using precompiled capabilities for %s\n", file);
+		keep = p->cap_keep;
+		jail_profile_close(p, size);
+		return apply_capabilities(keep);
+	}
+
+	if (parse_capabilities(file, &keep))
+		return -1;
+
+	return apply_capabilities(keep);
+}
@@ -13,6 +13,10 @@
 #ifndef _JAIL_CAPABILITIES_H_
 #define _JAIL_CAPABILITIES_H_
 
+#include <stdint.h>
+
+int parse_capabilities(const char *file, uint64_t *keep);
+int apply_capabilities(uint64_t keep);
 int drop_capabilities(const char *file);
 
 #endif
@@ -17,6 +17,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <glob.h>
+#include <dirent.h>
 #include <elf.h>
 #include <linux/limits.h>
 
@@ -26,8 +27,19 @@
 #include "fs.h"
 #include "log.h"
 
+#define LIB_INDEX_SIZE	256
+
+/* first file of every name found in the search paths, like ld.so.cache */
+struct lib_index_entry {
+	struct lib_index_entry *next;
+	const char *name;
+	char *path;
+};
+
 struct avl_tree libraries;
-static LIST_HEAD(library_paths);
+LIST_HEAD(library_paths);
+static struct lib_index_entry *lib_index[LIB_INDEX_SIZE];
+static bool lib_index_valid;
 
 static void alloc_library_path(const char *path)
 {
@@ -71,14 +83,138 @@ void alloc_library(const char *path, const char *name)
 	DEBUG("adding library %s (%s)\n", path, name);
 }
 
+static unsigned int lib_index_hash(const char *name)
+{
+	unsigned int h = 5381;
+
+	while (*name)
+		h = h * 33 + (unsigned char) *name++;
+
+	return h % LIB_INDEX_SIZE;
+}
+
+static struct lib_index_entry *lib_index_find(const char *name)
+{
+	struct lib_index_entry *e;
+
+	for (e = lib_index[lib_index_hash(name)]; e; e = e->next)
+		if (!strcmp(e->name, name))
+			return e;
+
+	return NULL;
+}
+
+static void lib_index_add(const char *dir, const char *name)
+{
+	struct lib_index_entry *e;
+	unsigned int h;
+	char *_path;
+
+	if (lib_index_find(name))
+		return;
+
+	e = calloc_a(sizeof(*e), &_path, strlen(dir) + strlen(name) + 2);
+	if (!e)
+		return;
+
+	sprintf(_path, "%s/%s", dir, name);
+	e->path = _path;
+	e->name = _path + strlen(dir) + 1;
+
+	h = lib_index_hash(name);
+	e->next = lib_index[h];
+	lib_index[h] = e;
+}
+
+/* one readdir per search path instead of an open() per path and library */
+static void lib_index_build(void)
+{
+	struct library_path *p;
+	struct dirent *d;
+	DIR *dir;
+	int n = 0;
+
+	lib_index_valid = true;
+	list_for_each_entry(p, &library_paths, list) {
+		struct stat s;
+
+		if (!stat(p->path, &s))
+			p->mtime = s.st_mtim;
+
+		dir = opendir(p->path);
+		if (!dir) {
+			ERROR("failed to index %s, falling back to lookups\n", p->path);
+			lib_index_valid = false;
+			continue;
+		}
+
+		while ((d = readdir(dir)) != NULL) {
+			if (d->d_name[0] == '.' || d->d_type == DT_DIR)
+				continue;
+			lib_index_add(p->path, d->d_name);
+			n++;
+		}
+		closedir(dir);
+	}
+
+	DEBUG("indexed %d files in the library search paths\n", n);
+}
+
+static void lib_index_free(void)
+{
+	struct lib_index_entry *e, *next;
+	int i;
+
+	for (i = 0; i < LIB_INDEX_SIZE; i++) {
+		for (e = lib_index[i]; e; e = next) {
+			next = e->next;
+			free(e);
+		}
+		lib_index[i] = NULL;
+	}
+}
+
+/* procd keeps the index across launches, rebuild it once a search path changed */
+void lib_index_refresh(void)
+{
+	struct library_path *p;
+	struct stat s;
+
+	list_for_each_entry(p, &library_paths, list) {
+		if (!stat(p->path, &s) &&
+		    s.st_mtim.tv_sec == p->mtime.tv_sec &&
+		    s.st_mtim.tv_nsec == p->mtime.tv_nsec)
+			continue;
+
+		DEBUG("%s changed, rebuilding the library index\n", p->path);
+		lib_index_free();
+		lib_index_build();
+		return;
+	}
+}
+
 int lib_open(char **fullpath, const char *file)
 {
+	struct lib_index_entry *e;
 	struct library_path *p;
 	char path[PATH_MAX];
 	int fd = -1;
 
 	*fullpath = NULL;
 
+	if (!strchr(file, '/')) {
+		e = lib_index_find(file);
+		if (e) {
+			fd = open(e->path, O_RDONLY|O_CLOEXEC);
+			if (fd >= 0) {
+				*fullpath = strdup(e->path);
+				return fd;
+			}
+		} else if (lib_index_valid) {
+			return -1;
+		}
+	}
+
 	list_for_each_entry(p, &library_paths, list) {
 		snprintf(path, sizeof(path), "%s/%s", p->path, file);
 		fd = open(path, O_RDONLY|O_CLOEXEC);
@@ -314,4 +450,5 @@ void init_library_search(void)
 	alloc_library_path("/lib64");
 	alloc_library_path("/usr/lib");
 	load_ldso_conf("/etc/ld.so.conf");
+	lib_index_build();
 }
@@ -13,6 +13,8 @@
 #ifndef _JAIL_ELF_H_
 #define _JAIL_ELF_H_
 
+#include <time.h>
+
 #include <libubox/avl.h>
 #include <libubox/avl-cmp.h>
 
@@ -25,14 +27,17 @@ struct library {
 struct library_path {
 	struct list_head list;
 	char *path;
+	struct timespec mtime;
 };
 
 extern struct avl_tree libraries;
+extern struct list_head library_paths;
 
 void alloc_library(const char *path, const char *name);
 int elf_load_deps(const char *path, const char *map);
 const char* find_lib(const char *file);
 void init_library_search(void);
+void lib_index_refresh(void);
 int lib_open(char **fullpath, const char *file);
 
 #endif
@@ -27,7 +27,9 @@
 
 #include <libubox/avl.h>
 #include <libubox/avl-cmp.h>
+#include <libubox/md5.h>
 
+#include "cache.h"
 #include "elf.h"
 #include "fs.h"
 #include "jail.h"
@@ -75,6 +77,64 @@ int mount_all(const char *jailroot) {
 	return 0;
 }
 
+static void mount_digest_add(md5_ctx_t *ctx, const char *path, int readonly)
+{
+	struct stat s;
+
+	md5_hash(path, strlen(path) + 1, ctx);
+	md5_hash(&readonly, sizeof(readonly), ctx);
+	if (stat(path, &s))
+		return;
+
+	md5_hash(&s.st_dev, sizeof(s.st_dev), ctx);
+	md5_hash(&s.st_ino, sizeof(s.st_ino), ctx);
+	md5_hash(&s.st_size, sizeof(s.st_size), ctx);
+	md5_hash(&s.st_mtim, sizeof(s.st_mtim), ctx);
+}
+
+/* identity of everything mount_all() would stage, call it before mount_all() */
+void mount_list_digest(uint32_t *digest)
+{
+	struct library *l;
+	struct mount *m;
+	md5_ctx_t ctx;
+
+	md5_begin(&ctx);
+	avl_for_each_element(&libraries, l, avl)
+		mount_digest_add(&ctx, l->path, 1);
+	avl_for_each_element(&mounts, m, avl)
+		mount_digest_add(&ctx, m->path, m->readonly);
+	md5_end(digest, &ctx);
+}
+
+/*
+ * Joining a running jail stages nothing, make sure everything this binary
+ * needs is already there. Call it from inside the jail.
+ */
+int mount_list_check(void)
+{
+	char path[PATH_MAX];
+	struct library *l;
+	struct mount *m;
+
+	avl_for_each_element(&libraries, l, avl) {
+		snprintf(path, sizeof(path), "%s/%s", l->path, l->name);
+		if (access(path, F_OK)) {
+			ERROR("%s is missing in the jail\n", path);
+			return -1;
+		}
+	}
+
+	avl_for_each_element(&mounts, m, avl) {
+		if (m->error && access(m->path, F_OK)) {
+			ERROR("%s is missing in the jail\n", m->path);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 void mount_list_init(void) {
 	avl_init(&mounts, avl_strcmp, false, NULL);
 }
@@ -102,33 +162,32 @@ static int add_script_interp(const char *path, const char *map, int size)
 	return add_path_and_deps(buf, 1, -1, 0);
 }
 
-int add_path_and_deps(const char *path, int readonly, int error, int lib)
+static int resolve_path_and_deps(const char *path, int readonly, int error)
 {
-	assert(path != NULL);
-
-	if (lib == 0 && path[0] != '/') {
-		ERROR("%s is not an absolute path\n", path);
-		return error;
-	}
-
 	char *map = NULL;
 	int fd, ret = -1;
 	if (path[0] == '/') {
-		if (avl_find(&mounts, path))
+		if (avl_find(&mounts, path)) {
+			deps_cache_mount(path, true);
 			return 0;
+		}
 		fd = open(path, O_RDONLY|O_CLOEXEC);
 		if (fd == -1)
 			return error;
 		add_mount(path, readonly, error);
+		deps_cache_mount(path, false);
 	} else {
-		if (avl_find(&libraries, path))
+		if (avl_find(&libraries, path)) {
+			deps_cache_library(path, NULL, true);
 			return 0;
+		}
 		char *fullpath;
 		fd = lib_open(&fullpath, path);
 		if (fd == -1)
 			return error;
 		if (fullpath) {
 			alloc_library(fullpath, path);
+			deps_cache_library(path, fullpath, false);
 			free(fullpath);
 		}
 	}
@@ -178,3 +237,34 @@ out:
 
 	return ret;
 }
+
+/*
+ * Top level lookups of a binary go through the dependency cache, the
+ * recursive calls for its interpreter and libraries are recorded into it.
+ */
+int add_path_and_deps(const char *path, int readonly, int error, int lib)
+{
+	static int depth;
+	int ret;
+
+	assert(path != NULL);
+
+	if (lib == 0 && path[0] != '/') {
+		ERROR("%s is not an absolute path\n", path);
+		return error;
+	}
+
+	if (depth || lib)
+		return resolve_path_and_deps(path, readonly, error);
+
+	if (!avl_find(&mounts, path) && !deps_cache_load(path, readonly, error))
+		return 0;
+
+	deps_cache_begin(path);
+	depth++;
+	ret = resolve_path_and_deps(path, readonly, error);
+	depth--;
+	deps_cache_end(ret);
+
+	return ret;
+}
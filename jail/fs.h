@@ -13,9 +13,13 @@
 #ifndef _JAIL_FS_H_
 #define _JAIL_FS_H_
 
+#include <stdint.h>
+
 int add_mount(const char *path, int readonly, int error);
 int add_path_and_deps(const char *path, int readonly, int error, int lib);
 int mount_all(const char *jailroot);
+void mount_list_digest(uint32_t *digest);
+int mount_list_check(void);
 void mount_list_init(void);
 
 #endif
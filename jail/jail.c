@@ -15,6 +15,8 @@
 #include <sys/mount.h>
 #include <sys/prctl.h>
 #include <sys/wait.h>
+#include <sys/file.h>
+#include <sys/socket.h>
 
 #include <stdlib.h>
 #include <unistd.h>
@@ -26,16 +28,30 @@
 #include <sched.h>
 #include <linux/limits.h>
 
+#include "cache.h"
 #include "capabilities.h"
 #include "elf.h"
 #include "fs.h"
 #include "jail.h"
+#include "launch.h"
 #include "log.h"
+#include "profile.h"
 
 #include <libubox/uloop.h>
+#include <libubox/utils.h>
 
 #define STACK_SIZE	(1024 * 1024)
-#define OPT_ARGS	"S:C:n:h:r:w:d:psuloc"
+#define OPT_ARGS	"S:C:n:h:r:w:d:psulocTN:J:"
+
+/* namespaces shared between the instances of a jail, in the order passed */
+static const struct {
+	const char *name;
+	int type;
+} shared_ns[] = {
+	{ "mnt", CLONE_NEWNS },
+	{ "uts", CLONE_NEWUTS },
+	{ "ipc", CLONE_NEWIPC },
+};
 
 static struct {
 	char *name;
@@ -48,12 +64,15 @@ static struct {
 	int procfs;
 	int ronly;
 	int sysfs;
-} opts;
+	int template;
+	char *template_root;
+	int ns_socket;
+	int ns_fd[ARRAY_SIZE(shared_ns)];
+	int ns_join;
+} opts = { .ns_socket = -1 };
 
 extern int pivot_root(const char *new_root, const char *put_old);
 
-int debug = 0;
-
 static char child_stack[STACK_SIZE];
 
 static int mkdir_p(char *dir, mode_t mask)
@@ -121,39 +140,186 @@ int mount_bind(const char *root, const char *path, int readonly, int error)
 	return 0;
 }
 
-static int build_jail_fs(void)
+/* stage the config and its precompiled profile, if there is one */
+static void add_profile_mount(const char *file)
 {
-	char jail_root[] = "/tmp/ujail-XXXXXX";
-	if (mkdtemp(jail_root) == NULL) {
-		ERROR("mkdtemp(jail_root) failed: %s\n", strerror(errno));
+	char path[PATH_MAX];
+	struct stat s;
+
+	add_mount(file, 1, -1);
+
+	snprintf(path, sizeof(path), "%s%s", file, JAIL_PROFILE_SUFFIX);
+	if (!stat(path, &s))
+		add_mount(path, 1, -1);
+}
+
+static int add_jail_deps(void)
+{
+	if (add_path_and_deps(*opts.jail_argv, 1, -1, 0)) {
+		ERROR("failed to load dependencies\n");
 		return -1;
 	}
 
-	if (mount("tmpfs", jail_root, "tmpfs", MS_NOATIME, "mode=0755")) {
+	if (opts.seccomp && add_path_and_deps("libpreload-seccomp.so", 1, -1, 1)) {
+		ERROR("failed to load libpreload-seccomp.so\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int build_template(const char *root, const char *sigfile, const char *sig)
+{
+	static const char * const dirs[] = { "old", "proc", "sys" };
+	char path[PATH_MAX];
+	struct stat s;
+	FILE *fp;
+	int i, fd;
+
+	unlink(sigfile);
+	umount2(root, MNT_DETACH);
+	mkdir(root, 0755);
+	if (lstat(root, &s) || !S_ISDIR(s.st_mode)) {
+		ERROR("%s is not a directory\n", root);
+		return -1;
+	}
+
+	if (mount("tmpfs", root, "tmpfs", MS_NOATIME, "mode=0755")) {
 		ERROR("tmpfs mount failed %s\n", strerror(errno));
 		return -1;
 	}
 
-	if (chdir(jail_root)) {
-		ERROR("failed to chdir() in the jail root\n");
+	if (mount_all(root)) {
+		ERROR("mount_all() failed\n");
+		goto error;
+	}
+
+	/* mount points needed once the jail root is read only */
+	for (i = 0; i < ARRAY_SIZE(dirs); i++) {
+		snprintf(path, sizeof(path), "%s/%s", root, dirs[i]);
+		mkdir(path, 0755);
+	}
+
+	if (mount("tmpfs", root, "tmpfs", MS_REMOUNT | MS_RDONLY | MS_NOATIME, "mode=0755")) {
+		ERROR("failed to remount ro %s: %s\n", root, strerror(errno));
+		goto error;
+	}
+
+	fd = open(sigfile, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0)
+		goto error;
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		goto error;
+	}
+	fprintf(fp, "%s\n", sig);
+	fclose(fp);
+
+	DEBUG("built jail template %s\n", root);
+	return 0;
+
+error:
+	umount2(root, MNT_DETACH);
+	return -1;
+}
+
+/*
+ * Staging a jail costs a bind mount per file. With -T the staged tree of a
+ * named jail is kept as a read only template in the initial mount namespace
+ * and every launch only bind mounts it recursively. The template is rebuilt
+ * whenever the options or the identity of any staged file changes.
+ */
+static int prepare_template(void)
+{
+	static char root[PATH_MAX];
+	char sigfile[PATH_MAX], lockfile[PATH_MAX], sig[64], old[64] = "";
+	struct stat s, d;
+	uint32_t digest[4];
+	FILE *fp;
+	int fd, sfd, ret = 0;
+
+	if (add_jail_deps())
+		return -1;
+
+	mount_list_digest(digest);
+	snprintf(sig, sizeof(sig), "%08x%08x%08x%08x-%d%d", digest[0], digest[1],
+		 digest[2], digest[3], opts.procfs, opts.sysfs);
+
+	if (jail_cache_dir())
+		return -1;
+
+	snprintf(root, sizeof(root), "%s/root-%s", JAIL_CACHE_DIR, opts.name);
+	snprintf(sigfile, sizeof(sigfile), "%s.sig", root);
+	snprintf(lockfile, sizeof(lockfile), "%s.lock", root);
+
+	/* serialize instances of the same jail starting at the same time */
+	fd = open(lockfile, O_RDONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0 || flock(fd, LOCK_EX)) {
+		ERROR("failed to lock %s: %s\n", lockfile, strerror(errno));
+		if (fd >= 0)
+			close(fd);
 		return -1;
 	}
 
-	if (add_path_and_deps(*opts.jail_argv, 1, -1, 0)) {
-		ERROR("failed to load dependencies\n");
+	sfd = open(sigfile, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	fp = sfd < 0 ? NULL : fdopen(sfd, "r");
+	if (sfd >= 0 && !fp)
+		close(sfd);
+	if (fp) {
+		if (!fgets(old, sizeof(old), fp))
+			*old = 0;
+		old[strcspn(old, "\n")] = 0;
+		fclose(fp);
+	}
+
+	if (strcmp(old, sig) || stat(root, &s) || stat(JAIL_CACHE_DIR, &d) ||
+	    s.st_dev == d.st_dev)
+		ret = build_template(root, sigfile, sig);
+	else
+		DEBUG("reusing jail template %s\n", root);
+
+	close(fd);
+	if (!ret)
+		opts.template_root = root;
+
+	return ret;
+}
+
+static int build_jail_fs(void)
+{
+	char jail_root[] = "/tmp/ujail-XXXXXX";
+	if (mkdtemp(jail_root) == NULL) {
+		ERROR("mkdtemp(jail_root) failed: %s\n", strerror(errno));
 		return -1;
 	}
 
-	if (opts.seccomp && add_path_and_deps("libpreload-seccomp.so", 1, -1, 1)) {
-		ERROR("failed to load libpreload-seccomp.so\n");
+	if (opts.template_root) {
+		if (mount(opts.template_root, jail_root, NULL, MS_BIND | MS_REC, NULL)) {
+			ERROR("failed to mount -B %s %s: %s\n", opts.template_root,
+			      jail_root, strerror(errno));
+			return -1;
+		}
+	} else if (mount("tmpfs", jail_root, "tmpfs", MS_NOATIME, "mode=0755")) {
+		ERROR("tmpfs mount failed %s\n", strerror(errno));
 		return -1;
 	}
 
-	if (mount_all(jail_root)) {
-		ERROR("mount_all() failed\n");
+	if (chdir(jail_root)) {
+		ERROR("failed to chdir() in the jail root\n");
 		return -1;
 	}
 
+	if (!opts.template_root) {
+		if (add_jail_deps())
+			return -1;
+
+		if (mount_all(jail_root)) {
+			ERROR("mount_all() failed\n");
+			return -1;
+		}
+	}
+
 	char dirbuf[sizeof(jail_root) + 4];
 	snprintf(dirbuf, sizeof(dirbuf), "%s/old", jail_root);
 	mkdir(dirbuf, 0755);
@@ -189,6 +355,9 @@ static char** build_envp(const char *seccomp)
 	static char preload_var[PATH_MAX];
 	static char seccomp_var[PATH_MAX];
 	static char debug_var[] = "LD_DEBUG=all";
+	static char listen_fds_var[32];
+	static char listen_pid_var[32];
+	const char *listen_fds = getenv("LISTEN_FDS");
 	const char *preload_lib = find_lib("libpreload-seccomp.so");
 	int count = 0;
 
@@ -204,6 +373,13 @@ static char** build_envp(const char *seccomp)
 	}
 	if (debug > 1)
 		envp[count++] = debug_var;
+	/* socket activation, the jailed process is the one the fds are meant for */
+	if (listen_fds) {
+		snprintf(listen_fds_var, sizeof(listen_fds_var), "LISTEN_FDS=%s", listen_fds);
+		envp[count++] = listen_fds_var;
+		snprintf(listen_pid_var, sizeof(listen_pid_var), "LISTEN_PID=%d", getpid());
+		envp[count++] = listen_pid_var;
+	}
 
 	return envp;
 }
@@ -225,6 +401,9 @@ static void usage(void)
 	fprintf(stderr, "  -l\t\tjail has /dev/log\n");
 	fprintf(stderr, "  -u\t\tjail has a ubus socket\n");
 	fprintf(stderr, "  -o\t\tremont jail root (/) read only\n");
+	fprintf(stderr, "  -T\t\treuse a read only template of the jail root (needs -n)\n");
+	fprintf(stderr, "  -N <fd>\tsend the mnt, uts and ipc namespaces of the jail over socket fd\n");
+	fprintf(stderr, "  -J <fds>\tjoin the mnt,uts,ipc namespace fds of a running jail\n");
 	fprintf(stderr, "\nWarning: by default root inside the jail is the same\n\
 and he has the same powers as root outside the jail,\n\
 thus he can escape the jail and/or break stuff.\n\
@@ -255,8 +434,89 @@ static int exec_jail(void)
 	exit(EXIT_FAILURE);
 }
 
+/* enter the namespaces of a running instance of the jail instead of building one */
+static int join_jail(void)
+{
+	int i;
+
+	if (add_jail_deps())
+		return -1;
+
+	for (i = 0; i < ARRAY_SIZE(shared_ns); i++) {
+		if (setns(opts.ns_fd[i], shared_ns[i].type)) {
+			ERROR("failed to join the %s namespace: %s\n", shared_ns[i].name, strerror(errno));
+			return -1;
+		}
+		close(opts.ns_fd[i]);
+	}
+
+	if (chdir("/")) {
+		ERROR("failed to chdir() in the jail root\n");
+		return -1;
+	}
+
+	/* the owner staged the dependencies of its own binary, maybe not ours */
+	if (mount_list_check())
+		return -1;
+
+	return 0;
+}
+
+/* hand the namespaces of the jail to procd once the jail is set up */
+static void share_jail(pid_t pid, int ready)
+{
+	char path[64], dummy, cbuf[CMSG_SPACE(sizeof(opts.ns_fd))];
+	struct iovec iov = { .iov_base = &dummy, .iov_len = 1 };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	int fds[ARRAY_SIZE(shared_ns)];
+	int i, n = 0;
+
+	/* the pipe is closed by the exec of the jailed binary or its exit */
+	while (read(ready, &dummy, 1) < 0 && errno == EINTR)
+		;
+	close(ready);
+
+	for (i = 0; i < ARRAY_SIZE(shared_ns); i++) {
+		snprintf(path, sizeof(path), "/proc/%d/ns/%s", pid, shared_ns[i].name);
+		fds[i] = open(path, O_RDONLY | O_CLOEXEC);
+		if (fds[i] >= 0)
+			n++;
+	}
+
+	if (n == ARRAY_SIZE(shared_ns)) {
+		dummy = 0;
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+		if (sendmsg(opts.ns_socket, &msg, 0) < 0)
+			ERROR("failed to share the jail namespaces: %s\n", strerror(errno));
+	}
+
+	for (i = 0; i < ARRAY_SIZE(shared_ns); i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+	close(opts.ns_socket);
+}
+
 static int spawn_jail(void *_notused)
 {
+	if (opts.ns_join) {
+		if (join_jail()) {
+			ERROR("failed to join jail");
+			exit(EXIT_FAILURE);
+		}
+
+		return exec_jail();
+	}
+
 	if (opts.hostname && sethostname(opts.hostname, strlen(opts.hostname))) {
 		ERROR("sethostname(%s) failed: %s\n", opts.hostname, strerror(errno));
 	}
@@ -289,12 +549,25 @@ static struct uloop_process jail_process = {
 	.cb = jail_process_handler,
 };
 
-int main(int argc, char **argv)
+void jail_launch_init(void)
+{
+	static bool done;
+
+	if (done) {
+		lib_index_refresh();
+		return;
+	}
+
+	done = true;
+	init_library_search();
+}
+
+int jail_launch(int argc, char **argv)
 {
 	uid_t uid = getuid();
 	char log[] = "/dev/log";
 	char ubus[] = "/var/run/ubus.sock";
-	int ch;
+	int ch, ready[2];
 
 	if (uid) {
 		ERROR("not root, aborting: %s\n", strerror(errno));
@@ -303,8 +576,10 @@ int main(int argc, char **argv)
 
 	umask(022);
 	mount_list_init();
-	init_library_search();
+	jail_launch_init();
 
+	/* the caller may have used getopt() already */
+	optind = 0;
 	while ((ch = getopt(argc, argv, OPT_ARGS)) != -1) {
 		switch (ch) {
 		case 'd':
@@ -324,11 +599,11 @@ int main(int argc, char **argv)
 			break;
 		case 'S':
 			opts.seccomp = optarg;
-			add_mount(optarg, 1, -1);
+			add_profile_mount(optarg);
 			break;
 		case 'C':
 			opts.capabilities = optarg;
-			add_mount(optarg, 1, -1);
+			add_profile_mount(optarg);
 			break;
 		case 'c':
 			opts.no_new_privs = 1;
@@ -355,6 +630,21 @@ int main(int argc, char **argv)
 			opts.namespace = 1;
 			add_mount(log, 0, -1);
 			break;
+		case 'T':
+			opts.template = 1;
+			break;
+		case 'N':
+			opts.namespace = 1;
+			opts.ns_socket = atoi(optarg);
+			break;
+		case 'J':
+			opts.namespace = 1;
+			if (sscanf(optarg, "%d,%d,%d", &opts.ns_fd[0], &opts.ns_fd[1],
+				   &opts.ns_fd[2]) == ARRAY_SIZE(shared_ns))
+				opts.ns_join = 1;
+			else
+				ERROR("invalid namespace list %s\n", optarg);
+			break;
 		}
 	}
 
@@ -375,11 +665,34 @@ int main(int argc, char **argv)
 
 	opts.jail_argv = &argv[optind];
 
+	/* fds handed over by procd must not leak into the jailed binary */
+	if (opts.ns_socket >= 0)
+		fcntl(opts.ns_socket, F_SETFD, FD_CLOEXEC);
+	for (ch = 0; opts.ns_join && ch < ARRAY_SIZE(shared_ns); ch++)
+		fcntl(opts.ns_fd[ch], F_SETFD, FD_CLOEXEC);
+
 	if (opts.name)
 		prctl(PR_SET_NAME, opts.name, NULL, NULL, NULL);
 
+	if (opts.template && opts.namespace) {
+		if (!opts.name)
+			ERROR("jail templates need a name, building the jail root\n");
+		else if (prepare_template())
+			ERROR("failed to prepare the jail template, building the jail root\n");
+	}
+
 	uloop_init();
-	if (opts.namespace) {
+	if (opts.ns_join) {
+		/* only the pid namespace is per instance */
+		jail_process.pid = clone(spawn_jail,
+			child_stack + STACK_SIZE, CLONE_NEWPID | SIGCHLD, NULL);
+	} else if (opts.namespace) {
+		if (opts.ns_socket >= 0 && pipe2(ready, O_CLOEXEC)) {
+			ERROR("pipe2() failed: %s\n", strerror(errno));
+			close(opts.ns_socket);
+			opts.ns_socket = -1;
+		}
+
 		jail_process.pid = clone(spawn_jail,
 			child_stack + STACK_SIZE,
 			CLONE_NEWUTS | CLONE_NEWPID | CLONE_NEWNS | CLONE_NEWIPC | SIGCHLD, NULL);
@@ -389,6 +702,10 @@ int main(int argc, char **argv)
 
 	if (jail_process.pid > 0) {
 		/* parent process */
+		if (opts.ns_socket >= 0) {
+			close(ready[1]);
+			share_jail(jail_process.pid, ready[0]);
+		}
 		uloop_process_add(&jail_process);
 		uloop_run();
 		uloop_done();
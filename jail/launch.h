@@ -0,0 +1,23 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#ifndef _JAIL_LAUNCH_H_
+#define _JAIL_LAUNCH_H_
+
+/*
+ * ujail as a library: jail_launch() takes the ujail command line, builds
+ * the jail, runs the binary in it and returns its exit code. procd calls
+ * it in a forked child, after jail_launch_init() in procd itself, so the
+ * library index is only built once and inherited by every launch.
+ */
+void jail_launch_init(void);
+int jail_launch(int argc, char **argv);
+
+#endif
@@ -13,7 +13,7 @@
 #ifndef _JAIL_LOG_H_
 #define _JAIL_LOG_H_
 
-extern int debug;
+extern unsigned int debug;
 #include <stdio.h>
 #include <syslog.h>
 
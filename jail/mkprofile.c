@@ -0,0 +1,138 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Compile the seccomp and capabilities JSON of a service into a binary
+ * profile that libpreload-seccomp and ujail can map and install without
+ * parsing anything. Written next to the JSON as <file>.bin it is picked
+ * up automatically for as long as it is not older than the JSON.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <linux/capability.h>
+
+#include <libubox/utils.h>
+
+#include "capabilities.h"
+#include "profile.h"
+#include "seccomp-bpf.h"
+#include "seccomp-filter.h"
+#include "seccomp.h"
+#include "../syscall-names.h"
+
+unsigned int debug = 0;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "%s [-S <seccomp.json>] [-C <capabilities.json>] -o <profile>\n", prog);
+}
+
+static int write_profile(const char *out, struct jail_profile *p, const struct sock_fprog *prog)
+{
+	char tmp[256];
+	FILE *fp;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", out, getpid());
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		perror("fopen");
+		return -1;
+	}
+
+	if (fwrite(p, sizeof(*p), 1, fp) != 1 ||
+	    (p->filter_len &&
+	     fwrite(prog->filter, sizeof(prog->filter[0]), p->filter_len, fp) != p->filter_len)) {
+		perror("fwrite");
+		fclose(fp);
+		unlink(tmp);
+		return -1;
+	}
+
+	if (fclose(fp) || rename(tmp, out)) {
+		perror("rename");
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct jail_profile p = {
+		.magic = JAIL_PROFILE_MAGIC,
+		.version = JAIL_PROFILE_VERSION,
+		.arch = ARCH_NR,
+		.cap_last = CAP_LAST_CAP,
+	};
+	struct sock_fprog prog = { 0 };
+	char *seccomp = NULL, *caps = NULL, *out = NULL;
+	uint32_t deny;
+	int ch, n, *nrs;
+
+	while ((ch = getopt(argc, argv, "S:C:o:d")) != -1) {
+		switch (ch) {
+		case 'S':
+			seccomp = optarg;
+			break;
+		case 'C':
+			caps = optarg;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!out || (!seccomp && !caps)) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (seccomp) {
+		n = seccomp_parse_whitelist(argv[0], seccomp, &nrs, &deny);
+		if (n < 0)
+			return EXIT_FAILURE;
+
+		if (seccomp_filter_tree(nrs, n, deny, &prog) ||
+		    !seccomp_filter_check(&prog, nrs, n, deny, ARRAY_SIZE(syscall_names))) {
+			fprintf(stderr, "failed to compile the syscall filter of %s\n", seccomp);
+			return EXIT_FAILURE;
+		}
+		free(nrs);
+
+		p.flags |= JAIL_PROFILE_SECCOMP;
+		p.filter_len = prog.len;
+	}
+
+	if (caps) {
+		if (parse_capabilities(caps, &p.cap_keep))
+			return EXIT_FAILURE;
+
+		p.flags |= JAIL_PROFILE_CAPS;
+	}
+
+	if (write_profile(out, &p, &prog))
+		return EXIT_FAILURE;
+
+	free(prog.filter);
+
+	return 0;
+}
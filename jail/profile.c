@@ -0,0 +1,94 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE 1
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <linux/capability.h>
+#include <linux/limits.h>
+
+#include "seccomp-bpf.h"
+#include "profile.h"
+
+static const struct jail_profile *profile_map(const char *file, int flags, size_t *size)
+{
+	const struct jail_profile *p;
+	struct stat s;
+	int fd;
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &s) || s.st_size < sizeof(*p)) {
+		close(fd);
+		return NULL;
+	}
+
+	p = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	*size = s.st_size;
+	if (p->magic != JAIL_PROFILE_MAGIC || p->version != JAIL_PROFILE_VERSION ||
+	    (p->flags & flags) != flags)
+		goto error;
+
+	if ((flags & JAIL_PROFILE_SECCOMP) &&
+	    (p->arch != ARCH_NR || !p->filter_len || p->filter_len > BPF_MAXINSNS ||
+	     sizeof(*p) + p->filter_len * sizeof(p->filter[0]) > *size))
+		goto error;
+
+	if ((flags & JAIL_PROFILE_CAPS) && p->cap_last != CAP_LAST_CAP)
+		goto error;
+
+	return p;
+
+error:
+	munmap((void *) p, *size);
+	return NULL;
+}
+
+/*
+ * Map the profile providing flags for the JSON config in file: either file
+ * itself is a profile or file.bin is one that is not older than file.
+ */
+const struct jail_profile *jail_profile_open(const char *file, int flags, size_t *size)
+{
+	const struct jail_profile *p;
+	char path[PATH_MAX];
+	struct stat s, j;
+
+	p = profile_map(file, flags, size);
+	if (p)
+		return p;
+
+	snprintf(path, sizeof(path), "%s%s", file, JAIL_PROFILE_SUFFIX);
+	if (stat(path, &s))
+		return NULL;
+
+	/* a stale profile loses against the JSON it was compiled from */
+	if (!stat(file, &j) &&
+	    (s.st_mtim.tv_sec < j.st_mtim.tv_sec ||
+	     (s.st_mtim.tv_sec == j.st_mtim.tv_sec && s.st_mtim.tv_nsec < j.st_mtim.tv_nsec)))
+		return NULL;
+
+	return profile_map(path, flags, size);
+}
+
+void jail_profile_close(const struct jail_profile *p, size_t size)
+{
+	munmap((void *) p, size);
+}
@@ -0,0 +1,45 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#ifndef _JAIL_PROFILE_H_
+#define _JAIL_PROFILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/filter.h>
+
+#define JAIL_PROFILE_MAGIC	0x6a707266	/* "jprf" */
+#define JAIL_PROFILE_VERSION	1
+#define JAIL_PROFILE_SUFFIX	".bin"
+
+#define JAIL_PROFILE_SECCOMP	(1 << 0)
+#define JAIL_PROFILE_CAPS	(1 << 1)
+
+/*
+ * Precompiled seccomp filter and capability set, written by
+ * ujail-mkprofile. The filter is ready to be passed to PR_SET_SECCOMP,
+ * cap_keep has a bit set for every capability kept in the bounding set.
+ */
+struct jail_profile {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t flags;
+	uint32_t arch;
+	uint32_t cap_last;
+	uint64_t cap_keep;
+	uint32_t filter_len;
+	uint32_t reserved;
+	struct sock_filter filter[];
+};
+
+const struct jail_profile *jail_profile_open(const char *file, int flags, size_t *size);
+void jail_profile_close(const struct jail_profile *p, size_t size);
+
+#endif
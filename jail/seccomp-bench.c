@@ -0,0 +1,125 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Compare the linear and the decision tree syscall filter of a seccomp
+ * whitelist (all known syscalls if none is given): check that both give
+ * the same verdict for every syscall, then report the program size and
+ * the instructions and time spent per syscall in the filter interpreter.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libubox/utils.h>
+
+#include "seccomp-bpf.h"
+#include "seccomp-filter.h"
+#include "seccomp.h"
+#include "../syscall-names.h"
+
+static int max_nr = ARRAY_SIZE(syscall_names);
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench(const char *name, const struct sock_fprog *prog, int loops)
+{
+	struct seccomp_data data = { .arch = ARCH_NR };
+	uint64_t start, ns;
+	int64_t steps = 0;
+	int i, nr, max = 0;
+	uint32_t sum = 0;
+
+	for (nr = 0; nr < max_nr; nr++) {
+		int s = 0;
+
+		data.nr = nr;
+		seccomp_filter_run(prog, &data, &s);
+		steps += s;
+		if (s > max)
+			max = s;
+	}
+
+	start = bench_now();
+	for (i = 0; i < loops; i++) {
+		for (nr = 0; nr < max_nr; nr++) {
+			data.nr = nr;
+			sum += seccomp_filter_run(prog, &data, NULL);
+		}
+	}
+	ns = bench_now() - start;
+
+	printf("%-8s %5d insns, %6.1f avg / %4d max insns per syscall, %7.1f ns per syscall (%x)\n",
+	       name, prog->len, (double) steps / max_nr, max,
+	       (double) ns / ((uint64_t) loops * max_nr), sum & 0xf);
+}
+
+int main(int argc, char **argv)
+{
+	struct sock_fprog linear, tree;
+	uint32_t deny = SECCOMP_RET_KILL;
+	int *nrs, n = 0, loops = 1000;
+	int ch, i;
+
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			loops = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "%s [-n <loops>] [seccomp.json]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc) {
+		n = seccomp_parse_whitelist(argv[0], argv[optind], &nrs, &deny);
+		if (n < 0)
+			return EXIT_FAILURE;
+	} else {
+		nrs = calloc(max_nr, sizeof(*nrs));
+		if (!nrs)
+			return EXIT_FAILURE;
+		for (i = 0; i < max_nr; i++)
+			if (syscall_names[i])
+				nrs[n++] = i;
+	}
+
+	if (seccomp_filter_linear(nrs, n, deny, &linear) ||
+	    seccomp_filter_tree(nrs, n, deny, &tree)) {
+		fprintf(stderr, "failed to compile filters\n");
+		return EXIT_FAILURE;
+	}
+
+	if (!seccomp_filter_check(&tree, nrs, n, deny, max_nr)) {
+		fprintf(stderr, "verdicts of the tree filter differ from the linear one\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("%d syscalls whitelisted, verdicts match\n", n);
+	bench("linear", &linear, loops);
+	bench("tree", &tree, loops);
+
+	free(linear.filter);
+	free(tree.filter);
+	free(nrs);
+
+	return 0;
+}
@@ -57,6 +57,10 @@ struct seccomp_data {
 # define SYS_SECCOMP 1
 #endif
 
+#ifndef SECCOMP_RET_TRACE
+#define SECCOMP_RET_TRACE	0x7ff00000U /* pass to a tracer or disallow */
+#endif
+
 #define syscall_nr (offsetof(struct seccomp_data, nr))
 #define arch_nr (offsetof(struct seccomp_data, arch))
 
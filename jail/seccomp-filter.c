@@ -0,0 +1,260 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdlib.h>
+#include <string.h>
+
+#include "seccomp-filter.h"
+
+/* arch check plus loading the syscall number */
+#define FILTER_HDR_LEN	4
+/* longest conditional jump, anything further needs a BPF_JA */
+#define FILTER_JMP_MAX	255
+
+/* maximal run of syscall numbers sharing the same verdict */
+struct filter_range {
+	uint32_t start;
+	uint32_t ret;
+};
+
+static void set_filter(struct sock_filter *filter, __u16 code, __u8 jt, __u8 jf, __u32 k)
+{
+	filter->code = code;
+	filter->jt = jt;
+	filter->jf = jf;
+	filter->k = k;
+}
+
+static int filter_hdr(struct sock_filter *filter)
+{
+	int idx = 0;
+
+	/* validate arch */
+	set_filter(&filter[idx++], BPF_LD + BPF_W + BPF_ABS, 0, 0, arch_nr);
+	set_filter(&filter[idx++], BPF_JMP + BPF_JEQ + BPF_K, 1, 0, ARCH_NR);
+	set_filter(&filter[idx++], BPF_RET + BPF_K, 0, 0, SECCOMP_RET_KILL);
+
+	/* get syscall */
+	set_filter(&filter[idx++], BPF_LD + BPF_W + BPF_ABS, 0, 0, syscall_nr);
+
+	return idx;
+}
+
+/* one compare and return per syscall, in whitelist order */
+int seccomp_filter_linear(const int *nrs, int n, uint32_t deny, struct sock_fprog *prog)
+{
+	struct sock_filter *filter;
+	int i, idx;
+
+	filter = calloc(FILTER_HDR_LEN + 2 * n + 1, sizeof(*filter));
+	if (!filter)
+		return -1;
+
+	idx = filter_hdr(filter);
+	for (i = 0; i < n; i++) {
+		set_filter(&filter[idx++], BPF_JMP + BPF_JEQ + BPF_K, 0, 1, nrs[i]);
+		set_filter(&filter[idx++], BPF_RET + BPF_K, 0, 0, SECCOMP_RET_ALLOW);
+	}
+	set_filter(&filter[idx++], BPF_RET + BPF_K, 0, 0, deny);
+
+	prog->len = idx;
+	prog->filter = filter;
+
+	return 0;
+}
+
+static int cmp_nr(const void *a, const void *b)
+{
+	return *(const int *) a - *(const int *) b;
+}
+
+/* split [0, 2^32) into alternating allowed and denied ranges */
+static int filter_ranges(const int *nrs, int n, uint32_t deny, struct filter_range *r)
+{
+	int *sorted, i, count = 0;
+
+	sorted = malloc(n * sizeof(*sorted));
+	if (!sorted)
+		return -1;
+
+	memcpy(sorted, nrs, n * sizeof(*sorted));
+	qsort(sorted, n, sizeof(*sorted), cmp_nr);
+
+	if (!n || sorted[0] > 0) {
+		r[count].start = 0;
+		r[count++].ret = deny;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (i && sorted[i] == sorted[i - 1])
+			continue;
+
+		if (i && sorted[i] == sorted[i - 1] + 1)
+			continue;
+
+		if (i) {
+			r[count].start = sorted[i - 1] + 1;
+			r[count++].ret = deny;
+		}
+		r[count].start = sorted[i];
+		r[count++].ret = SECCOMP_RET_ALLOW;
+	}
+
+	if (n) {
+		r[count].start = sorted[n - 1] + 1;
+		r[count++].ret = deny;
+	}
+	free(sorted);
+
+	return count;
+}
+
+static int tree_size(int lo, int hi)
+{
+	int mid, left;
+
+	if (lo == hi)
+		return 1;
+
+	mid = (lo + hi + 1) / 2;
+	left = tree_size(lo, mid - 1);
+
+	return 1 + (left > FILTER_JMP_MAX) + left + tree_size(mid, hi);
+}
+
+static int tree_emit(struct sock_filter *filter, const struct filter_range *r, int lo, int hi)
+{
+	int mid, left, idx = 0;
+
+	if (lo == hi) {
+		set_filter(&filter[idx++], BPF_RET + BPF_K, 0, 0, r[lo].ret);
+		return idx;
+	}
+
+	/* nr >= start of the upper half skips over the lower half */
+	mid = (lo + hi + 1) / 2;
+	left = tree_size(lo, mid - 1);
+	if (left > FILTER_JMP_MAX) {
+		set_filter(&filter[idx++], BPF_JMP + BPF_JGE + BPF_K, 0, 1, r[mid].start);
+		set_filter(&filter[idx++], BPF_JMP + BPF_JA, 0, 0, left);
+	} else {
+		set_filter(&filter[idx++], BPF_JMP + BPF_JGE + BPF_K, left, 0, r[mid].start);
+	}
+
+	idx += tree_emit(&filter[idx], r, lo, mid - 1);
+	idx += tree_emit(&filter[idx], r, mid, hi);
+
+	return idx;
+}
+
+/*
+ * Binary search over the ranges of contiguous syscall numbers, a syscall
+ * costs log2(ranges) compares instead of walking the whole whitelist.
+ */
+int seccomp_filter_tree(const int *nrs, int n, uint32_t deny, struct sock_fprog *prog)
+{
+	struct sock_filter *filter;
+	struct filter_range *r;
+	int count, idx;
+
+	r = calloc(2 * n + 1, sizeof(*r));
+	if (!r)
+		return -1;
+
+	count = filter_ranges(nrs, n, deny, r);
+	if (count < 0) {
+		free(r);
+		return -1;
+	}
+
+	filter = calloc(FILTER_HDR_LEN + tree_size(0, count - 1), sizeof(*filter));
+	if (!filter) {
+		free(r);
+		return -1;
+	}
+
+	idx = filter_hdr(filter);
+	idx += tree_emit(&filter[idx], r, 0, count - 1);
+	free(r);
+
+	prog->len = idx;
+	prog->filter = filter;
+
+	return 0;
+}
+
+/* interpreter for the instructions emitted above */
+uint32_t seccomp_filter_run(const struct sock_fprog *prog, const struct seccomp_data *data,
+			    int *steps)
+{
+	const struct sock_filter *f;
+	uint32_t A = 0;
+	int pc = 0;
+
+	while (pc < prog->len) {
+		f = &prog->filter[pc++];
+		if (steps)
+			(*steps)++;
+
+		switch (f->code) {
+		case BPF_LD + BPF_W + BPF_ABS:
+			memcpy(&A, (const char *) data + f->k, sizeof(A));
+			break;
+		case BPF_JMP + BPF_JA:
+			pc += f->k;
+			break;
+		case BPF_JMP + BPF_JEQ + BPF_K:
+			pc += (A == f->k) ? f->jt : f->jf;
+			break;
+		case BPF_JMP + BPF_JGE + BPF_K:
+			pc += (A >= f->k) ? f->jt : f->jf;
+			break;
+		case BPF_RET + BPF_K:
+			return f->k;
+		default:
+			return SECCOMP_RET_KILL;
+		}
+	}
+
+	return SECCOMP_RET_KILL;
+}
+
+/* compare the verdicts of prog with the linear filter for every syscall */
+bool seccomp_filter_check(const struct sock_fprog *prog, const int *nrs, int n, uint32_t deny,
+			  int max_nr)
+{
+	struct seccomp_data data = { .arch = ARCH_NR };
+	struct sock_fprog linear;
+	bool ret = true;
+	int64_t nr;
+
+	if (seccomp_filter_linear(nrs, n, deny, &linear))
+		return false;
+
+	for (nr = 0; ret && nr <= max_nr + 1; nr++) {
+		data.nr = nr;
+		ret = seccomp_filter_run(prog, &data, NULL) == seccomp_filter_run(&linear, &data, NULL);
+	}
+
+	data.nr = -1;
+	if (ret)
+		ret = seccomp_filter_run(prog, &data, NULL) == seccomp_filter_run(&linear, &data, NULL);
+
+	data.arch = ~ARCH_NR;
+	data.nr = n ? nrs[0] : 0;
+	if (ret)
+		ret = seccomp_filter_run(prog, &data, NULL) == seccomp_filter_run(&linear, &data, NULL);
+
+	free(linear.filter);
+
+	return ret;
+}
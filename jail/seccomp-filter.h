@@ -0,0 +1,26 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#ifndef _JAIL_SECCOMP_FILTER_H_
+#define _JAIL_SECCOMP_FILTER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "seccomp-bpf.h"
+
+int seccomp_filter_linear(const int *nrs, int n, uint32_t deny, struct sock_fprog *prog);
+int seccomp_filter_tree(const int *nrs, int n, uint32_t deny, struct sock_fprog *prog);
+uint32_t seccomp_filter_run(const struct sock_fprog *prog, const struct seccomp_data *data,
+			    int *steps);
+bool seccomp_filter_check(const struct sock_fprog *prog, const int *nrs, int n, uint32_t deny,
+			  int max_nr);
+
+#endif
@@ -12,6 +12,7 @@
 #define _GNU_SOURCE 1
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <libubox/utils.h>
@@ -19,7 +20,9 @@
 #include <libubox/blobmsg_json.h>
 
 #include "seccomp-bpf.h"
+#include "seccomp-filter.h"
 #include "seccomp.h"
+#include "profile.h"
 #include "../syscall-names.h"
 
 static int max_syscall = ARRAY_SIZE(syscall_names);
@@ -35,15 +38,11 @@ static int find_syscall(const char *name)
 	return -1;
 }
 
-static void set_filter(struct sock_filter *filter, __u16 code, __u8 jt, __u8 jf, __u32 k)
-{
-	filter->code = code;
-	filter->jt = jt;
-	filter->jf = jf;
-	filter->k = k;
-}
-
-int install_syscall_filter(const char *argv, const char *file)
+/*
+ * Read the whitelist and default policy from file, *nrs holds the syscall
+ * numbers afterwards and has to be freed by the caller.
+ */
+int seccomp_parse_whitelist(const char *argv, const char *file, int **nrs, uint32_t *deny)
 {
 	enum {
 		SECCOMP_WHITELIST,
@@ -57,13 +56,7 @@ int install_syscall_filter(const char *argv, const char *file)
 	struct blob_buf b = { 0 };
 	struct blob_attr *tb[__SECCOMP_MAX];
 	struct blob_attr *cur;
-	int rem;
-
-	struct sock_filter *filter;
-	struct sock_fprog prog = { 0 };
-	int sz = 5, idx = 0, default_policy = 0;
-
-	INFO("%s: setting up syscall filter\n", argv);
+	int rem, n = 0, default_policy = 0;
 
 	blob_buf_init(&b, 0);
 	if (!blobmsg_add_json_from_file(&b, file)) {
@@ -80,28 +73,28 @@ int install_syscall_filter(const char *argv, const char *file)
 	if (tb[SECCOMP_POLICY])
 		default_policy = blobmsg_get_u32(tb[SECCOMP_POLICY]);
 
+	if (default_policy)
+		/* return -1 and set errno */
+		*deny = SECCOMP_RET_LOGGER(default_policy);
+	else
+		/* kill the process */
+		*deny = SECCOMP_RET_KILL;
+
 	blobmsg_for_each_attr(cur, tb[SECCOMP_WHITELIST], rem)
-		sz += 2;
+		n++;
 
-	filter = calloc(sz, sizeof(struct sock_filter));
-	if (!filter) {
+	*nrs = calloc(n + 1, sizeof(**nrs));
+	if (!*nrs) {
 		INFO("failed to allocate filter memory\n");
 		return -1;
 	}
 
-	/* validate arch */
-	set_filter(&filter[idx++], BPF_LD + BPF_W + BPF_ABS, 0, 0, arch_nr);
-	set_filter(&filter[idx++], BPF_JMP + BPF_JEQ + BPF_K, 1, 0, ARCH_NR);
-	set_filter(&filter[idx++], BPF_RET + BPF_K, 0, 0, SECCOMP_RET_KILL);
-
-	/* get syscall */
-	set_filter(&filter[idx++], BPF_LD + BPF_W + BPF_ABS, 0, 0, syscall_nr);
-
+	n = 0;
 	blobmsg_for_each_attr(cur, tb[SECCOMP_WHITELIST], rem) {
 		char *name = blobmsg_get_string(cur);
 		int nr;
 
-		if (!name) {
+		if (!name || blobmsg_type(cur) != BLOBMSG_TYPE_STRING) {
 			INFO("%s: invalid syscall name\n", argv);
 			continue;
 		}
@@ -112,29 +105,67 @@ int install_syscall_filter(const char *argv, const char *file)
 			continue;
 		}
 
-		/* add whitelist */
-		set_filter(&filter[idx++], BPF_JMP + BPF_JEQ + BPF_K, 0, 1, nr);
-		set_filter(&filter[idx++], BPF_RET + BPF_K, 0, 0, SECCOMP_RET_ALLOW);
+		(*nrs)[n++] = nr;
 	}
+	blob_buf_free(&b);
 
-	if (default_policy)
-		/* return -1 and set errno */
-		set_filter(&filter[idx], BPF_RET + BPF_K, 0, 0, SECCOMP_RET_LOGGER(default_policy));
-	else
-		/* kill the process */
-		set_filter(&filter[idx], BPF_RET + BPF_K, 0, 0, SECCOMP_RET_KILL);
+	return n;
+}
 
+static int install_filter(const char *argv, struct sock_fprog *prog)
+{
 	if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0)) {
 		INFO("%s: prctl(PR_SET_NO_NEW_PRIVS) failed: %s\n", argv, strerror(errno));
 		return errno;
 	}
 
-	prog.len = (unsigned short) idx + 1;
-	prog.filter = filter;
-
-	if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog)) {
+	if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, prog)) {
 		INFO("%s: prctl(PR_SET_SECCOMP) failed: %s\n", argv, strerror(errno));
 		return errno;
 	}
 	return 0;
 }
+
+int install_syscall_filter(const char *argv, const char *file)
+{
+	struct sock_fprog prog = { 0 };
+	const struct jail_profile *p;
+	uint32_t deny;
+	size_t size;
+	int *nrs, n, ret;
+
+	INFO("%s: setting up syscall filter\n", argv);
+
+	p = jail_profile_open(file, JAIL_PROFILE_SECCOMP, &size);
+	if (p) {
+		/* the filter may well deny munmap, so unmap before installing */
+		static struct sock_filter filter[BPF_MAXINSNS];
+
+		prog.len = p->filter_len;
+		prog.filter = filter;
+		memcpy(filter, p->filter, p->filter_len * sizeof(filter[0]));
+		jail_profile_close(p, size);
+		return install_filter(argv, &prog);
+	}
+
+	n = seccomp_parse_whitelist(argv, file, &nrs, &deny);
+	if (n < 0)
+		return -1;
+
+	if (seccomp_filter_tree(nrs, n, deny, &prog) ||
+	    !seccomp_filter_check(&prog, nrs, n, deny, max_syscall)) {
+		INFO("%s: failed to compile the syscall filter, using a linear one\n", argv);
+		free(prog.filter);
+		if (seccomp_filter_linear(nrs, n, deny, &prog)) {
+			INFO("failed to allocate filter memory\n");
+			free(nrs);
+			return -1;
+		}
+	}
+	free(nrs);
+
+	ret = install_filter(argv, &prog);
+	free(prog.filter);
+
+	return ret;
+}
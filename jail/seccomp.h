@@ -13,6 +13,7 @@
 #ifndef _JAIL_SECCOMP_H_
 #define _JAIL_SECCOMP_H_
 
+#include <stdint.h>
 #include <stdio.h>
 #include <syslog.h>
 
@@ -21,6 +22,7 @@
 	fprintf(stderr,"preload-seccomp: "fmt, ## __VA_ARGS__); \
 	} while (0)
 
+int seccomp_parse_whitelist(const char *argv, const char *file, int **nrs, uint32_t *deny);
 int install_syscall_filter(const char *argv, const char *file);
 
 #endif
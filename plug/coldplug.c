@@ -16,14 +16,70 @@
 #include <sys/types.h>
 #include <sys/mount.h>
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <libubox/avl.h>
+
 #include "../procd.h"
 #include "../libc-compat.h"
+#include "../spawn.h"
 
 #include "hotplug.h"
 
+/* devices triggered per uloop iteration */
+#define COLDPLUG_BATCH	32
+
+struct coldplug_subsys {
+	struct list_head list;
+	char *name;
+	char *path;
+	int prio;
+	/* /sys/block, partitions are only found below their disk */
+	bool partitions;
+
+	int devices;
+	uint32_t start;
+	uint32_t end;
+};
+
+struct coldplug_seen {
+	struct avl_node avl;
+	ino_t ino;
+};
+
+/* subsystems triggered first, everything else follows in name order */
+static const char * const coldplug_prio[] = {
+	"block", "mtd", "ubi", "tty", "misc", "net",
+};
+
 static struct uloop_process udevtrigger;
+static struct uloop_timeout coldplug_timer;
+static LIST_HEAD(subsystems);
+static struct coldplug_subsys *cur;
+static struct avl_tree seen;
+static DIR *cur_dir;
+static int sysfs = -1;
+static uint32_t coldplug_start, coldplug_end;
+
+static uint32_t coldplug_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int seen_cmp(const void *k1, const void *k2, void *ptr)
+{
+	const ino_t *i1 = k1, *i2 = k2;
+
+	return (*i1 > *i2) - (*i1 < *i2);
+}
 
 static void coldplug_complete(struct uloop_timeout *t)
 {
@@ -38,9 +94,310 @@ static void udevtrigger_complete(struct uloop_process *proc, int ret)
 	hotplug_last_event(coldplug_complete);
 }
 
-void procd_coldplug(void)
+static int coldplug_udevtrigger(void)
 {
 	char *argv[] = { "udevtrigger", NULL };
+	struct spawn_opts o;
+
+	spawn_opts_init(&o);
+	o.argv = argv;
+	udevtrigger.cb = udevtrigger_complete;
+	udevtrigger.pid = procd_spawn(&o);
+	if (udevtrigger.pid <= 0) {
+		ERROR("Failed to start new coldplug instance\n");
+		return -1;
+	}
+
+	uloop_process_add(&udevtrigger);
+
+	DEBUG(4, "Launched coldplug instance, pid=%d\n", (int) udevtrigger.pid);
+
+	return 0;
+}
+
+static struct coldplug_subsys *coldplug_add_subsys(const char *name, const char *fmt, ...)
+{
+	struct coldplug_subsys *s, *n;
+	char path[64], *_name, *_path;
+	va_list ap;
+	int i;
+
+	va_start(ap, fmt);
+	vsnprintf(path, sizeof(path), fmt, ap);
+	va_end(ap);
+
+	s = calloc_a(sizeof(*s), &_name, strlen(name) + 1, &_path, strlen(path) + 1);
+	if (!s)
+		return NULL;
+
+	s->name = strcpy(_name, name);
+	s->path = strcpy(_path, path);
+	s->prio = ARRAY_SIZE(coldplug_prio);
+	for (i = 0; i < ARRAY_SIZE(coldplug_prio); i++)
+		if (!strcmp(name, coldplug_prio[i]))
+			s->prio = i;
+
+	list_for_each_entry(n, &subsystems, list)
+		if (s->prio < n->prio || (s->prio == n->prio && strcmp(s->name, n->name) < 0))
+			break;
+	list_add_tail(&s->list, &n->list);
+
+	return s;
+}
+
+static bool coldplug_scan(const char *dir, const char *fmt)
+{
+	struct dirent *e;
+	DIR *d;
+	int fd;
+
+	fd = openat(sysfs, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	d = fdopendir(fd);
+	if (!d) {
+		close(fd);
+		return false;
+	}
+
+	while ((e = readdir(d)) != NULL) {
+		if (e->d_name[0] == '.')
+			continue;
+		coldplug_add_subsys(e->d_name, fmt, dir, e->d_name);
+	}
+	closedir(d);
+
+	return true;
+}
+
+/*
+ * Devices show up under both their class and bus, identify them by the
+ * inode of the directory the links resolve to and only trigger them once.
+ */
+static bool coldplug_device(int dfd, const char *name)
+{
+	struct coldplug_seen *n;
+	struct stat s;
+	bool ret = false;
+	int fd, ufd;
+
+	fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	if (fstat(fd, &s) || avl_find(&seen, &s.st_ino))
+		goto out;
+
+	n = calloc(1, sizeof(*n));
+	if (n) {
+		n->ino = s.st_ino;
+		n->avl.key = &n->ino;
+		avl_insert(&seen, &n->avl);
+	}
+
+	/* we only have a device, if we have a dev and an uevent file */
+	if (fstatat(fd, "dev", &s, 0) || !(s.st_mode & S_IRUSR))
+		goto out;
+
+	ufd = openat(fd, "uevent", O_WRONLY | O_CLOEXEC);
+	if (ufd < 0)
+		goto out;
+
+	if (write(ufd, "add", 3) < 0)
+		DEBUG(2, "error on triggering %s: %s\n", name, strerror(errno));
+	else
+		ret = true;
+	close(ufd);
+
+out:
+	close(fd);
+	return ret;
+}
+
+/* /sys/block has no links for partitions, they are subdirectories named after the disk */
+static int coldplug_partitions(int dfd, const char *disk)
+{
+	struct dirent *e;
+	int fd, n = 0;
+	DIR *d;
+
+	fd = openat(dfd, disk, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	d = fdopendir(fd);
+	if (!d) {
+		close(fd);
+		return 0;
+	}
+
+	while ((e = readdir(d)) != NULL) {
+		if (strncmp(e->d_name, disk, strlen(disk)) || !e->d_name[strlen(disk)])
+			continue;
+
+		if (coldplug_device(dirfd(d), e->d_name))
+			n++;
+	}
+	closedir(d);
+
+	return n;
+}
+
+static void coldplug_done(void)
+{
+	struct coldplug_seen *n, *tmp;
+
+	avl_remove_all_elements(&seen, n, avl, tmp)
+		free(n);
+
+	close(sysfs);
+	sysfs = -1;
+	coldplug_end = coldplug_now();
+	DEBUG(2, "Coldplug triggered all devices in %ums\n", coldplug_end - coldplug_start);
+	hotplug_last_event(coldplug_complete);
+}
+
+/*
+ * Trigger a batch of devices per uloop iteration, so the resulting events
+ * are handled (and handed to the hotplug workers) while the walk continues,
+ * instead of piling up in the netlink socket.
+ */
+static void coldplug_step(struct uloop_timeout *t)
+{
+	struct dirent *e;
+	int budget = COLDPLUG_BATCH;
+	int fd;
+
+	while (budget > 0) {
+		if (!cur_dir) {
+			struct list_head *next = cur ? cur->list.next : subsystems.next;
+
+			if (next == &subsystems) {
+				coldplug_done();
+				return;
+			}
+
+			cur = list_entry(next, struct coldplug_subsys, list);
+			cur->start = coldplug_now();
+			fd = openat(sysfs, cur->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (fd >= 0)
+				cur_dir = fdopendir(fd);
+			if (!cur_dir) {
+				if (fd >= 0)
+					close(fd);
+				cur->end = cur->start;
+				continue;
+			}
+		}
+
+		e = readdir(cur_dir);
+		if (!e) {
+			closedir(cur_dir);
+			cur_dir = NULL;
+			cur->end = coldplug_now();
+			DEBUG(4, "coldplug %s: %d devices in %ums\n", cur->name,
+				cur->devices, cur->end - cur->start);
+			continue;
+		}
+
+		if (e->d_name[0] == '.')
+			continue;
+
+		if (coldplug_device(dirfd(cur_dir), e->d_name)) {
+			cur->devices++;
+			budget--;
+		}
+
+		if (cur->partitions) {
+			int n = coldplug_partitions(dirfd(cur_dir), e->d_name);
+
+			cur->devices += n;
+			budget -= n;
+		}
+	}
+
+	uloop_timeout_set(&coldplug_timer, 0);
+}
+
+static int coldplug_start_walk(void)
+{
+	struct stat s;
+	bool found;
+
+	sysfs = open("/sys", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (sysfs < 0)
+		return -1;
+
+	avl_init(&seen, seen_cmp, false, NULL);
+	found = coldplug_scan("bus", "%s/%s/devices");
+	found |= coldplug_scan("class", "%s/%s");
+	if (!found) {
+		ERROR("Failed to scan /sys for coldplug\n");
+		close(sysfs);
+		sysfs = -1;
+		return -1;
+	}
+
+	/* scan "block" if it isn't a "class" */
+	if (fstatat(sysfs, "class/block", &s, 0)) {
+		struct coldplug_subsys *b = coldplug_add_subsys("block", "block");
+
+		if (b)
+			b->partitions = true;
+	}
+
+	coldplug_start = coldplug_now();
+	coldplug_timer.cb = coldplug_step;
+	uloop_timeout_set(&coldplug_timer, 0);
+
+	return 0;
+}
+
+/*
+ * A subsystem can be both a bus and a class, its entries are next to each
+ * other in the list and reported as one.
+ */
+void coldplug_dump_stats(struct blob_buf *b)
+{
+	struct coldplug_subsys *s, *first = NULL;
+	uint32_t end = 0;
+	int devices = 0;
+	void *c, *t;
+
+	if (list_empty(&subsystems))
+		return;
+
+	c = blobmsg_open_table(b, "coldplug");
+	if (coldplug_end)
+		blobmsg_add_u32(b, "time", coldplug_end - coldplug_start);
+	list_for_each_entry(s, &subsystems, list) {
+		if (!first || strcmp(first->name, s->name)) {
+			first = s;
+			devices = 0;
+		}
+		devices += s->devices;
+		end = s->end;
+
+		if (s->list.next != &subsystems &&
+		    !strcmp(s->name, list_entry(s->list.next, struct coldplug_subsys, list)->name))
+			continue;
+
+		if (!devices)
+			continue;
+
+		t = blobmsg_open_table(b, s->name);
+		blobmsg_add_u32(b, "devices", devices);
+		blobmsg_add_u32(b, "start", first->start - coldplug_start);
+		if (end)
+			blobmsg_add_u32(b, "time", end - first->start);
+		blobmsg_close_table(b, t);
+	}
+	blobmsg_close_table(b, c);
+}
+
+void procd_coldplug(void)
+{
 	unsigned int oldumask = umask(0);
 
 	umount2("/dev/pts", MNT_DETACH);
@@ -50,20 +407,7 @@ void procd_coldplug(void)
 	mkdir("/dev/pts", 0755);
 	umask(oldumask);
 	mount("devpts", "/dev/pts", "devpts", MS_NOEXEC | MS_NOSUID, 0);
-	udevtrigger.cb = udevtrigger_complete;
-	udevtrigger.pid = fork();
-	if (!udevtrigger.pid) {
-		execvp(argv[0], argv);
-		ERROR("Failed to start coldplug\n");
-		exit(-1);
-	}
 
-	if (udevtrigger.pid <= 0) {
-		ERROR("Failed to start new coldplug instance\n");
-		return;
-	}
-
-	uloop_process_add(&udevtrigger);
-
-	DEBUG(4, "Launched coldplug instance, pid=%d\n", (int) udevtrigger.pid);
+	if (coldplug_start_walk())
+		coldplug_udevtrigger();
 }
@@ -0,0 +1,217 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * A kernel uevent starts with "action@devpath", followed by ACTION=,
+ * DEVPATH= and SUBSYSTEM= in that order. With n the length of the header,
+ * the SUBSYSTEM= key is at 2 * n + 17, so the filter only has to look for
+ * the end of the header, which it does unrolled, as classic BPF has no
+ * loops. Anything that does not look like that is let through, the filter
+ * only drops what it knows no rule wants.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libubox/utils.h>
+
+#include "hotplug-filter.h"
+
+/* bytes searched for the end of the header, paths are rarely longer */
+#define UEVENT_SCAN_MAX		512
+#define UEVENT_KEY_OFS(n)	(2 * (n) + 17)
+#define UEVENT_KEY		"SUBSYSTEM="
+
+#define SUBSYSTEM_MAX		63
+#define ACTION_MAX		15
+
+#define FILTER_ACCEPT		0xffffffff
+#define FILTER_DROP		0
+#define FILTER_JMP_MAX		255
+
+struct filter_buf {
+	struct sock_filter *insn;
+	int len;
+	bool error;
+};
+
+/* the compares jumping to the next label on a mismatch */
+struct filter_fix {
+	int idx[16];
+	int n;
+};
+
+static void
+emit(struct filter_buf *f, __u16 code, __u8 jt, __u8 jf, __u32 k)
+{
+	struct sock_filter *insn;
+
+	if (f->len >= BPF_MAXINSNS) {
+		f->error = true;
+		return;
+	}
+
+	insn = &f->insn[f->len++];
+	insn->code = code;
+	insn->jt = jt;
+	insn->jf = jf;
+	insn->k = k;
+}
+
+/* compare n bytes at the (absolute or X relative) offset with str */
+static void
+emit_cmp(struct filter_buf *f, struct filter_fix *fix, __u16 mode, __u32 ofs,
+	 const char *str, int n)
+{
+	uint32_t val;
+	int size, i;
+
+	while (n > 0) {
+		size = n >= 4 ? 4 : n >= 2 ? 2 : 1;
+		for (val = 0, i = 0; i < size; i++)
+			val = (val << 8) | (uint8_t) str[i];
+
+		if (fix->n == ARRAY_SIZE(fix->idx)) {
+			f->error = true;
+			return;
+		}
+
+		emit(f, BPF_LD + (size == 4 ? BPF_W : size == 2 ? BPF_H : BPF_B) + mode, 0, 0, ofs);
+		fix->idx[fix->n++] = f->len;
+		emit(f, BPF_JMP + BPF_JEQ + BPF_K, 0, 0, val);
+
+		str += size;
+		ofs += size;
+		n -= size;
+	}
+}
+
+static void
+emit_label(struct filter_buf *f, struct filter_fix *fix)
+{
+	int i, d;
+
+	for (i = 0; i < fix->n && !f->error; i++) {
+		d = f->len - fix->idx[i] - 1;
+		if (d > FILTER_JMP_MAX)
+			f->error = true;
+		else
+			f->insn[fix->idx[i]].jf = d;
+	}
+	fix->n = 0;
+}
+
+static void
+emit_match(struct filter_buf *f, const struct uevent_match *m)
+{
+	struct filter_fix sfix = {}, afix = {};
+	char action[ACTION_MAX + 2];
+	int i, len;
+
+	emit_cmp(f, &sfix, BPF_IND, strlen(UEVENT_KEY), m->subsystem, strlen(m->subsystem) + 1);
+	if (!m->n_actions) {
+		emit(f, BPF_RET + BPF_K, 0, 0, FILTER_ACCEPT);
+	} else {
+		for (i = 0; i < m->n_actions; i++) {
+			len = snprintf(action, sizeof(action), "%s@", m->actions[i]);
+			emit_cmp(f, &afix, BPF_ABS, 0, action, len);
+			emit(f, BPF_RET + BPF_K, 0, 0, FILTER_ACCEPT);
+			emit_label(f, &afix);
+		}
+		emit(f, BPF_RET + BPF_K, 0, 0, FILTER_DROP);
+	}
+	emit_label(f, &sfix);
+}
+
+int
+uevent_filter_build(const struct uevent_match *m, int n, struct sock_fprog *prog)
+{
+	struct filter_buf f = {};
+	struct filter_fix fix = {};
+	int *jumps, guard = 0, i, j;
+
+	for (i = 0; i < n; i++) {
+		if (strlen(m[i].subsystem) > SUBSYSTEM_MAX)
+			return -1;
+		for (j = 0; j < m[i].n_actions; j++)
+			if (strlen(m[i].actions[j]) > ACTION_MAX)
+				return -1;
+		if (strlen(m[i].subsystem) + 1 > guard)
+			guard = strlen(m[i].subsystem) + 1;
+	}
+	/* all X relative loads stay below key + guard */
+	guard += strlen(UEVENT_KEY);
+
+	f.insn = calloc(BPF_MAXINSNS, sizeof(*f.insn));
+	jumps = calloc(UEVENT_SCAN_MAX, sizeof(*jumps));
+	if (!f.insn || !jumps)
+		goto error;
+
+	/* too short for the checks below, let userspace deal with it */
+	emit(&f, BPF_LD + BPF_W + BPF_LEN, 0, 0, 0);
+	emit(&f, BPF_JMP + BPF_JGE + BPF_K, 1, 0, 8);
+	emit(&f, BPF_RET + BPF_K, 0, 0, FILTER_ACCEPT);
+
+	/* libudev monitor messages, userspace drops them as well */
+	emit(&f, BPF_LD + BPF_W + BPF_ABS, 0, 0, 0);
+	emit(&f, BPF_JMP + BPF_JEQ + BPF_K, 0, 3, 0x6c696275);
+	emit(&f, BPF_LD + BPF_W + BPF_ABS, 0, 0, 4);
+	emit(&f, BPF_JMP + BPF_JEQ + BPF_K, 0, 1, 0x64657600);
+	emit(&f, BPF_RET + BPF_K, 0, 0, FILTER_DROP);
+
+	/* the end of the header gives the offset of the SUBSYSTEM= key plus guard in X */
+	for (i = 1; i < UEVENT_SCAN_MAX; i++) {
+		emit(&f, BPF_LD + BPF_B + BPF_ABS, 0, 0, i);
+		emit(&f, BPF_JMP + BPF_JEQ + BPF_K, 0, 2, 0);
+		emit(&f, BPF_LDX + BPF_W + BPF_IMM, 0, 0, UEVENT_KEY_OFS(i) + guard);
+		jumps[i] = f.len;
+		emit(&f, BPF_JMP + BPF_JA, 0, 0, 0);
+	}
+	emit(&f, BPF_RET + BPF_K, 0, 0, FILTER_ACCEPT);
+
+	for (i = 1; i < UEVENT_SCAN_MAX && !f.error; i++)
+		f.insn[jumps[i]].k = f.len - jumps[i] - 1;
+
+	/* the packet has to extend past the guard */
+	emit(&f, BPF_LD + BPF_W + BPF_LEN, 0, 0, 0);
+	emit(&f, BPF_JMP + BPF_JGE + BPF_X, 1, 0, 0);
+	emit(&f, BPF_RET + BPF_K, 0, 0, FILTER_ACCEPT);
+	emit(&f, BPF_MISC + BPF_TXA, 0, 0, 0);
+	emit(&f, BPF_ALU + BPF_SUB + BPF_K, 0, 0, guard);
+	emit(&f, BPF_MISC + BPF_TAX, 0, 0, 0);
+
+	/* not the layout of a kernel uevent */
+	emit_cmp(&f, &fix, BPF_IND, 0, UEVENT_KEY, strlen(UEVENT_KEY));
+	emit(&f, BPF_JMP + BPF_JA, 0, 0, 1);
+	emit_label(&f, &fix);
+	emit(&f, BPF_RET + BPF_K, 0, 0, FILTER_ACCEPT);
+
+	for (i = 0; i < n; i++)
+		emit_match(&f, &m[i]);
+	emit(&f, BPF_RET + BPF_K, 0, 0, FILTER_DROP);
+
+	if (f.error)
+		goto error;
+
+	free(jumps);
+	prog->len = f.len;
+	prog->filter = f.insn;
+
+	return 0;
+
+error:
+	free(jumps);
+	free(f.insn);
+	return -1;
+}
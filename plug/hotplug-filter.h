@@ -0,0 +1,26 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __PROCD_HOTPLUG_FILTER_H
+#define __PROCD_HOTPLUG_FILTER_H
+
+#include <linux/filter.h>
+
+/* a subsystem the rules care about, for any action if n_actions is 0 */
+struct uevent_match {
+	const char *subsystem;
+	const char **actions;
+	int n_actions;
+};
+
+int uevent_filter_build(const struct uevent_match *m, int n, struct sock_fprog *prog);
+
+#endif
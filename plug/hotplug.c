@@ -12,9 +12,13 @@
  * GNU General Public License for more details.
  */
 
+#define _GNU_SOURCE
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <linux/types.h>
 #include <linux/netlink.h>
@@ -22,32 +26,78 @@
 #include <libubox/blobmsg_json.h>
 #include <libubox/json_script.h>
 #include <libubox/uloop.h>
+#include <libubox/avl-cmp.h>
 #include <json-c/json.h>
 
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <libgen.h>
+#include <inttypes.h>
 
 #include "../procd.h"
+#include "../utils/utils.h"
+#include "../utils/slab.h"
+#include "../profiler.h"
+#include "../spawn.h"
 
 #include "hotplug.h"
+#include "hotplug-filter.h"
 
 #define HOTPLUG_WAIT	500
 
+/* datagrams read per recvmmsg call and calls per wakeup */
+#define HOTPLUG_BATCH		16
+#define HOTPLUG_BATCH_MAX	8
+#define UEVENT_BUFFER_SIZE	4096
+
+/* room reserved for the blobmsg form of a uevent, covers typical ones */
+#define UEVENT_ARENA_SIZE	(2 * UEVENT_BUFFER_SIZE)
+
+/* default and maximum number of parallel hotplug exec workers */
+#define HOTPLUG_WORKERS		4
+#define HOTPLUG_WORKERS_MAX	32
+
+/* bytes of firmware pushed to the kernel per uloop iteration */
+#define FW_CHUNK_SIZE		(256 * 1024)
+
 struct cmd_handler;
 struct cmd_queue {
 	struct list_head list;
 
 	struct blob_attr *msg;
 	struct blob_attr *data;
+	char *key;
 	int timeout;
 
-	void (*handler)(struct blob_attr *msg, struct blob_attr *data);
+	pid_t (*spawn)(struct blob_attr *msg, struct blob_attr *data);
 	void (*start)(struct blob_attr *msg, struct blob_attr *data);
 	void (*complete)(struct blob_attr *msg, struct blob_attr *data, int ret);
 };
 
+/*
+ * Commands run in parallel, but the ones sharing a key (DEVPATH, or
+ * SUBSYSTEM if procd.hotplug_order=subsystem is set) are run in the
+ * order their events arrived.
+ */
+struct hotplug_worker {
+	struct uloop_process proc;
+	struct cmd_queue *c;
+};
+
+struct fw_load {
+	struct list_head list;
+	struct uloop_timeout step;
+	char *file;
+	char *dev;
+
+	int src;
+	int data;
+	void *map;
+	off_t size;
+	off_t off;
+};
+
 struct button_timeout {
 	struct list_head list;
 	struct uloop_timeout timeout;
@@ -58,12 +108,61 @@ struct button_timeout {
 
 static LIST_HEAD(cmd_queue);
 static LIST_HEAD(button_timer);
-static struct uloop_process queue_proc;
+static LIST_HEAD(fw_loads);
+/* only n_workers of them are used, no allocation that could fail in pid 1 */
+static struct hotplug_worker workers[HOTPLUG_WORKERS_MAX];
+static int n_workers = HOTPLUG_WORKERS;
+static bool order_subsystem;
 static struct uloop_timeout last_event;
 static struct blob_buf b, button_buf;
 static char *rule_file;
 static struct blob_buf script;
-static struct cmd_queue *current;
+static int capture_fd = -1;
+static int filter_len;
+
+static struct {
+	uint64_t received;
+	uint64_t dropped;
+	uint64_t overflow;
+} stats;
+
+/*
+ * The rule file is split into its top level statements, which are indexed by
+ * the SUBSYSTEM and ACTION values their conditions require. Each statement
+ * still runs through json_script, but an event only ever looks at the few
+ * statements that can match it. Statements the compiler does not understand
+ * are simply run for every event.
+ */
+struct hotplug_rule {
+	struct json_script_file *file;
+
+	/* string, array of strings or table keyed by value, NULL matches all */
+	struct blob_attr *subsystem;
+	struct blob_attr *action;
+
+#ifdef HOTPLUG_BENCH
+	uint64_t runs;
+	uint64_t ns;
+#endif
+};
+
+struct rule_bucket {
+	struct avl_node avl;
+	int n_rules;
+	int rules[];
+};
+
+#define RULE_NEXT	"__next"
+
+static struct hotplug_rule *rules;
+static int n_rules;
+static struct rule_bucket *rule_default;
+static struct avl_tree rule_index;
+static struct blob_buf rule_buf;
+static bool rule_next;
+
+/* the uevent being run through the rules, shared by the commands it queues */
+static struct slab_event uevent;
 
 static void queue_add(struct cmd_handler *h, struct blob_attr *msg, struct blob_attr *data);
 static void handle_button_complete(struct blob_attr *msg, struct blob_attr *data, int ret);
@@ -72,9 +171,13 @@ static void button_free(struct button_timeout *b)
 {
 	uloop_timeout_cancel(&b->timeout);
 	list_del(&b->list);
-	free(b->data);
-	free(b->name);
-	free(b);
+	slab_free(b);
+}
+
+static void cmd_queue_free(struct cmd_queue *c)
+{
+	slab_blob_put(c->msg);
+	slab_free(c);
 }
 
 static void button_timeout_remove(char *button)
@@ -159,15 +262,14 @@ static void handle_rm(struct blob_attr *msg, struct blob_attr *data)
 		unlink(blobmsg_data(tb));
 }
 
-static void handle_exec(struct blob_attr *msg, struct blob_attr *data)
+static pid_t handle_exec(struct blob_attr *msg, struct blob_attr *data)
 {
 	char *argv[8];
+	struct spawn_opts o;
 	struct blob_attr *cur;
-	int rem, fd;
+	int rem;
 	int i = 0;
-
-	blobmsg_for_each_attr(cur, msg, rem)
-		setenv(blobmsg_name(cur), blobmsg_data(cur), 1);
+	pid_t pid;
 
 	blobmsg_for_each_attr(cur, data, rem) {
 		argv[i] = blobmsg_data(cur);
@@ -176,22 +278,22 @@ static void handle_exec(struct blob_attr *msg, struct blob_attr *data)
 			break;
 	}
 
-	if (debug < 3) {
-		fd = open("/dev/null", O_RDWR);
-		if (fd > -1) {
-			dup2(fd, STDIN_FILENO);
-			dup2(fd, STDOUT_FILENO);
-			dup2(fd, STDERR_FILENO);
-			if (fd > STDERR_FILENO)
-				close(fd);
-		}
-	}
+	if (!i)
+		return -1;
+	argv[i] = NULL;
 
-	if (i > 0) {
-		argv[i] = NULL;
-		execvp(argv[0], &argv[0]);
-	}
-	exit(-1);
+	spawn_opts_init(&o);
+	o.argv = argv;
+	if (debug < 3)
+		o.fd[0] = o.fd[1] = o.fd[2] = SPAWN_FD_NULL;
+
+	blobmsg_for_each_attr(cur, msg, rem)
+		spawn_env_add(&o.env, NULL, blobmsg_name(cur), blobmsg_data(cur));
+
+	pid = procd_spawn(&o);
+	spawn_opts_free(&o);
+
+	return pid;
 }
 
 static void handle_button_start(struct blob_attr *msg, struct blob_attr *data)
@@ -202,84 +304,157 @@ static void handle_button_start(struct blob_attr *msg, struct blob_attr *data)
 		button_timeout_remove(button);
 }
 
+static void fw_load_free(struct fw_load *fw)
+{
+	uloop_timeout_cancel(&fw->step);
+	list_del(&fw->list);
+	if (fw->map)
+		munmap(fw->map, fw->size);
+	if (fw->src >= 0)
+		close(fw->src);
+	if (fw->data >= 0)
+		close(fw->data);
+	free(fw);
+}
+
+static int fw_load_set(struct fw_load *fw, const char *val)
+{
+	char loadpath[256];
+	int load, ret = 0;
+
+	snprintf(loadpath, sizeof(loadpath), "/sys/%s/loading", fw->dev);
+	load = open(loadpath, O_WRONLY);
+	if (load < 0) {
+		ERROR("Failed to open %s\n", loadpath);
+		return -1;
+	}
+
+	if (write(load, val, strlen(val)) == -1) {
+		ERROR("Failed to write to %s\n", loadpath);
+		ret = -1;
+	}
+	close(load);
+
+	return ret;
+}
+
+static void fw_load_done(struct fw_load *fw, bool success)
+{
+	if (fw->data >= 0) {
+		close(fw->data);
+		fw->data = -1;
+	}
+
+	/* "-1" makes the kernel abort the request instead of waiting for it */
+	fw_load_set(fw, success ? "0" : "-1");
+	DEBUG(2, "Done loading %s for %s\n", fw->file, fw->dev);
+	fw_load_free(fw);
+}
+
+/*
+ * Push the image to the kernel one chunk per uloop iteration, so several
+ * loads can make progress at the same time without blocking event handling.
+ * sendfile is used if the kernel can splice into the sysfs attribute,
+ * otherwise the image is written from a mapping of the file.
+ */
+static void fw_load_step(struct uloop_timeout *t)
+{
+	struct fw_load *fw = container_of(t, struct fw_load, step);
+	size_t len = fw->size - fw->off;
+	ssize_t ret;
+
+	if (len > FW_CHUNK_SIZE)
+		len = FW_CHUNK_SIZE;
+
+	if (!fw->map) {
+		ret = sendfile(fw->data, fw->src, &fw->off, len);
+		if (ret < 0 && (errno == EINVAL || errno == ENOSYS)) {
+			fw->map = mmap(NULL, fw->size, PROT_READ, MAP_PRIVATE, fw->src, 0);
+			if (fw->map == MAP_FAILED) {
+				fw->map = NULL;
+				ERROR("Failed to map firmware %s\n", fw->file);
+				fw_load_done(fw, false);
+				return;
+			}
+			ret = 0;
+		}
+	} else {
+		ret = write(fw->data, (char *) fw->map + fw->off, len);
+		if (ret > 0)
+			fw->off += ret;
+	}
+
+	if (ret < 0) {
+		if (errno == EINTR || errno == EAGAIN) {
+			uloop_timeout_set(&fw->step, 0);
+			return;
+		}
+
+		ERROR("failed to write firmware file %s to %s\n", fw->file, fw->dev);
+		fw_load_done(fw, false);
+		return;
+	}
+
+	if (fw->off >= fw->size) {
+		fw_load_done(fw, true);
+		return;
+	}
+
+	uloop_timeout_set(&fw->step, 0);
+}
+
 static void handle_firmware(struct blob_attr *msg, struct blob_attr *data)
 {
 	char *dir = blobmsg_get_string(blobmsg_data(data));
 	char *file = hotplug_msg_find_var(msg, "FIRMWARE");
 	char *dev = hotplug_msg_find_var(msg, "DEVPATH");
-	struct stat s = { 0 };
-	char *path, loadpath[256], syspath[256];
-	int fw, src, load, len;
-	static char buf[4096];
+	char *_file, *_dev, syspath[256];
+	struct fw_load *fw;
+	struct stat s;
 
 	DEBUG(2, "Firmware request for %s/%s\n", dir, file);
 
 	if (!file || !dir || !dev) {
 		ERROR("Request for unknown firmware %s/%s\n", dir, file);
-		exit(-1);
+		return;
 	}
 
-	path = alloca(strlen(dir) + strlen(file) + 2);
-	sprintf(path, "%s/%s", dir, file);
-
-	if (stat(path, &s)) {
-		ERROR("Could not find firmware %s\n", path);
-		src = -1;
-		s.st_size = 0;
-		goto send_to_kernel;
+	fw = calloc_a(sizeof(*fw), &_file, strlen(dir) + strlen(file) + 2,
+		&_dev, strlen(dev) + 1);
+	if (!fw) {
+		ERROR("Out of memory in %s\n", __func__);
+		return;
 	}
 
-	src = open(path, O_RDONLY);
-	if (src < 0) {
-		ERROR("Failed to open %s\n", path);
-		s.st_size = 0;
-		goto send_to_kernel;
+	sprintf(_file, "%s/%s", dir, file);
+	fw->file = _file;
+	fw->dev = strcpy(_dev, dev);
+	fw->data = -1;
+	fw->step.cb = fw_load_step;
+	list_add_tail(&fw->list, &fw_loads);
+
+	fw->src = open(fw->file, O_RDONLY | O_CLOEXEC);
+	if (fw->src < 0 || fstat(fw->src, &s)) {
+		ERROR("Could not find firmware %s\n", fw->file);
+		fw_load_done(fw, false);
+		return;
 	}
+	fw->size = s.st_size;
 
-send_to_kernel:
-	snprintf(loadpath, sizeof(loadpath), "/sys/%s/loading", dev);
-	load = open(loadpath, O_WRONLY);
-	if (!load) {
-		ERROR("Failed to open %s\n", loadpath);
-		exit(-1);
-	}
-	if (write(load, "1", 1) == -1) {
-		ERROR("Failed to write to %s\n", loadpath);
-		exit(-1);
+	if (fw_load_set(fw, "1")) {
+		fw_load_free(fw);
+		return;
 	}
-	close(load);
 
 	snprintf(syspath, sizeof(syspath), "/sys/%s/data", dev);
-	fw = open(syspath, O_WRONLY);
-	if (fw < 0) {
+	fw->data = open(syspath, O_WRONLY | O_CLOEXEC);
+	if (fw->data < 0) {
 		ERROR("Failed to open %s\n", syspath);
-		exit(-1);
-	}
-
-	len = s.st_size;
-	while (len) {
-		len = read(src, buf, sizeof(buf));
-		if (len <= 0)
-			break;
-
-		if (write(fw, buf, len) == -1) {
-			ERROR("failed to write firmware file %s/%s to %s\n", dir, file, dev);
-			break;
-		}
+		fw_load_done(fw, false);
+		return;
 	}
 
-	if (src >= 0)
-		close(src);
-	close(fw);
-
-	load = open(loadpath, O_WRONLY);
-	if (write(load, "0", 1) == -1)
-		ERROR("failed to write to %s\n", loadpath);
-	close(load);
-
-	DEBUG(2, "Done loading %s\n", path);
-
-	exit(-1);
+	fw_load_step(&fw->step);
 }
 
 enum {
@@ -294,6 +469,7 @@ static struct cmd_handler {
 	char *name;
 	int atomic;
 	void (*handler)(struct blob_attr *msg, struct blob_attr *data);
+	pid_t (*spawn)(struct blob_attr *msg, struct blob_attr *data);
 	void (*start)(struct blob_attr *msg, struct blob_attr *data);
 	void (*complete)(struct blob_attr *msg, struct blob_attr *data, int ret);
 } handlers[] = {
@@ -309,83 +485,113 @@ static struct cmd_handler {
 	},
 	[HANDLER_EXEC] = {
 		.name = "exec",
-		.handler = handle_exec,
+		.spawn = handle_exec,
 	},
 	[HANDLER_BUTTON] = {
 		.name = "button",
-		.handler = handle_exec,
+		.spawn = handle_exec,
 		.start = handle_button_start,
 		.complete = handle_button_complete,
 	},
 	[HANDLER_FW] = {
 		.name = "load-firmware",
+		.atomic = 1,
 		.handler = handle_firmware,
 	},
 };
 
+static bool queue_key_busy(const char *key)
+{
+	int i;
+
+	for (i = 0; i < n_workers; i++)
+		if (workers[i].c && !strcmp(workers[i].c->key, key))
+			return true;
+
+	return false;
+}
+
+static struct cmd_queue *queue_find_next(void)
+{
+	struct cmd_queue *c;
+
+	list_for_each_entry(c, &cmd_queue, list)
+		if (!queue_key_busy(c->key))
+			return c;
+
+	return NULL;
+}
+
 static void queue_next(void)
 {
+	struct hotplug_worker *w;
 	struct cmd_queue *c;
+	int i;
 
-	if (queue_proc.pending || list_empty(&cmd_queue))
-		return;
+	for (i = 0; i < n_workers && !list_empty(&cmd_queue); i++) {
+		w = &workers[i];
+		if (w->c)
+			continue;
 
-	c = list_first_entry(&cmd_queue, struct cmd_queue, list);
+		c = queue_find_next();
+		if (!c)
+			break;
 
-	queue_proc.pid = fork();
-	if (!queue_proc.pid) {
-		uloop_done();
-		c->handler(c->msg, c->data);
-		exit(0);
-	}
-	if (c->start)
-		c->start(c->msg, c->data);
-	list_del(&c->list);
-	if (c->complete)
-		current = c;
-	else
-		free(c);
-	if (queue_proc.pid <= 0) {
-		queue_next();
-		return;
-	}
+		list_del(&c->list);
+		w->proc.pid = c->spawn(c->msg, c->data);
+		if (w->proc.pid < 0) {
+			cmd_queue_free(c);
+			i--;
+			continue;
+		}
 
-	uloop_process_add(&queue_proc);
+		if (c->start)
+			c->start(c->msg, c->data);
+		w->c = c;
+		uloop_process_add(&w->proc);
 
-	DEBUG(4, "Launched hotplug exec instance, pid=%d\n", (int) queue_proc.pid);
+		DEBUG(4, "Launched hotplug exec instance, pid=%d key=%s\n", (int) w->proc.pid, c->key);
+	}
 }
 
-static void queue_proc_cb(struct uloop_process *c, int ret)
+static void queue_proc_cb(struct uloop_process *p, int ret)
 {
-	DEBUG(4, "Finished hotplug exec instance, pid=%d\n", (int) c->pid);
+	struct hotplug_worker *w = container_of(p, struct hotplug_worker, proc);
+	struct cmd_queue *c = w->c;
 
-	if (current) {
-		current->complete(current->msg, current->data, ret);
-		free(current);
-		current = NULL;
-	}
+	DEBUG(4, "Finished hotplug exec instance, pid=%d\n", (int) p->pid);
+
+	w->c = NULL;
+	if (c->complete)
+		c->complete(c->msg, c->data, ret);
+	cmd_queue_free(c);
 	queue_next();
 }
 
 static void queue_add(struct cmd_handler *h, struct blob_attr *msg, struct blob_attr *data)
 {
 	struct cmd_queue *c = NULL;
-	struct blob_attr *_msg, *_data;
-
-	c = calloc_a(sizeof(struct cmd_queue),
-		&_msg, blob_pad_len(msg),
-		&_data, blob_pad_len(data),
-		NULL);
+	char *key;
 
-	c->msg = _msg;
-	c->data = _data;
+	key = hotplug_msg_find_var(msg, order_subsystem ? "SUBSYSTEM" : "DEVPATH");
+	if (!key)
+		key = "";
 
+	/* the rule data is copied along, the message is shared with the other rules */
+	c = slab_alloc(sizeof(struct cmd_queue) + blob_pad_len(data) + strlen(key) + 1);
 	if (!c)
 		return;
 
-	memcpy(c->msg, msg, blob_pad_len(msg));
+	c->msg = slab_event_ref(&uevent, msg);
+	if (!c->msg) {
+		slab_free(c);
+		return;
+	}
+
+	c->data = (struct blob_attr *) (c + 1);
 	memcpy(c->data, data, blob_pad_len(data));
-	c->handler = h->handler;
+	c->key = strcpy((char *) c->data + blob_pad_len(data), key);
+	c->spawn = h->spawn;
 	c->complete = h->complete;
 	c->start = h->start;
 	list_add_tail(&c->list, &cmd_queue);
@@ -413,20 +619,17 @@ static void handle_button_complete(struct blob_attr *msg, struct blob_attr *data
 	struct button_timeout *b;
 	int timeout = ret >> 8;
 
-	if (!timeout)
+	if (!timeout || !name)
 		return;
 
-	b = malloc(sizeof(*b));
-	if (!b || !name)
+	b = slab_alloc(sizeof(*b) + blob_pad_len(data) + strlen(name) + 1);
+	if (!b)
 		return;
 
-	memset(b, 0, sizeof(*b));
-
-	b->data = malloc(blob_pad_len(data));
-	b->name = strdup(name);
-	b->seen = timeout;
-
+	b->data = (struct blob_attr *) (b + 1);
 	memcpy(b->data, data, blob_pad_len(data));
+	b->name = strcpy((char *) b->data + blob_pad_len(data), name);
+	b->seen = timeout;
 	b->timeout.cb = handle_button_timeout;
 
 	uloop_timeout_set(&b->timeout, timeout * 1000);
@@ -473,6 +676,11 @@ static void rule_handle_command(struct json_script_ctx *ctx, const char *name,
 	struct blob_attr *cur;
 	int rem, i;
 
+	if (!strcmp(name, RULE_NEXT)) {
+		rule_next = true;
+		return;
+	}
+
 	if (debug > 3) {
 		DEBUG(4, "Command: %s", name);
 		blobmsg_for_each_attr(cur, data, rem)
@@ -515,6 +723,296 @@ static struct json_script_ctx jctx = {
 	.handle_file = rule_handle_file,
 };
 
+static bool rule_guard_match(struct blob_attr *guard, const char *val)
+{
+	struct blob_attr *cur;
+	int rem;
+
+	if (!guard)
+		return true;
+
+	if (!val)
+		return false;
+
+	switch (blobmsg_type(guard)) {
+	case BLOBMSG_TYPE_STRING:
+		return !strcmp(blobmsg_get_string(guard), val);
+
+	case BLOBMSG_TYPE_ARRAY:
+		blobmsg_for_each_attr(cur, guard, rem)
+			if (!strcmp(blobmsg_get_string(cur), val))
+				return true;
+		break;
+
+	case BLOBMSG_TYPE_TABLE:
+		blobmsg_for_each_attr(cur, guard, rem)
+			if (!strcmp(blobmsg_name(cur), val))
+				return true;
+		break;
+	}
+
+	return false;
+}
+
+static bool rule_guard_valid(struct blob_attr *val)
+{
+	struct blob_attr *cur;
+	int rem;
+
+	if (blobmsg_type(val) == BLOBMSG_TYPE_STRING)
+		return true;
+
+	if (blobmsg_type(val) != BLOBMSG_TYPE_ARRAY)
+		return false;
+
+	blobmsg_for_each_attr(cur, val, rem)
+		if (blobmsg_type(cur) != BLOBMSG_TYPE_STRING)
+			return false;
+
+	return true;
+}
+
+static void rule_set_guard(struct hotplug_rule *r, const char *var, struct blob_attr *val)
+{
+	if (!strcmp(var, "SUBSYSTEM") && !r->subsystem)
+		r->subsystem = val;
+	else if (!strcmp(var, "ACTION") && !r->action)
+		r->action = val;
+}
+
+static void rule_compile_cond(struct hotplug_rule *r, struct blob_attr *cond)
+{
+	struct blob_attr *tb[3], *cur;
+	const char *name;
+	int rem, i = 0;
+
+	if (blobmsg_type(cond) != BLOBMSG_TYPE_ARRAY)
+		return;
+
+	memset(tb, 0, sizeof(tb));
+	blobmsg_for_each_attr(cur, cond, rem)
+		if (i < ARRAY_SIZE(tb))
+			tb[i++] = cur;
+
+	if (!tb[0] || blobmsg_type(tb[0]) != BLOBMSG_TYPE_STRING)
+		return;
+
+	name = blobmsg_get_string(tb[0]);
+	if (!strcmp(name, "eq")) {
+		if (i == 3 && blobmsg_type(tb[1]) == BLOBMSG_TYPE_STRING &&
+		    rule_guard_valid(tb[2]))
+			rule_set_guard(r, blobmsg_get_string(tb[1]), tb[2]);
+	} else if (!strcmp(name, "and")) {
+		/* every term has to match, so any of them can act as guard */
+		i = 0;
+		blobmsg_for_each_attr(cur, cond, rem)
+			if (i++)
+				rule_compile_cond(r, cur);
+	}
+}
+
+static void rule_compile(struct hotplug_rule *r, struct blob_attr *rule)
+{
+	struct blob_attr *tb[4], *cur;
+	const char *name;
+	int rem, i = 0;
+
+	if (blobmsg_type(rule) != BLOBMSG_TYPE_ARRAY)
+		return;
+
+	memset(tb, 0, sizeof(tb));
+	blobmsg_for_each_attr(cur, rule, rem)
+		if (i < ARRAY_SIZE(tb))
+			tb[i++] = cur;
+
+	if (!tb[0] || blobmsg_type(tb[0]) != BLOBMSG_TYPE_STRING)
+		return;
+
+	name = blobmsg_get_string(tb[0]);
+	if (!strcmp(name, "if")) {
+		/* an else branch runs when the condition does not match */
+		if (tb[1] && !tb[3])
+			rule_compile_cond(r, tb[1]);
+	} else if (!strcmp(name, "case")) {
+		if (tb[1] && tb[2] && blobmsg_type(tb[1]) == BLOBMSG_TYPE_STRING &&
+		    blobmsg_type(tb[2]) == BLOBMSG_TYPE_TABLE)
+			rule_set_guard(r, blobmsg_get_string(tb[1]), tb[2]);
+	}
+}
+
+/*
+ * Wrap the statement in a list followed by a marker command. The marker
+ * only gets called if the statement did not "return", in which case the
+ * following statements need to run as well.
+ */
+static struct json_script_file *rule_file_create(struct blob_attr *rule)
+{
+	static struct blob_buf buf;
+	void *a, *c;
+
+	blob_buf_init(&buf, 0);
+	a = blobmsg_open_array(&buf, "");
+	blobmsg_add_blob(&buf, rule);
+	c = blobmsg_open_array(&buf, NULL);
+	blobmsg_add_string(&buf, NULL, RULE_NEXT);
+	blobmsg_close_array(&buf, c);
+	blobmsg_close_array(&buf, a);
+
+	return json_script_file_from_blobmsg(NULL, blob_data(buf.head), blob_len(buf.head));
+}
+
+static struct rule_bucket *rule_bucket_create(const char *subsystem)
+{
+	struct rule_bucket *bucket;
+	char *key = NULL;
+	int i;
+
+	if (subsystem)
+		bucket = calloc_a(sizeof(*bucket) + n_rules * sizeof(int),
+			&key, strlen(subsystem) + 1);
+	else
+		bucket = calloc(1, sizeof(*bucket) + n_rules * sizeof(int));
+	if (!bucket)
+		return NULL;
+
+	for (i = 0; i < n_rules; i++) {
+		if (subsystem && !rule_guard_match(rules[i].subsystem, subsystem))
+			continue;
+		if (!subsystem && rules[i].subsystem)
+			continue;
+		bucket->rules[bucket->n_rules++] = i;
+	}
+
+	if (key)
+		bucket->avl.key = strcpy(key, subsystem);
+
+	return bucket;
+}
+
+static void rule_index_add(const char *subsystem)
+{
+	struct rule_bucket *bucket;
+
+	if (avl_find(&rule_index, subsystem))
+		return;
+
+	bucket = rule_bucket_create(subsystem);
+	if (bucket)
+		avl_insert(&rule_index, &bucket->avl);
+}
+
+static int rules_compile(const char *file)
+{
+	struct blob_attr *top, *cur, *val;
+	json_object *obj;
+	int rem, rem2, i = 0;
+
+	obj = json_object_from_file((char *) file);
+	if (!obj)
+		return -1;
+
+	blob_buf_init(&rule_buf, 0);
+	blobmsg_add_json_element(&rule_buf, "", obj);
+	json_object_put(obj);
+
+	top = blob_data(rule_buf.head);
+	if (blobmsg_type(top) != BLOBMSG_TYPE_ARRAY)
+		return -1;
+
+	blobmsg_for_each_attr(cur, top, rem)
+		n_rules++;
+
+	rules = calloc(n_rules, sizeof(*rules));
+	if (!rules)
+		return -1;
+
+	blobmsg_for_each_attr(cur, top, rem) {
+		struct hotplug_rule *r = &rules[i++];
+
+		r->file = rule_file_create(cur);
+		if (!r->file)
+			return -1;
+		rule_compile(r, cur);
+	}
+
+	avl_init(&rule_index, avl_strcmp, false, NULL);
+	for (i = 0; i < n_rules; i++) {
+		struct blob_attr *guard = rules[i].subsystem;
+
+		if (!guard)
+			continue;
+
+		if (blobmsg_type(guard) == BLOBMSG_TYPE_STRING) {
+			rule_index_add(blobmsg_get_string(guard));
+			continue;
+		}
+
+		blobmsg_for_each_attr(val, guard, rem2)
+			rule_index_add(blobmsg_type(guard) == BLOBMSG_TYPE_TABLE ?
+				blobmsg_name(val) : blobmsg_get_string(val));
+	}
+
+	rule_default = rule_bucket_create(NULL);
+	if (!rule_default)
+		return -1;
+
+	DEBUG(2, "Compiled %d hotplug rules, %d indexed subsystems, %d generic\n",
+		n_rules, rule_index.count, rule_default->n_rules);
+
+	return 0;
+}
+
+static void rules_free(void)
+{
+	struct rule_bucket *bucket, *tmp;
+	int i;
+
+	if (rule_index.comp)
+		avl_remove_all_elements(&rule_index, bucket, avl, tmp)
+			free(bucket);
+
+	for (i = 0; rules && i < n_rules; i++)
+		free(rules[i].file);
+
+	free(rules);
+	free(rule_default);
+	rules = NULL;
+	rule_default = NULL;
+	n_rules = 0;
+}
+
+static void rules_run(struct blob_attr *vars)
+{
+	const char *subsystem = hotplug_msg_find_var(vars, "SUBSYSTEM");
+	const char *action = hotplug_msg_find_var(vars, "ACTION");
+	struct rule_bucket *bucket = NULL;
+	int i;
+
+	if (subsystem)
+		bucket = avl_find_element(&rule_index, subsystem, bucket, avl);
+	if (!bucket)
+		bucket = rule_default;
+
+	for (i = 0; i < bucket->n_rules; i++) {
+		struct hotplug_rule *r = &rules[bucket->rules[i]];
+
+		if (!rule_guard_match(r->action, action))
+			continue;
+
+		rule_next = false;
+#ifdef HOTPLUG_BENCH
+		r->runs++;
+		r->ns -= hotplug_bench_ns();
+#endif
+		json_script_run_file(&jctx, r->file, vars);
+#ifdef HOTPLUG_BENCH
+		r->ns += hotplug_bench_ns();
+#endif
+		if (!rule_next)
+			break;
+	}
+}
+
 static void hotplug_handler_debug(struct blob_attr *data)
 {
 	char *str;
@@ -527,30 +1025,145 @@ static void hotplug_handler_debug(struct blob_attr *data)
 	free(str);
 }
 
-static void hotplug_handler(struct uloop_fd *u, unsigned int ev)
+/*
+ * With procd.hotplug_capture=<file> every uevent is appended to the file as
+ * it came from the socket, after its length as a native endian uint32_t.
+ * hotplug-bench replays such a capture.
+ */
+static void hotplug_capture_open(void)
 {
-	int i = 0;
-	static char buf[4096];
-	int len = recv(u->fd, buf, sizeof(buf), MSG_DONTWAIT);
-	void *index;
-	if (len < 1)
+	char path[128];
+
+	if (!get_cmdline_val("procd.hotplug_capture", path, sizeof(path)))
 		return;
 
+	capture_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	if (capture_fd < 0)
+		ERROR("Failed to open hotplug capture %s: %s\n", path, strerror(errno));
+	else
+		LOG("Capturing uevents to %s\n", path);
+}
+
+static void hotplug_capture(char *buf, int len)
+{
+	uint32_t hdr = len;
+	struct iovec iov[2] = {
+		{ .iov_base = &hdr, .iov_len = sizeof(hdr) },
+		{ .iov_base = buf, .iov_len = len },
+	};
+
+	if (writev(capture_fd, iov, 2) != sizeof(hdr) + len) {
+		ERROR("Failed to write hotplug capture, stopping it\n");
+		close(capture_fd);
+		capture_fd = -1;
+	}
+}
+
+/*
+ * b is the parse arena: blob_buf_init() keeps its allocation, so once the
+ * reserve is in place events are rebuilt without touching the heap. The
+ * values have to be copied, a blobmsg string is stored inline behind its
+ * name.
+ */
+static void hotplug_handle_event(char *buf, int len)
+{
+	char *cur, *end = buf + len, *e;
+	void *index;
+
 	blob_buf_init(&b, 0);
+	if (b.buflen < UEVENT_ARENA_SIZE)
+		blob_buf_grow(&b, UEVENT_ARENA_SIZE - b.buflen);
 	index = blobmsg_open_table(&b, NULL);
-	while (i < len) {
-		int l = strlen(buf + i) + 1;
-		char *e = strstr(&buf[i], "=");
+	for (cur = buf; cur < end; cur += strlen(cur) + 1) {
+		e = strchr(cur, '=');
+		if (!e)
+			continue;
 
-		if (e) {
-			*e = '\0';
-			blobmsg_add_string(&b, &buf[i], &e[1]);
-		}
-		i += l;
+		*e = '\0';
+		blobmsg_add_string(&b, cur, &e[1]);
 	}
 	blobmsg_close_table(&b, index);
 	hotplug_handler_debug(b.head);
-	json_script_run(&jctx, rule_file, blob_data(b.head));
+	slab_event_begin(&uevent, blob_data(b.head));
+	if (rules)
+		rules_run(blob_data(b.head));
+	else
+		json_script_run(&jctx, rule_file, blob_data(b.head));
+	slab_event_end(&uevent);
+}
+
+static void hotplug_handler(struct uloop_fd *u, unsigned int ev)
+{
+	PROF_SCOPE();
+	static char buf[HOTPLUG_BATCH][UEVENT_BUFFER_SIZE + 1];
+	static struct mmsghdr msgs[HOTPLUG_BATCH];
+	static struct iovec iov[HOTPLUG_BATCH];
+	int i, n, loop = 0;
+
+	while (loop++ < HOTPLUG_BATCH_MAX) {
+		for (i = 0; i < HOTPLUG_BATCH; i++) {
+			iov[i].iov_base = buf[i];
+			iov[i].iov_len = UEVENT_BUFFER_SIZE;
+			memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		n = recvmmsg(u->fd, msgs, HOTPLUG_BATCH, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/* the kernel had to discard events, keep reading the rest */
+			if (errno == ENOBUFS) {
+				stats.overflow++;
+				ERROR("hotplug socket overflow, events were lost\n");
+				continue;
+			}
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			int len = msgs[i].msg_len;
+
+			/* skip truncated and libudev monitor messages */
+			if ((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) || len < 1 ||
+			    !strncmp(buf[i], "libudev", 8)) {
+				stats.dropped++;
+				continue;
+			}
+
+			stats.received++;
+			if (capture_fd >= 0)
+				hotplug_capture(buf[i], len);
+			buf[i][len] = '\0';
+			hotplug_handle_event(buf[i], len);
+		}
+
+		if (n < HOTPLUG_BATCH)
+			break;
+	}
+}
+
+static int fw_loading(void)
+{
+	struct fw_load *fw;
+	int n = 0;
+
+	list_for_each_entry(fw, &fw_loads, list)
+		n++;
+
+	return n;
+}
+
+void hotplug_dump_stats(struct blob_buf *b)
+{
+	blobmsg_add_u64(b, "received", stats.received);
+	blobmsg_add_u64(b, "dropped", stats.dropped);
+	blobmsg_add_u64(b, "overflow", stats.overflow);
+	blobmsg_add_u32(b, "workers", n_workers);
+	blobmsg_add_u32(b, "firmware", fw_loading());
+	blobmsg_add_u32(b, "filter", filter_len);
 }
 
 static struct uloop_fd hotplug_fd = {
@@ -566,12 +1179,154 @@ void hotplug_last_event(uloop_timeout_handler handler)
 		uloop_timeout_cancel(&last_event);
 }
 
-void hotplug(char *rules)
+static void rule_action_add(struct uevent_match *m, const char *action)
+{
+	int i;
+
+	for (i = 0; i < m->n_actions; i++)
+		if (!strcmp(m->actions[i], action))
+			return;
+
+	m->actions[m->n_actions++] = action;
+}
+
+/* the actions the rules of a bucket can match, none if one of them takes any */
+static int rule_actions(struct rule_bucket *bucket, struct uevent_match *m)
+{
+	struct blob_attr *guard, *cur;
+	int i, rem, n = 0;
+
+	for (i = 0; i < bucket->n_rules; i++) {
+		guard = rules[bucket->rules[i]].action;
+		if (!guard)
+			return 0;
+
+		if (blobmsg_type(guard) == BLOBMSG_TYPE_STRING)
+			n++;
+		else
+			blobmsg_for_each_attr(cur, guard, rem)
+				n++;
+	}
+
+	m->actions = calloc(n + 1, sizeof(*m->actions));
+	if (!m->actions)
+		return -1;
+
+	for (i = 0; i < bucket->n_rules; i++) {
+		guard = rules[bucket->rules[i]].action;
+		if (blobmsg_type(guard) == BLOBMSG_TYPE_STRING) {
+			rule_action_add(m, blobmsg_get_string(guard));
+			continue;
+		}
+
+		blobmsg_for_each_attr(cur, guard, rem)
+			rule_action_add(m, blobmsg_type(guard) == BLOBMSG_TYPE_TABLE ?
+				blobmsg_name(cur) : blobmsg_get_string(cur));
+	}
+
+	return 0;
+}
+
+/*
+ * Let the kernel drop the uevents of subsystems and actions that no rule
+ * can match. Without compiled rules, with a rule that does not depend on
+ * the subsystem, or while capturing, every uevent is received.
+ */
+static void hotplug_filter_update(void)
+{
+	struct uevent_match *m = NULL;
+	struct rule_bucket *bucket;
+	struct sock_fprog prog;
+	int i, n = 0, dummy = 0;
+	bool attached = false;
+
+	if (!rules || rule_default->n_rules || capture_fd >= 0)
+		goto out;
+
+	m = calloc(rule_index.count + 1, sizeof(*m));
+	if (!m)
+		goto out;
+
+	avl_for_each_element(&rule_index, bucket, avl) {
+		m[n].subsystem = bucket->avl.key;
+		if (rule_actions(bucket, &m[n++]))
+			goto out;
+	}
+
+	if (uevent_filter_build(m, n, &prog)) {
+		ERROR("Failed to build the uevent filter, receiving all uevents\n");
+		goto out;
+	}
+
+	if (setsockopt(hotplug_fd.fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog))) {
+		ERROR("Failed to attach the uevent filter: %s\n", strerror(errno));
+	} else {
+		DEBUG(2, "uevent filter for %d subsystems, %d instructions\n", n, prog.len);
+		filter_len = prog.len;
+		attached = true;
+	}
+	free(prog.filter);
+
+out:
+	for (i = 0; i < n; i++)
+		free(m[i].actions);
+	free(m);
+
+	if (!attached && filter_len) {
+		setsockopt(hotplug_fd.fd, SOL_SOCKET, SO_DETACH_FILTER, &dummy, sizeof(dummy));
+		filter_len = 0;
+	}
+}
+
+static void hotplug_workers_init(void)
+{
+	char line[16];
+	int i;
+
+	if (get_cmdline_val("procd.hotplug_workers", line, sizeof(line)))
+		n_workers = atoi(line);
+	if (n_workers < 1)
+		n_workers = 1;
+	else if (n_workers > HOTPLUG_WORKERS_MAX)
+		n_workers = HOTPLUG_WORKERS_MAX;
+
+	if (get_cmdline_val("procd.hotplug_order", line, sizeof(line)))
+		order_subsystem = !strcmp(line, "subsystem");
+
+	for (i = 0; i < n_workers; i++)
+		workers[i].proc.cb = queue_proc_cb;
+}
+
+/* the uevents queued up while procd re-executes itself are not lost */
+static bool hotplug_handover(void)
+{
+	char *env = getenv("HOTPLUGFD");
+	int dummy = 0;
+
+	if (!env)
+		return false;
+
+	DEBUG(2, "Hotplug socket handover: fd=%s\n", env);
+	hotplug_fd.fd = atoi(env);
+	unsetenv("HOTPLUGFD");
+	fcntl(hotplug_fd.fd, F_SETFD, fcntl(hotplug_fd.fd, F_GETFD) | FD_CLOEXEC);
+
+	/* hotplug_filter_update() attaches the one matching the current rules */
+	setsockopt(hotplug_fd.fd, SOL_SOCKET, SO_DETACH_FILTER, &dummy, sizeof(dummy));
+
+	return true;
+}
+
+int hotplug_socket(void)
+{
+	return hotplug_fd.registered ? hotplug_fd.fd : -1;
+}
+
+static void hotplug_open(void)
 {
 	struct sockaddr_nl nls;
 	int nlbufsize = 512 * 1024;
 
-	rule_file = strdup(rules);
 	memset(&nls,0,sizeof(struct sockaddr_nl));
 	nls.nl_family = AF_NETLINK;
 	nls.nl_pid = getpid();
@@ -588,16 +1343,44 @@ void hotplug(char *rules)
 
 	if (setsockopt(hotplug_fd.fd, SOL_SOCKET, SO_RCVBUFFORCE, &nlbufsize, sizeof(nlbufsize)))
 		ERROR("Failed to resize receive buffer: %s\n", strerror(errno));
+}
+
+void hotplug(char *rule_path)
+{
+	rule_file = strdup(rule_path);
+	if (!hotplug_handover())
+		hotplug_open();
 
 	json_script_init(&jctx);
-	queue_proc.cb = queue_proc_cb;
+	if (rules_compile(rule_file)) {
+		ERROR("Failed to compile %s, using generic rule processing\n", rule_file);
+		rules_free();
+	}
+	hotplug_workers_init();
+	hotplug_capture_open();
+	hotplug_filter_update();
 	uloop_fd_add(&hotplug_fd, ULOOP_READ);
 }
 
-int hotplug_run(char *rules)
+void hotplug_reload(void)
+{
+	if (!rule_file)
+		return;
+
+	/* drops the cached rule file of the generic processing as well */
+	json_script_free(&jctx);
+	rules_free();
+	if (rules_compile(rule_file)) {
+		ERROR("Failed to compile %s, using generic rule processing\n", rule_file);
+		rules_free();
+	}
+	hotplug_filter_update();
+}
+
+int hotplug_run(char *rule_path)
 {
 	uloop_init();
-	hotplug(rules);
+	hotplug(rule_path);
 	uloop_run();
 
 	return 0;
@@ -608,3 +1391,83 @@ void hotplug_shutdown(void)
 	uloop_fd_delete(&hotplug_fd);
 	close(hotplug_fd.fd);
 }
+
+#ifdef HOTPLUG_BENCH
+static uint64_t bench_cmds;
+
+static void bench_handler(struct blob_attr *msg, struct blob_attr *data)
+{
+	bench_cmds++;
+}
+
+static pid_t bench_spawn(struct blob_attr *msg, struct blob_attr *data)
+{
+	bench_cmds++;
+
+	/* a failed spawn completes the queued command right away */
+	return -1;
+}
+
+/* the rules and the dispatch are the real ones, but no command is run */
+int hotplug_bench_init(char *rule_path)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(handlers); i++) {
+		handlers[i].handler = bench_handler;
+		handlers[i].spawn = bench_spawn;
+		handlers[i].start = NULL;
+		handlers[i].complete = NULL;
+	}
+
+	rule_file = strdup(rule_path);
+	json_script_init(&jctx);
+	if (rules_compile(rule_file)) {
+		ERROR("Failed to compile %s, using generic rule processing\n", rule_file);
+		rules_free();
+	}
+	hotplug_workers_init();
+
+	return 0;
+}
+
+void hotplug_bench_event(char *buf, int len)
+{
+	stats.received++;
+	hotplug_handle_event(buf, len);
+}
+
+uint64_t hotplug_bench_cmds(void)
+{
+	return bench_cmds;
+}
+
+static char *bench_guard(struct blob_attr *attr)
+{
+	if (!attr)
+		return strdup("*");
+
+	if (blobmsg_type(attr) == BLOBMSG_TYPE_STRING)
+		return strdup(blobmsg_get_string(attr));
+
+	return blobmsg_format_json(attr, true);
+}
+
+void hotplug_bench_rules(FILE *f)
+{
+	char *subsystem, *action;
+	int i;
+
+	for (i = 0; rules && i < n_rules; i++) {
+		struct hotplug_rule *r = &rules[i];
+
+		subsystem = bench_guard(r->subsystem);
+		action = bench_guard(r->action);
+		fprintf(f, "rule %3d  runs %10" PRIu64 "  %8.0f ns/run  subsystem %s action %s\n",
+			i, r->runs, r->runs ? (double) r->ns / r->runs : 0.0,
+			subsystem ? subsystem : "?", action ? action : "?");
+		free(subsystem);
+		free(action);
+	}
+}
+#endif
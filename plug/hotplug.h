@@ -16,10 +16,27 @@
 #define __PROCD_HOTPLUG_H
 
 #include <libubox/uloop.h>
+#include <libubox/blobmsg.h>
 
-void hotplug(char *rules);
-int hotplug_run(char *rules);
+void hotplug(char *rule_path);
+int hotplug_run(char *rule_path);
 void hotplug_shutdown(void);
+int hotplug_socket(void);
+void hotplug_reload(void);
 void hotplug_last_event(uloop_timeout_handler handler);
+void hotplug_dump_stats(struct blob_buf *b);
+void coldplug_dump_stats(struct blob_buf *b);
+
+#ifdef HOTPLUG_BENCH
+#include <stdio.h>
+
+/* provided by the benchmark, a monotonic clock in ns */
+uint64_t hotplug_bench_ns(void);
+
+int hotplug_bench_init(char *rule_path);
+void hotplug_bench_event(char *buf, int len);
+uint64_t hotplug_bench_cmds(void);
+void hotplug_bench_rules(FILE *f);
+#endif
 
 #endif
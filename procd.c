@@ -70,7 +70,7 @@ int main(int argc, char **argv)
 	trigger_init();
 	if (getpid() != 1)
 		procd_connect_ubus();
-	else
+	else if (!procd_reexec_restore())
 		procd_state_next();
 	uloop_run();
 	uloop_done();
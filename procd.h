@@ -36,7 +36,14 @@ void ubus_init_system(struct ubus_context *ctx);
 
 void procd_state_next(void);
 void procd_state_ubus_connect(void);
+void procd_boot_mark(const char *name);
+void procd_state_dump(struct blob_buf *b);
 void procd_shutdown(int event);
+bool procd_state_running(void);
+void procd_state_resume(struct blob_attr *boot);
+int procd_reexec(void);
+void procd_reexec_keep(int fd);
+bool procd_reexec_restore(void);
 void procd_early(void);
 void procd_preinit(void);
 void procd_coldplug(void);
@@ -44,6 +51,8 @@ void procd_signal(void);
 void procd_signal_preinit(void);
 void procd_inittab(void);
 void procd_inittab_run(const char *action);
+void procd_inittab_dump(struct blob_buf *b);
+void procd_inittab_adopt(struct blob_attr *attr);
 void procd_bcast_event(char *event, struct blob_attr *msg);
 
 struct trigger;
@@ -51,6 +60,8 @@ void trigger_init(void);
 void trigger_event(const char *type, struct blob_attr *data);
 void trigger_add(struct blob_attr *rule, void *id);
 void trigger_del(void *id);
+void trigger_dump(struct blob_buf *b, void *id);
+void trigger_dump_stats(struct blob_buf *b);
 
 void watch_add(const char *_name, void *id);
 void watch_del(void *id);
@@ -0,0 +1,129 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "procd.h"
+#include "profiler.h"
+
+#define PROF_SLOTS	64
+
+struct prof_entry {
+	const char *name;
+	uint32_t calls;
+	uint32_t slow;
+	uint64_t wall_total;
+	uint64_t wall_max;
+	uint64_t cpu_total;
+	uint64_t cpu_max;
+};
+
+static struct prof_entry prof_table[PROF_SLOTS];
+static int prof_used;
+static uint32_t prof_slow_us;
+
+static uint64_t prof_now(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct prof_scope prof_begin(struct prof_point *p)
+{
+	struct prof_scope s = { .point = p };
+
+	/* the table is full, the function is not profiled */
+	if (p->slot < 0 && prof_used < PROF_SLOTS) {
+		p->slot = prof_used++;
+		prof_table[p->slot].name = p->name;
+	}
+
+	if (p->slot >= 0) {
+		s.wall = prof_now(CLOCK_MONOTONIC);
+		s.cpu = prof_now(CLOCK_PROCESS_CPUTIME_ID);
+	}
+
+	return s;
+}
+
+void prof_end(struct prof_scope *s)
+{
+	struct prof_entry *e;
+	uint64_t wall, cpu;
+
+	if (s->point->slot < 0)
+		return;
+
+	cpu = prof_now(CLOCK_PROCESS_CPUTIME_ID) - s->cpu;
+	wall = prof_now(CLOCK_MONOTONIC) - s->wall;
+
+	e = &prof_table[s->point->slot];
+	e->calls++;
+	e->wall_total += wall;
+	e->cpu_total += cpu;
+	if (wall > e->wall_max)
+		e->wall_max = wall;
+	if (cpu > e->cpu_max)
+		e->cpu_max = cpu;
+
+	if (prof_slow_us && wall > prof_slow_us) {
+		e->slow++;
+		LOG("slow callback %s: %lluus wall, %lluus cpu\n", e->name,
+		    (unsigned long long) wall, (unsigned long long) cpu);
+	}
+}
+
+void prof_slow_threshold(uint32_t us)
+{
+	prof_slow_us = us;
+}
+
+/* the slots stay assigned, only the numbers are cleared */
+void prof_reset(void)
+{
+	int i;
+
+	for (i = 0; i < prof_used; i++) {
+		const char *name = prof_table[i].name;
+
+		memset(&prof_table[i], 0, sizeof(prof_table[i]));
+		prof_table[i].name = name;
+	}
+}
+
+void prof_dump(struct blob_buf *b)
+{
+	void *c, *t;
+	int i;
+
+	blobmsg_add_u32(b, "slow_us", prof_slow_us);
+	c = blobmsg_open_table(b, "handlers");
+	for (i = 0; i < prof_used; i++) {
+		struct prof_entry *e = &prof_table[i];
+
+		if (!e->calls)
+			continue;
+
+		t = blobmsg_open_table(b, e->name);
+		blobmsg_add_u32(b, "calls", e->calls);
+		blobmsg_add_u64(b, "wall_us", e->wall_total);
+		blobmsg_add_u64(b, "wall_max_us", e->wall_max);
+		blobmsg_add_u64(b, "cpu_us", e->cpu_total);
+		blobmsg_add_u64(b, "cpu_max_us", e->cpu_max);
+		if (e->slow)
+			blobmsg_add_u32(b, "slow", e->slow);
+		blobmsg_close_table(b, t);
+	}
+	blobmsg_close_table(b, c);
+}
@@ -0,0 +1,52 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __PROCD_PROFILER_H
+#define __PROCD_PROFILER_H
+
+#ifdef PROCD_PROFILER
+
+#include <stdint.h>
+#include <libubox/blobmsg.h>
+
+/* one per profiled function, placed in the table on its first call */
+struct prof_point {
+	const char *name;
+	int slot;
+};
+
+struct prof_scope {
+	struct prof_point *point;
+	uint64_t wall;
+	uint64_t cpu;
+};
+
+struct prof_scope prof_begin(struct prof_point *p);
+void prof_end(struct prof_scope *s);
+void prof_dump(struct blob_buf *b);
+void prof_reset(void);
+void prof_slow_threshold(uint32_t us);
+
+/*
+ * Put at the top of a function to account the time until it returns,
+ * nested scopes are included in the time of the outer ones.
+ */
+#define PROF_SCOPE() \
+	static struct prof_point __prof_point = { .name = __func__, .slot = -1 }; \
+	struct prof_scope __prof_scope __attribute__((cleanup(prof_end), unused)) = \
+		prof_begin(&__prof_point)
+
+#else
+
+#define PROF_SCOPE() do {} while (0)
+
+#endif
+#endif
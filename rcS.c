@@ -16,30 +16,101 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <libubox/uloop.h>
 #include <libubox/runqueue.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <glob.h>
+#include <sys/inotify.h>
+#include <libgen.h>
+#include <dirent.h>
 
 #include <libubox/ustream.h>
+#include <libubox/avl-cmp.h>
 
 #include "procd.h"
+#include "profiler.h"
 #include "rcS.h"
+#include "spawn.h"
+
+#define RCS_MAX_JOBS	4
+#define INITD_HDR_LINES	64
+#define INITD_HDR_LEN	128
 
 static struct runqueue q, r;
+static LIST_HEAD(timeline);
+
+struct initd_rec {
+	struct list_head list;
+	char *file;
+	char *param;
+	pid_t pid;
+	int status;
+
+	/* CLOCK_MONOTONIC timestamps in ms */
+	uint32_t queued;
+	uint32_t exec;
+	uint32_t exit;
+};
 
 struct initd {
 	struct ustream_fd fd;
 	struct runqueue_process proc;
 	char *file;
 	char *param;
+
+	/* scripts that can only start once this one is done */
+	struct initd **rdeps;
+	int n_rdeps;
+	/* number of scripts this one is still waiting for */
+	int deps;
+
+	struct initd_rec *rec;
+};
+
+struct initd_hdr {
+	char name[INITD_HDR_LEN];
+	char provides[INITD_HDR_LEN];
+	char requires[INITD_HDR_LEN];
+	char after[INITD_HDR_LEN];
+	int start;
+	int stop;
+	bool has_deps;
+};
+
+/* cached script and its parsed header, key is the file name */
+struct initd_script {
+	struct avl_node avl;
+	char *file;
+	struct initd_hdr hdr;
+};
+
+struct initd_dir {
+	const char *path;
+	struct avl_tree scripts;
+	bool valid;
+	bool nocache;
+	int wd;
+};
+
+enum {
+	INITD_DIR_RCD,
+	INITD_DIR_INITD,
+};
+
+static struct initd_dir initd_dirs[] = {
+	[INITD_DIR_RCD] = { .path = "/etc/rc.d" },
+	[INITD_DIR_INITD] = { .path = "/etc/init.d" },
 };
 
+static struct uloop_fd initd_inotify = { .fd = -1 };
+
 static void pipe_cb(struct ustream *s, int bytes)
 {
 	char *newline, *str;
@@ -62,49 +133,117 @@ static void pipe_cb(struct ustream *s, int bytes)
 	} while (1);
 }
 
+static uint32_t initd_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void initd_rec_add(struct initd *s)
+{
+	struct initd_rec *rec;
+	char *f, *p;
+
+	rec = calloc_a(sizeof(*rec), &f, strlen(s->file) + 1, &p, strlen(s->param) + 1);
+	if (!rec)
+		return;
+
+	rec->file = strcpy(f, s->file);
+	rec->param = strcpy(p, s->param);
+	rec->status = -1;
+	list_add_tail(&rec->list, &timeline);
+	s->rec = rec;
+}
+
+static void initd_queue(struct runqueue *q, struct initd *s)
+{
+	if (s->rec)
+		s->rec->queued = initd_now();
+	runqueue_task_add(q, &s->proc.task, false);
+}
+
+static void q_initd_exit(struct uloop_process *p, int ret)
+{
+	struct initd *s = container_of(p, struct initd, proc.proc);
+
+	if (s->rec) {
+		s->rec->exit = initd_now();
+		s->rec->status = ret;
+	}
+	runqueue_task_complete(&s->proc.task);
+}
+
 static void q_initd_run(struct runqueue *q, struct runqueue_task *t)
 {
+	PROF_SCOPE();
 	struct initd *s = container_of(t, struct initd, proc.task);
+	char *argv[] = { s->file, s->param, NULL };
+	struct spawn_opts o;
 	int pipefd[2];
 	pid_t pid;
 
 	DEBUG(2, "start %s %s \n", s->file, s->param);
-	if (pipe(pipefd) == -1) {
+	if (pipe2(pipefd, O_CLOEXEC) == -1) {
 		ERROR("Failed to create pipe\n");
+		runqueue_task_complete(t);
 		return;
 	}
 
-	pid = fork();
-	if (pid < 0)
-		return;
-
-	if (pid) {
-		close(pipefd[1]);
-		s->fd.stream.string_data = true,
-		s->fd.stream.notify_read = pipe_cb,
-		runqueue_process_add(q, &s->proc, pid);
-		ustream_fd_init(&s->fd, pipefd[0]);
+	spawn_opts_init(&o);
+	o.argv = argv;
+	o.fd[1] = o.fd[2] = pipefd[1];
+	pid = procd_spawn(&o);
+	close(pipefd[1]);
+	if (pid < 0) {
+		close(pipefd[0]);
+		runqueue_task_complete(t);
 		return;
 	}
-	close(pipefd[0]);
-	dup2(pipefd[1], STDOUT_FILENO);
-	dup2(pipefd[1], STDERR_FILENO);
 
-	execlp(s->file, s->file, s->param, NULL);
-	exit(1);
+	s->fd.stream.string_data = true,
+	s->fd.stream.notify_read = pipe_cb,
+	runqueue_process_add(q, &s->proc, pid);
+	/* hook the exit callback to know the exit status */
+	s->proc.proc.cb = q_initd_exit;
+	ustream_fd_init(&s->fd, pipefd[0]);
+	if (s->rec) {
+		s->rec->exec = initd_now();
+		s->rec->pid = pid;
+	}
 }
 
 static void q_initd_complete(struct runqueue *q, struct runqueue_task *p)
 {
+	PROF_SCOPE();
 	struct initd *s = container_of(p, struct initd, proc.task);
+	int i;
 
 	DEBUG(2, "stop %s %s \n", s->file, s->param);
-	ustream_free(&s->fd.stream);
-	close(s->fd.fd.fd);
+	if (s->rec && !s->rec->exit)
+		s->rec->exit = initd_now();
+
+	if (s->fd.fd.fd > 0) {
+		ustream_free(&s->fd.stream);
+		close(s->fd.fd.fd);
+	}
+
+	for (i = 0; i < s->n_rdeps; i++) {
+		struct initd *d = s->rdeps[i];
+
+		if (--d->deps)
+			continue;
+
+		DEBUG(2, "dependencies of %s met\n", d->file);
+		initd_queue(q, d);
+	}
+	free(s->rdeps);
 	free(s);
 }
 
-static void add_initd(struct runqueue *q, char *file, char *param)
+static struct initd *alloc_initd(char *file, char *param)
 {
 	static const struct runqueue_task_type initd_type = {
 		.run = q_initd_run,
@@ -117,7 +256,7 @@ static void add_initd(struct runqueue *q, char *file, char *param)
 	s = calloc_a(sizeof(*s), &f, strlen(file) + 1, &p, strlen(param) + 1);
 	if (!s) {
 		ERROR("Out of memory in %s.\n", file);
-		return;
+		return NULL;
 	}
 	s->proc.task.type = &initd_type;
 	s->proc.task.complete = q_initd_complete;
@@ -127,51 +266,489 @@ static void add_initd(struct runqueue *q, char *file, char *param)
 	s->file = f;
 	strcpy(s->param, param);
 	strcpy(s->file, file);
-	runqueue_task_add(q, &s->proc.task, false);
+
+	return s;
+}
+
+static void add_initd(struct runqueue *q, char *file, char *param)
+{
+	struct initd *s = alloc_initd(file, param);
+
+	if (s)
+		runqueue_task_add(q, &s->proc.task, false);
+}
+
+static void initd_hdr_copy(char *dest, char *val)
+{
+	char *end;
+
+	while (*val == '"' || *val == '\'')
+		val++;
+
+	end = val + strcspn(val, "\"'#\n");
+	while (end > val && isspace(end[-1]))
+		end--;
+	*end = 0;
+
+	strncpy(dest, val, INITD_HDR_LEN - 1);
+}
+
+/*
+ * Read the START/STOP style shell variables at the top of an init script.
+ * PROVIDES lists additional names the script can be referred to by,
+ * REQUIRES and AFTER list the scripts that need to have completed before
+ * this one may run.
+ */
+static void initd_parse_hdr(const char *file, struct initd_hdr *h)
+{
+	char line[256], *name;
+	FILE *fp;
+	int i;
+
+	memset(h, 0, sizeof(*h));
+
+	snprintf(line, sizeof(line), "%s", file);
+	name = basename(line);
+	if (name[0] == 'S' || name[0] == 'K') {
+		h->start = h->stop = atoi(name + 1);
+		name += strspn(name + 1, "0123456789") + 1;
+	}
+	strncpy(h->name, name, INITD_HDR_LEN - 1);
+
+	fp = fopen(file, "r");
+	if (!fp)
+		return;
+
+	for (i = 0; i < INITD_HDR_LINES && fgets(line, sizeof(line), fp); i++) {
+		if (!strncmp(line, "PROVIDES=", 9))
+			initd_hdr_copy(h->provides, &line[9]);
+		else if (!strncmp(line, "REQUIRES=", 9))
+			initd_hdr_copy(h->requires, &line[9]);
+		else if (!strncmp(line, "AFTER=", 6))
+			initd_hdr_copy(h->after, &line[6]);
+		else if (!strncmp(line, "START=", 6) && !h->start)
+			h->start = atoi(&line[6]);
+		else if (!strncmp(line, "STOP=", 5) && !h->stop)
+			h->stop = atoi(&line[5]);
+	}
+	fclose(fp);
+
+	h->has_deps = *h->requires || *h->after;
+}
+
+static void initd_index_flush(struct initd_dir *d)
+{
+	struct initd_script *s, *tmp;
+
+	avl_remove_all_elements(&d->scripts, s, avl, tmp)
+		free(s);
+	d->valid = false;
+}
+
+#define INITD_WATCH_MASK	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+				 IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* a directory that can't be watched is rescanned on every lookup */
+static void initd_index_watch(struct initd_dir *d)
+{
+	if (d->wd >= 0)
+		inotify_rm_watch(initd_inotify.fd, d->wd);
+
+	d->wd = inotify_add_watch(initd_inotify.fd, d->path, INITD_WATCH_MASK);
+	d->nocache = d->wd < 0;
+}
+
+static void initd_index_drain(void)
+{
+	char buf[1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	ssize_t len, i;
+	bool changed = false;
+
+	if (initd_inotify.fd < 0)
+		return;
+
+	while ((len = read(initd_inotify.fd, buf, sizeof(buf))) > 0) {
+		changed = true;
+
+		/* a replaced directory (e.g. by an overlay or a package) needs a new watch */
+		for (i = 0; i < len; i += sizeof(*ev) + ev->len) {
+			int j;
+
+			ev = (struct inotify_event *) &buf[i];
+			if (!(ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)))
+				continue;
+
+			for (j = 0; j < ARRAY_SIZE(initd_dirs); j++) {
+				if (initd_dirs[j].wd != ev->wd)
+					continue;
+
+				/* a deleted one lost its watch already */
+				if (!(ev->mask & IN_MOVE_SELF))
+					initd_dirs[j].wd = -1;
+				initd_dirs[j].nocache = true;
+			}
+		}
+	}
+
+	/* rc.d only holds links into init.d, so any change invalidates both */
+	if (changed)
+		for (i = 0; i < ARRAY_SIZE(initd_dirs); i++)
+			initd_index_flush(&initd_dirs[i]);
+
+	for (i = 0; i < ARRAY_SIZE(initd_dirs); i++)
+		if (initd_dirs[i].nocache)
+			initd_index_watch(&initd_dirs[i]);
+}
+
+static void initd_inotify_cb(struct uloop_fd *fd, unsigned int events)
+{
+	initd_index_drain();
 }
 
-static int _rc(struct runqueue *q, char *path, const char *file, char *pattern, char *param)
+static void initd_index_init(void)
 {
-	char *dir = alloca(2 + strlen(path) + strlen(file) + strlen(pattern));
-	glob_t gl;
-	int j;
+	static bool init;
+	int i;
 
+	if (init)
+		return;
+	init = true;
+
+	for (i = 0; i < ARRAY_SIZE(initd_dirs); i++) {
+		avl_init(&initd_dirs[i].scripts, avl_strcmp, false, NULL);
+		initd_dirs[i].wd = -1;
+	}
+
+	initd_inotify.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (initd_inotify.fd < 0) {
+		ERROR("Failed to init inotify, not caching init scripts\n");
+		return;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(initd_dirs); i++)
+		initd_index_watch(&initd_dirs[i]);
+
+	initd_inotify.cb = initd_inotify_cb;
+	uloop_fd_add(&initd_inotify, ULOOP_READ);
+}
+
+static void initd_index_scan(struct initd_dir *d)
+{
+	struct initd_script *s;
+	struct dirent *e;
+	struct stat st;
+	char *key, *file;
+	DIR *dir;
+
+	initd_index_flush(d);
+
+	dir = opendir(d->path);
 	if (!dir) {
+		DEBUG(2, "failed to open %s\n", d->path);
+		return;
+	}
+
+	while ((e = readdir(dir)) != NULL) {
+		if (e->d_name[0] == '.')
+			continue;
+
+		if (fstatat(dirfd(dir), e->d_name, &st, 0) || !S_ISREG(st.st_mode))
+			continue;
+
+		s = calloc_a(sizeof(*s), &key, strlen(e->d_name) + 1,
+			&file, strlen(d->path) + strlen(e->d_name) + 2);
+		if (!s) {
+			ERROR("Out of memory in %s.\n", __func__);
+			break;
+		}
+
+		sprintf(file, "%s/%s", d->path, e->d_name);
+		s->file = file;
+		s->avl.key = strcpy(key, e->d_name);
+		initd_parse_hdr(file, &s->hdr);
+		avl_insert(&d->scripts, &s->avl);
+	}
+	closedir(dir);
+
+	d->valid = !d->nocache && initd_inotify.fd >= 0;
+	DEBUG(2, "indexed %d scripts in %s\n", d->scripts.count, d->path);
+}
+
+/*
+ * Return all scripts in the directory whose name starts with prefix, or only
+ * the one matching it if exact is set, sorted by name like glob() would.
+ */
+static int initd_index_lookup(struct initd_dir *d, const char *prefix, bool exact,
+			      struct initd_script ***list)
+{
+	struct initd_script *s, **l;
+	int n = 0, len = strlen(prefix);
+
+	initd_index_init();
+	initd_index_drain();
+	if (!d->valid)
+		initd_index_scan(d);
+
+	*list = l = calloc(d->scripts.count + 1, sizeof(*l));
+	if (!l)
+		return -1;
+
+	if (exact) {
+		s = avl_find_element(&d->scripts, prefix, s, avl);
+		if (s)
+			l[n++] = s;
+		return n;
+	}
+
+	s = avl_find_ge_element(&d->scripts, prefix, s, avl);
+	if (!s)
+		return 0;
+
+	avl_for_element_to_last(&d->scripts, s, s, avl) {
+		if (strncmp(s->avl.key, prefix, len))
+			break;
+		l[n++] = s;
+	}
+
+	return n;
+}
+
+static bool initd_hdr_provides(struct initd_hdr *h, const char *name)
+{
+	const char *p = h->provides;
+	int len = strlen(name);
+
+	if (!strcmp(h->name, name))
+		return true;
+
+	while ((p = strstr(p, name)) != NULL) {
+		if ((p == h->provides || isspace(p[-1])) &&
+		    (!p[len] || isspace(p[len])))
+			return true;
+		p += len;
+	}
+
+	return false;
+}
+
+static void initd_add_dep(struct initd *s, struct initd *d)
+{
+	struct initd **rdeps;
+
+	rdeps = realloc(s->rdeps, (s->n_rdeps + 1) * sizeof(*rdeps));
+	if (!rdeps) {
+		ERROR("Out of memory in %s.\n", s->file);
+		return;
+	}
+
+	rdeps[s->n_rdeps++] = d;
+	s->rdeps = rdeps;
+	d->deps++;
+}
+
+static void initd_add_deps(struct initd **s, struct initd_script **scripts, int n, int cur,
+			   const char *deps, bool required, bool reverse)
+{
+	char list[INITD_HDR_LEN], *name, *sptr;
+	int i;
+
+	strcpy(list, deps);
+	for (name = strtok_r(list, " \t", &sptr); name; name = strtok_r(NULL, " \t", &sptr)) {
+		bool found = false;
+
+		for (i = 0; i < n; i++) {
+			if (i == cur || !s[i] || !initd_hdr_provides(&scripts[i]->hdr, name))
+				continue;
+
+			found = true;
+			if (reverse) {
+				/* stopping: whatever cur depends on goes down after it */
+				if (i > cur)
+					initd_add_dep(s[cur], s[i]);
+				continue;
+			}
+			if (i > cur) {
+				ERROR("%s: ignoring dependency on %s, which starts later\n",
+					s[cur]->file, s[i]->file);
+				continue;
+			}
+			initd_add_dep(s[i], s[cur]);
+		}
+
+		if (!found && required)
+			ERROR("%s: required script %s not found\n", s[cur]->file, name);
+	}
+}
+
+/*
+ * Scripts without dependency headers keep the classic rc.d ordering and wait
+ * for every script sorting before them. Scripts declaring REQUIRES/AFTER only
+ * wait for the scripts they name, which allows independent ones to run in
+ * parallel. Dependencies can only point to scripts sorting earlier, so the
+ * resulting graph is always acyclic.
+ *
+ * K* scripts use the same headers with the edges reversed: a script is only
+ * stopped once everything that requires it has stopped, all others stop in
+ * parallel.
+ */
+static void add_initd_graph(struct runqueue *q, struct initd_script **scripts, int n,
+			    char *param, bool ordered, bool reverse)
+{
+	struct initd **s = calloc(n, sizeof(*s));
+	int i, j, last = -1;
+
+	if (!s) {
+		ERROR("Out of memory in %s.\n", __func__);
+		for (i = 0; i < n; i++)
+			add_initd(q, scripts[i]->file, param);
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		s[i] = alloc_initd(scripts[i]->file, param);
+		if (s[i])
+			initd_rec_add(s[i]);
+	}
+
+	for (i = 0; i < n; i++) {
+		struct initd_hdr *h = &scripts[i]->hdr;
+
+		if (!s[i])
+			continue;
+
+		if (ordered && h->has_deps) {
+			initd_add_deps(s, scripts, n, i, h->requires, true, reverse);
+			initd_add_deps(s, scripts, n, i, h->after, false, reverse);
+			continue;
+		}
+
+		for (j = last < 0 ? 0 : last; j < i; j++)
+			if (s[j])
+				initd_add_dep(s[j], s[i]);
+		last = i;
+	}
+
+	for (i = 0; i < n; i++)
+		if (s[i] && !s[i]->deps)
+			initd_queue(q, s[i]);
+
+	free(s);
+}
+
+static int _rc(struct runqueue *q, struct initd_dir *d, const char *file, bool exact, char *param)
+{
+	struct initd_script **scripts;
+	int j, n;
+
+	DEBUG(2, "running %s/%s%s %s\n", d->path, file, exact ? "" : "*", param);
+	n = initd_index_lookup(d, file, exact, &scripts);
+	if (n < 0) {
 		ERROR("Out of memory in %s.\n", file);
 		return -1;
 	}
 
-	DEBUG(2, "running %s/%s%s %s\n", path, file, pattern, param);
-	sprintf(dir, "%s/%s%s", path, file, pattern);
-	if (glob(dir, GLOB_NOESCAPE | GLOB_MARK, NULL, &gl)) {
-		DEBUG(2, "glob failed on %s\n", dir);
+	if (!n) {
+		DEBUG(2, "no script matching %s/%s\n", d->path, file);
+		free(scripts);
 		return -1;
 	}
 
-	for (j = 0; j < gl.gl_pathc; j++)
-		add_initd(q, gl.gl_pathv[j], param);
+	if (q == &r) {
+		for (j = 0; j < n; j++)
+			add_initd(q, scripts[j]->file, param);
+	} else {
+		add_initd_graph(q, scripts, n, param, *file == 'S' || *file == 'K', *file == 'K');
+	}
 
-	globfree(&gl);
+	free(scripts);
 
 	return 0;
 }
 
-int rcS(char *pattern, char *param, void (*q_empty)(struct runqueue *))
+int rcS(char *pattern, char *param, int jobs, void (*q_empty)(struct runqueue *))
 {
 	runqueue_init(&q);
 	q.empty_cb = q_empty;
-	q.max_running_tasks = 1;
+	q.max_running_tasks = jobs > 0 ? jobs : RCS_MAX_JOBS;
 
-	return _rc(&q, "/etc/rc.d", pattern, "*", param);
+	return _rc(&q, &initd_dirs[INITD_DIR_RCD], pattern, false, param);
 }
 
 int rc(const char *file, char *param)
 {
-	return _rc(&r, "/etc/init.d", file, "", param);
+	return _rc(&r, &initd_dirs[INITD_DIR_INITD], file, true, param);
+}
+
+void rcS_timeline_dump(struct blob_buf *b)
+{
+	struct initd_rec *rec;
+	void *a, *t;
+
+	a = blobmsg_open_array(b, "scripts");
+	list_for_each_entry(rec, &timeline, list) {
+		t = blobmsg_open_table(b, NULL);
+		blobmsg_add_string(b, "file", rec->file);
+		blobmsg_add_string(b, "param", rec->param);
+		if (rec->pid)
+			blobmsg_add_u32(b, "pid", rec->pid);
+		blobmsg_add_u32(b, "queued", rec->queued);
+		if (rec->exec)
+			blobmsg_add_u32(b, "exec", rec->exec);
+		if (rec->exit) {
+			blobmsg_add_u32(b, "exit", rec->exit);
+			blobmsg_add_u32(b, "time", rec->exit - (rec->exec ? rec->exec : rec->queued));
+		}
+		if (rec->status >= 0)
+			blobmsg_add_u32(b, "status", rec->status);
+		blobmsg_close_table(b, t);
+	}
+	blobmsg_close_array(b, a);
+}
+
+/*
+ * Write the timeline as a bootchart proc_ps.log, sampling every 10ms. Each
+ * sample block is the uptime in jiffies (assuming HZ=100) followed by a
+ * /proc/<pid>/stat style line for every script running at that time.
+ */
+int rcS_timeline_bootchart(const char *path)
+{
+	struct initd_rec *rec;
+	uint32_t first = 0, last = 0, t;
+	FILE *fp;
+
+	list_for_each_entry(rec, &timeline, list) {
+		if (!rec->exec)
+			continue;
+		if (!first || rec->exec < first)
+			first = rec->exec;
+		if (rec->exit > last)
+			last = rec->exit;
+	}
+
+	fp = fopen(path, "w");
+	if (!fp)
+		return -1;
+
+	for (t = first - first % 10; first && t <= last; t += 10) {
+		fprintf(fp, "%u\n", t / 10);
+		list_for_each_entry(rec, &timeline, list) {
+			if (!rec->exec || rec->exec > t || (rec->exit && rec->exit < t))
+				continue;
+
+			fprintf(fp, "%d (%s) R 1 %d %d 0 -1 0 0 0 0 0 0 0 0 0 20 0 1 0 %u\n",
+				rec->pid, basename(rec->file), rec->pid, rec->pid, rec->exec / 10);
+		}
+		fprintf(fp, "\n");
+	}
+	fclose(fp);
+
+	return 0;
 }
 
 static void r_empty(struct runqueue *q)
 {
+	PROF_SCOPE();
 
 }
 
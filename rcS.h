@@ -16,8 +16,11 @@
 #define __PROCD_RCS_H
 
 #include <libubox/runqueue.h>
+#include <libubox/blobmsg.h>
 
-extern int rcS(char *pattern, char *param, void (*q_empty)(struct runqueue *));
+extern int rcS(char *pattern, char *param, int jobs, void (*q_empty)(struct runqueue *));
 extern int rc(const char *file, char *param);
+extern void rcS_timeline_dump(struct blob_buf *b);
+extern int rcS_timeline_bootchart(const char *path);
 
 #endif
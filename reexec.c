@@ -0,0 +1,290 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Re-exec: procd writes its supervisor state to a memfd and executes
+ * /sbin/procd again, which stays pid 1 and so remains the parent of every
+ * child. The new image restores the services from the state and adopts
+ * their processes and stdio instead of starting them. The state, the
+ * watchdog and the uevent socket are handed over in the environment, the
+ * same way the watchdog is handed to upgraded. Queued trigger actions and
+ * hotplug commands, watchdog heartbeats and the event journal are lost.
+ */
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "procd.h"
+#include "watchdog.h"
+#include "plug/hotplug.h"
+#include "service/service.h"
+
+#define REEXEC_VERSION	1
+#define REEXEC_ENV	"PROCD_STATE"
+
+static char procd_path[] = "/sbin/procd";
+
+static struct blob_buf b;
+static struct uloop_timeout reexec_timer;
+static struct uloop_timeout reap_timer;
+
+/* the fds the next image inherits */
+static int *keep_fds;
+static int n_keep_fds;
+static bool keep_failed;
+
+enum {
+	REEXEC_VERSION_ATTR,
+	REEXEC_BOOT,
+	REEXEC_WATCHDOG,
+	REEXEC_SERVICES,
+	REEXEC_INITTAB,
+	__REEXEC_MAX
+};
+
+static const struct blobmsg_policy reexec_attrs[__REEXEC_MAX] = {
+	[REEXEC_VERSION_ATTR] = { "version", BLOBMSG_TYPE_INT32 },
+	[REEXEC_BOOT] = { "boot", BLOBMSG_TYPE_TABLE },
+	[REEXEC_WATCHDOG] = { "watchdog", BLOBMSG_TYPE_TABLE },
+	[REEXEC_SERVICES] = { "services", BLOBMSG_TYPE_ARRAY },
+	[REEXEC_INITTAB] = { "inittab", BLOBMSG_TYPE_ARRAY },
+};
+
+enum {
+	WDT_TIMEOUT,
+	WDT_FREQUENCY,
+	WDT_STOPPED,
+	__WDT_MAX
+};
+
+static const struct blobmsg_policy wdt_attrs[__WDT_MAX] = {
+	[WDT_TIMEOUT] = { "timeout", BLOBMSG_TYPE_INT32 },
+	[WDT_FREQUENCY] = { "frequency", BLOBMSG_TYPE_INT32 },
+	[WDT_STOPPED] = { "stopped", BLOBMSG_TYPE_BOOL },
+};
+
+/* keeps fd open across the exec, the new image sets close-on-exec again */
+void procd_reexec_keep(int fd)
+{
+	int *fds;
+
+	fds = realloc(keep_fds, (n_keep_fds + 1) * sizeof(*fds));
+	if (!fds) {
+		keep_failed = true;
+		return;
+	}
+
+	keep_fds = fds;
+	keep_fds[n_keep_fds++] = fd;
+	fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) & ~FD_CLOEXEC);
+}
+
+static void reexec_release(void)
+{
+	int i;
+
+	for (i = 0; i < n_keep_fds; i++)
+		fcntl(keep_fds[i], F_SETFD, fcntl(keep_fds[i], F_GETFD) | FD_CLOEXEC);
+
+	free(keep_fds);
+	keep_fds = NULL;
+	n_keep_fds = 0;
+	keep_failed = false;
+}
+
+static void reexec_setenv(const char *name, int fd)
+{
+	char buf[12];
+
+	snprintf(buf, sizeof(buf), "%d", fd);
+	setenv(name, buf, 1);
+	procd_reexec_keep(fd);
+}
+
+static void reexec_cb(struct uloop_timeout *t)
+{
+	char *argv[] = { procd_path, NULL, NULL, NULL };
+	char *wdt_fd = watchdog_fd();
+	char dbg[12];
+	void *c;
+	int fd, len;
+
+	fd = memfd_create("procd-state", MFD_CLOEXEC);
+	if (fd < 0) {
+		ERROR("Failed to create the re-exec state: %s\n", strerror(errno));
+		return;
+	}
+
+	blob_buf_init(&b, 0);
+	blobmsg_add_u32(&b, "version", REEXEC_VERSION);
+	c = blobmsg_open_table(&b, "boot");
+	procd_state_dump(&b);
+	blobmsg_close_table(&b, c);
+	c = blobmsg_open_table(&b, "watchdog");
+	blobmsg_add_u32(&b, "timeout", watchdog_timeout(0));
+	blobmsg_add_u32(&b, "frequency", watchdog_frequency(0));
+	blobmsg_add_u8(&b, "stopped", watchdog_get_stopped());
+	blobmsg_close_table(&b, c);
+	service_state_dump(&b);
+	procd_inittab_dump(&b);
+
+	len = blob_pad_len(b.head);
+	if (write(fd, b.head, len) != len) {
+		ERROR("Failed to write the re-exec state: %s\n", strerror(errno));
+		goto out;
+	}
+
+	reexec_setenv(REEXEC_ENV, fd);
+	if (wdt_fd)
+		reexec_setenv("WDTFD", atoi(wdt_fd));
+	if (hotplug_socket() >= 0)
+		reexec_setenv("HOTPLUGFD", hotplug_socket());
+	if (keep_failed) {
+		ERROR("Out of memory in %s\n", __func__);
+		goto env;
+	}
+
+	if (debug) {
+		snprintf(dbg, sizeof(dbg), "%u", debug);
+		setenv("DBGLVL", dbg, 1);
+	}
+	if (ubus_socket) {
+		argv[1] = "-s";
+		argv[2] = ubus_socket;
+	}
+
+	LOG("- re-exec -\n");
+	execv(procd_path, argv);
+	ERROR("Failed to re-exec %s: %s\n", procd_path, strerror(errno));
+	unsetenv("DBGLVL");
+
+env:
+	unsetenv(REEXEC_ENV);
+	unsetenv("WDTFD");
+	unsetenv("HOTPLUGFD");
+out:
+	reexec_release();
+	close(fd);
+}
+
+/* the exec happens once the reply to the caller went out */
+int procd_reexec(void)
+{
+	if (getpid() != 1 || !procd_state_running() || upgrade_running)
+		return -1;
+
+	if (access(procd_path, X_OK))
+		return -1;
+
+	reexec_timer.cb = reexec_cb;
+	uloop_timeout_set(&reexec_timer, 0);
+
+	return 0;
+}
+
+static void reexec_watchdog(struct blob_attr *attr)
+{
+	struct blob_attr *tb[__WDT_MAX];
+
+	blobmsg_parse(wdt_attrs, __WDT_MAX, tb, blobmsg_data(attr), blobmsg_data_len(attr));
+	if (tb[WDT_TIMEOUT])
+		watchdog_timeout(blobmsg_get_u32(tb[WDT_TIMEOUT]));
+	if (tb[WDT_FREQUENCY])
+		watchdog_frequency(blobmsg_get_u32(tb[WDT_FREQUENCY]));
+	if (tb[WDT_STOPPED])
+		watchdog_set_stopped(blobmsg_get_bool(tb[WDT_STOPPED]));
+}
+
+/* children that exited before uloop got to watch for them are zombies by now */
+static void reexec_reap_cb(struct uloop_timeout *t)
+{
+	kill(getpid(), SIGCHLD);
+}
+
+static struct blob_attr *reexec_load(int fd)
+{
+	struct blob_attr *state;
+	struct stat s;
+
+	if (fstat(fd, &s) || s.st_size < sizeof(*state))
+		return NULL;
+
+	state = malloc(s.st_size);
+	if (!state)
+		return NULL;
+
+	if (pread(fd, state, s.st_size, 0) != s.st_size ||
+	    blob_pad_len(state) > s.st_size) {
+		free(state);
+		return NULL;
+	}
+
+	return state;
+}
+
+/*
+ * Takes the place of the boot states when started by procd_reexec(). If the
+ * state is unusable procd still takes over as init, but without services.
+ */
+bool procd_reexec_restore(void)
+{
+	struct blob_attr *tb[__REEXEC_MAX] = { 0 };
+	struct blob_attr *state;
+	char *env = getenv(REEXEC_ENV);
+	int fd;
+
+	if (!env)
+		return false;
+
+	fd = atoi(env);
+	unsetenv(REEXEC_ENV);
+
+	state = reexec_load(fd);
+	close(fd);
+	if (state)
+		blobmsg_parse(reexec_attrs, __REEXEC_MAX, tb, blob_data(state), blob_len(state));
+
+	if (!tb[REEXEC_VERSION_ATTR] || blobmsg_get_u32(tb[REEXEC_VERSION_ATTR]) != REEXEC_VERSION) {
+		ERROR("Unusable re-exec state, continuing without services\n");
+		memset(tb, 0, sizeof(tb));
+	}
+
+	watchdog_init(0);
+	if (tb[REEXEC_WATCHDOG])
+		reexec_watchdog(tb[REEXEC_WATCHDOG]);
+	hotplug("/etc/hotplug.json");
+
+	service_init();
+	service_boot_done();
+	if (tb[REEXEC_SERVICES])
+		service_state_restore(tb[REEXEC_SERVICES]);
+
+	procd_inittab();
+	procd_inittab_adopt(tb[REEXEC_INITTAB]);
+
+	procd_connect_ubus();
+	procd_state_resume(tb[REEXEC_BOOT]);
+	free(state);
+
+	reap_timer.cb = reexec_reap_cb;
+	uloop_timeout_set(&reap_timer, 0);
+
+	return true;
+}
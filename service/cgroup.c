@@ -0,0 +1,346 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../procd.h"
+
+#include "service.h"
+#include "instance.h"
+#include "cgroup.h"
+
+#ifndef CGROUP2_SUPER_MAGIC
+#define CGROUP2_SUPER_MAGIC	0x63677270
+#endif
+
+/*
+ * Instances with a "cgroup" table (or whose service has one) get their own
+ * group below CGROUP_BASE/<service>/<instance>. Only these interface files
+ * may be set, all other keys are rejected when the config is parsed.
+ */
+static const char * const cgroup_keys[] = {
+	"cpu.weight",
+	"cpu.max",
+	"memory.high",
+	"memory.max",
+	"io.weight",
+	"pids.max",
+};
+
+static const char cgroup_controllers[] = "+cpu +memory +io +pids";
+
+static int cgroup_ok = -1;
+
+static bool
+cgroup_available(void)
+{
+	struct statfs s;
+
+	if (cgroup_ok >= 0)
+		return cgroup_ok;
+
+	cgroup_ok = !statfs(CGROUP_ROOT, &s) && s.f_type == CGROUP2_SUPER_MAGIC;
+	if (!cgroup_ok)
+		ERROR("cgroup v2 is not mounted on %s, ignoring cgroup settings\n", CGROUP_ROOT);
+
+	return cgroup_ok;
+}
+
+static bool
+cgroup_key_valid(const char *key)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(cgroup_keys); i++)
+		if (!strcmp(cgroup_keys[i], key))
+			return true;
+
+	return false;
+}
+
+bool
+cgroup_valid(struct blob_attr *attr)
+{
+	struct blob_attr *cur;
+	int rem;
+
+	blobmsg_for_each_attr(cur, attr, rem) {
+		if (!cgroup_key_valid(blobmsg_name(cur)))
+			return false;
+
+		switch (blobmsg_type(cur)) {
+		case BLOBMSG_TYPE_STRING:
+		case BLOBMSG_TYPE_INT32:
+			break;
+		default:
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static int
+cgroup_write(int dir, const char *file, const char *val)
+{
+	int fd, ret;
+
+	fd = openat(dir, file, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	ret = write(fd, val, strlen(val));
+	close(fd);
+
+	return ret < 0 ? -1 : 0;
+}
+
+static void
+cgroup_apply(int dir, const char *path, struct blob_attr *attr)
+{
+	struct blob_attr *cur;
+	char buf[32];
+	const char *val;
+	int rem;
+
+	if (!attr)
+		return;
+
+	blobmsg_for_each_attr(cur, attr, rem) {
+		if (blobmsg_type(cur) == BLOBMSG_TYPE_INT32) {
+			snprintf(buf, sizeof(buf), "%u", blobmsg_get_u32(cur));
+			val = buf;
+		} else {
+			val = blobmsg_get_string(cur);
+		}
+
+		if (cgroup_write(dir, blobmsg_name(cur), val))
+			ERROR("failed to set %s/%s to %s: %s\n", path,
+			      blobmsg_name(cur), val, strerror(errno));
+	}
+}
+
+/* open (and create) a group below dir, enabling the controllers for it */
+static int
+cgroup_mkdir(int dir, const char *name)
+{
+	int fd;
+
+	if (strchr(name, '/') || name[0] == '.')
+		return -1;
+
+	cgroup_write(dir, "cgroup.subtree_control", cgroup_controllers);
+	if (mkdirat(dir, name, 0755) && errno != EEXIST)
+		return -1;
+
+	fd = openat(dir, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	return fd;
+}
+
+static int
+cgroup_instance_dir(struct service_instance *in, bool create)
+{
+	int root, base, srv, dir = -1;
+
+	root = open(CGROUP_ROOT, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (root < 0)
+		return -1;
+
+	base = cgroup_mkdir(root, "procd");
+	close(root);
+	if (base < 0)
+		return -1;
+
+	if (!create) {
+		srv = openat(base, in->srv->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (srv >= 0) {
+			dir = openat(srv, in->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			close(srv);
+		}
+		close(base);
+		return dir;
+	}
+
+	srv = cgroup_mkdir(base, in->srv->name);
+	close(base);
+	if (srv < 0)
+		return -1;
+
+	cgroup_apply(srv, in->srv->name, in->srv->cgroup);
+	dir = cgroup_mkdir(srv, in->name);
+	close(srv);
+
+	return dir;
+}
+
+/*
+ * Prepare the group of an instance and return a descriptor of its
+ * cgroup.procs file, the child writes to it before exec to move itself.
+ */
+int
+cgroup_instance_open(struct service_instance *in)
+{
+	int dir, fd;
+
+	if (!in->cgroup && !in->srv->cgroup)
+		return -1;
+
+	if (!cgroup_available())
+		return -1;
+
+	dir = cgroup_instance_dir(in, true);
+	if (dir < 0) {
+		ERROR("failed to create cgroup for %s::%s: %s\n",
+		      in->srv->name, in->name, strerror(errno));
+		return -1;
+	}
+
+	cgroup_apply(dir, in->name, in->cgroup);
+	fd = openat(dir, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+	close(dir);
+
+	return fd;
+}
+
+/* kill everything left in the group of an instance */
+void
+cgroup_instance_kill(struct service_instance *in)
+{
+	FILE *f;
+	int dir, fd, pid;
+
+	if (!in->cgroup && !in->srv->cgroup)
+		return;
+
+	if (!cgroup_available())
+		return;
+
+	dir = cgroup_instance_dir(in, false);
+	if (dir < 0)
+		return;
+
+	/* cgroup.kill needs linux 5.14, walk cgroup.procs on older kernels */
+	if (!cgroup_write(dir, "cgroup.kill", "1")) {
+		close(dir);
+		return;
+	}
+
+	fd = openat(dir, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+	close(dir);
+	if (fd < 0)
+		return;
+
+	f = fdopen(fd, "r");
+	if (!f) {
+		close(fd);
+		return;
+	}
+
+	while (fscanf(f, "%d", &pid) == 1)
+		kill(pid, SIGKILL);
+	fclose(f);
+}
+
+void
+cgroup_instance_remove(struct service_instance *in)
+{
+	char path[256];
+
+	if (!in->cgroup && !in->srv->cgroup)
+		return;
+
+	if (!cgroup_available())
+		return;
+
+	snprintf(path, sizeof(path), "%s/%s/%s", CGROUP_BASE, in->srv->name, in->name);
+	rmdir(path);
+	snprintf(path, sizeof(path), "%s/%s", CGROUP_BASE, in->srv->name);
+	rmdir(path);
+}
+
+void
+cgroup_dump(struct blob_buf *b, struct service_instance *in)
+{
+	char path[256];
+	void *c;
+
+	if (!in->cgroup && !in->srv->cgroup)
+		return;
+
+	c = blobmsg_open_table(b, "cgroup");
+	snprintf(path, sizeof(path), "%s/%s/%s", CGROUP_BASE, in->srv->name, in->name);
+	blobmsg_add_string(b, "path", path);
+	if (in->srv->cgroup)
+		blobmsg_add_field(b, BLOBMSG_TYPE_TABLE, "service",
+				  blobmsg_data(in->srv->cgroup), blobmsg_data_len(in->srv->cgroup));
+	if (in->cgroup)
+		blobmsg_add_field(b, BLOBMSG_TYPE_TABLE, "instance",
+				  blobmsg_data(in->cgroup), blobmsg_data_len(in->cgroup));
+	blobmsg_close_table(b, c);
+}
+
+/* lifetime cpu usage and memory peak of the group of an instance */
+int
+cgroup_instance_stats(struct service_instance *in, uint64_t *user_us,
+		      uint64_t *system_us, uint64_t *mem_peak)
+{
+	char key[32];
+	unsigned long long val;
+	FILE *f;
+	int dir, fd;
+
+	if (!in->cgroup && !in->srv->cgroup)
+		return -1;
+
+	if (!cgroup_available())
+		return -1;
+
+	dir = cgroup_instance_dir(in, false);
+	if (dir < 0)
+		return -1;
+
+	fd = openat(dir, "cpu.stat", O_RDONLY | O_CLOEXEC);
+	f = fd >= 0 ? fdopen(fd, "r") : NULL;
+	if (f) {
+		while (fscanf(f, "%31s %llu", key, &val) == 2) {
+			if (!strcmp(key, "user_usec"))
+				*user_us = val;
+			else if (!strcmp(key, "system_usec"))
+				*system_us = val;
+		}
+		fclose(f);
+	} else if (fd >= 0) {
+		close(fd);
+	}
+
+	/* memory.peak appeared in linux 5.19 */
+	fd = openat(dir, "memory.peak", O_RDONLY | O_CLOEXEC);
+	f = fd >= 0 ? fdopen(fd, "r") : NULL;
+	if (f) {
+		if (fscanf(f, "%llu", &val) == 1)
+			*mem_peak = val;
+		fclose(f);
+	} else if (fd >= 0) {
+		close(fd);
+	}
+	close(dir);
+
+	return 0;
+}
@@ -0,0 +1,31 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __PROCD_CGROUP_H
+#define __PROCD_CGROUP_H
+
+#include <libubox/blobmsg.h>
+
+#define CGROUP_ROOT	"/sys/fs/cgroup"
+#define CGROUP_BASE	CGROUP_ROOT "/procd"
+
+struct service;
+struct service_instance;
+
+bool cgroup_valid(struct blob_attr *attr);
+int cgroup_instance_open(struct service_instance *in);
+void cgroup_instance_kill(struct service_instance *in);
+void cgroup_instance_remove(struct service_instance *in);
+int cgroup_instance_stats(struct service_instance *in, uint64_t *user_us,
+			  uint64_t *system_us, uint64_t *mem_peak);
+void cgroup_dump(struct blob_buf *b, struct service_instance *in);
+
+#endif
@@ -17,6 +17,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <net/if.h>
 #include <unistd.h>
 #include <stdint.h>
@@ -24,14 +26,24 @@
 #include <fcntl.h>
 #include <pwd.h>
 #include <libgen.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <libubox/md5.h>
+#include <libubox/usock.h>
+#include <libubox/avl-cmp.h>
 
 #include "../procd.h"
+#include "../profiler.h"
+#include "../spawn.h"
+#ifdef JAIL_SUPPORT
+#include "../jail/launch.h"
+#endif
 
 #include "service.h"
 #include "instance.h"
+#include "cgroup.h"
+#include "pressure.h"
 
 
 enum {
@@ -53,6 +65,18 @@ enum {
 	INSTANCE_ATTR_JAIL,
 	INSTANCE_ATTR_TRACE,
 	INSTANCE_ATTR_SECCOMP,
+	INSTANCE_ATTR_CGROUP,
+	INSTANCE_ATTR_CPUSET,
+	INSTANCE_ATTR_SCHED_POLICY,
+	INSTANCE_ATTR_SCHED_PRIORITY,
+	INSTANCE_ATTR_IOPRIO,
+	INSTANCE_ATTR_SOCKETS,
+	INSTANCE_ATTR_SOCKET_IDLE,
+	INSTANCE_ATTR_START_PRIORITY,
+	INSTANCE_ATTR_PRESSURE,
+	INSTANCE_ATTR_PRESSURE_SIGNAL,
+	INSTANCE_ATTR_LOG_BUFFER,
+	INSTANCE_ATTR_SYSLOG,
 	__INSTANCE_ATTR_MAX
 };
 
@@ -75,6 +99,18 @@ static const struct blobmsg_policy instance_attr[__INSTANCE_ATTR_MAX] = {
 	[INSTANCE_ATTR_JAIL] = { "jail", BLOBMSG_TYPE_TABLE },
 	[INSTANCE_ATTR_TRACE] = { "trace", BLOBMSG_TYPE_BOOL },
 	[INSTANCE_ATTR_SECCOMP] = { "seccomp", BLOBMSG_TYPE_STRING },
+	[INSTANCE_ATTR_CGROUP] = { "cgroup", BLOBMSG_TYPE_TABLE },
+	[INSTANCE_ATTR_CPUSET] = { "cpuset", BLOBMSG_TYPE_STRING },
+	[INSTANCE_ATTR_SCHED_POLICY] = { "sched_policy", BLOBMSG_TYPE_STRING },
+	[INSTANCE_ATTR_SCHED_PRIORITY] = { "sched_priority", BLOBMSG_TYPE_INT32 },
+	[INSTANCE_ATTR_IOPRIO] = { "ioprio", BLOBMSG_TYPE_STRING },
+	[INSTANCE_ATTR_SOCKETS] = { "sockets", BLOBMSG_TYPE_ARRAY },
+	[INSTANCE_ATTR_SOCKET_IDLE] = { "socket_idle", BLOBMSG_TYPE_INT32 },
+	[INSTANCE_ATTR_START_PRIORITY] = { "start_priority", BLOBMSG_TYPE_STRING },
+	[INSTANCE_ATTR_PRESSURE] = { "pressure", BLOBMSG_TYPE_STRING },
+	[INSTANCE_ATTR_PRESSURE_SIGNAL] = { "pressure_signal", BLOBMSG_TYPE_INT32 },
+	[INSTANCE_ATTR_LOG_BUFFER] = { "log_buffer", BLOBMSG_TYPE_INT32 },
+	[INSTANCE_ATTR_SYSLOG] = { "syslog", BLOBMSG_TYPE_BOOL },
 };
 
 enum {
@@ -85,6 +121,8 @@ enum {
 	JAIL_ATTR_UBUS,
 	JAIL_ATTR_LOG,
 	JAIL_ATTR_RONLY,
+	JAIL_ATTR_TEMPLATE,
+	JAIL_ATTR_SHARED,
 	JAIL_ATTR_MOUNT,
 	__JAIL_ATTR_MAX,
 };
@@ -97,6 +135,8 @@ static const struct blobmsg_policy jail_attr[__JAIL_ATTR_MAX] = {
 	[JAIL_ATTR_UBUS] = { "ubus", BLOBMSG_TYPE_BOOL },
 	[JAIL_ATTR_LOG] = { "log", BLOBMSG_TYPE_BOOL },
 	[JAIL_ATTR_RONLY] = { "ronly", BLOBMSG_TYPE_BOOL },
+	[JAIL_ATTR_TEMPLATE] = { "template", BLOBMSG_TYPE_BOOL },
+	[JAIL_ATTR_SHARED] = { "shared", BLOBMSG_TYPE_BOOL },
 	[JAIL_ATTR_MOUNT] = { "mount", BLOBMSG_TYPE_TABLE },
 };
 
@@ -107,9 +147,28 @@ struct instance_netdev {
 
 struct instance_file {
 	struct blobmsg_list_node node;
+	struct file_fp *fp;
 	uint32_t md5[4];
+	bool cache_hit;
 };
 
+/*
+ * last known fingerprint and md5 of a watched file, keyed by path and
+ * referenced by every instance_file of that path
+ */
+struct file_fp {
+	struct avl_node avl;
+	int refcount;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	struct timespec ctime;
+	uint32_t md5[4];
+};
+
+#define FILE_HASH_BUF	(64 * 1024)
+
 struct rlimit_name {
 	const char *name;
 	int resource;
@@ -133,7 +192,26 @@ static const struct rlimit_name rlimit_names[] = {
 	{ NULL, 0 }
 };
 
+/*
+ * Instances of a service with a shared jail of the same name run in the
+ * mount, uts and ipc namespaces of the first one started. Its ujail sends
+ * the namespace fds back over a socket pair, procd holds on to them until
+ * the last instance using them is gone.
+ */
+#define JAIL_NS		3
+#define JAIL_NS_FD_MIN	64
+
+struct jail_ns {
+	struct avl_node avl;
+	struct uloop_fd sock;
+	int fds[JAIL_NS];
+	int refs;
+};
+
 static char trace[] = "/sbin/utrace";
+static int log_fd = -1;
+static struct avl_tree file_fps;
+static struct avl_tree jail_ns_tree;
 
 static void closefd(int fd)
 {
@@ -141,8 +219,189 @@ static void closefd(int fd)
 		close(fd);
 }
 
+static uint32_t
+instance_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static const struct {
+	const char *name;
+	int policy;
+} sched_policies[] = {
+	{ "other", SCHED_OTHER },
+	{ "batch", SCHED_BATCH },
+	{ "idle", SCHED_IDLE },
+	{ "fifo", SCHED_FIFO },
+	{ "rr", SCHED_RR },
+};
+
+static const char * const ioprio_classes[] = { "none", "rt", "be", "idle" };
+
+/* "0-1,3" style cpu lists, as used by taskset and cpuset.cpus */
+static bool
+instance_parse_cpuset(const char *str, cpu_set_t *set)
+{
+	char *end;
+	unsigned long first, last;
+
+	CPU_ZERO(set);
+	while (*str) {
+		first = strtoul(str, &end, 10);
+		if (end == str)
+			return false;
+
+		last = first;
+		if (*end == '-') {
+			str = end + 1;
+			last = strtoul(str, &end, 10);
+			if (end == str || last < first)
+				return false;
+		}
+		if (last >= CPU_SETSIZE)
+			return false;
+
+		for (; first <= last; first++)
+			CPU_SET(first, set);
+
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return false;
+		str = end;
+	}
+
+	return CPU_COUNT(set) > 0;
+}
+
+static int
+instance_parse_sched(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(sched_policies); i++)
+		if (!strcmp(sched_policies[i].name, name))
+			return sched_policies[i].policy;
+
+	return -1;
+}
+
+/* "idle", "be" or "rt" with an optional ":level" from 0 to 7 */
+static int
+instance_parse_ioprio(const char *str)
+{
+	const char *sep = strchr(str, ':');
+	int len = sep ? sep - str : strlen(str);
+	int class, level = 4;
+	char *end;
+
+	for (class = 1; class < ARRAY_SIZE(ioprio_classes); class++)
+		if (strlen(ioprio_classes[class]) == len &&
+		    !strncmp(ioprio_classes[class], str, len))
+			break;
+	if (class == ARRAY_SIZE(ioprio_classes))
+		return -1;
+
+	if (sep) {
+		level = strtoul(sep + 1, &end, 10);
+		if (end == sep + 1 || *end || level > 7)
+			return -1;
+	}
+	if (class == 3)
+		level = 0;
+
+	return SPAWN_IOPRIO(class, level);
+}
+
+static bool
+instance_sched_parse(struct service_instance *in, struct blob_attr **tb)
+{
+	struct blob_attr *cur;
+
+	if ((cur = tb[INSTANCE_ATTR_CPUSET])) {
+		if (!instance_parse_cpuset(blobmsg_get_string(cur), &in->cpuset)) {
+			ERROR("%s: invalid cpuset %s\n", in->name, blobmsg_get_string(cur));
+			return false;
+		}
+		in->has_cpuset = true;
+	}
+
+	if ((cur = tb[INSTANCE_ATTR_SCHED_POLICY])) {
+		in->sched_policy = instance_parse_sched(blobmsg_get_string(cur));
+		if (in->sched_policy < 0) {
+			ERROR("%s: invalid sched_policy %s\n", in->name, blobmsg_get_string(cur));
+			return false;
+		}
+	}
+
+	if ((cur = tb[INSTANCE_ATTR_SCHED_PRIORITY]))
+		in->sched_priority = blobmsg_get_u32(cur);
+
+	if (in->sched_policy >= 0 &&
+	    (in->sched_priority < sched_get_priority_min(in->sched_policy) ||
+	     in->sched_priority > sched_get_priority_max(in->sched_policy))) {
+		ERROR("%s: sched_priority %d out of range\n", in->name, in->sched_priority);
+		return false;
+	}
+
+	if ((cur = tb[INSTANCE_ATTR_IOPRIO])) {
+		in->ioprio = instance_parse_ioprio(blobmsg_get_string(cur));
+		if (in->ioprio < 0) {
+			ERROR("%s: invalid ioprio %s\n", in->name, blobmsg_get_string(cur));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void
+instance_sched_dump(struct blob_buf *b, struct service_instance *in)
+{
+	char buf[16];
+	int i;
+
+	if (in->has_cpuset) {
+		void *a = blobmsg_open_array(b, "cpuset");
+
+		for (i = 0; i < CPU_SETSIZE; i++)
+			if (CPU_ISSET(i, &in->cpuset))
+				blobmsg_add_u32(b, NULL, i);
+		blobmsg_close_array(b, a);
+	}
+
+	if (in->sched_policy >= 0) {
+		for (i = 0; i < ARRAY_SIZE(sched_policies); i++)
+			if (sched_policies[i].policy == in->sched_policy)
+				blobmsg_add_string(b, "sched_policy", sched_policies[i].name);
+		blobmsg_add_u32(b, "sched_priority", in->sched_priority);
+	}
+
+	if (in->ioprio >= 0) {
+		snprintf(buf, sizeof(buf), "%s:%d",
+			 ioprio_classes[in->ioprio >> SPAWN_IOPRIO_CLASS_SHIFT],
+			 in->ioprio & ((1 << SPAWN_IOPRIO_CLASS_SHIFT) - 1));
+		blobmsg_add_string(b, "ioprio", buf);
+	}
+}
+
+/* bucket 0 is below 1 unit, each further one a factor of 10 more */
 static void
-instance_limits(const char *limit, const char *value)
+metrics_hist_add(uint32_t *hist, uint64_t val)
+{
+	int i;
+
+	for (i = 0; i < METRICS_BUCKETS - 1 && val; i++)
+		val /= 10;
+
+	hist[i]++;
+}
+
+static void
+instance_limits(struct spawn_opts *o, const char *limit, const char *value)
 {
 	int i;
 	struct rlimit rlim;
@@ -168,13 +427,203 @@ instance_limits(const char *limit, const char *value)
 			rlim.rlim_max = max;
 		}
 
-		setrlimit(rlimit_names[i].resource, &rlim);
+		spawn_limit_add(o, rlimit_names[i].resource, &rlim);
 		return;
 	}
 }
 
+static void
+jail_ns_recv(struct uloop_fd *u, unsigned int events)
+{
+	struct jail_ns *ns = container_of(u, struct jail_ns, sock);
+	char buf[CMSG_SPACE(JAIL_NS * sizeof(int))];
+	struct iovec iov = { .iov_base = &events, .iov_len = sizeof(events) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = buf,
+		.msg_controllen = sizeof(buf),
+	};
+	struct cmsghdr *cmsg;
+	int i;
+
+	if (recvmsg(u->fd, &msg, MSG_CMSG_CLOEXEC) < 0 && errno == EINTR)
+		return;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+	    cmsg->cmsg_len == CMSG_LEN(JAIL_NS * sizeof(int))) {
+		int *fds = (int *) CMSG_DATA(cmsg);
+
+		/* out of the way of the stdio and listen fds of the next child */
+		for (i = 0; i < JAIL_NS; i++) {
+			ns->fds[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, JAIL_NS_FD_MIN);
+			close(fds[i]);
+		}
+	}
+
+	/* the owner either sent its namespaces or is gone, ask the next one */
+	uloop_fd_delete(u);
+	close(u->fd);
+	u->fd = -1;
+}
+
+/*
+ * ujail stages the mounts of the binary and its options only for the owner,
+ * so only instances that would stage the same ones may share a jail.
+ */
+static void
+jail_ns_deps(struct service_instance *in, uint32_t *digest)
+{
+	struct blobmsg_list_node *var;
+	const char *cmd = blobmsg_data(blobmsg_data(in->command));
+	bool flags[] = { in->jail.procfs, in->jail.sysfs, in->jail.ubus,
+			 in->jail.log, in->jail.ronly };
+	md5_ctx_t ctx;
+
+	md5_begin(&ctx);
+	md5_hash(cmd, strlen(cmd) + 1, &ctx);
+	md5_hash(flags, sizeof(flags), &ctx);
+	if (in->seccomp)
+		md5_hash(in->seccomp, strlen(in->seccomp) + 1, &ctx);
+	blobmsg_list_for_each(&in->jail.mount, var)
+		md5_hash(var->data, blob_pad_len(var->data), &ctx);
+	md5_end(digest, &ctx);
+}
+
+static struct jail_ns *
+jail_ns_get(struct service_instance *in)
+{
+	struct jail_ns *ns;
+	uint32_t digest[4];
+	char *key;
+	int i;
+
+	if (in->jail.ns)
+		return in->jail.ns;
+
+	if (!jail_ns_tree.comp)
+		avl_init(&jail_ns_tree, avl_strcmp, false, NULL);
+
+	/* the whole digest, a collision would share namespaces across configs */
+	jail_ns_deps(in, digest);
+	key = alloca(strlen(in->srv->name) + strlen(in->jail.name) + 35);
+	sprintf(key, "%s/%s/%08x%08x%08x%08x", in->srv->name, in->jail.name,
+		digest[0], digest[1], digest[2], digest[3]);
+
+	ns = avl_find_element(&jail_ns_tree, key, ns, avl);
+	if (!ns) {
+		char *key_buf;
+
+		ns = calloc_a(sizeof(*ns), &key_buf, strlen(key) + 1);
+		if (!ns)
+			return NULL;
+
+		ns->avl.key = strcpy(key_buf, key);
+		ns->sock.fd = -1;
+		ns->sock.cb = jail_ns_recv;
+		for (i = 0; i < JAIL_NS; i++)
+			ns->fds[i] = -1;
+		avl_insert(&jail_ns_tree, &ns->avl);
+	}
+
+	ns->refs++;
+	in->jail.ns = ns;
+
+	return ns;
+}
+
+static void
+jail_ns_put(struct service_instance *in)
+{
+	struct jail_ns *ns = in->jail.ns;
+	int i;
+
+	if (!ns)
+		return;
+
+	in->jail.ns = NULL;
+	if (--ns->refs)
+		return;
+
+	if (ns->sock.fd >= 0) {
+		uloop_fd_delete(&ns->sock);
+		close(ns->sock.fd);
+	}
+	for (i = 0; i < JAIL_NS; i++)
+		if (ns->fds[i] >= 0)
+			close(ns->fds[i]);
+	avl_delete(&jail_ns_tree, &ns->avl);
+	free(ns);
+}
+
+/*
+ * Join the namespaces of a running instance, or make this one the owner
+ * if there is none yet. While an owner is starting up, further instances
+ * get a private jail.
+ */
+static int
+jail_ns_args(struct service_instance *in, char **argv, struct spawn_opts *o)
+{
+	struct jail *jail = &in->jail;
+	struct jail_ns *ns = jail_ns_get(in);
+	int sv[2];
+
+	if (!ns)
+		return 0;
+
+	if (ns->fds[0] >= 0) {
+		snprintf(jail->ns_arg, sizeof(jail->ns_arg), "%d,%d,%d",
+			ns->fds[0], ns->fds[1], ns->fds[2]);
+		o->keep_fds = ns->fds;
+		o->n_keep_fds = JAIL_NS;
+		argv[0] = "-J";
+		argv[1] = jail->ns_arg;
+		return 2;
+	}
+
+	if (ns->sock.fd >= 0 ||
+	    socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv))
+		return 0;
+
+	jail->ns_peer = fcntl(sv[1], F_DUPFD_CLOEXEC, JAIL_NS_FD_MIN);
+	close(sv[1]);
+	if (jail->ns_peer < 0) {
+		close(sv[0]);
+		return 0;
+	}
+
+	ns->sock.fd = sv[0];
+	uloop_fd_add(&ns->sock, ULOOP_READ);
+
+	snprintf(jail->ns_arg, sizeof(jail->ns_arg), "%d", jail->ns_peer);
+	o->keep_fds = &jail->ns_peer;
+	o->n_keep_fds = 1;
+	argv[0] = "-N";
+	argv[1] = jail->ns_arg;
+
+	return 2;
+}
+
+#ifdef JAIL_SUPPORT
+/* ujail linked in, the forked child becomes the jail process itself */
+static int
+jail_launch_child(char * const *argv)
+{
+	int argc = 0, ret;
+
+	while (argv[argc])
+		argc++;
+
+	ret = jail_launch(argc, (char **) argv);
+	fflush(stdout);
+
+	return ret;
+}
+#endif
+
 static inline int
-jail_run(struct service_instance *in, char **argv)
+jail_run(struct service_instance *in, char **argv, struct spawn_opts *o)
 {
 	struct blobmsg_list_node *var;
 	struct jail *jail = &in->jail;
@@ -215,6 +664,21 @@ jail_run(struct service_instance *in, char **argv)
 	if (jail->ronly)
 		argv[argc++] = "-o";
 
+	if (jail->template)
+		argv[argc++] = "-T";
+
+	jail->ns_peer = -1;
+	if (jail->shared)
+		argc += jail_ns_args(in, &argv[argc], o);
+
+#ifdef JAIL_SUPPORT
+	/* utrace has to exec ujail to trace it */
+	if (!in->trace) {
+		jail_launch_init();
+		o->launch = jail_launch_child;
+	}
+#endif
+
 	blobmsg_list_for_each(&jail->mount, var) {
 		const char *type = blobmsg_data(var->data);
 
@@ -230,88 +694,395 @@ jail_run(struct service_instance *in, char **argv)
 	return argc;
 }
 
+/*
+ * Instances of the "low" and "idle" start classes are not started while
+ * the system boots. "low" ones are released once init is complete or the
+ * cpu has been mostly idle for a poll interval, "idle" ones only after
+ * init and once the cpu is idle, or BOOT_DEFER_MAX ms after init at the
+ * latest. At most BOOT_RELEASE_BATCH instances are started per poll.
+ */
+static const char * const start_classes[] = {
+	[START_CRITICAL] = "critical",
+	[START_DEFAULT] = "default",
+	[START_LOW] = "low",
+	[START_IDLE] = "idle",
+};
+
+static LIST_HEAD(boot_queue);
+static struct uloop_timeout boot_release;
+static bool boot_done;
+static uint32_t boot_done_time;
+
+int
+instance_start_class_parse(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(start_classes); i++)
+		if (!strcmp(start_classes[i], name))
+			return i;
+
+	return -1;
+}
+
+/* the class of the instance, or the one of its service */
+int
+instance_start_class(struct service_instance *in)
+{
+	return in->start_class >= 0 ? in->start_class : in->srv->start_class;
+}
+
+/* idle percentage of all cpus since the previous call */
+static int
+boot_cpu_idle(void)
+{
+	static unsigned long long last_idle, last_total;
+	unsigned long long v[8] = { 0 }, idle, total = 0;
+	int i, pct = 0;
+	FILE *f;
+
+	f = fopen("/proc/stat", "r");
+	if (!f)
+		return 0;
+
+	if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+		   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) < 4) {
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+
+	for (i = 0; i < ARRAY_SIZE(v); i++)
+		total += v[i];
+	idle = v[3] + v[4];
+
+	if (last_total && total > last_total)
+		pct = (idle - last_idle) * 100 / (total - last_total);
+
+	last_idle = idle;
+	last_total = total;
+
+	return pct;
+}
+
+static void
+instance_boot_dequeue(struct service_instance *in)
+{
+	if (!in->boot_queued)
+		return;
+
+	list_del(&in->boot_list);
+	in->boot_queued = false;
+}
+
 static void
-instance_run(struct service_instance *in, int _stdout, int _stderr)
+boot_release_cb(struct uloop_timeout *t)
+{
+	struct service_instance *in, *tmp;
+	bool cpu_idle = boot_cpu_idle() >= BOOT_IDLE_PCT;
+	bool low_ok = boot_done || cpu_idle;
+	bool idle_ok = boot_done &&
+		(cpu_idle || instance_now() - boot_done_time >= BOOT_DEFER_MAX);
+	int n = 0;
+
+	list_for_each_entry_safe(in, tmp, &boot_queue, boot_list) {
+		if (n >= BOOT_RELEASE_BATCH)
+			break;
+
+		if (!(instance_start_class(in) == START_LOW ? low_ok : idle_ok))
+			continue;
+
+		DEBUG(2, "Releasing deferred instance %s::%s\n", in->srv->name, in->name);
+		instance_boot_dequeue(in);
+		in->boot_released = true;
+		instance_start(in);
+		n++;
+	}
+
+	if (!list_empty(&boot_queue))
+		uloop_timeout_set(t, BOOT_POLL);
+}
+
+/* returns true if the start of the instance was deferred */
+static bool
+instance_boot_defer(struct service_instance *in)
+{
+	if (boot_done || in->boot_released || instance_start_class(in) < START_LOW)
+		return false;
+
+	if (!in->boot_queued) {
+		list_add_tail(&in->boot_list, &boot_queue);
+		in->boot_queued = true;
+		service_changed(in->srv);
+	}
+
+	boot_release.cb = boot_release_cb;
+	if (!boot_release.pending)
+		uloop_timeout_set(&boot_release, BOOT_POLL);
+
+	return true;
+}
+
+void
+instance_boot_done(void)
+{
+	boot_done = true;
+	boot_done_time = instance_now();
+
+	if (list_empty(&boot_queue))
+		return;
+
+	boot_release.cb = boot_release_cb;
+	uloop_timeout_set(&boot_release, 0);
+}
+
+/*
+ * Socket activation: "sockets" holds "tcp:[host:]port", "udp:[host:]port"
+ * or "unix:path" entries. procd listens on them and only spawns the
+ * instance once one becomes readable, then keeps an edge triggered watch
+ * to see new connections and stops the instance after socket_idle seconds
+ * without any. The next connection starts it again.
+ */
+static int
+instance_socket_open(const char *spec)
+{
+	char buf[128], *host = NULL, *port;
+	int type, fd;
+
+	if (!strncmp(spec, "unix:", 5)) {
+		unlink(spec + 5);
+		return usock(USOCK_UNIX | USOCK_SERVER, spec + 5, NULL);
+	}
+
+	if (!strncmp(spec, "tcp:", 4))
+		type = USOCK_TCP;
+	else if (!strncmp(spec, "udp:", 4))
+		type = USOCK_UDP;
+	else
+		return -1;
+
+	snprintf(buf, sizeof(buf), "%s", spec + 4);
+	port = strrchr(buf, ':');
+	if (port) {
+		*port++ = 0;
+		host = buf;
+		if (*host == '[' && host[strlen(host) - 1] == ']') {
+			host[strlen(host) - 1] = 0;
+			host++;
+		}
+	} else {
+		port = buf;
+	}
+
+	fd = usock(type | USOCK_SERVER | USOCK_NUMERIC, host, port);
+
+	return fd;
+}
+
+static void
+instance_sockets_close(struct service_instance *in)
+{
+	int i;
+
+	for (i = 0; i < in->n_sockets; i++) {
+		uloop_fd_delete(&in->sockets[i].fd);
+		close(in->sockets[i].fd.fd);
+	}
+
+	free(in->sockets);
+	in->sockets = NULL;
+	in->n_sockets = 0;
+	in->activated = false;
+	uloop_timeout_cancel(&in->idle_timer);
+}
+
+static void
+instance_socket_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct instance_socket *sk = container_of(fd, struct instance_socket, fd);
+	struct service_instance *in = sk->in;
+	int i;
+
+	in->last_activity = instance_now();
+	if (in->activated)
+		return;
+
+	DEBUG(2, "Activating instance %s::%s\n", in->srv->name, in->name);
+	in->activated = true;
+	for (i = 0; i < in->n_sockets; i++)
+		uloop_fd_add(&in->sockets[i].fd, ULOOP_READ | ULOOP_EDGE_TRIGGER);
+
+	instance_start(in);
+
+	if (in->socket_idle)
+		uloop_timeout_set(&in->idle_timer, in->socket_idle * 1000);
+}
+
+static void
+instance_idle_cb(struct uloop_timeout *t)
+{
+	struct service_instance *in = container_of(t, struct service_instance, idle_timer);
+	uint32_t idle = instance_now() - in->last_activity;
+
+	if (idle < in->socket_idle * 1000) {
+		uloop_timeout_set(t, in->socket_idle * 1000 - idle);
+		return;
+	}
+
+	if (!in->proc.pending)
+		return;
+
+	DEBUG(2, "Stopping idle instance %s::%s\n", in->srv->name, in->name);
+	in->restart = false;
+	in->idle_stop = true;
+	kill(in->proc.pid, SIGTERM);
+}
+
+/* (re)arm the listening sockets, returns false if the instance has none */
+static bool
+instance_sockets_listen(struct service_instance *in)
+{
+	struct blob_attr *cur;
+	int rem, i = 0;
+
+	if (!in->sockets_attr)
+		return false;
+
+	if (!in->sockets) {
+		in->sockets = calloc(blobmsg_check_array(in->sockets_attr, BLOBMSG_TYPE_STRING),
+				     sizeof(*in->sockets));
+		if (!in->sockets)
+			return false;
+
+		blobmsg_for_each_attr(cur, in->sockets_attr, rem) {
+			struct instance_socket *sk = &in->sockets[i];
+
+			sk->fd.fd = instance_socket_open(blobmsg_get_string(cur));
+			if (sk->fd.fd < 0) {
+				ERROR("%s: failed to listen on %s: %s\n", in->name,
+				      blobmsg_get_string(cur), strerror(errno));
+				continue;
+			}
+			/* the child gets its own copies from spawn_listen_fds() */
+			fcntl(sk->fd.fd, F_SETFD, FD_CLOEXEC);
+			sk->fd.cb = instance_socket_cb;
+			sk->in = in;
+			i++;
+		}
+		in->n_sockets = i;
+	}
+
+	if (!in->n_sockets)
+		return false;
+
+	in->activated = false;
+	uloop_timeout_cancel(&in->idle_timer);
+	for (i = 0; i < in->n_sockets; i++)
+		uloop_fd_add(&in->sockets[i].fd, ULOOP_READ);
+
+	return true;
+}
+
+static pid_t
+instance_spawn(struct service_instance *in, int _stdout, int _stderr)
 {
 	struct blobmsg_list_node *var;
 	struct blob_attr *cur;
+	struct spawn_opts o;
 	char **argv;
-	char *ld_preload;
+	char ld_preload[64];
 	int argc = 1; /* NULL terminated */
-	int rem, _stdin;
+	int rem;
 	bool seccomp = !in->trace && !in->has_jail && in->seccomp;
 	bool setlbf = _stdout >= 0;
-
-	if (in->nice)
-		setpriority(PRIO_PROCESS, 0, in->nice);
+	pid_t pid;
+
+	spawn_opts_init(&o);
+	o.nice = in->nice;
+	o.uid = in->uid;
+	o.gid = in->gid;
+	if (in->has_cpuset) {
+		o.affinity = &in->cpuset;
+		o.affinity_size = sizeof(in->cpuset);
+	}
+	o.sched_policy = in->sched_policy;
+	o.sched_priority = in->sched_priority;
+	o.ioprio = in->ioprio;
 
 	blobmsg_for_each_attr(cur, in->command, rem)
 		argc++;
 
 	blobmsg_list_for_each(&in->env, var)
-		setenv(blobmsg_name(var->data), blobmsg_data(var->data), 1);
+		spawn_env_add(&o.env, NULL, blobmsg_name(var->data), blobmsg_data(var->data));
 
 	if (seccomp)
-		setenv("SECCOMP_FILE", in->seccomp, 1);
+		spawn_env_add(&o.env, NULL, "SECCOMP_FILE", in->seccomp);
 
-	if ((seccomp || setlbf) && asprintf(&ld_preload, "LD_PRELOAD=%s%s%s",
+	if (seccomp || setlbf) {
+		snprintf(ld_preload, sizeof(ld_preload), "%s%s%s",
 			seccomp ? "/lib/libpreload-seccomp.so" : "",
 			seccomp && setlbf ? ":" : "",
-			setlbf ? "/lib/libsetlbf.so" : "") > 0)
-		putenv(ld_preload);
+			setlbf ? "/lib/libsetlbf.so" : "");
+		spawn_env_add(&o.env, NULL, "LD_PRELOAD", ld_preload);
+	}
 
 	blobmsg_list_for_each(&in->limits, var)
-		instance_limits(blobmsg_name(var->data), blobmsg_data(var->data));
+		instance_limits(&o, blobmsg_name(var->data), blobmsg_data(var->data));
 
 	if (in->trace)
-		argc += 1;
+		argc += 2;
 
 	argv = alloca(sizeof(char *) * (argc + in->jail.argc));
 	argc = 0;
 
-	if (in->trace)
+	if (in->trace) {
 		argv[argc++] = trace;
+		argv[argc++] = "-P";
+	}
 
 	if (in->has_jail)
-		argc = jail_run(in, argv);
+		argc = jail_run(in, argv, &o);
 
 	blobmsg_for_each_attr(cur, in->command, rem)
 		argv[argc++] = blobmsg_data(cur);
 
 	argv[argc] = NULL;
+	o.argv = argv;
 
-	_stdin = open("/dev/null", O_RDONLY);
+	o.fd[0] = SPAWN_FD_NULL;
+	o.fd[1] = _stdout >= 0 ? _stdout : SPAWN_FD_NULL;
+	o.fd[2] = _stderr >= 0 ? _stderr : SPAWN_FD_NULL;
+	o.cgroup_fd = cgroup_instance_open(in);
 
-	if (_stdout == -1)
-		_stdout = open("/dev/null", O_WRONLY);
+	if (in->n_sockets) {
+		int *fds = alloca(in->n_sockets * sizeof(int));
+		int i;
 
-	if (_stderr == -1)
-		_stderr = open("/dev/null", O_WRONLY);
-
-	if (_stdin > -1) {
-		dup2(_stdin, STDIN_FILENO);
-		closefd(_stdin);
-	}
-	if (_stdout > -1) {
-		dup2(_stdout, STDOUT_FILENO);
-		closefd(_stdout);
-	}
-	if (_stderr > -1) {
-		dup2(_stderr, STDERR_FILENO);
-		closefd(_stderr);
+		for (i = 0; i < in->n_sockets; i++)
+			fds[i] = in->sockets[i].fd.fd;
+		o.listen_fds = fds;
+		o.n_listen_fds = in->n_sockets;
 	}
 
-	if (in->gid && setgid(in->gid)) {
-		ERROR("failed to set group id %d: %d (%s)\n", in->gid, errno, strerror(errno));
-		exit(127);
-	}
-	if (in->uid && setuid(in->uid)) {
-		ERROR("failed to set user id %d: %d (%s)\n", in->uid, errno, strerror(errno));
-		exit(127);
+	pid = procd_spawn(&o);
+	closefd(o.cgroup_fd);
+	spawn_opts_free(&o);
+
+	if (in->has_jail)
+		closefd(in->jail.ns_peer);
+
+	if (pid < 0) {
+		jail_ns_put(in);
+		in->metrics.spawn_failures++;
+	} else {
+		in->metrics.starts++;
+		in->metrics.spawn_us_last = o.exec_us;
+		if (o.exec_us > in->metrics.spawn_us_max)
+			in->metrics.spawn_us_max = o.exec_us;
+		metrics_hist_add(in->metrics.spawn_hist, o.exec_us / 100);
 	}
 
-	execvp(argv[0], argv);
-	exit(127);
+	return pid;
 }
 
 static void
@@ -330,6 +1101,57 @@ instance_free_stdio(struct service_instance *in)
 	}
 }
 
+/*
+ * Fixed delay unless respawn_max is set above the respawn timeout, in that
+ * case the delay doubles with every crash up to respawn_max seconds, with
+ * +-25% jitter so instances that crashed together do not restart together.
+ */
+static uint32_t
+instance_respawn_delay(struct service_instance *in)
+{
+	uint64_t delay = in->respawn_timeout * 1000;
+	uint64_t max = (uint64_t) in->respawn_max * 1000;
+	int shift = in->respawn_count;
+
+	if (max <= delay)
+		return delay;
+
+	if (!delay)
+		delay = RESPAWN_BACKOFF_MIN;
+	if (shift > 16)
+		shift = 16;
+	delay <<= shift;
+	if (delay > max)
+		delay = max;
+
+	return delay * 3 / 4 + random() % (delay / 2 + 1);
+}
+
+/* count a crash, then either wait for the backoff or give up on a crash loop */
+static void
+instance_respawn_schedule(struct service_instance *in, long runtime, int ret)
+{
+	if (runtime < in->respawn_threshold)
+		in->respawn_count++;
+	else
+		in->respawn_count = 0;
+	if (in->respawn_count > in->respawn_retry && in->respawn_retry > 0 ) {
+		LOG("Instance %s::%s s in a crash loop %d crashes, %ld seconds since last crash\n",
+							in->srv->name, in->name, in->respawn_count, runtime);
+		in->restart = in->respawn = 0;
+		in->halt = 1;
+		instance_sockets_close(in);
+		service_journal("instance.crashloop", in->srv->name, in->name, in->respawn_count);
+	} else {
+		in->respawn_backoff = instance_respawn_delay(in);
+		/* the connection that killed it may still be queued, do not re-arm at once */
+		if (in->n_sockets && ret && in->respawn_backoff < RESPAWN_BACKOFF_MIN)
+			in->respawn_backoff = RESPAWN_BACKOFF_MIN;
+		service_journal("instance.respawn", in->srv->name, in->name, in->respawn_count);
+		uloop_timeout_set(&in->timeout, in->respawn_backoff);
+	}
+}
+
 void
 instance_start(struct service_instance *in)
 {
@@ -345,43 +1167,56 @@ instance_start(struct service_instance *in)
 	if (in->proc.pending)
 		return;
 
+	in->pressure_stopped = false;
 	instance_free_stdio(in);
 	if (in->_stdout.fd.fd > -2) {
-		if (pipe(opipe)) {
+		if (pipe2(opipe, O_CLOEXEC)) {
 			ULOG_WARN("pipe() failed: %d (%s)\n", errno, strerror(errno));
 			opipe[0] = opipe[1] = -1;
 		}
 	}
 
 	if (in->_stderr.fd.fd > -2) {
-		if (pipe(epipe)) {
+		if (pipe2(epipe, O_CLOEXEC)) {
 			ULOG_WARN("pipe() failed: %d (%s)\n", errno, strerror(errno));
 			epipe[0] = epipe[1] = -1;
 		}
 	}
 
 	in->restart = false;
-	in->halt = !in->respawn;
+	in->halt = !in->respawn && !in->sockets_attr;
 
 	if (!in->valid)
 		return;
 
-	pid = fork();
-	if (pid < 0)
+	if (instance_boot_defer(in) ||
+	    (!in->activated && instance_sockets_listen(in))) {
+		closefd(opipe[0]);
+		closefd(opipe[1]);
+		closefd(epipe[0]);
+		closefd(epipe[1]);
 		return;
+	}
 
-	if (!pid) {
-		uloop_done();
+	pid = instance_spawn(in, opipe[1], epipe[1]);
+	if (pid < 0) {
 		closefd(opipe[0]);
+		closefd(opipe[1]);
 		closefd(epipe[0]);
-		instance_run(in, opipe[1], epipe[1]);
+		closefd(epipe[1]);
+		/* a failed exec counts as a crash, the binary may show up later */
+		if (!in->halt && (in->respawn || in->n_sockets))
+			instance_respawn_schedule(in, 0, -1);
 		return;
 	}
 
 	DEBUG(2, "Started instance %s::%s\n", in->srv->name, in->name);
 	in->proc.pid = pid;
+	snprintf(in->log.ident, sizeof(in->log.ident), "%s[%d]",
+		basename(blobmsg_data(blobmsg_data(in->command))), pid);
 	clock_gettime(CLOCK_MONOTONIC, &in->start);
 	uloop_process_add(&in->proc);
+	service_changed(in->srv);
 
 	if (opipe[0] > -1) {
 		ustream_fd_init(&in->_stdout, opipe[0]);
@@ -396,15 +1231,14 @@ instance_start(struct service_instance *in)
 	service_event("instance.start", in->srv->name, in->name);
 }
 
+/* used if /dev/log is not available yet */
 static void
-instance_stdio(struct ustream *s, int prio, struct service_instance *in)
+instance_stdio_ulog(struct ustream *s, int prio, struct service_instance *in)
 {
-	char *newline, *str, *arg0, ident[32];
+	char *newline, *str;
 	int len;
 
-	arg0 = basename(blobmsg_data(blobmsg_data(in->command)));
-	snprintf(ident, sizeof(ident), "%s[%d]", arg0, in->proc.pid);
-	ulog_open(ULOG_SYSLOG, LOG_DAEMON, ident);
+	ulog_open(ULOG_SYSLOG, LOG_DAEMON, in->log.ident);
 
 	do {
 		str = ustream_get_read_buf(s, NULL);
@@ -416,6 +1250,7 @@ instance_stdio(struct ustream *s, int prio, struct service_instance *in)
 			break;
 
 		*newline = 0;
+		logbuf_add(&in->logbuf, prio, str, newline - str);
 		ulog(prio, "%s\n", str);
 
 		len = newline + 1 - str;
@@ -425,6 +1260,188 @@ instance_stdio(struct ustream *s, int prio, struct service_instance *in)
 	ulog_open(ULOG_SYSLOG, LOG_DAEMON, "procd");
 }
 
+static int
+instance_log_open(void)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+		.sun_path = "/dev/log",
+	};
+
+	if (log_fd >= 0)
+		return log_fd;
+
+	log_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (log_fd < 0)
+		return -1;
+
+	if (connect(log_fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		close(log_fd);
+		log_fd = -1;
+	}
+
+	return log_fd;
+}
+
+static void
+instance_log_close(void)
+{
+	close(log_fd);
+	log_fd = -1;
+}
+
+/* token bucket allowing LOG_BURST lines at once and LOG_RATE lines per second */
+static bool
+instance_log_allow(struct service_instance *in)
+{
+	struct timespec ts;
+	uint32_t now, add, delta;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+	delta = now - in->log.last;
+	if (delta > LOG_BURST * 1000 / LOG_RATE)
+		add = LOG_BURST;
+	else
+		add = delta * LOG_RATE / 1000;
+	if (add) {
+		in->log.tokens += add;
+		if (in->log.tokens > LOG_BURST)
+			in->log.tokens = LOG_BURST;
+		in->log.last = now;
+	}
+
+	if (!in->log.tokens)
+		return false;
+
+	in->log.tokens--;
+	return true;
+}
+
+static int
+instance_log_header(char *buf, int len, int prio, const char *ident)
+{
+	struct tm tm;
+	time_t now;
+	char ts[16];
+
+	now = time(NULL);
+	localtime_r(&now, &tm);
+	strftime(ts, sizeof(ts), "%b %e %T", &tm);
+
+	return snprintf(buf, len, "<%d>%s %s: ", LOG_DAEMON | prio, ts, ident);
+}
+
+static void
+instance_log_dropped(struct service_instance *in, int fd, int prio)
+{
+	char buf[128];
+	int len;
+
+	if (!in->log.pending || !instance_log_allow(in))
+		return;
+
+	len = instance_log_header(buf, sizeof(buf), prio, in->log.ident);
+	len += snprintf(buf + len, sizeof(buf) - len, "%u lines dropped", in->log.pending);
+	if (send(fd, buf, len, MSG_DONTWAIT) >= 0)
+		in->log.pending = 0;
+}
+
+/* syslog forwarding is off, the lines only go to the buffer of the instance */
+static void
+instance_stdio_buffer(struct ustream *s, int prio, struct service_instance *in)
+{
+	char *str, *p, *newline;
+	int len;
+
+	while ((str = ustream_get_read_buf(s, &len)) != NULL) {
+		p = str;
+		while ((newline = memchr(p, '\n', str + len - p)) != NULL) {
+			in->log.lines++;
+			logbuf_add(&in->logbuf, prio, p, newline - p);
+			p = newline + 1;
+		}
+
+		if (p == str)
+			break;
+
+		ustream_consume(s, p - str);
+	}
+}
+
+/*
+ * Forward complete lines to /dev/log, one datagram per line but many
+ * datagrams per sendmmsg() call. Lines over the rate limit are dropped and
+ * reported once the instance is allowed to log again.
+ */
+static void
+instance_stdio(struct ustream *s, int prio, struct service_instance *in)
+{
+	PROF_SCOPE();
+	static struct mmsghdr msgs[LOG_BATCH];
+	static struct iovec iov[LOG_BATCH][2];
+	char hdr[64], *str, *p, *newline;
+	int fd, len, hlen, n, sent;
+
+	if (!in->syslog) {
+		instance_stdio_buffer(s, prio, in);
+		return;
+	}
+
+	fd = instance_log_open();
+	if (fd < 0) {
+		instance_stdio_ulog(s, prio, in);
+		return;
+	}
+
+	hlen = instance_log_header(hdr, sizeof(hdr), prio, in->log.ident);
+	do {
+		str = ustream_get_read_buf(s, &len);
+		if (!str)
+			break;
+
+		n = 0;
+		p = str;
+		while (n < LOG_BATCH && (newline = memchr(p, '\n', str + len - p)) != NULL) {
+			in->log.lines++;
+			logbuf_add(&in->logbuf, prio, p, newline - p);
+			if (instance_log_allow(in)) {
+				iov[n][0].iov_base = hdr;
+				iov[n][0].iov_len = hlen;
+				iov[n][1].iov_base = p;
+				iov[n][1].iov_len = newline - p;
+				memset(&msgs[n], 0, sizeof(msgs[n]));
+				msgs[n].msg_hdr.msg_iov = iov[n];
+				msgs[n].msg_hdr.msg_iovlen = 2;
+				n++;
+			} else {
+				in->log.dropped++;
+				in->log.pending++;
+			}
+			p = newline + 1;
+		}
+
+		if (p == str)
+			break;
+
+		if (n) {
+			sent = sendmmsg(fd, msgs, n, MSG_DONTWAIT);
+			if (sent < 0) {
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					instance_log_close();
+				sent = 0;
+			}
+			in->log.dropped += n - sent;
+		}
+
+		ustream_consume(s, p - str);
+	} while (log_fd >= 0);
+
+	if (log_fd >= 0)
+		instance_log_dropped(in, log_fd, prio);
+}
+
 static void
 instance_stdout(struct ustream *s, int bytes)
 {
@@ -432,11 +1449,100 @@ instance_stdout(struct ustream *s, int bytes)
 	               container_of(s, struct service_instance, _stdout.stream));
 }
 
-static void
-instance_stderr(struct ustream *s, int bytes)
-{
-	instance_stdio(s, LOG_ERR,
-	               container_of(s, struct service_instance, _stderr.stream));
+static void
+instance_stderr(struct ustream *s, int bytes)
+{
+	instance_stdio(s, LOG_ERR,
+	               container_of(s, struct service_instance, _stderr.stream));
+}
+
+/*
+ * Respawns are rate limited system wide: a token bucket allows
+ * RESPAWN_BURST restarts at once and respawn_rate restarts per second,
+ * anything above that waits in respawn_queue and is released in order.
+ */
+static LIST_HEAD(respawn_queue);
+static struct uloop_timeout respawn_release;
+static int respawn_rate;
+static uint32_t respawn_tokens = RESPAWN_BURST;
+static uint32_t respawn_last;
+
+static void
+respawn_refill(void)
+{
+	uint32_t now = instance_now();
+	uint32_t delta = now - respawn_last;
+	uint32_t add;
+
+	if (delta > RESPAWN_BURST * 1000)
+		add = RESPAWN_BURST;
+	else
+		add = delta * respawn_rate / 1000;
+	if (!add)
+		return;
+
+	respawn_tokens += add;
+	if (respawn_tokens > RESPAWN_BURST)
+		respawn_tokens = RESPAWN_BURST;
+	respawn_last = now;
+}
+
+static void
+instance_respawn_dequeue(struct service_instance *in)
+{
+	if (!in->respawn_queued)
+		return;
+
+	list_del(&in->respawn_list);
+	in->respawn_queued = false;
+}
+
+static void
+respawn_release_cb(struct uloop_timeout *t)
+{
+	struct service_instance *in;
+
+	respawn_refill();
+	while (respawn_tokens && !list_empty(&respawn_queue)) {
+		in = list_first_entry(&respawn_queue, struct service_instance, respawn_list);
+		instance_respawn_dequeue(in);
+		respawn_tokens--;
+		DEBUG(2, "Releasing queued respawn of %s::%s\n", in->srv->name, in->name);
+		instance_start(in);
+	}
+
+	if (!list_empty(&respawn_queue))
+		uloop_timeout_set(t, 1000 / respawn_rate);
+}
+
+static void
+instance_respawn(struct service_instance *in)
+{
+	if (!respawn_rate) {
+		char line[16];
+
+		respawn_rate = RESPAWN_RATE;
+		if (get_cmdline_val("procd.respawn_rate", line, sizeof(line)) && atoi(line) > 0)
+			respawn_rate = atoi(line);
+		respawn_release.cb = respawn_release_cb;
+		respawn_last = instance_now();
+	}
+
+	respawn_refill();
+	if (respawn_tokens && list_empty(&respawn_queue)) {
+		respawn_tokens--;
+		instance_start(in);
+		return;
+	}
+
+	if (in->respawn_queued)
+		return;
+
+	list_add_tail(&in->respawn_list, &respawn_queue);
+	in->respawn_queued = true;
+	service_changed(in->srv);
+	if (!respawn_release.pending)
+		uloop_timeout_set(&respawn_release, 1000 / respawn_rate);
 }
 
 static void
@@ -446,8 +1552,41 @@ instance_timeout(struct uloop_timeout *t)
 
 	in = container_of(t, struct service_instance, timeout);
 
-	if (!in->halt && (in->restart || in->respawn))
-		instance_start(in);
+	if (in->halt) {
+		if (in->proc.pending) {
+			LOG("Instance %s::%s did not stop, killing it\n", in->srv->name, in->name);
+			cgroup_instance_kill(in);
+			kill(in->proc.pid, SIGKILL);
+		}
+		return;
+	}
+
+	/* socket activated instances are started by the next connection */
+	if (in->n_sockets && !in->restart)
+		instance_sockets_listen(in);
+	else if (in->restart || in->respawn)
+		instance_respawn(in);
+}
+
+static void
+instance_metrics_exit(struct service_instance *in, int ret, struct timespec *tp)
+{
+	struct instance_metrics *m = &in->metrics;
+	uint64_t runtime;
+
+	runtime = (tp->tv_sec - in->start.tv_sec) * 1000 +
+		  (tp->tv_nsec - in->start.tv_nsec) / 1000000;
+	metrics_hist_add(m->runtime_hist, runtime / 1000);
+
+	m->last_status = ret;
+	if (WIFSIGNALED(ret))
+		m->exit_signaled++;
+	else if (WEXITSTATUS(ret))
+		m->exit_failed++;
+	else
+		m->exit_clean++;
+
+	cgroup_instance_stats(in, &m->cpu_user_us, &m->cpu_system_us, &m->mem_peak);
 }
 
 static void
@@ -458,44 +1597,51 @@ instance_exit(struct uloop_process *p, int ret)
 	long runtime;
 
 	in = container_of(p, struct service_instance, proc);
+	service_changed(in->srv);
 
 	clock_gettime(CLOCK_MONOTONIC, &tp);
 	runtime = tp.tv_sec - in->start.tv_sec;
 
 	DEBUG(2, "Instance %s::%s exit with error code %d after %ld seconds\n", in->srv->name, in->name, ret, runtime);
+	service_journal("instance.exit", in->srv->name, in->name, ret);
+	instance_metrics_exit(in, ret, &tp);
+	cgroup_instance_kill(in);
+	jail_ns_put(in);
 	if (upgrade_running)
 		return;
 
 	uloop_timeout_cancel(&in->timeout);
 	if (in->halt) {
-		/* no action */
+		instance_sockets_close(in);
+		service_stop_check();
 	} else if (in->restart) {
 		instance_start(in);
-	} else if (in->respawn) {
-		if (runtime < in->respawn_threshold)
-			in->respawn_count++;
-		else
-			in->respawn_count = 0;
-		if (in->respawn_count > in->respawn_retry && in->respawn_retry > 0 ) {
-			LOG("Instance %s::%s s in a crash loop %d crashes, %ld seconds since last crash\n",
-								in->srv->name, in->name, in->respawn_count, runtime);
-			in->restart = in->respawn = 0;
-			in->halt = 1;
-		} else {
-			uloop_timeout_set(&in->timeout, in->respawn_timeout * 1000);
-		}
+	} else if (in->idle_stop) {
+		/* socket activated instances go back to waiting for a connection */
+		instance_sockets_listen(in);
+	} else if (in->respawn || in->n_sockets) {
+		instance_respawn_schedule(in, runtime, ret);
 	}
+	in->idle_stop = false;
 	service_event("instance.stop", in->srv->name, in->name);
 }
 
 void
 instance_stop(struct service_instance *in)
 {
-	if (!in->proc.pending)
+	instance_respawn_dequeue(in);
+	instance_boot_dequeue(in);
+	in->pressure_stopped = false;
+	if (!in->proc.pending) {
+		/* an idle socket activated instance must not be started by a connection */
+		uloop_timeout_cancel(&in->timeout);
+		instance_sockets_close(in);
 		return;
+	}
 	in->halt = true;
 	in->restart = in->respawn = false;
 	kill(in->proc.pid, SIGTERM);
+	uloop_timeout_set(&in->timeout, STOP_TIMEOUT);
 }
 
 static void
@@ -514,6 +1660,10 @@ instance_config_changed(struct service_instance *in, struct service_instance *in
 	if (!in->valid)
 		return true;
 
+	if (in_new->valid &&
+	    !memcmp(in->digest, in_new->digest, sizeof(in->digest)))
+		return false;
+
 	if (!blob_attr_equal(in->command, in_new->command))
 		return true;
 
@@ -538,6 +1688,17 @@ instance_config_changed(struct service_instance *in, struct service_instance *in
 	if (in->gid != in_new->gid)
 		return true;
 
+	if (in->has_cpuset != in_new->has_cpuset ||
+	    (in->has_cpuset && !CPU_EQUAL(&in->cpuset, &in_new->cpuset)))
+		return true;
+
+	if (in->sched_policy != in_new->sched_policy ||
+	    in->sched_priority != in_new->sched_priority)
+		return true;
+
+	if (in->ioprio != in_new->ioprio)
+		return true;
+
 	if (!blobmsg_list_equal(&in->limits, &in_new->limits))
 		return true;
 
@@ -547,6 +1708,13 @@ instance_config_changed(struct service_instance *in, struct service_instance *in
 	if (!blobmsg_list_equal(&in->errors, &in_new->errors))
 		return true;
 
+	if (!blob_attr_equal(in->cgroup, in_new->cgroup))
+		return true;
+
+	if (!blob_attr_equal(in->sockets_attr, in_new->sockets_attr) ||
+	    in->socket_idle != in_new->socket_idle)
+		return true;
+
 	return false;
 }
 
@@ -576,39 +1744,128 @@ instance_file_cmp(struct blobmsg_list_node *l1, struct blobmsg_list_node *l2)
 	return !memcmp(f1->md5, f2->md5, sizeof(f1->md5));
 }
 
-static void
-instance_file_update(struct blobmsg_list_node *l)
+/* read, not mmap, a file truncated under a mapping would SIGBUS pid 1 */
+static bool
+file_hash_fd(int fd, uint32_t *md5)
 {
-	struct instance_file *f = container_of(l, struct instance_file, node);
-	md5_ctx_t md5;
-	char buf[256];
-	int len, fd;
-
-	memset(f->md5, 0, sizeof(f->md5));
+	static char *buf;
+	md5_ctx_t ctx;
+	int len;
 
-	fd = open(l->avl.key, O_RDONLY);
-	if (fd < 0)
-		return;
+	if (!buf)
+		buf = malloc(FILE_HASH_BUF);
+	if (!buf)
+		return false;
 
-	md5_begin(&md5);
+	md5_begin(&ctx);
 	do {
-		len = read(fd, buf, sizeof(buf));
+		len = read(fd, buf, FILE_HASH_BUF);
 		if (len < 0) {
 			if (errno == EINTR)
 				continue;
 
-			break;
+			return false;
 		}
 		if (!len)
 			break;
 
-		md5_hash(buf, len, &md5);
+		md5_hash(buf, len, &ctx);
 	} while(1);
 
-	md5_end(f->md5, &md5);
+	md5_end(md5, &ctx);
+	return true;
+}
+
+static bool
+file_fp_match(struct file_fp *fp, struct stat *s)
+{
+	return fp->dev == s->st_dev && fp->ino == s->st_ino &&
+	       fp->size == s->st_size &&
+	       fp->mtime.tv_sec == s->st_mtim.tv_sec &&
+	       fp->mtime.tv_nsec == s->st_mtim.tv_nsec &&
+	       fp->ctime.tv_sec == s->st_ctim.tv_sec &&
+	       fp->ctime.tv_nsec == s->st_ctim.tv_nsec;
+}
+
+/*
+ * Only rehash a file if its (dev, inode, size, mtime, ctime) fingerprint
+ * changed since it was last hashed by any instance.
+ */
+static void
+instance_file_update(struct blobmsg_list_node *l)
+{
+	struct instance_file *f = container_of(l, struct instance_file, node);
+	const char *path = l->avl.key;
+	struct file_fp *fp;
+	struct stat s;
+	char *_path;
+	int fd;
+
+	memset(f->md5, 0, sizeof(f->md5));
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &s)) {
+		close(fd);
+		return;
+	}
+
+	if (!file_fps.comp)
+		avl_init(&file_fps, avl_strcmp, false, NULL);
+
+	fp = avl_find_element(&file_fps, path, fp, avl);
+	if (fp) {
+		fp->refcount++;
+		f->fp = fp;
+	}
+
+	if (fp && file_fp_match(fp, &s)) {
+		memcpy(f->md5, fp->md5, sizeof(f->md5));
+		f->cache_hit = true;
+		close(fd);
+		return;
+	}
+
+	if (!fp) {
+		fp = calloc_a(sizeof(*fp), &_path, strlen(path) + 1);
+		if (fp) {
+			fp->avl.key = strcpy(_path, path);
+			fp->refcount = 1;
+			avl_insert(&file_fps, &fp->avl);
+			f->fp = fp;
+		}
+	}
+
+	if (file_hash_fd(fd, f->md5) && fp) {
+		fp->dev = s.st_dev;
+		fp->ino = s.st_ino;
+		fp->size = s.st_size;
+		fp->mtime = s.st_mtim;
+		fp->ctime = s.st_ctim;
+		memcpy(fp->md5, f->md5, sizeof(fp->md5));
+	}
 	close(fd);
 }
 
+/* forget the fingerprints of files no instance watches any more */
+static void
+instance_files_put(struct service_instance *in)
+{
+	struct blobmsg_list_node *var;
+	struct instance_file *f;
+
+	blobmsg_list_for_each(&in->file, var) {
+		f = container_of(var, struct instance_file, node);
+		if (!f->fp || --f->fp->refcount)
+			continue;
+
+		avl_delete(&file_fps, &f->fp->avl);
+		free(f->fp);
+	}
+}
+
 static void
 instance_fill_any(struct blobmsg_list *l, struct blob_attr *cur)
 {
@@ -680,6 +1937,20 @@ instance_jail_parse(struct service_instance *in, struct blob_attr *attr)
 		jail->ronly = blobmsg_get_bool(tb[JAIL_ATTR_RONLY]);
 		jail->argc++;
 	}
+	if (tb[JAIL_ATTR_TEMPLATE]) {
+		jail->template = blobmsg_get_bool(tb[JAIL_ATTR_TEMPLATE]);
+		jail->argc++;
+	}
+	if (tb[JAIL_ATTR_SHARED] && blobmsg_get_bool(tb[JAIL_ATTR_SHARED])) {
+		/* the pid namespace stays private, so would a procfs jail */
+		if (!jail->name || jail->procfs) {
+			ERROR("%s::%s: shared jail needs a name and no procfs\n",
+				in->srv->name, in->name);
+		} else {
+			jail->shared = true;
+			jail->argc += 2;
+		}
+	}
 	if (tb[JAIL_ATTR_MOUNT]) {
 		struct blob_attr *cur;
 		int rem;
@@ -694,6 +1965,69 @@ instance_jail_parse(struct service_instance *in, struct blob_attr *attr)
 	return 1;
 }
 
+/*
+ * Digest of the raw config plus the state resolved while parsing it
+ * (interface indexes, file hashes, uid/gid), equal digests mean
+ * instance_config_changed() has nothing to compare.
+ */
+static void
+instance_config_digest(struct service_instance *in)
+{
+	struct blobmsg_list_node *var;
+	md5_ctx_t ctx;
+
+	md5_begin(&ctx);
+	md5_hash(in->config, blob_pad_len(in->config), &ctx);
+
+	blobmsg_list_for_each(&in->netdev, var) {
+		struct instance_netdev *n = container_of(var, struct instance_netdev, node);
+
+		md5_hash(&n->ifindex, sizeof(n->ifindex), &ctx);
+	}
+
+	blobmsg_list_for_each(&in->file, var) {
+		struct instance_file *f = container_of(var, struct instance_file, node);
+
+		md5_hash(f->md5, sizeof(f->md5), &ctx);
+	}
+
+	md5_hash(&in->uid, sizeof(in->uid), &ctx);
+	md5_hash(&in->gid, sizeof(in->gid), &ctx);
+	md5_hash(&in->nice, sizeof(in->nice), &ctx);
+	md5_end(in->digest, &ctx);
+}
+
+/* the checks of instance_config_parse() that need no instance to run */
+bool
+instance_config_check(struct blob_attr *config)
+{
+	struct blob_attr *tb[__INSTANCE_ATTR_MAX];
+	struct blob_attr *cur;
+
+	if (blobmsg_type(config) != BLOBMSG_TYPE_TABLE)
+		return false;
+
+	blobmsg_parse(instance_attr, __INSTANCE_ATTR_MAX, tb,
+		blobmsg_data(config), blobmsg_data_len(config));
+
+	cur = tb[INSTANCE_ATTR_COMMAND];
+	if (!cur || blobmsg_check_array(cur, BLOBMSG_TYPE_STRING) <= 0)
+		return false;
+
+	if (tb[INSTANCE_ATTR_CGROUP] && !cgroup_valid(tb[INSTANCE_ATTR_CGROUP]))
+		return false;
+
+	if ((cur = tb[INSTANCE_ATTR_START_PRIORITY]) &&
+	    instance_start_class_parse(blobmsg_get_string(cur)) < 0)
+		return false;
+
+	if ((cur = tb[INSTANCE_ATTR_PRESSURE]) &&
+	    pressure_policy_parse(blobmsg_get_string(cur)) < 0)
+		return false;
+
+	return true;
+}
+
 static bool
 instance_config_parse(struct service_instance *in)
 {
@@ -723,10 +2057,10 @@ instance_config_parse(struct service_instance *in)
 
 	if (tb[INSTANCE_ATTR_RESPAWN]) {
 		int i = 0;
-		uint32_t vals[3] = { 3600, 5, 5};
+		uint32_t vals[4] = { 3600, 5, 5, 0 };
 
 		blobmsg_for_each_attr(cur2, tb[INSTANCE_ATTR_RESPAWN], rem) {
-			if ((i >= 3) && (blobmsg_type(cur2) == BLOBMSG_TYPE_STRING))
+			if ((i >= 4) || (blobmsg_type(cur2) != BLOBMSG_TYPE_STRING))
 				continue;
 			vals[i] = atoi(blobmsg_get_string(cur2));
 			i++;
@@ -736,7 +2070,16 @@ instance_config_parse(struct service_instance *in)
 		in->respawn_threshold = vals[0];
 		in->respawn_timeout = vals[1];
 		in->respawn_retry = vals[2];
+		in->respawn_max = vals[3];
 	}
+	if (tb[INSTANCE_ATTR_CGROUP]) {
+		if (!cgroup_valid(tb[INSTANCE_ATTR_CGROUP])) {
+			ERROR("%s: invalid cgroup settings\n", in->name);
+			return false;
+		}
+		in->cgroup = tb[INSTANCE_ATTR_CGROUP];
+	}
+
 	if (tb[INSTANCE_ATTR_TRIGGER]) {
 		in->trigger = tb[INSTANCE_ATTR_TRIGGER];
 		trigger_add(in->trigger, in);
@@ -757,6 +2100,37 @@ instance_config_parse(struct service_instance *in)
 			return false;
 	}
 
+	if (!instance_sched_parse(in, tb))
+		return false;
+
+	if ((cur = tb[INSTANCE_ATTR_SOCKETS])) {
+		if (blobmsg_check_array(cur, BLOBMSG_TYPE_STRING) <= 0)
+			return false;
+		in->sockets_attr = cur;
+	}
+
+	if ((cur = tb[INSTANCE_ATTR_SOCKET_IDLE]))
+		in->socket_idle = blobmsg_get_u32(cur);
+
+	if ((cur = tb[INSTANCE_ATTR_START_PRIORITY])) {
+		in->start_class = instance_start_class_parse(blobmsg_get_string(cur));
+		if (in->start_class < 0) {
+			ERROR("%s: invalid start_priority %s\n", in->name, blobmsg_get_string(cur));
+			return false;
+		}
+	}
+
+	if ((cur = tb[INSTANCE_ATTR_PRESSURE])) {
+		in->pressure_policy = pressure_policy_parse(blobmsg_get_string(cur));
+		if (in->pressure_policy < 0) {
+			ERROR("%s: invalid pressure policy %s\n", in->name, blobmsg_get_string(cur));
+			return false;
+		}
+	}
+
+	if ((cur = tb[INSTANCE_ATTR_PRESSURE_SIGNAL]))
+		in->pressure_signal = blobmsg_get_u32(cur);
+
 	if (tb[INSTANCE_ATTR_USER]) {
 		struct passwd *p = getpwnam(blobmsg_get_string(tb[INSTANCE_ATTR_USER]));
 		if (p) {
@@ -789,6 +2163,13 @@ instance_config_parse(struct service_instance *in)
 	if (tb[INSTANCE_ATTR_STDERR] && blobmsg_get_bool(tb[INSTANCE_ATTR_STDERR]))
 		in->_stderr.fd.fd = -1;
 
+	if (tb[INSTANCE_ATTR_LOG_BUFFER])
+		logbuf_init(&in->logbuf, blobmsg_get_u32(tb[INSTANCE_ATTR_LOG_BUFFER]));
+	else if (in->_stdout.fd.fd > -2 || in->_stderr.fd.fd > -2)
+		logbuf_init(&in->logbuf, LOGBUF_DEFAULT);
+
+	in->syslog = !tb[INSTANCE_ATTR_SYSLOG] || blobmsg_get_bool(tb[INSTANCE_ATTR_SYSLOG]);
+
 	instance_fill_any(&in->data, tb[INSTANCE_ATTR_DATA]);
 
 	if (!instance_fill_array(&in->env, tb[INSTANCE_ATTR_ENV], NULL, false))
@@ -806,6 +2187,8 @@ instance_config_parse(struct service_instance *in)
 	if (!instance_fill_array(&in->errors, tb[INSTANCE_ATTR_ERROR], NULL, true))
 		return false;
 
+	instance_config_digest(in);
+
 	return true;
 }
 
@@ -815,6 +2198,7 @@ instance_config_cleanup(struct service_instance *in)
 	blobmsg_list_free(&in->env);
 	blobmsg_list_free(&in->data);
 	blobmsg_list_free(&in->netdev);
+	instance_files_put(in);
 	blobmsg_list_free(&in->file);
 	blobmsg_list_free(&in->limits);
 	blobmsg_list_free(&in->errors);
@@ -833,13 +2217,31 @@ instance_config_move(struct service_instance *in, struct service_instance *in_sr
 	blobmsg_list_move(&in->errors, &in_src->errors);
 	blobmsg_list_move(&in->jail.mount, &in_src->jail.mount);
 	in->trigger = in_src->trigger;
+	in->cgroup = in_src->cgroup;
+	if (!blob_attr_equal(in->sockets_attr, in_src->sockets_attr))
+		instance_sockets_close(in);
+	in->sockets_attr = in_src->sockets_attr;
+	in->start_class = in_src->start_class;
+	in->pressure_policy = in_src->pressure_policy;
+	in->pressure_signal = in_src->pressure_signal;
+	in->socket_idle = in_src->socket_idle;
+	logbuf_init(&in->logbuf, in_src->logbuf.size);
+	in->syslog = in_src->syslog;
+	in->has_cpuset = in_src->has_cpuset;
+	in->cpuset = in_src->cpuset;
+	in->sched_policy = in_src->sched_policy;
+	in->sched_priority = in_src->sched_priority;
+	in->ioprio = in_src->ioprio;
 	in->command = in_src->command;
 	in->name = in_src->name;
 	in->node.avl.key = in_src->node.avl.key;
+	memcpy(in->digest, in_src->digest, sizeof(in->digest));
 
 	free(in->config);
 	in->config = in_src->config;
 	in_src->config = NULL;
+
+	service_data_index(in);
 }
 
 bool
@@ -866,12 +2268,22 @@ instance_update(struct service_instance *in, struct service_instance *in_new)
 void
 instance_free(struct service_instance *in)
 {
+	service_data_unindex(in);
 	instance_free_stdio(in);
+	/* nobody will reap a process that is still stopping, finish it off */
+	if (in->proc.pending)
+		cgroup_instance_kill(in);
+	cgroup_instance_remove(in);
 	uloop_process_delete(&in->proc);
 	uloop_timeout_cancel(&in->timeout);
+	jail_ns_put(in);
+	instance_sockets_close(in);
+	instance_respawn_dequeue(in);
+	instance_boot_dequeue(in);
 	trigger_del(in);
 	watch_del(in);
 	instance_config_cleanup(in);
+	logbuf_free(&in->logbuf);
 	free(in->config);
 	free(in);
 }
@@ -884,8 +2296,14 @@ instance_init(struct service_instance *in, struct service *s, struct blob_attr *
 	in->name = blobmsg_name(config);
 	in->config = config;
 	in->timeout.cb = instance_timeout;
+	in->idle_timer.cb = instance_idle_cb;
 	in->proc.cb = instance_exit;
 
+	in->log.tokens = LOG_BURST;
+	in->sched_policy = -1;
+	in->ioprio = -1;
+	in->start_class = -1;
+
 	in->_stdout.fd.fd = -2;
 	in->_stdout.stream.string_data = true;
 	in->_stdout.stream.notify_read = instance_stdout;
@@ -901,7 +2319,273 @@ instance_init(struct service_instance *in, struct service *s, struct blob_attr *
 	blobmsg_list_simple_init(&in->limits);
 	blobmsg_list_simple_init(&in->errors);
 	blobmsg_list_simple_init(&in->jail.mount);
+	INIT_LIST_HEAD(&in->data_entries);
 	in->valid = instance_config_parse(in);
+	service_data_index(in);
+}
+
+const char *
+instance_start_class_name(int class)
+{
+	return start_classes[class];
+}
+
+/*
+ * Runtime state handed over to the next procd image by procd_reexec(), the
+ * config travels with the service. The stdio pipes and listening sockets
+ * stay open across the exec, shared jail namespaces and metrics do not.
+ */
+enum {
+	ISTATE_PID,
+	ISTATE_START,
+	ISTATE_STDOUT,
+	ISTATE_STDERR,
+	ISTATE_SOCKETS,
+	ISTATE_ACTIVATED,
+	ISTATE_HALT,
+	ISTATE_RESTART,
+	ISTATE_RESPAWN,
+	ISTATE_RESPAWN_COUNT,
+	ISTATE_BACKOFF,
+	ISTATE_QUEUED,
+	__ISTATE_MAX
+};
+
+static const struct blobmsg_policy instance_state_attrs[__ISTATE_MAX] = {
+	[ISTATE_PID] = { "pid", BLOBMSG_TYPE_INT32 },
+	[ISTATE_START] = { "start", BLOBMSG_TYPE_INT64 },
+	[ISTATE_STDOUT] = { "stdout", BLOBMSG_TYPE_INT32 },
+	[ISTATE_STDERR] = { "stderr", BLOBMSG_TYPE_INT32 },
+	[ISTATE_SOCKETS] = { "sockets", BLOBMSG_TYPE_ARRAY },
+	[ISTATE_ACTIVATED] = { "activated", BLOBMSG_TYPE_BOOL },
+	[ISTATE_HALT] = { "halt", BLOBMSG_TYPE_BOOL },
+	[ISTATE_RESTART] = { "restart", BLOBMSG_TYPE_BOOL },
+	[ISTATE_RESPAWN] = { "respawn", BLOBMSG_TYPE_BOOL },
+	[ISTATE_RESPAWN_COUNT] = { "respawn_count", BLOBMSG_TYPE_INT32 },
+	[ISTATE_BACKOFF] = { "backoff", BLOBMSG_TYPE_INT32 },
+	[ISTATE_QUEUED] = { "queued", BLOBMSG_TYPE_BOOL },
+};
+
+static void
+instance_state_fd(struct blob_buf *b, const char *name, int fd)
+{
+	if (fd < 0)
+		return;
+
+	procd_reexec_keep(fd);
+	blobmsg_add_u32(b, name, fd);
+}
+
+void
+instance_state_dump(struct blob_buf *b, struct service_instance *in)
+{
+	void *c, *s;
+	int i;
+
+	c = blobmsg_open_table(b, in->name);
+	if (in->proc.pending) {
+		blobmsg_add_u32(b, "pid", in->proc.pid);
+		blobmsg_add_u64(b, "start", (uint64_t) in->start.tv_sec * 1000000000 + in->start.tv_nsec);
+	}
+	instance_state_fd(b, "stdout", in->_stdout.fd.fd);
+	instance_state_fd(b, "stderr", in->_stderr.fd.fd);
+
+	if (in->n_sockets) {
+		s = blobmsg_open_array(b, "sockets");
+		for (i = 0; i < in->n_sockets; i++)
+			instance_state_fd(b, NULL, in->sockets[i].fd.fd);
+		blobmsg_close_array(b, s);
+		blobmsg_add_u8(b, "activated", in->activated);
+	}
+
+	blobmsg_add_u8(b, "halt", in->halt);
+	blobmsg_add_u8(b, "restart", in->restart);
+	blobmsg_add_u8(b, "respawn", in->respawn);
+	blobmsg_add_u32(b, "respawn_count", in->respawn_count);
+	if (!in->proc.pending && in->timeout.pending)
+		blobmsg_add_u32(b, "backoff", uloop_timeout_remaining(&in->timeout));
+	if (in->respawn_queued || in->boot_queued)
+		blobmsg_add_u8(b, "queued", true);
+	blobmsg_close_table(b, c);
+}
+
+static int
+instance_state_get_fd(struct blob_attr *attr)
+{
+	int fd = blobmsg_get_u32(attr);
+
+	fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+
+	return fd;
+}
+
+/* adopt what the previous procd image left, false if there is nothing */
+bool
+instance_state_restore(struct service_instance *in, struct blob_attr *attr)
+{
+	struct blob_attr *tb[__ISTATE_MAX], *cur;
+	uint64_t start;
+	int rem, i = 0;
+
+	if (!attr)
+		return false;
+
+	blobmsg_parse(instance_state_attrs, __ISTATE_MAX, tb, blobmsg_data(attr), blobmsg_data_len(attr));
+
+	if (tb[ISTATE_HALT])
+		in->halt = blobmsg_get_bool(tb[ISTATE_HALT]);
+	if (tb[ISTATE_RESTART])
+		in->restart = blobmsg_get_bool(tb[ISTATE_RESTART]);
+	if (tb[ISTATE_RESPAWN])
+		in->respawn = blobmsg_get_bool(tb[ISTATE_RESPAWN]);
+	if (tb[ISTATE_RESPAWN_COUNT])
+		in->respawn_count = blobmsg_get_u32(tb[ISTATE_RESPAWN_COUNT]);
+
+	if (tb[ISTATE_STDOUT])
+		ustream_fd_init(&in->_stdout, instance_state_get_fd(tb[ISTATE_STDOUT]));
+	if (tb[ISTATE_STDERR])
+		ustream_fd_init(&in->_stderr, instance_state_get_fd(tb[ISTATE_STDERR]));
+
+	if (tb[ISTATE_SOCKETS] && in->sockets_attr) {
+		in->sockets = calloc(blobmsg_check_array(tb[ISTATE_SOCKETS], BLOBMSG_TYPE_INT32),
+				     sizeof(*in->sockets));
+		blobmsg_for_each_attr(cur, tb[ISTATE_SOCKETS], rem) {
+			if (!in->sockets)
+				break;
+			in->sockets[i].fd.fd = instance_state_get_fd(cur);
+			in->sockets[i].fd.cb = instance_socket_cb;
+			in->sockets[i].in = in;
+			i++;
+		}
+		in->n_sockets = i;
+	}
+
+	if (tb[ISTATE_PID]) {
+		in->proc.pid = blobmsg_get_u32(tb[ISTATE_PID]);
+		if (tb[ISTATE_START]) {
+			start = blobmsg_get_u64(tb[ISTATE_START]);
+			in->start.tv_sec = start / 1000000000;
+			in->start.tv_nsec = start % 1000000000;
+		} else {
+			clock_gettime(CLOCK_MONOTONIC, &in->start);
+		}
+		snprintf(in->log.ident, sizeof(in->log.ident), "%s[%d]",
+			basename(blobmsg_data(blobmsg_data(in->command))), in->proc.pid);
+		uloop_process_add(&in->proc);
+		DEBUG(2, "Adopted instance %s::%s, pid=%d\n", in->srv->name, in->name, in->proc.pid);
+
+		if (in->n_sockets && tb[ISTATE_ACTIVATED] && blobmsg_get_bool(tb[ISTATE_ACTIVATED])) {
+			in->activated = true;
+			in->last_activity = instance_now();
+			for (i = 0; i < in->n_sockets; i++)
+				uloop_fd_add(&in->sockets[i].fd, ULOOP_READ | ULOOP_EDGE_TRIGGER);
+			if (in->socket_idle)
+				uloop_timeout_set(&in->idle_timer, in->socket_idle * 1000);
+		}
+	} else if (in->n_sockets) {
+		instance_sockets_listen(in);
+	} else if (tb[ISTATE_BACKOFF]) {
+		in->respawn_backoff = blobmsg_get_u32(tb[ISTATE_BACKOFF]);
+		uloop_timeout_set(&in->timeout, in->respawn_backoff);
+	} else if (tb[ISTATE_QUEUED] && !in->halt) {
+		instance_start(in);
+	}
+
+	service_changed(in->srv);
+
+	return true;
+}
+
+static void
+metrics_hist_dump(struct blob_buf *b, const char *name, uint32_t *hist)
+{
+	void *a;
+	int i;
+
+	a = blobmsg_open_array(b, name);
+	for (i = 0; i < METRICS_BUCKETS; i++)
+		blobmsg_add_u32(b, NULL, hist[i]);
+	blobmsg_close_array(b, a);
+}
+
+/* cpu time in ms and peak rss in kB of a running process */
+static void
+instance_proc_sample(struct blob_buf *b, pid_t pid)
+{
+	unsigned long utime, stime, hwm = 0;
+	long hz = sysconf(_SC_CLK_TCK);
+	char path[32], buf[512], *p;
+	FILE *f;
+	void *c;
+	int len;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	len = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	if (len <= 0)
+		return;
+	buf[len] = 0;
+
+	p = strrchr(buf, ')');
+	if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			 &utime, &stime) != 2)
+		return;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	f = fopen(path, "r");
+	if (f) {
+		while (fgets(buf, sizeof(buf), f))
+			if (sscanf(buf, "VmHWM: %lu", &hwm) == 1)
+				break;
+		fclose(f);
+	}
+
+	c = blobmsg_open_table(b, "current");
+	blobmsg_add_u64(b, "user_ms", (uint64_t) utime * 1000 / hz);
+	blobmsg_add_u64(b, "system_ms", (uint64_t) stime * 1000 / hz);
+	blobmsg_add_u64(b, "maxrss_kb", hwm);
+	blobmsg_close_table(b, c);
+}
+
+void instance_dump_metrics(struct blob_buf *b, struct service_instance *in)
+{
+	struct instance_metrics *m = &in->metrics;
+	void *i, *c;
+
+	i = blobmsg_open_table(b, in->name);
+	blobmsg_add_u32(b, "starts", m->starts);
+	blobmsg_add_u32(b, "spawn_failures", m->spawn_failures);
+
+	c = blobmsg_open_table(b, "exit");
+	blobmsg_add_u32(b, "clean", m->exit_clean);
+	blobmsg_add_u32(b, "failed", m->exit_failed);
+	blobmsg_add_u32(b, "signaled", m->exit_signaled);
+	if (m->exit_clean + m->exit_failed + m->exit_signaled)
+		blobmsg_add_u32(b, "last_status", m->last_status);
+	metrics_hist_dump(b, "runtime_hist", m->runtime_hist);
+	blobmsg_close_table(b, c);
+
+	c = blobmsg_open_table(b, "spawn");
+	blobmsg_add_u32(b, "last_us", m->spawn_us_last);
+	blobmsg_add_u32(b, "max_us", m->spawn_us_max);
+	metrics_hist_dump(b, "latency_hist", m->spawn_hist);
+	blobmsg_close_table(b, c);
+
+	if (m->cpu_user_us || m->cpu_system_us || m->mem_peak) {
+		c = blobmsg_open_table(b, "cgroup");
+		blobmsg_add_u64(b, "user_us", m->cpu_user_us);
+		blobmsg_add_u64(b, "system_us", m->cpu_system_us);
+		blobmsg_add_u64(b, "memory_peak", m->mem_peak);
+		blobmsg_close_table(b, c);
+	}
+
+	if (in->proc.pending)
+		instance_proc_sample(b, in->proc.pid);
+
+	blobmsg_close_table(b, i);
 }
 
 void instance_dump(struct blob_buf *b, struct service_instance *in, int verbose)
@@ -954,9 +2638,48 @@ void instance_dump(struct blob_buf *b, struct service_instance *in, int verbose)
 		blobmsg_add_u32(b, "threshold", in->respawn_threshold);
 		blobmsg_add_u32(b, "timeout", in->respawn_timeout);
 		blobmsg_add_u32(b, "retry", in->respawn_retry);
+		if (in->respawn_max > in->respawn_timeout) {
+			blobmsg_add_string(b, "policy", "backoff");
+			blobmsg_add_u32(b, "max", in->respawn_max);
+		} else {
+			blobmsg_add_string(b, "policy", "fixed");
+		}
+		blobmsg_add_u32(b, "count", in->respawn_count);
+		if (in->respawn_backoff)
+			blobmsg_add_u32(b, "backoff_ms", in->respawn_backoff);
+		if (in->respawn_queued)
+			blobmsg_add_u8(b, "queued", true);
 		blobmsg_close_table(b, r);
 	}
 
+	if (verbose && (in->log.lines || in->logbuf.size)) {
+		void *l = blobmsg_open_table(b, "log");
+		blobmsg_add_u64(b, "lines", in->log.lines);
+		blobmsg_add_u64(b, "dropped", in->log.dropped);
+		if (in->logbuf.size) {
+			blobmsg_add_u32(b, "buffer", in->logbuf.size);
+			blobmsg_add_u32(b, "buffered", in->logbuf.count);
+		}
+		if (!in->syslog)
+			blobmsg_add_u8(b, "syslog", false);
+		blobmsg_close_table(b, l);
+	}
+
+	instance_sched_dump(b, in);
+
+	if (instance_start_class(in) != START_DEFAULT)
+		blobmsg_add_string(b, "start_priority", start_classes[instance_start_class(in)]);
+	if (in->boot_queued)
+		blobmsg_add_u8(b, "deferred", true);
+	pressure_dump(b, in);
+
+	if (in->sockets_attr) {
+		blobmsg_add_blob(b, in->sockets_attr);
+		blobmsg_add_u8(b, "activated", in->activated);
+		if (in->socket_idle)
+			blobmsg_add_u32(b, "socket_idle", in->socket_idle);
+	}
+
 	if (in->trace)
 		blobmsg_add_u8(b, "trace", true);
 
@@ -977,6 +2700,8 @@ void instance_dump(struct blob_buf *b, struct service_instance *in, int verbose)
 		blobmsg_add_u8(b, "ubus", in->jail.ubus);
 		blobmsg_add_u8(b, "log", in->jail.log);
 		blobmsg_add_u8(b, "ronly", in->jail.ronly);
+		blobmsg_add_u8(b, "template", in->jail.template);
+		blobmsg_add_u8(b, "shared", in->jail.shared);
 		blobmsg_close_table(b, r);
 		if (!avl_is_empty(&in->jail.mount.avl)) {
 			struct blobmsg_list_node *var;
@@ -987,8 +2712,32 @@ void instance_dump(struct blob_buf *b, struct service_instance *in, int verbose)
 		}
 	}
 
-	if (verbose && in->trigger)
+	cgroup_dump(b, in);
+
+	if (verbose && !avl_is_empty(&in->file.avl)) {
+		struct blobmsg_list_node *var;
+		int hits = 0, misses = 0;
+		void *c;
+
+		blobmsg_list_for_each(&in->file, var) {
+			struct instance_file *f = container_of(var, struct instance_file, node);
+
+			if (f->cache_hit)
+				hits++;
+			else
+				misses++;
+		}
+
+		c = blobmsg_open_table(b, "file_cache");
+		blobmsg_add_u32(b, "hits", hits);
+		blobmsg_add_u32(b, "misses", misses);
+		blobmsg_close_table(b, c);
+	}
+
+	if (verbose && in->trigger) {
 		blobmsg_add_blob(b, in->trigger);
+		trigger_dump(b, in);
+	}
 
 	blobmsg_close_table(b, i);
 }
@@ -15,23 +15,106 @@
 #ifndef __PROCD_INSTANCE_H
 #define __PROCD_INSTANCE_H
 
+#include <sched.h>
+
 #include <libubox/vlist.h>
 #include <libubox/uloop.h>
 #include <libubox/ustream.h>
 #include "../utils/utils.h"
+#include "logbuf.h"
 
 #define RESPAWN_ERROR	(5 * 60)
 
+/* global respawn budget and the first backoff step for a 0s timeout */
+#define RESPAWN_RATE		4
+#define RESPAWN_BURST		8
+#define RESPAWN_BACKOFF_MIN	500
+
+/* how long a stopping instance gets before its whole group is killed */
+#define STOP_TIMEOUT		5000
+
+/* lines per sendmmsg() call and the per instance log rate limit */
+#define LOG_BATCH	32
+#define LOG_RATE	100
+#define LOG_BURST	1000
+
+struct instance_log {
+	char ident[32];
+	uint32_t tokens;
+	uint32_t last;
+	uint32_t pending;
+	uint64_t lines;
+	uint64_t dropped;
+};
+
+/* start classes, see instance_boot_defer() */
+enum {
+	START_CRITICAL,
+	START_DEFAULT,
+	START_LOW,
+	START_IDLE,
+};
+
+/* what an instance does under memory pressure, see pressure.c */
+enum {
+	PRESSURE_POLICY_IGNORE,
+	PRESSURE_POLICY_SHRINK,
+	PRESSURE_POLICY_STOP,
+};
+
+#define BOOT_POLL		500
+#define BOOT_IDLE_PCT		50
+#define BOOT_DEFER_MAX		(30 * 1000)
+#define BOOT_RELEASE_BATCH	4
+
+/* decade buckets: spawn latency from 100us, run time from 1s */
+#define METRICS_BUCKETS	6
+
+struct instance_metrics {
+	uint32_t starts;
+	uint32_t spawn_failures;
+	uint32_t exit_clean;
+	uint32_t exit_failed;
+	uint32_t exit_signaled;
+	int last_status;
+
+	uint32_t spawn_us_last;
+	uint32_t spawn_us_max;
+	uint32_t spawn_hist[METRICS_BUCKETS];
+	uint32_t runtime_hist[METRICS_BUCKETS];
+
+	/* from the cgroup of the instance, if it has one */
+	uint64_t cpu_user_us;
+	uint64_t cpu_system_us;
+	uint64_t mem_peak;
+};
+
+struct service_instance;
+
+struct instance_socket {
+	struct uloop_fd fd;
+	struct service_instance *in;
+};
+
+struct jail_ns;
+
 struct jail {
 	bool procfs;
 	bool sysfs;
 	bool ubus;
 	bool log;
 	bool ronly;
+	bool template;
+	bool shared;
 	char *name;
 	char *hostname;
 	struct blobmsg_list mount;
 	int argc;
+
+	/* namespaces of a shared jail, and the argument passing them to ujail */
+	struct jail_ns *ns;
+	int ns_peer;
+	char ns_arg[40];
 };
 
 struct service_instance {
@@ -45,6 +128,12 @@ struct service_instance {
 	uid_t uid;
 	gid_t gid;
 
+	bool has_cpuset;
+	cpu_set_t cpuset;
+	int sched_policy;
+	int sched_priority;
+	int ioprio;
+
 	bool halt;
 	bool restart;
 	bool respawn;
@@ -60,17 +149,45 @@ struct service_instance {
 	uint32_t respawn_timeout;
 	uint32_t respawn_threshold;
 	uint32_t respawn_retry;
+	uint32_t respawn_max;
+	uint32_t respawn_backoff;
+	bool respawn_queued;
+	struct list_head respawn_list;
 
 	struct blob_attr *config;
+	uint32_t digest[4];
 	struct uloop_process proc;
 	struct uloop_timeout timeout;
 	struct ustream_fd _stdout;
 	struct ustream_fd _stderr;
+	struct instance_log log;
+	struct logbuf logbuf;
+	bool syslog;
+	struct instance_metrics metrics;
 
 	struct blob_attr *command;
 	struct blob_attr *trigger;
+	struct blob_attr *cgroup;
+	struct blob_attr *sockets_attr;
+	struct instance_socket *sockets;
+	int n_sockets;
+	bool activated;
+	bool idle_stop;
+	uint32_t socket_idle;
+	uint32_t last_activity;
+	struct uloop_timeout idle_timer;
+
+	int pressure_policy;
+	int pressure_signal;
+	bool pressure_stopped;
+
+	int start_class;
+	bool boot_queued;
+	bool boot_released;
+	struct list_head boot_list;
 	struct blobmsg_list env;
 	struct blobmsg_list data;
+	struct list_head data_entries;
 	struct blobmsg_list netdev;
 	struct blobmsg_list file;
 	struct blobmsg_list limits;
@@ -81,7 +198,15 @@ void instance_start(struct service_instance *in);
 void instance_stop(struct service_instance *in);
 bool instance_update(struct service_instance *in, struct service_instance *in_new);
 void instance_init(struct service_instance *in, struct service *s, struct blob_attr *config);
+bool instance_config_check(struct blob_attr *config);
 void instance_free(struct service_instance *in);
 void instance_dump(struct blob_buf *b, struct service_instance *in, int debug);
+void instance_boot_done(void);
+int instance_start_class_parse(const char *name);
+int instance_start_class(struct service_instance *in);
+const char *instance_start_class_name(int class);
+void instance_dump_metrics(struct blob_buf *b, struct service_instance *in);
+void instance_state_dump(struct blob_buf *b, struct service_instance *in);
+bool instance_state_restore(struct service_instance *in, struct blob_attr *attr);
 
 #endif
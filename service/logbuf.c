@@ -0,0 +1,188 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "logbuf.h"
+
+/*
+ * Lines are stored back to back, each one behind a small header and
+ * padded to 4 bytes. A record never wraps, if it does not fit at the end
+ * of the buffer it goes to the start and the records in its way are
+ * dropped. The sequence number of a record is not stored, it follows from
+ * the one of the oldest record.
+ */
+struct logbuf_rec {
+	uint32_t time;
+	/* of the line, including its NUL */
+	uint16_t len;
+	uint8_t prio;
+	uint8_t pad;
+	char data[];
+};
+
+#define LOGBUF_REC_LEN(len)	((sizeof(struct logbuf_rec) + (len) + 3) & ~3)
+
+static struct logbuf_rec *
+logbuf_rec(struct logbuf *l, uint32_t pos)
+{
+	return (struct logbuf_rec *) (l->buf + pos);
+}
+
+static uint32_t
+logbuf_step(struct logbuf *l, uint32_t pos)
+{
+	pos += LOGBUF_REC_LEN(logbuf_rec(l, pos)->len);
+	if (l->wrapped && pos == l->end)
+		pos = 0;
+
+	return pos;
+}
+
+static void
+logbuf_reset(struct logbuf *l)
+{
+	l->head = l->tail = l->end = 0;
+	l->wrapped = false;
+	l->count = 0;
+	l->first = l->next;
+}
+
+static void
+logbuf_drop(struct logbuf *l)
+{
+	l->head = logbuf_step(l, l->head);
+	if (l->wrapped && !l->head) {
+		l->end = 0;
+		l->wrapped = false;
+	}
+
+	l->first++;
+	if (!--l->count)
+		logbuf_reset(l);
+}
+
+/* 0 disables the buffer, the records are kept unless the size changes */
+void
+logbuf_init(struct logbuf *l, uint32_t size)
+{
+	if (size && size < LOGBUF_MIN)
+		size = LOGBUF_MIN;
+	if (size > LOGBUF_MAX)
+		size = LOGBUF_MAX;
+	size = (size + 3) & ~3;
+
+	if (size == l->size)
+		return;
+
+	free(l->buf);
+	l->buf = NULL;
+	l->size = size;
+	logbuf_reset(l);
+}
+
+void
+logbuf_free(struct logbuf *l)
+{
+	free(l->buf);
+	l->buf = NULL;
+	l->size = 0;
+	logbuf_reset(l);
+}
+
+void
+logbuf_add(struct logbuf *l, int prio, const char *data, int len)
+{
+	struct logbuf_rec *r;
+	uint32_t rlen;
+
+	if (!l->size)
+		return;
+
+	/* allocated on the first line, plenty of instances never print one */
+	if (!l->buf) {
+		l->buf = malloc(l->size);
+		if (!l->buf)
+			return;
+	}
+
+	/* a line too long for the buffer keeps its beginning */
+	if (LOGBUF_REC_LEN(len + 1) > l->size)
+		len = l->size - sizeof(*r) - 4;
+	rlen = LOGBUF_REC_LEN(len + 1);
+
+	while (l->count) {
+		if (!l->wrapped) {
+			if (l->tail + rlen <= l->size)
+				break;
+			l->end = l->tail;
+			l->tail = 0;
+			l->wrapped = true;
+		}
+
+		if (l->tail + rlen <= l->head)
+			break;
+		logbuf_drop(l);
+	}
+
+	r = logbuf_rec(l, l->tail);
+	r->time = time(NULL);
+	r->len = len + 1;
+	r->prio = prio;
+	memcpy(r->data, data, len);
+	r->data[len] = 0;
+
+	l->tail += rlen;
+	l->count++;
+	l->next++;
+}
+
+/*
+ * The lines from sequence number *since on, or all of them without since,
+ * only the last ones if lines is set. Lines a caller asked for that were
+ * dropped already are reported as lost.
+ */
+void
+logbuf_dump(struct blob_buf *b, struct logbuf *l, const uint32_t *since, uint32_t lines)
+{
+	struct logbuf_rec *r;
+	uint32_t seq = l->first, start = since ? *since : 0, pos = l->head, i;
+	void *a, *c;
+
+	if (start < l->first)
+		start = l->first;
+	if (lines && l->next - start > lines)
+		start = l->next - lines;
+
+	blobmsg_add_u32(b, "size", l->size);
+	blobmsg_add_u32(b, "first", l->first);
+	blobmsg_add_u32(b, "next", l->next);
+	if (since && *since < l->first)
+		blobmsg_add_u32(b, "lost", l->first - *since);
+
+	a = blobmsg_open_array(b, "lines");
+	for (i = 0; i < l->count; i++, seq++, pos = logbuf_step(l, pos)) {
+		if (seq < start)
+			continue;
+
+		r = logbuf_rec(l, pos);
+		c = blobmsg_open_table(b, NULL);
+		blobmsg_add_u32(b, "seq", seq);
+		blobmsg_add_u32(b, "time", r->time);
+		blobmsg_add_string(b, "stream", r->prio == LOG_ERR ? "stderr" : "stdout");
+		blobmsg_add_field(b, BLOBMSG_TYPE_STRING, "data", r->data, r->len);
+		blobmsg_close_table(b, c);
+	}
+	blobmsg_close_array(b, a);
+}
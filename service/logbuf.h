@@ -0,0 +1,47 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __PROCD_LOGBUF_H
+#define __PROCD_LOGBUF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libubox/blobmsg.h>
+
+/* default size of the buffer of an instance with stdout or stderr, and the limits */
+#define LOGBUF_DEFAULT	4096
+#define LOGBUF_MIN	256
+#define LOGBUF_MAX	(64 * 1024)
+
+/* the most recent output lines of an instance, oldest ones are dropped first */
+struct logbuf {
+	char *buf;
+	uint32_t size;
+
+	/* records are in [head, tail), or [head, end) and [0, tail) once wrapped */
+	uint32_t head;
+	uint32_t tail;
+	uint32_t end;
+	bool wrapped;
+
+	/* sequence numbers of the oldest record and of the next one */
+	uint32_t count;
+	uint32_t first;
+	uint32_t next;
+};
+
+void logbuf_init(struct logbuf *l, uint32_t size);
+void logbuf_free(struct logbuf *l);
+void logbuf_add(struct logbuf *l, int prio, const char *data, int len);
+void logbuf_dump(struct blob_buf *b, struct logbuf *l, const uint32_t *since, uint32_t lines);
+
+#endif
@@ -0,0 +1,274 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <sys/epoll.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../procd.h"
+
+#include "service.h"
+#include "instance.h"
+#include "pressure.h"
+
+#define PSI_MEMORY	"/proc/pressure/memory"
+
+/*
+ * A PSI trigger fires when tasks were stalled on memory for the given time
+ * within a one second window, "some" if at least one task was, "full" if
+ * all non idle tasks were. Both thresholds can be set on the kernel command
+ * line in ms, as procd.pressure_some and procd.pressure_full.
+ */
+#define PSI_WINDOW_US		1000000
+#define PSI_SOME_MS		150
+#define PSI_FULL_MS		100
+
+/* a level is left once its trigger has not fired for this long */
+#define PRESSURE_HOLD		10000
+
+static const char * const pressure_levels[] = {
+	[PRESSURE_NONE] = "none",
+	[PRESSURE_SOME] = "some",
+	[PRESSURE_FULL] = "full",
+};
+
+static struct uloop_fd psi_epoll = { .fd = -1 };
+static int psi_fds[__PRESSURE_MAX] = { -1, -1, -1 };
+static struct uloop_timeout pressure_timer;
+static uint32_t pressure_last[__PRESSURE_MAX];
+static int pressure_level;
+
+static uint32_t
+pressure_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static const char *
+pressure_policy_name(int policy)
+{
+	switch (policy) {
+	case PRESSURE_POLICY_SHRINK:
+		return "shrink";
+	case PRESSURE_POLICY_STOP:
+		return "stop";
+	default:
+		return NULL;
+	}
+}
+
+int
+pressure_policy_parse(const char *name)
+{
+	if (!strcmp(name, "ignore"))
+		return PRESSURE_POLICY_IGNORE;
+	if (!strcmp(name, "shrink"))
+		return PRESSURE_POLICY_SHRINK;
+	if (!strcmp(name, "stop"))
+		return PRESSURE_POLICY_STOP;
+
+	return -1;
+}
+
+void
+pressure_dump(struct blob_buf *b, struct service_instance *in)
+{
+	const char *name = pressure_policy_name(in->pressure_policy);
+
+	if (!name)
+		return;
+
+	blobmsg_add_string(b, "pressure", name);
+	if (in->pressure_signal)
+		blobmsg_add_u32(b, "pressure_signal", in->pressure_signal);
+	if (in->pressure_stopped)
+		blobmsg_add_u8(b, "pressure_stopped", true);
+}
+
+/*
+ * "shrink" instances are asked to give back memory once there is some
+ * pressure, "stop" instances are stopped when it is full and started
+ * again only once it is gone completely.
+ */
+static void
+pressure_apply(int level)
+{
+	struct service_instance *in;
+	struct service *s;
+
+	avl_for_each_element(&services, s, avl) {
+		vlist_for_each_element(&s->instances, in, node) {
+			switch (in->pressure_policy) {
+			case PRESSURE_POLICY_SHRINK:
+				if (level < PRESSURE_SOME || !in->proc.pending)
+					break;
+				if (in->pressure_signal)
+					kill(in->proc.pid, in->pressure_signal);
+				service_event("instance.shrink", s->name, in->name);
+				break;
+
+			case PRESSURE_POLICY_STOP:
+				if (level == PRESSURE_FULL && in->proc.pending && !in->halt) {
+					LOG("Stopping %s::%s on memory pressure\n", s->name, in->name);
+					instance_stop(in);
+					in->pressure_stopped = true;
+				} else if (level == PRESSURE_NONE && in->pressure_stopped) {
+					LOG("Restarting %s::%s, memory pressure is gone\n", s->name, in->name);
+					instance_start(in);
+				}
+				break;
+			}
+		}
+	}
+}
+
+static void
+pressure_set(int level)
+{
+	static struct blob_buf b;
+
+	if (level == pressure_level)
+		return;
+
+	DEBUG(2, "Memory pressure %s -> %s\n", pressure_levels[pressure_level], pressure_levels[level]);
+	pressure_level = level;
+
+	blob_buf_init(&b, 0);
+	blobmsg_add_string(&b, "level", pressure_levels[level]);
+	trigger_event("pressure.memory", b.head);
+
+	pressure_apply(level);
+}
+
+static void
+pressure_update(void)
+{
+	uint32_t now = pressure_now();
+	int level;
+
+	for (level = PRESSURE_FULL; level > PRESSURE_NONE; level--)
+		if (pressure_last[level] && now - pressure_last[level] < PRESSURE_HOLD)
+			break;
+
+	pressure_set(level);
+	if (level != PRESSURE_NONE)
+		uloop_timeout_set(&pressure_timer, PRESSURE_HOLD);
+}
+
+static void
+pressure_timeout(struct uloop_timeout *t)
+{
+	pressure_update();
+}
+
+/* drops the triggers and their epoll set, pressure_init() can start over */
+static void
+pressure_close(void)
+{
+	int i;
+
+	if (psi_epoll.registered)
+		uloop_fd_delete(&psi_epoll);
+
+	for (i = 0; i < __PRESSURE_MAX; i++) {
+		if (psi_fds[i] >= 0)
+			close(psi_fds[i]);
+		psi_fds[i] = -1;
+	}
+
+	if (psi_epoll.fd >= 0)
+		close(psi_epoll.fd);
+	psi_epoll.fd = -1;
+}
+
+static void
+pressure_psi_cb(struct uloop_fd *u, unsigned int events)
+{
+	struct epoll_event ev[__PRESSURE_MAX];
+	int i, n;
+
+	n = epoll_wait(u->fd, ev, ARRAY_SIZE(ev), 0);
+	for (i = 0; i < n; i++) {
+		if (ev[i].events & EPOLLERR) {
+			ERROR("PSI memory trigger went away\n");
+			pressure_close();
+			return;
+		}
+		pressure_last[ev[i].data.u32] = pressure_now();
+	}
+
+	if (n > 0)
+		pressure_update();
+}
+
+static int
+pressure_trigger_add(int level, const char *type, const char *param, int def)
+{
+	struct epoll_event ev = { .events = EPOLLPRI, .data.u32 = level };
+	char trigger[64], line[16];
+	int ms = def, fd;
+
+	if (get_cmdline_val(param, line, sizeof(line)) && atoi(line) > 0)
+		ms = atoi(line);
+
+	fd = open(PSI_MEMORY, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	snprintf(trigger, sizeof(trigger), "%s %d %d", type, ms * 1000, PSI_WINDOW_US);
+	if (write(fd, trigger, strlen(trigger) + 1) < 0 ||
+	    epoll_ctl(psi_epoll.fd, EPOLL_CTL_ADD, fd, &ev)) {
+		ERROR("Failed to add PSI trigger \"%s\": %s\n", trigger, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	/* the trigger lives as long as its fd */
+	psi_fds[level] = fd;
+
+	return 0;
+}
+
+/*
+ * uloop does not poll for EPOLLPRI, which is all a PSI trigger signals,
+ * so the triggers are in an epoll set of their own, readable when one of
+ * them fired.
+ */
+void
+pressure_init(void)
+{
+	if (access(PSI_MEMORY, R_OK))
+		return;
+
+	psi_epoll.fd = epoll_create1(EPOLL_CLOEXEC);
+	if (psi_epoll.fd < 0)
+		return;
+
+	if (pressure_trigger_add(PRESSURE_SOME, "some", "procd.pressure_some", PSI_SOME_MS) ||
+	    pressure_trigger_add(PRESSURE_FULL, "full", "procd.pressure_full", PSI_FULL_MS)) {
+		pressure_close();
+		return;
+	}
+
+	pressure_timer.cb = pressure_timeout;
+	psi_epoll.cb = pressure_psi_cb;
+	uloop_fd_add(&psi_epoll, ULOOP_READ);
+}
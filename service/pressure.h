@@ -0,0 +1,30 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __PROCD_PRESSURE_H
+#define __PROCD_PRESSURE_H
+
+#include <libubox/blobmsg.h>
+
+enum {
+	PRESSURE_NONE,
+	PRESSURE_SOME,
+	PRESSURE_FULL,
+	__PRESSURE_MAX
+};
+
+struct service_instance;
+
+void pressure_init(void);
+int pressure_policy_parse(const char *name);
+void pressure_dump(struct blob_buf *b, struct service_instance *in);
+
+#endif
@@ -12,20 +12,65 @@
  * GNU General Public License for more details.
  */
 
+#define _GNU_SOURCE
 #include <libubox/blobmsg_json.h>
 #include <libubox/avl-cmp.h>
 
 #include "../procd.h"
+#include "../profiler.h"
 
 #include "service.h"
 #include "instance.h"
+#include "cgroup.h"
+#include "pressure.h"
 
 #include "../rcS.h"
 
 struct avl_tree services;
 static struct blob_buf b;
+static struct blob_buf dump_buf;
 static struct ubus_context *ctx;
 
+/* instance.update changes collected while a set_many call is applied */
+static struct blob_buf batch;
+static void *batch_changes;
+static int batch_count;
+/* the reply of set_many, b gets reused by the events sent while applying */
+static struct blob_buf batch_reply;
+
+/*
+ * Besides the notify per event on "service", service_event()s are
+ * collected for EVENT_BATCH_DELAY ms and sent as one "events" notify with
+ * an array of them on "service.events", subscribing to that object is how
+ * a client opts in to batches.
+ */
+#define EVENT_BATCH_DELAY	5
+#define EVENT_BATCH_MAX		128
+
+static struct blob_buf event_batch;
+static void *event_batch_list;
+static int event_batch_count;
+static struct uloop_timeout event_batch_timer;
+
+/* bounded lifecycle event journal, see service_journal() */
+#define JOURNAL_SIZE	256
+
+struct journal_entry {
+	uint32_t seq;
+	time_t time;
+	const char *type;
+	char *service;
+	char *instance;
+	int code;
+};
+
+static struct journal_entry journal[JOURNAL_SIZE];
+static uint32_t journal_seq;
+
+/* set while services are restored after procd_reexec(), see service_state_restore() */
+static bool restoring;
+static struct blob_attr *restore_state;
+
 static void
 service_instance_add(struct service *s, struct blob_attr *attr)
 {
@@ -42,6 +87,22 @@ service_instance_add(struct service *s, struct blob_attr *attr)
 	vlist_add(&s->instances, &in->node, (void *) in->name);
 }
 
+static struct blob_attr *
+service_restore_get(const char *name)
+{
+	struct blob_attr *cur;
+	int rem;
+
+	if (!restore_state)
+		return NULL;
+
+	blobmsg_for_each_attr(cur, restore_state, rem)
+		if (!strcmp(blobmsg_name(cur), name))
+			return cur;
+
+	return NULL;
+}
+
 static void
 service_instance_update(struct vlist_tree *tree, struct vlist_node *node_new,
 			struct vlist_node *node_old)
@@ -64,8 +125,29 @@ service_instance_update(struct vlist_tree *tree, struct vlist_node *node_new,
 		instance_free(in_o);
 	} else if (in_n) {
 		DEBUG(2, "Create instance %s::%s\n", in_n->srv->name, in_n->name);
-		instance_start(in_n);
+		if (!restoring || !instance_state_restore(in_n, service_restore_get(in_n->name)))
+			instance_start(in_n);
+	}
+
+	service_changed(in_o ? in_o->srv : in_n->srv);
+
+	if (batch_changes) {
+		struct service_instance *in = in_n ? in_n : in_o;
+		void *c;
+
+		c = blobmsg_open_table(&batch, NULL);
+		blobmsg_add_string(&batch, "service", in->srv->name);
+		blobmsg_add_string(&batch, "instance", in->name);
+		blobmsg_add_string(&batch, "action",
+			(in_o && in_n) ? "update" : (in_o ? "delete" : "add"));
+		blobmsg_close_table(&batch, c);
+		batch_count++;
+		return;
 	}
+
+	if (restoring)
+		return;
+
 	blob_buf_init(&b, 0);
 	trigger_event("instance.update", b.head);
 }
@@ -83,6 +165,7 @@ service_alloc(const char *name)
 	s->instances.keep_old = true;
 	s->name = new_name;
 	s->avl.key = s->name;
+	s->start_class = START_DEFAULT;
 	INIT_LIST_HEAD(&s->validators);
 
 	return s;
@@ -94,6 +177,8 @@ enum {
 	SERVICE_SET_INSTANCES,
 	SERVICE_SET_TRIGGER,
 	SERVICE_SET_VALIDATE,
+	SERVICE_SET_CGROUP,
+	SERVICE_SET_START_PRIORITY,
 	__SERVICE_SET_MAX
 };
 
@@ -103,14 +188,63 @@ static const struct blobmsg_policy service_set_attrs[__SERVICE_SET_MAX] = {
 	[SERVICE_SET_INSTANCES] = { "instances", BLOBMSG_TYPE_TABLE },
 	[SERVICE_SET_TRIGGER] = { "triggers", BLOBMSG_TYPE_ARRAY },
 	[SERVICE_SET_VALIDATE] = { "validate", BLOBMSG_TYPE_ARRAY },
+	[SERVICE_SET_CGROUP] = { "cgroup", BLOBMSG_TYPE_TABLE },
+	[SERVICE_SET_START_PRIORITY] = { "start_priority", BLOBMSG_TYPE_STRING },
 };
 
-static int
-service_update(struct service *s, struct blob_attr **tb, bool add)
+/*
+ * Everything service_update() would reject, and instances it would keep
+ * but never start, so that set_many can refuse a batch as a whole.
+ */
+static bool
+service_set_check(struct blob_attr **tb)
 {
 	struct blob_attr *cur;
 	int rem;
 
+	if (!tb[SERVICE_SET_NAME])
+		return false;
+
+	if (tb[SERVICE_SET_CGROUP] && !cgroup_valid(tb[SERVICE_SET_CGROUP]))
+		return false;
+
+	if (tb[SERVICE_SET_START_PRIORITY] &&
+	    instance_start_class_parse(blobmsg_get_string(tb[SERVICE_SET_START_PRIORITY])) < 0)
+		return false;
+
+	if (tb[SERVICE_SET_INSTANCES]) {
+		blobmsg_for_each_attr(cur, tb[SERVICE_SET_INSTANCES], rem)
+			if (!instance_config_check(cur))
+				return false;
+	}
+
+	return true;
+}
+
+static int
+service_update(struct service *s, struct blob_attr **tb, bool add)
+{
+	struct blob_attr *cur, *cgroup = NULL;
+	int rem, class = -1;
+
+	/* nothing is changed by a request that gets rejected */
+	if (tb[SERVICE_SET_CGROUP] && !cgroup_valid(tb[SERVICE_SET_CGROUP]))
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	if (tb[SERVICE_SET_START_PRIORITY]) {
+		class = instance_start_class_parse(blobmsg_get_string(tb[SERVICE_SET_START_PRIORITY]));
+		if (class < 0)
+			return UBUS_STATUS_INVALID_ARGUMENT;
+	}
+
+	if (tb[SERVICE_SET_CGROUP]) {
+		cgroup = blob_memdup(tb[SERVICE_SET_CGROUP]);
+		if (!cgroup)
+			return UBUS_STATUS_UNKNOWN_ERROR;
+	}
+
+	service_changed(s);
+
 	if (s->trigger) {
 		trigger_del(s);
 		free(s->trigger);
@@ -119,6 +253,14 @@ service_update(struct service *s, struct blob_attr **tb, bool add)
 
 	service_validate_del(s);
 
+	if (cgroup) {
+		free(s->cgroup);
+		s->cgroup = cgroup;
+	}
+
+	if (class >= 0)
+		s->start_class = class;
+
 	if (tb[SERVICE_SET_TRIGGER] && blobmsg_data_len(tb[SERVICE_SET_TRIGGER])) {
 		s->trigger = blob_memdup(tb[SERVICE_SET_TRIGGER]);
 		if (!s->trigger)
@@ -141,23 +283,52 @@ service_update(struct service *s, struct blob_attr **tb, bool add)
 			vlist_flush(&s->instances);
 	}
 
-	rc(s->name, "running");
+	if (!restoring)
+		rc(s->name, "running");
 
 	return 0;
 }
 
 static void
-service_delete(struct service *s)
+service_free(struct service *s)
 {
-	service_event("service.stop", s->name, NULL);
 	vlist_flush_all(&s->instances);
-	avl_delete(&services, &s->avl);
 	trigger_del(s);
+	service_validate_del(s);
 	free(s->trigger);
+	free(s->cgroup);
+	free(s->dump);
 	free(s);
-	service_validate_del(s);
 }
 
+static void
+service_delete(struct service *s)
+{
+	service_event("service.stop", s->name, NULL);
+	avl_delete(&services, &s->avl);
+	service_free(s);
+}
+
+enum {
+	SET_MANY_SERVICES,
+	SET_MANY_ADD,
+	__SET_MANY_MAX
+};
+
+static const struct blobmsg_policy set_many_attrs[__SET_MANY_MAX] = {
+	[SET_MANY_SERVICES] = { "services", BLOBMSG_TYPE_ARRAY },
+	[SET_MANY_ADD] = { "add", BLOBMSG_TYPE_BOOL },
+};
+
+enum {
+	EVENTS_SINCE,
+	__EVENTS_MAX
+};
+
+static const struct blobmsg_policy events_attrs[__EVENTS_MAX] = {
+	[EVENTS_SINCE] = { "since", BLOBMSG_TYPE_INT32 },
+};
+
 enum {
 	SERVICE_ATTR_NAME,
 	__SERVICE_ATTR_MAX,
@@ -181,12 +352,14 @@ static const struct blobmsg_policy service_del_attrs[__SERVICE_DEL_ATTR_MAX] = {
 enum {
 	SERVICE_LIST_ATTR_NAME,
 	SERVICE_LIST_ATTR_VERBOSE,
+	SERVICE_LIST_ATTR_FIELDS,
 	__SERVICE_LIST_ATTR_MAX,
 };
 
 static const struct blobmsg_policy service_list_attrs[__SERVICE_LIST_ATTR_MAX] = {
 	[SERVICE_LIST_ATTR_NAME] = { "name", BLOBMSG_TYPE_STRING },
 	[SERVICE_LIST_ATTR_VERBOSE] = { "verbose", BLOBMSG_TYPE_BOOL },
+	[SERVICE_LIST_ATTR_FIELDS] = { "fields", BLOBMSG_TYPE_ARRAY },
 };
 
 enum {
@@ -213,6 +386,21 @@ static const struct blobmsg_policy validate_policy[__VALIDATE_MAX] = {
 	[VALIDATE_SERVICE] = { .name = "service", .type = BLOBMSG_TYPE_STRING },
 };
 
+enum {
+	SERVICE_LOG_NAME,
+	SERVICE_LOG_INSTANCE,
+	SERVICE_LOG_SINCE,
+	SERVICE_LOG_LINES,
+	__SERVICE_LOG_MAX
+};
+
+static const struct blobmsg_policy service_log_attrs[__SERVICE_LOG_MAX] = {
+	[SERVICE_LOG_NAME] = { "name", BLOBMSG_TYPE_STRING },
+	[SERVICE_LOG_INSTANCE] = { "instance", BLOBMSG_TYPE_STRING },
+	[SERVICE_LOG_SINCE] = { "since", BLOBMSG_TYPE_INT32 },
+	[SERVICE_LOG_LINES] = { "lines", BLOBMSG_TYPE_INT32 },
+};
+
 enum {
 	DATA_NAME,
 	DATA_INSTANCE,
@@ -227,22 +415,16 @@ static const struct blobmsg_policy get_data_policy[] = {
 };
 
 static int
-service_handle_set(struct ubus_context *ctx, struct ubus_object *obj,
-		   struct ubus_request_data *req, const char *method,
-		   struct blob_attr *msg)
+service_set(struct blob_attr **tb, bool add)
 {
-	struct blob_attr *tb[__SERVICE_SET_MAX], *cur;
 	struct service *s = NULL;
 	const char *name;
-	bool add = !strcmp(method, "add");
 	int ret;
 
-	blobmsg_parse(service_set_attrs, __SERVICE_SET_MAX, tb, blob_data(msg), blob_len(msg));
-	cur = tb[SERVICE_ATTR_NAME];
-	if (!cur)
+	if (!tb[SERVICE_SET_NAME])
 		return UBUS_STATUS_INVALID_ARGUMENT;
 
-	name = blobmsg_data(cur);
+	name = blobmsg_data(tb[SERVICE_SET_NAME]);
 
 	s = avl_find_element(&services, name, s, avl);
 	if (s) {
@@ -256,8 +438,10 @@ service_handle_set(struct ubus_context *ctx, struct ubus_object *obj,
 		return UBUS_STATUS_UNKNOWN_ERROR;
 
 	ret = service_update(s, tb, add);
-	if (ret)
+	if (ret) {
+		service_free(s);
 		return ret;
+	}
 
 	avl_insert(&services, &s->avl);
 
@@ -266,24 +450,178 @@ service_handle_set(struct ubus_context *ctx, struct ubus_object *obj,
 	return 0;
 }
 
+static int
+service_handle_set(struct ubus_context *ctx, struct ubus_object *obj,
+		   struct ubus_request_data *req, const char *method,
+		   struct blob_attr *msg)
+{
+	PROF_SCOPE();
+	struct blob_attr *tb[__SERVICE_SET_MAX];
+	bool add = !strcmp(method, "add");
+
+	blobmsg_parse(service_set_attrs, __SERVICE_SET_MAX, tb, blob_data(msg), blob_len(msg));
+
+	return service_set(tb, add);
+}
+
+static int
+service_handle_set_many(struct ubus_context *ctx, struct ubus_object *obj,
+			struct ubus_request_data *req, const char *method,
+			struct blob_attr *msg)
+{
+	PROF_SCOPE();
+	struct blob_attr *tb[__SET_MANY_MAX], *stb[__SERVICE_SET_MAX], *cur;
+	bool add = false;
+	void *f;
+	int rem, ret = 0, n = 0;
+
+	blobmsg_parse(set_many_attrs, __SET_MANY_MAX, tb, blob_data(msg), blob_len(msg));
+	if (!tb[SET_MANY_SERVICES])
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	if (tb[SET_MANY_ADD])
+		add = blobmsg_get_bool(tb[SET_MANY_ADD]);
+
+	/* reject the whole message before touching any service */
+	blob_buf_init(&batch_reply, 0);
+	f = blobmsg_open_array(&batch_reply, "failed");
+	blobmsg_for_each_attr(cur, tb[SET_MANY_SERVICES], rem) {
+		if (blobmsg_type(cur) != BLOBMSG_TYPE_TABLE) {
+			ret = UBUS_STATUS_INVALID_ARGUMENT;
+			continue;
+		}
+
+		blobmsg_parse(service_set_attrs, __SERVICE_SET_MAX, stb,
+			      blobmsg_data(cur), blobmsg_data_len(cur));
+		if (!service_set_check(stb)) {
+			if (stb[SERVICE_SET_NAME])
+				blobmsg_add_string(&batch_reply, NULL, blobmsg_get_string(stb[SERVICE_SET_NAME]));
+			ret = UBUS_STATUS_INVALID_ARGUMENT;
+		}
+	}
+	if (ret) {
+		blobmsg_close_array(&batch_reply, f);
+		blobmsg_add_u32(&batch_reply, "services", 0);
+		blobmsg_add_u32(&batch_reply, "changes", 0);
+		ubus_send_reply(ctx, req, batch_reply.head);
+		return ret;
+	}
+
+	blob_buf_init(&batch, 0);
+	batch_changes = blobmsg_open_array(&batch, "changes");
+	batch_count = 0;
+
+	blobmsg_for_each_attr(cur, tb[SET_MANY_SERVICES], rem) {
+		blobmsg_parse(service_set_attrs, __SERVICE_SET_MAX, stb,
+			      blobmsg_data(cur), blobmsg_data_len(cur));
+		if (service_set(stb, add)) {
+			blobmsg_add_string(&batch_reply, NULL, blobmsg_get_string(stb[SERVICE_SET_NAME]));
+			ret = UBUS_STATUS_UNKNOWN_ERROR;
+		} else {
+			n++;
+		}
+	}
+	blobmsg_close_array(&batch_reply, f);
+
+	blobmsg_close_array(&batch, batch_changes);
+	batch_changes = NULL;
+
+	if (batch_count)
+		trigger_event("instance.update", batch.head);
+
+	blobmsg_add_u32(&batch_reply, "services", n);
+	blobmsg_add_u32(&batch_reply, "changes", batch_count);
+	ubus_send_reply(ctx, req, batch_reply.head);
+
+	return ret;
+}
+
 static void
-service_dump(struct service *s, bool verbose)
+service_dump(struct blob_buf *b, struct service *s, bool verbose)
 {
 	struct service_instance *in;
 	void *c, *i;
 
-	c = blobmsg_open_table(&b, s->name);
+	c = blobmsg_open_table(b, s->name);
 
 	if (!avl_is_empty(&s->instances.avl)) {
-		i = blobmsg_open_table(&b, "instances");
+		i = blobmsg_open_table(b, "instances");
 		vlist_for_each_element(&s->instances, in, node)
-			instance_dump(&b, in, verbose);
-		blobmsg_close_table(&b, i);
+			instance_dump(b, in, verbose);
+		blobmsg_close_table(b, i);
+	}
+	if (verbose && s->trigger) {
+		blobmsg_add_blob(b, s->trigger);
+		trigger_dump(b, s);
 	}
-	if (verbose && s->trigger)
-		blobmsg_add_blob(&b, s->trigger);
 	if (verbose && !list_empty(&s->validators))
-		service_validate_dump(&b, s);
+		service_validate_dump(b, s);
+	blobmsg_close_table(b, c);
+}
+
+/*
+ * Non-verbose dumps only contain config and process state, so they are
+ * kept until the service generation changes. Verbose dumps carry live
+ * counters and are always rebuilt.
+ */
+static struct blob_attr *
+service_dump_cached(struct service *s, bool verbose)
+{
+	if (!verbose && s->dump && s->dump_gen == s->gen)
+		return s->dump;
+
+	blob_buf_init(&dump_buf, 0);
+	service_dump(&dump_buf, s, verbose);
+	if (verbose)
+		return blob_data(dump_buf.head);
+
+	free(s->dump);
+	s->dump = blob_memdup(blob_data(dump_buf.head));
+	s->dump_gen = s->gen;
+
+	return s->dump ? s->dump : blob_data(dump_buf.head);
+}
+
+static bool
+service_field_wanted(struct blob_attr *fields, const char *name)
+{
+	struct blob_attr *cur;
+	int rem;
+
+	blobmsg_for_each_attr(cur, fields, rem)
+		if (blobmsg_type(cur) == BLOBMSG_TYPE_STRING &&
+		    !strcmp(blobmsg_get_string(cur), name))
+			return true;
+
+	return false;
+}
+
+/* copy a service dump keeping only the selected per instance fields */
+static void
+service_dump_filter(struct blob_attr *dump, struct blob_attr *fields)
+{
+	struct blob_attr *cur, *in, *f;
+	void *c, *i, *t;
+	int rem, rem2, rem3;
+
+	c = blobmsg_open_table(&b, blobmsg_name(dump));
+	blobmsg_for_each_attr(cur, dump, rem) {
+		if (strcmp(blobmsg_name(cur), "instances")) {
+			if (service_field_wanted(fields, blobmsg_name(cur)))
+				blobmsg_add_blob(&b, cur);
+			continue;
+		}
+
+		i = blobmsg_open_table(&b, "instances");
+		blobmsg_for_each_attr(in, cur, rem2) {
+			t = blobmsg_open_table(&b, blobmsg_name(in));
+			blobmsg_for_each_attr(f, in, rem3)
+				if (service_field_wanted(fields, blobmsg_name(f)))
+					blobmsg_add_blob(&b, f);
+			blobmsg_close_table(&b, t);
+		}
+		blobmsg_close_table(&b, i);
+	}
 	blobmsg_close_table(&b, c);
 }
 
@@ -292,7 +630,9 @@ service_handle_list(struct ubus_context *ctx, struct ubus_object *obj,
 		    struct ubus_request_data *req, const char *method,
 		    struct blob_attr *msg)
 {
+	PROF_SCOPE();
 	struct blob_attr *tb[__SERVICE_LIST_ATTR_MAX];
+	struct blob_attr *fields = NULL, *dump;
 	struct service *s;
 	const char *name = NULL;
 	bool verbose = false;
@@ -303,13 +643,19 @@ service_handle_list(struct ubus_context *ctx, struct ubus_object *obj,
 		verbose = blobmsg_get_bool(tb[SERVICE_LIST_ATTR_VERBOSE]);
 	if (tb[SERVICE_LIST_ATTR_NAME])
 		name = blobmsg_get_string(tb[SERVICE_LIST_ATTR_NAME]);
+	if (tb[SERVICE_LIST_ATTR_FIELDS])
+		fields = tb[SERVICE_LIST_ATTR_FIELDS];
 
 	blob_buf_init(&b, 0);
 	avl_for_each_element(&services, s, avl) {
 		if (name && strcmp(s->name, name) != 0)
 			continue;
 
-		service_dump(s, verbose);
+		dump = service_dump_cached(s, verbose);
+		if (fields)
+			service_dump_filter(dump, fields);
+		else
+			blobmsg_add_blob(&b, dump);
 	}
 
 	ubus_send_reply(ctx, req, b.head);
@@ -317,11 +663,18 @@ service_handle_list(struct ubus_context *ctx, struct ubus_object *obj,
 	return 0;
 }
 
+void
+service_changed(struct service *s)
+{
+	s->gen++;
+}
+
 static int
 service_handle_delete(struct ubus_context *ctx, struct ubus_object *obj,
 		    struct ubus_request_data *req, const char *method,
 		    struct blob_attr *msg)
 {
+	PROF_SCOPE();
 	struct blob_attr *tb[__SERVICE_DEL_ATTR_MAX], *cur;
 	struct service *s;
 	struct service_instance *in;
@@ -358,6 +711,7 @@ service_handle_update(struct ubus_context *ctx, struct ubus_object *obj,
 		      struct ubus_request_data *req, const char *method,
 		      struct blob_attr *msg)
 {
+	PROF_SCOPE();
 	struct blob_attr *tb[__SERVICE_ATTR_MAX], *cur;
 	struct service *s;
 
@@ -384,6 +738,7 @@ service_handle_event(struct ubus_context *ctx, struct ubus_object *obj,
 			struct ubus_request_data *req, const char *method,
 			struct blob_attr *msg)
 {
+	PROF_SCOPE();
 	struct blob_attr *tb[__EVENT_MAX];
 
 	if (!msg)
@@ -403,6 +758,7 @@ service_handle_validate(struct ubus_context *ctx, struct ubus_object *obj,
 			struct ubus_request_data *req, const char *method,
 			struct blob_attr *msg)
 {
+	PROF_SCOPE();
 	struct blob_attr *tb[__VALIDATE_MAX];
 	char *p = NULL, *t = NULL;
 
@@ -426,11 +782,192 @@ service_handle_validate(struct ubus_context *ctx, struct ubus_object *obj,
 	return 0;
 }
 
+/*
+ * get_data index: every data blob of a live instance is kept in data_index,
+ * keyed by its type (the blob name). Replies to queries that only give a
+ * type are cached until any data changes, at most DATA_REPLIES_MAX types.
+ */
+#define DATA_REPLIES_MAX	16
+
+struct data_entry {
+	struct avl_node avl;
+	struct list_head list;
+	struct service_instance *in;
+	struct blob_attr *data;
+};
+
+struct data_reply {
+	struct avl_node avl;
+	struct blob_attr *reply;
+};
+
+static struct avl_tree data_index;
+static struct avl_tree data_replies;
+
+static void
+data_replies_flush(void)
+{
+	struct data_reply *r, *tmp;
+
+	avl_remove_all_elements(&data_replies, r, avl, tmp) {
+		free(r->reply);
+		free(r);
+	}
+}
+
+void
+service_data_unindex(struct service_instance *in)
+{
+	struct data_entry *e, *tmp;
+
+	if (list_empty(&in->data_entries))
+		return;
+
+	list_for_each_entry_safe(e, tmp, &in->data_entries, list) {
+		avl_delete(&data_index, &e->avl);
+		list_del(&e->list);
+		free(e);
+	}
+	data_replies_flush();
+}
+
+void
+service_data_index(struct service_instance *in)
+{
+	struct blobmsg_list_node *var;
+	struct data_entry *e;
+
+	service_data_unindex(in);
+	if (!in->valid)
+		return;
+
+	blobmsg_list_for_each(&in->data, var) {
+		e = calloc(1, sizeof(*e));
+		if (!e)
+			break;
+
+		e->in = in;
+		e->data = var->data;
+		e->avl.key = blobmsg_name(var->data);
+		avl_insert(&data_index, &e->avl);
+		list_add_tail(&e->list, &in->data_entries);
+	}
+	if (!list_empty(&in->data_entries))
+		data_replies_flush();
+}
+
+static int
+data_entry_cmp(const void *a, const void *b)
+{
+	const struct data_entry *e1 = *(const struct data_entry **) a;
+	const struct data_entry *e2 = *(const struct data_entry **) b;
+	int ret;
+
+	ret = strcmp(e1->in->srv->name, e2->in->srv->name);
+	if (!ret)
+		ret = strcmp(e1->in->name, e2->in->name);
+
+	return ret;
+}
+
+/* the matches of one type, grouped by service and instance */
+static void
+service_get_data_typed(const char *name, const char *instance, const char *type)
+{
+	struct data_entry *e, *first, *last, **match;
+	struct service_instance *in = NULL;
+	struct service *s = NULL;
+	void *cs = NULL, *ci = NULL;
+	int i, n = 0;
+
+	first = avl_find_element(&data_index, type, first, avl);
+	if (!first)
+		return;
+
+	last = first;
+	avl_for_element_to_last(&data_index, first, e, avl) {
+		if (strcmp(e->avl.key, type))
+			break;
+		last = e;
+		n++;
+	}
+
+	match = alloca(n * sizeof(*match));
+	n = 0;
+	avl_for_element_range(first, last, e, avl) {
+		if (name && strcmp(name, e->in->srv->name))
+			continue;
+		if (instance && strcmp(instance, e->in->name))
+			continue;
+		match[n++] = e;
+	}
+	qsort(match, n, sizeof(*match), data_entry_cmp);
+
+	for (i = 0; i < n; i++) {
+		e = match[i];
+		if (e->in != in && ci) {
+			blobmsg_close_table(&b, ci);
+			ci = NULL;
+		}
+		if (e->in->srv != s && cs) {
+			blobmsg_close_table(&b, cs);
+			cs = NULL;
+		}
+		if (!cs)
+			cs = blobmsg_open_table(&b, e->in->srv->name);
+		if (!ci)
+			ci = blobmsg_open_table(&b, e->in->name);
+		s = e->in->srv;
+		in = e->in;
+
+		blobmsg_add_blob(&b, e->data);
+	}
+
+	if (ci)
+		blobmsg_close_table(&b, ci);
+	if (cs)
+		blobmsg_close_table(&b, cs);
+}
+
+static struct blob_attr *
+service_get_data_cached(const char *type)
+{
+	struct data_reply *r;
+	char *key;
+
+	r = avl_find_element(&data_replies, type, r, avl);
+	if (r)
+		return r->reply;
+
+	blob_buf_init(&b, 0);
+	service_get_data_typed(NULL, NULL, type);
+
+	/* any type can be asked for, not only the indexed ones */
+	if (data_replies.count >= DATA_REPLIES_MAX)
+		data_replies_flush();
+
+	r = calloc_a(sizeof(*r), &key, strlen(type) + 1);
+	if (!r)
+		return b.head;
+
+	r->reply = blob_memdup(b.head);
+	if (!r->reply) {
+		free(r);
+		return b.head;
+	}
+
+	r->avl.key = strcpy(key, type);
+	avl_insert(&data_replies, &r->avl);
+
+	return r->reply;
+}
+
 static int
 service_get_data(struct ubus_context *ctx, struct ubus_object *obj,
 		 struct ubus_request_data *req, const char *method,
 		 struct blob_attr *msg)
 {
+	PROF_SCOPE();
 	struct service_instance *in;
 	struct service *s;
 	struct blob_attr *tb[__DATA_MAX];
@@ -446,7 +983,18 @@ service_get_data(struct ubus_context *ctx, struct ubus_object *obj,
 	if (tb[DATA_TYPE])
 		type = blobmsg_data(tb[DATA_TYPE]);
 
+	if (type && !name && !instance) {
+		ubus_send_reply(ctx, req, service_get_data_cached(type));
+		return 0;
+	}
+
 	blob_buf_init(&b, 0);
+	if (type) {
+		service_get_data_typed(name, instance, type);
+		ubus_send_reply(ctx, req, b.head);
+		return 0;
+	}
+
 	avl_for_each_element(&services, s, avl) {
 		void *cs = NULL;
 
@@ -485,9 +1033,156 @@ service_get_data(struct ubus_context *ctx, struct ubus_object *obj,
 	return 0;
 }
 
+static int
+service_handle_trigger_stats(struct ubus_context *ctx, struct ubus_object *obj,
+			     struct ubus_request_data *req, const char *method,
+			     struct blob_attr *msg)
+{
+	PROF_SCOPE();
+	blob_buf_init(&b, 0);
+	trigger_dump_stats(&b);
+	ubus_send_reply(ctx, req, b.head);
+
+	return 0;
+}
+
+static int
+service_handle_metrics(struct ubus_context *ctx, struct ubus_object *obj,
+		       struct ubus_request_data *req, const char *method,
+		       struct blob_attr *msg)
+{
+	PROF_SCOPE();
+	struct blob_attr *tb[__SERVICE_ATTR_MAX];
+	struct service_instance *in;
+	struct service *s;
+	const char *name = NULL;
+	void *c, *i;
+
+	blobmsg_parse(service_attrs, __SERVICE_ATTR_MAX, tb, blob_data(msg), blob_len(msg));
+	if (tb[SERVICE_ATTR_NAME])
+		name = blobmsg_get_string(tb[SERVICE_ATTR_NAME]);
+
+	blob_buf_init(&b, 0);
+	avl_for_each_element(&services, s, avl) {
+		if (name && strcmp(s->name, name))
+			continue;
+
+		c = blobmsg_open_table(&b, s->name);
+		i = blobmsg_open_table(&b, "instances");
+		vlist_for_each_element(&s->instances, in, node)
+			instance_dump_metrics(&b, in);
+		blobmsg_close_table(&b, i);
+		blobmsg_close_table(&b, c);
+	}
+	ubus_send_reply(ctx, req, b.head);
+
+	return 0;
+}
+
+/*
+ * The buffered output of the instances of a service, a client tails it by
+ * passing the "next" sequence number of the previous reply as "since".
+ */
+static int
+service_handle_log(struct ubus_context *ctx, struct ubus_object *obj,
+		   struct ubus_request_data *req, const char *method,
+		   struct blob_attr *msg)
+{
+	PROF_SCOPE();
+	struct blob_attr *tb[__SERVICE_LOG_MAX];
+	struct service_instance *in;
+	struct service *s;
+	const char *instance = NULL;
+	uint32_t since = 0, lines = 0;
+	void *c, *i, *l;
+
+	blobmsg_parse(service_log_attrs, __SERVICE_LOG_MAX, tb, blob_data(msg), blob_len(msg));
+	if (!tb[SERVICE_LOG_NAME])
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	s = avl_find_element(&services, blobmsg_get_string(tb[SERVICE_LOG_NAME]), s, avl);
+	if (!s)
+		return UBUS_STATUS_NOT_FOUND;
+
+	if (tb[SERVICE_LOG_INSTANCE])
+		instance = blobmsg_get_string(tb[SERVICE_LOG_INSTANCE]);
+	if (tb[SERVICE_LOG_SINCE])
+		since = blobmsg_get_u32(tb[SERVICE_LOG_SINCE]);
+	if (tb[SERVICE_LOG_LINES])
+		lines = blobmsg_get_u32(tb[SERVICE_LOG_LINES]);
+
+	blob_buf_init(&b, 0);
+	c = blobmsg_open_table(&b, s->name);
+	i = blobmsg_open_table(&b, "instances");
+	vlist_for_each_element(&s->instances, in, node) {
+		if (instance && strcmp(in->name, instance))
+			continue;
+		if (!in->logbuf.size)
+			continue;
+
+		l = blobmsg_open_table(&b, in->name);
+		logbuf_dump(&b, &in->logbuf, tb[SERVICE_LOG_SINCE] ? &since : NULL, lines);
+		blobmsg_close_table(&b, l);
+	}
+	blobmsg_close_table(&b, i);
+	blobmsg_close_table(&b, c);
+	ubus_send_reply(ctx, req, b.head);
+
+	return 0;
+}
+
+static int
+service_handle_events(struct ubus_context *ctx, struct ubus_object *obj,
+		      struct ubus_request_data *req, const char *method,
+		      struct blob_attr *msg)
+{
+	PROF_SCOPE();
+	struct blob_attr *tb[__EVENTS_MAX];
+	uint32_t since = 0, first, seq;
+	void *a;
+
+	blobmsg_parse(events_attrs, __EVENTS_MAX, tb, blob_data(msg), blob_len(msg));
+	if (tb[EVENTS_SINCE])
+		since = blobmsg_get_u32(tb[EVENTS_SINCE]);
+
+	first = journal_seq > JOURNAL_SIZE ? journal_seq - JOURNAL_SIZE + 1 : 1;
+	if (since > journal_seq)
+		since = journal_seq;
+
+	blob_buf_init(&b, 0);
+	blobmsg_add_u32(&b, "seq", journal_seq);
+	blobmsg_add_u32(&b, "first", first);
+	/* caller fell behind and missed some events, it should resync */
+	if (tb[EVENTS_SINCE] && journal_seq && since + 1 < first)
+		blobmsg_add_u8(&b, "lost", true);
+
+	a = blobmsg_open_array(&b, "events");
+	for (seq = since + 1 > first ? since + 1 : first; seq && seq <= journal_seq; seq++) {
+		struct journal_entry *e = &journal[seq % JOURNAL_SIZE];
+		void *t;
+
+		t = blobmsg_open_table(&b, NULL);
+		blobmsg_add_u32(&b, "seq", e->seq);
+		blobmsg_add_u32(&b, "time", e->time);
+		blobmsg_add_string(&b, "type", e->type);
+		blobmsg_add_string(&b, "service", e->service);
+		if (e->instance)
+			blobmsg_add_string(&b, "instance", e->instance);
+		if (e->code >= 0)
+			blobmsg_add_u32(&b, "code", e->code);
+		blobmsg_close_table(&b, t);
+	}
+	blobmsg_close_array(&b, a);
+
+	ubus_send_reply(ctx, req, b.head);
+
+	return 0;
+}
+
 static struct ubus_method main_object_methods[] = {
 	UBUS_METHOD("set", service_handle_set, service_set_attrs),
 	UBUS_METHOD("add", service_handle_set, service_set_attrs),
+	UBUS_METHOD("set_many", service_handle_set_many, set_many_attrs),
 	UBUS_METHOD("list", service_handle_list, service_list_attrs),
 	UBUS_METHOD("delete", service_handle_delete, service_del_attrs),
 	UBUS_METHOD("update_start", service_handle_update, service_attrs),
@@ -495,6 +1190,10 @@ static struct ubus_method main_object_methods[] = {
 	UBUS_METHOD("event", service_handle_event, event_policy),
 	UBUS_METHOD("validate", service_handle_validate, validate_policy),
 	UBUS_METHOD("get_data", service_get_data, get_data_policy),
+	UBUS_METHOD_NOARG("trigger_stats", service_handle_trigger_stats),
+	UBUS_METHOD("events", service_handle_events, events_attrs),
+	UBUS_METHOD("metrics", service_handle_metrics, service_attrs),
+	UBUS_METHOD("log", service_handle_log, service_log_attrs),
 };
 
 static struct ubus_object_type main_object_type =
@@ -535,11 +1234,78 @@ service_start_early(char *name, char *cmdline)
 	return service_handle_set(NULL, NULL, NULL, "add", b.head);
 }
 
+/* type must be a string constant, code < 0 means not applicable */
+void service_journal(const char *type, const char *service, const char *instance, int code)
+{
+	struct journal_entry *e = &journal[++journal_seq % JOURNAL_SIZE];
+
+	free(e->service);
+	free(e->instance);
+
+	e->seq = journal_seq;
+	e->time = time(NULL);
+	e->type = type;
+	e->service = strdup(service);
+	e->instance = instance ? strdup(instance) : NULL;
+	e->code = code;
+}
+
+static struct ubus_object_type events_object_type = {
+	.name = "service.events",
+};
+
+static struct ubus_object events_object = {
+	.name = "service.events",
+	.type = &events_object_type,
+};
+
+static void service_event_flush(struct uloop_timeout *t)
+{
+	uloop_timeout_cancel(&event_batch_timer);
+	if (!event_batch_count)
+		return;
+
+	blobmsg_close_array(&event_batch, event_batch_list);
+	if (ctx)
+		ubus_notify(ctx, &events_object, "events", event_batch.head, -1);
+	event_batch_count = 0;
+}
+
+static void service_event_batch(const char *type, const char *service, const char *instance)
+{
+	void *e;
+
+	if (!event_batch_count) {
+		blob_buf_init(&event_batch, 0);
+		event_batch_list = blobmsg_open_array(&event_batch, "events");
+		event_batch_timer.cb = service_event_flush;
+		uloop_timeout_set(&event_batch_timer, EVENT_BATCH_DELAY);
+	}
+
+	e = blobmsg_open_table(&event_batch, NULL);
+	blobmsg_add_string(&event_batch, "type", type);
+	blobmsg_add_string(&event_batch, "service", service);
+	if (instance)
+		blobmsg_add_string(&event_batch, "instance", instance);
+	blobmsg_close_table(&event_batch, e);
+
+	if (++event_batch_count >= EVENT_BATCH_MAX)
+		service_event_flush(NULL);
+}
+
 void service_event(const char *type, const char *service, const char *instance)
 {
+	service_journal(type, service, instance, -1);
+
 	if (!ctx)
 		return;
 
+	if (events_object.has_subscribers)
+		service_event_batch(type, service, instance);
+
+	if (!main_object.has_subscribers)
+		return;
+
 	blob_buf_init(&b, 0);
 	blobmsg_add_string(&b, "service", service);
 	if (instance)
@@ -551,12 +1317,133 @@ void ubus_init_service(struct ubus_context *_ctx)
 {
 	ctx = _ctx;
 	ubus_add_object(ctx, &main_object);
+	ubus_add_object(ctx, &events_object);
+}
+
+void
+service_boot_done(void)
+{
+	instance_boot_done();
+}
+
+/* every service as the set call that creates it, plus the state of its instances */
+void
+service_state_dump(struct blob_buf *b)
+{
+	struct service_instance *in;
+	struct service *s;
+	void *a, *c, *i;
+
+	a = blobmsg_open_array(b, "services");
+	avl_for_each_element(&services, s, avl) {
+		c = blobmsg_open_table(b, NULL);
+		blobmsg_add_string(b, "name", s->name);
+		if (s->start_class != START_DEFAULT)
+			blobmsg_add_string(b, "start_priority", instance_start_class_name(s->start_class));
+		if (s->cgroup)
+			blobmsg_add_blob(b, s->cgroup);
+		if (s->trigger)
+			blobmsg_add_blob(b, s->trigger);
+		if (!list_empty(&s->validators))
+			service_validate_dump_config(b, s);
+
+		i = blobmsg_open_table(b, "instances");
+		vlist_for_each_element(&s->instances, in, node)
+			blobmsg_add_blob(b, in->config);
+		blobmsg_close_table(b, i);
+
+		i = blobmsg_open_table(b, "state");
+		vlist_for_each_element(&s->instances, in, node)
+			instance_state_dump(b, in);
+		blobmsg_close_table(b, i);
+		blobmsg_close_table(b, c);
+	}
+	blobmsg_close_array(b, a);
+}
+
+/*
+ * Recreates the services of service_state_dump(), the instances adopt the
+ * processes and fds of the previous procd image instead of being started.
+ * Neither the init scripts nor the triggers are notified.
+ */
+void
+service_state_restore(struct blob_attr *attr)
+{
+	static const struct blobmsg_policy state_attr = { "state", BLOBMSG_TYPE_TABLE };
+	struct blob_attr *tb[__SERVICE_SET_MAX], *cur;
+	int rem;
+
+	restoring = true;
+	blobmsg_for_each_attr(cur, attr, rem) {
+		if (blobmsg_type(cur) != BLOBMSG_TYPE_TABLE)
+			continue;
+
+		blobmsg_parse(&state_attr, 1, &restore_state, blobmsg_data(cur), blobmsg_data_len(cur));
+		blobmsg_parse(service_set_attrs, __SERVICE_SET_MAX, tb, blobmsg_data(cur), blobmsg_data_len(cur));
+		if (service_set(tb, true))
+			ERROR("Failed to restore a service\n");
+	}
+	restoring = false;
+	restore_state = NULL;
+}
+
+/* shutdown: instances of start class stop_class and above being stopped */
+static int stop_class = -1;
+static void (*stop_done)(void);
+
+static bool
+service_stop_pending(void)
+{
+	struct service_instance *in;
+	struct service *s;
+
+	avl_for_each_element(&services, s, avl)
+		vlist_for_each_element(&s->instances, in, node)
+			if (in->proc.pending && instance_start_class(in) >= stop_class)
+				return true;
+
+	return false;
+}
+
+void
+service_stop_check(void)
+{
+	void (*cb)(void) = stop_done;
+
+	if (!cb || service_stop_pending())
+		return;
+
+	stop_done = NULL;
+	cb();
+}
+
+/*
+ * Send SIGTERM to all instances of the given start class or a lower
+ * priority one at once, done is called as soon as the last of them exited.
+ */
+void
+service_stop_all(int class, void (*done)(void))
+{
+	struct service_instance *in;
+	struct service *s;
+
+	stop_class = class;
+	stop_done = done;
+	avl_for_each_element(&services, s, avl)
+		vlist_for_each_element(&s->instances, in, node)
+			if (instance_start_class(in) >= class && !in->halt)
+				instance_stop(in);
+
+	service_stop_check();
 }
 
 void
 service_init(void)
 {
 	avl_init(&services, avl_strcmp, false, NULL);
+	avl_init(&data_index, avl_strcmp, true, NULL);
+	avl_init(&data_replies, avl_strcmp, false, NULL);
 	service_validate_init();
+	pressure_init();
 }
 
@@ -31,6 +31,7 @@ struct validate {
 	struct avl_node avl;
 	struct list_head list;
 
+	/* the avl key is the validator itself, sorted by package and type */
 	char *package;
 	char *type;
 
@@ -42,17 +43,36 @@ struct service {
 	const char *name;
 
 	struct blob_attr *trigger;
+	struct blob_attr *cgroup;
+	int start_class;
 	struct vlist_tree instances;
 	struct list_head validators;
+
+	/* bumped on every state or config change, invalidates dump */
+	uint32_t gen;
+	uint32_t dump_gen;
+	struct blob_attr *dump;
 };
 
+struct service_instance;
+
+void service_data_index(struct service_instance *in);
+void service_data_unindex(struct service_instance *in);
 void service_validate_add(struct service *s, struct blob_attr *attr);
 void service_validate_dump(struct blob_buf *b, struct service *s);
+void service_validate_dump_config(struct blob_buf *b, struct service *s);
 void service_validate_dump_all(struct blob_buf *b, char *p, char *s);
 int service_start_early(char *name, char *cmdline);
 void service_validate_del(struct service *s);
 void service_validate_init(void);
 void service_init(void);
+void service_boot_done(void);
+void service_stop_all(int class, void (*done)(void));
+void service_stop_check(void);
+void service_changed(struct service *s);
+void service_journal(const char *type, const char *service, const char *instance, int code);
 void service_event(const char *type, const char *service, const char *instance);
+void service_state_dump(struct blob_buf *b);
+void service_state_restore(struct blob_attr *attr);
 
 #endif
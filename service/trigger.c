@@ -24,6 +24,7 @@
 #include <libubox/runqueue.h>
 #include <libubox/ustream.h>
 #include <libubox/uloop.h>
+#include <libubox/avl-cmp.h>
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -31,16 +32,35 @@
 #include <libgen.h>
 
 #include "../procd.h"
+#include "../profiler.h"
+#include "../spawn.h"
+#include "../utils/utils.h"
+#include "../utils/slab.h"
+
+/* prefixes of at least this length share the last length counter */
+#define TRIGGER_PREFIX_LEN	64
+
+/* default for how many trigger jobs of different triggers may run at once */
+#define TRIGGER_JOBS		4
 
 struct trigger {
 	struct list_head list;
+	struct avl_node avl;
 
 	char *type;
+	/* type without the wildcard part, key of the avl node */
+	char *match;
+	bool wildcard;
+	unsigned int seq;
+	unsigned int hits;
 
 	int pending;
 	int remove;
 	int timeout;
 
+	/* follow-up run for events that arrived while a job was pending */
+	struct job *next;
+
 	void *id;
 
 	struct blob_attr *rule;
@@ -62,11 +82,37 @@ struct job {
 	struct trigger *trigger;
 	struct blob_attr *exec;
 	struct blob_attr *env;
+
+	uint32_t queued;
+	uint32_t start;
 };
 
 static LIST_HEAD(triggers);
 static struct runqueue q;
 
+static struct {
+	unsigned int queued;
+	uint64_t jobs;
+	uint64_t coalesced;
+	uint64_t wait_total;
+	uint64_t run_total;
+	uint32_t wait_max;
+	uint32_t run_max;
+} stats;
+
+/*
+ * Triggers are indexed by their exact type, or by the prefix in front of
+ * the ".*" for wildcard triggers. An event only needs to look up its type
+ * and those of its prefixes that have a wildcard trigger of that length.
+ */
+static struct avl_tree trigger_exact;
+static struct avl_tree trigger_prefix;
+static int prefix_lens[TRIGGER_PREFIX_LEN + 1];
+static unsigned int trigger_seq;
+
+/* the event being run through the rules, its data is shared by the jobs */
+static struct slab_event *cur_event;
+
 static const char* rule_handle_var(struct json_script_ctx *ctx, const char *name, struct blob_attr *vars)
 {
 	return NULL;
@@ -80,33 +126,97 @@ rule_load_script(struct json_script_ctx *ctx, const char *name)
 	return json_script_file_from_blobmsg(t->type, t->rule, blob_pad_len(t->rule));
 }
 
+static uint32_t trigger_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 static void q_job_run(struct runqueue *q, struct runqueue_task *t)
 {
+	PROF_SCOPE();
 	struct job *j = container_of(t, struct job, proc.task);
+	uint32_t wait;
+
+	j->start = trigger_now();
+	wait = j->start - j->queued;
+	stats.queued--;
+	stats.wait_total += wait;
+	if (wait > stats.wait_max)
+		stats.wait_max = wait;
 
 	DEBUG(4, "handle event %s\n", j->cmd->name);
 	j->cmd->handler(j, j->exec, j->env);
 }
 
+static int trigger_prefix_slot(int len)
+{
+	return len < TRIGGER_PREFIX_LEN ? len : TRIGGER_PREFIX_LEN;
+}
+
+static void job_free(struct job *j)
+{
+	if (!j)
+		return;
+
+	slab_blob_put(j->env);
+	slab_free(j);
+}
+
 static void trigger_free(struct trigger *t)
 {
 	json_script_free(&t->jctx);
 	uloop_timeout_cancel(&t->delay);
-	free(t->data);
+	slab_blob_put(t->data);
+	job_free(t->next);
 	list_del(&t->list);
+	if (t->wildcard) {
+		avl_delete(&trigger_prefix, &t->avl);
+		prefix_lens[trigger_prefix_slot(strlen(t->match))]--;
+	} else {
+		avl_delete(&trigger_exact, &t->avl);
+	}
 	free(t);
 }
 
+static void queue_job(struct job *j)
+{
+	j->queued = trigger_now();
+	j->trigger->pending = 1;
+	stats.queued++;
+	runqueue_task_add(&q, &j->proc.task, false);
+}
+
 static void q_job_complete(struct runqueue *q, struct runqueue_task *p)
 {
+	PROF_SCOPE();
 	struct job *j = container_of(p, struct job, proc.task);
+	struct trigger *t = j->trigger;
+	uint32_t run;
 
-	if (j->trigger->remove) {
-		trigger_free(j->trigger);
+	/* cancelled before it was started */
+	if (!j->start) {
+		stats.queued--;
 	} else {
-		j->trigger->pending = 0;
+		run = trigger_now() - j->start;
+		stats.jobs++;
+		stats.run_total += run;
+		if (run > stats.run_max)
+			stats.run_max = run;
 	}
-	free(j);
+
+	if (t->remove) {
+		trigger_free(t);
+	} else if (t->next) {
+		queue_job(t->next);
+		t->next = NULL;
+	} else {
+		t->pending = 0;
+	}
+	job_free(j);
 }
 
 static void add_job(struct trigger *t, struct cmd *cmd, struct blob_attr *exec, struct blob_attr *data)
@@ -116,57 +226,57 @@ static void add_job(struct trigger *t, struct cmd *cmd, struct blob_attr *exec,
 		.cancel = runqueue_process_cancel_cb,
 		.kill = runqueue_process_kill_cb,
 	};
-	struct blob_attr *d, *e;
-	struct job *j = calloc_a(sizeof(*j), &e, blob_pad_len(exec), &d, blob_pad_len(data));
+	struct job *j = slab_alloc(sizeof(*j) + blob_pad_len(exec));
 
-	j->env = d;
-	j->exec = e;
+	if (!j)
+		return;
+
+	j->env = slab_event_ref(cur_event, data);
+	if (!j->env) {
+		slab_free(j);
+		return;
+	}
+
+	j->exec = (struct blob_attr *) (j + 1);
 	j->cmd = cmd;
 	j->trigger = t;
 	j->proc.task.type = &job_type;
 	j->proc.task.complete = q_job_complete;
-	t->pending = 1;
 
 	memcpy(j->exec, exec, blob_pad_len(exec));
-	memcpy(j->env, data, blob_pad_len(data));
-
-	runqueue_task_add(&q, &j->proc.task, false);
-}
 
-static void _setenv(const char *key, const char *val)
-{
-	char _key[32];
+	/*
+	 * Jobs of the same trigger never run at the same time. Events that
+	 * arrive while one is pending are folded into a single follow-up run
+	 * with the data of the latest one.
+	 */
+	if (t->pending) {
+		if (t->next)
+			stats.coalesced++;
+		job_free(t->next);
+		t->next = j;
+		return;
+	}
 
-	snprintf(_key, sizeof(_key), "PARAM_%s", key);
-	setenv(_key, val, 1);
+	queue_job(j);
 }
 
 static void handle_run_script(struct job *j, struct blob_attr *exec, struct blob_attr *env)
 {
 	char *argv[8];
+	struct spawn_opts o;
 	struct blob_attr *cur;
 	int rem;
 	int i = 0;
 	pid_t pid;
 
-	pid = fork();
-	if (pid < 0)
-		return;
+	spawn_opts_init(&o);
+	if (debug < 3)
+		o.fd[0] = o.fd[1] = o.fd[2] = SPAWN_FD_NULL;
 
-	if (pid) {
-		runqueue_process_add(&q, &j->proc, pid);
-		return;
-	}
-
-	if (debug < 3) {
-		close(STDIN_FILENO);
-		close(STDOUT_FILENO);
-		close(STDERR_FILENO);
-	}
-
-	_setenv("type", j->trigger->type);
+	spawn_env_add(&o.env, "PARAM_", "type", j->trigger->type);
 	blobmsg_for_each_attr(cur, j->env, rem)
-		_setenv(blobmsg_name(cur), blobmsg_data(cur));
+		spawn_env_add(&o.env, "PARAM_", blobmsg_name(cur), blobmsg_data(cur));
 
 	blobmsg_for_each_attr(cur, j->exec, rem) {
 		argv[i] = blobmsg_data(cur);
@@ -174,13 +284,17 @@ static void handle_run_script(struct job *j, struct blob_attr *exec, struct blob
 		if (i == 7)
 			break;
 	}
+	argv[i] = NULL;
+	o.argv = argv;
 
-	if (i > 0) {
-		argv[i] = NULL;
-		execvp(argv[0], &argv[0]);
+	pid = procd_spawn(&o);
+	spawn_opts_free(&o);
+	if (pid < 0) {
+		runqueue_task_complete(&j->proc.task);
+		return;
 	}
 
-	exit(1);
+	runqueue_process_add(&q, &j->proc, pid);
 }
 
 static struct cmd handlers[] = {
@@ -196,9 +310,6 @@ static void rule_handle_command(struct json_script_ctx *ctx, const char *name,
 	struct trigger *t = container_of(ctx, struct trigger, jctx);
 	int i;
 
-	if (t->pending)
-		return;
-
 	for (i = 0; i < ARRAY_SIZE(handlers); i++) {
 		if (!strcmp(handlers[i].name, name)) {
 			add_job(t, &handlers[i], exec, vars);
@@ -219,24 +330,33 @@ static void rule_handle_error(struct json_script_ctx *ctx, const char *msg,
 
 static void q_empty(struct runqueue *q)
 {
+	PROF_SCOPE();
 }
 
 static void trigger_delay_cb(struct uloop_timeout *tout)
 {
 	struct trigger *t = container_of(tout, struct trigger, delay);
+	struct slab_event ev = { .src = t->data, .copy = t->data }, *prev = cur_event;
 
-	json_script_run(&t->jctx, "foo", t->data);
-	free(t->data);
 	t->data = NULL;
+	cur_event = &ev;
+	json_script_run(&t->jctx, "foo", ev.copy);
+	cur_event = prev;
+	slab_event_end(&ev);
 }
 
 static struct trigger* _trigger_add(char *type, struct blob_attr *rule, int timeout, void *id)
 {
-	char *_t;
+	char *_t, *_m, *wildcard = strstr(type, ".*");
 	struct blob_attr *_r;
-	struct trigger *t = calloc_a(sizeof(*t), &_t, strlen(type) + 1, &_r, blob_pad_len(rule));
+	struct trigger *t = calloc_a(sizeof(*t), &_t, strlen(type) + 1, &_r, blob_pad_len(rule),
+		&_m, strlen(type) + 1);
+
+	if (!t)
+		return NULL;
 
 	t->type = _t;
+	t->match = _m;
 	t->rule = _r;
 	t->delay.cb = trigger_delay_cb;
 	t->timeout = timeout;
@@ -251,6 +371,18 @@ static struct trigger* _trigger_add(char *type, struct blob_attr *rule, int time
 	strcpy(t->type, type);
 	memcpy(t->rule, rule, blob_pad_len(rule));
 
+	t->seq = ++trigger_seq;
+	t->avl.key = t->match;
+	if (wildcard) {
+		t->wildcard = true;
+		strncpy(t->match, type, wildcard - type);
+		prefix_lens[trigger_prefix_slot(wildcard - type)]++;
+		avl_insert(&trigger_prefix, &t->avl);
+	} else {
+		strcpy(t->match, type);
+		avl_insert(&trigger_exact, &t->avl);
+	}
+
 	list_add(&t->list, &triggers);
 	json_script_init(&t->jctx);
 
@@ -318,34 +450,168 @@ void trigger_del(void *id)
 
 void trigger_init(void)
 {
+	char line[16];
+
 	runqueue_init(&q);
 	q.empty_cb = q_empty;
-	q.max_running_tasks = 1;
+	q.max_running_tasks = TRIGGER_JOBS;
+	if (get_cmdline_val("procd.trigger_jobs", line, sizeof(line)) && atoi(line) > 0)
+		q.max_running_tasks = atoi(line);
+	avl_init(&trigger_exact, avl_strcmp, true, NULL);
+	avl_init(&trigger_prefix, avl_strcmp, true, NULL);
+}
+
+static int trigger_add_matches(struct avl_tree *tree, const char *key, struct trigger **m, int n)
+{
+	struct trigger *t;
+
+	t = avl_find_ge_element(tree, key, t, avl);
+	if (!t)
+		return n;
+
+	avl_for_element_to_last(tree, t, t, avl) {
+		if (strcmp(t->match, key))
+			break;
+		if (!t->remove)
+			m[n++] = t;
+	}
+
+	return n;
+}
+
+/*
+ * The duplicates of an avl key stay in insertion order, so every bucket is
+ * already sorted by seq. Merge the matches of the next bucket into the
+ * ones collected so far, working from the end so it can be done in place.
+ */
+static int trigger_merge(struct trigger **m, int n, struct trigger **run, int k)
+{
+	int i = n - 1, j = k - 1, w = n + k - 1;
+
+	while (j >= 0) {
+		if (i >= 0 && m[i]->seq > run[j]->seq)
+			m[w--] = m[i--];
+		else
+			m[w--] = run[j--];
+	}
+
+	return n + k;
+}
+
+/* reused by every event, a callback raising another event gets its own */
+static struct trigger **trigger_scratch;
+static int trigger_scratch_size;
+static bool trigger_scratch_busy;
+
+static struct trigger **trigger_scratch_get(int size)
+{
+	struct trigger **m;
+
+	if (trigger_scratch_busy)
+		return calloc(size, sizeof(*m));
+
+	if (size > trigger_scratch_size) {
+		m = realloc(trigger_scratch, size * sizeof(*m));
+		if (!m)
+			return NULL;
+		trigger_scratch = m;
+		trigger_scratch_size = size;
+	}
+
+	trigger_scratch_busy = true;
+	return trigger_scratch;
 }
 
-static bool trigger_match(const char *event, const char *match)
+static void trigger_scratch_put(struct trigger **m)
 {
-	char *wildcard = strstr(match, ".*");
-	if (wildcard)
-		return !strncmp(event, match, wildcard - match);
-	return !strcmp(event, match);
+	if (m == trigger_scratch)
+		trigger_scratch_busy = false;
+	else
+		free(m);
 }
 
 void trigger_event(const char *type, struct blob_attr *data)
+{
+	PROF_SCOPE();
+	int len = strlen(type), count, i, n;
+	struct slab_event ev, *prev;
+	struct trigger **m, **run;
+	char *prefix;
+
+	if (!trigger_exact.count && !trigger_prefix.count)
+		return;
+
+	/* the matches sorted by seq, followed by room for the next bucket */
+	count = trigger_exact.count + trigger_prefix.count;
+	m = trigger_scratch_get(2 * count);
+	if (!m)
+		return;
+
+	run = m + count;
+	prefix = alloca(len + 1);
+
+	n = trigger_add_matches(&trigger_exact, type, m, 0);
+	for (i = 0; i <= len && trigger_prefix.count; i++) {
+		if (!prefix_lens[trigger_prefix_slot(i)])
+			continue;
+
+		memcpy(prefix, type, i);
+		prefix[i] = 0;
+		n = trigger_merge(m, n, run, trigger_add_matches(&trigger_prefix, prefix, run, 0));
+	}
+
+	/* all delayed triggers and jobs of this event hold the same copy */
+	slab_event_begin(&ev, data);
+	prev = cur_event;
+	cur_event = &ev;
+
+	/* newest first, the order of the trigger list */
+	for (i = n - 1; i >= 0; i--) {
+		struct trigger *t = m[i];
+
+		t->hits++;
+		if (t->timeout) {
+			slab_blob_put(t->data);
+			t->data = slab_event_ref(&ev, data);
+			uloop_timeout_set(&t->delay, t->timeout);
+		} else {
+			json_script_run(&t->jctx, "foo", data);
+		}
+	}
+	cur_event = prev;
+	slab_event_end(&ev);
+	trigger_scratch_put(m);
+}
+
+void trigger_dump(struct blob_buf *b, void *id)
 {
 	struct trigger *t;
+	void *a, *c;
 
+	a = blobmsg_open_array(b, "trigger_stats");
 	list_for_each_entry(t, &triggers, list) {
-		if (t->remove)
+		if (t->id != id || t->remove)
 			continue;
-		if (trigger_match(type, t->type)) {
-			if (t->timeout) {
-				free(t->data);
-				t->data = blob_memdup(data);
-				uloop_timeout_set(&t->delay, t->timeout);
-			} else {
-				json_script_run(&t->jctx, "foo", data);
-			}
-		}
+
+		c = blobmsg_open_table(b, NULL);
+		blobmsg_add_string(b, "type", t->type);
+		blobmsg_add_u32(b, "hits", t->hits);
+		blobmsg_close_table(b, c);
+	}
+	blobmsg_close_array(b, a);
+}
+
+void trigger_dump_stats(struct blob_buf *b)
+{
+	blobmsg_add_u32(b, "max_running", q.max_running_tasks);
+	blobmsg_add_u32(b, "running", q.running_tasks);
+	blobmsg_add_u32(b, "queued", stats.queued);
+	blobmsg_add_u64(b, "jobs", stats.jobs);
+	blobmsg_add_u64(b, "coalesced", stats.coalesced);
+	if (stats.jobs) {
+		blobmsg_add_u32(b, "wait_avg", stats.wait_total / stats.jobs);
+		blobmsg_add_u32(b, "run_avg", stats.run_total / stats.jobs);
 	}
+	blobmsg_add_u32(b, "wait_max", stats.wait_max);
+	blobmsg_add_u32(b, "run_max", stats.run_max);
 }
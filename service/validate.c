@@ -13,7 +13,6 @@
 
 #include <libubox/blobmsg_json.h>
 #include <libubox/avl-cmp.h>
-#include <json-c/json.h>
 
 #include "../procd.h"
 
@@ -32,42 +31,156 @@ static const struct blobmsg_policy service_validate_attrs[__SERVICE_VAL_MAX] = {
 	[SERVICE_VAL_DATA] = { "data", BLOBMSG_TYPE_TABLE },
 };
 
+/*
+ * Validators are sorted by (package, type), so a dump emits every
+ * package and type table exactly once, in one pass. Rendered replies are
+ * cached per query until a validator is added or removed, at most
+ * VALIDATE_REPLIES_MAX of them.
+ */
+#define VALIDATE_REPLIES_MAX	16
+
+struct validate_reply {
+	struct avl_node avl;
+	/* NULL if the query did not give it */
+	char *package;
+	char *type;
+	struct blob_attr *reply;
+};
+
 static struct avl_tree validators;
+static struct avl_tree validate_replies;
+static struct blob_buf validate_buf;
 
-void
-service_validate_dump_all(struct blob_buf *b, char *p, char *s)
+static int
+strcmp_null(const char *s1, const char *s2)
 {
-	struct json_object *r = json_object_new_object();
-	struct validate *v;
+	if (!s1 || !s2)
+		return !!s1 - !!s2;
 
-	if (!r)
+	return strcmp(s1, s2);
+}
+
+static int
+validate_reply_cmp(const void *k1, const void *k2, void *ptr)
+{
+	const struct validate_reply *r1 = k1, *r2 = k2;
+	int ret;
+
+	ret = strcmp_null(r1->package, r2->package);
+	if (!ret)
+		ret = strcmp_null(r1->type, r2->type);
+
+	return ret;
+}
+
+static void
+validate_replies_flush(void)
+{
+	struct validate_reply *r, *tmp;
+
+	avl_remove_all_elements(&validate_replies, r, avl, tmp) {
+		free(r->reply);
+		free(r);
+	}
+}
+
+static int
+validate_cmp(const void *k1, const void *k2, void *ptr)
+{
+	const struct validate *v1 = k1, *v2 = k2;
+	int ret;
+
+	ret = strcmp(v1->package, v2->package);
+	if (!ret)
+		ret = strcmp(v1->type, v2->type);
+
+	return ret;
+}
+
+static void
+validate_render(struct blob_buf *b, char *p, char *s)
+{
+	struct validate key = { .package = p ? p : "", .type = s ? s : "" };
+	struct validate *v, *prev = NULL;
+	void *o = NULL, *t = NULL;
+
+	if (p && s)
+		v = avl_find_element(&validators, &key, v, avl);
+	else if (p)
+		v = avl_find_ge_element(&validators, &key, v, avl);
+	else
+		v = avl_first_element(&validators, v, avl);
+
+	if (!v)
 		return;
 
-	avl_for_each_element(&validators, v, avl) {
-		struct json_object *o, *t;
+	avl_for_element_to_last(&validators, v, v, avl) {
 		struct vrule *vr;
 
 		if (p && strcmp(p, v->package))
-			continue;
+			break;
 
 		if (s && strcmp(s, v->type))
 			continue;
 
-		json_object_object_get_ex(r, v->package, &o);
-		if (!o) {
-			o = json_object_new_object();
-			json_object_object_add(r, v->package, o);
-		}
-		json_object_object_get_ex(o, v->type, &t);
-		if (!t) {
-			t = json_object_new_object();
-			json_object_object_add(o, v->type, t);
+		if (prev && strcmp(prev->package, v->package)) {
+			blobmsg_close_table(b, t);
+			blobmsg_close_table(b, o);
+			o = t = NULL;
+		} else if (prev && strcmp(prev->type, v->type)) {
+			blobmsg_close_table(b, t);
+			t = NULL;
 		}
+
+		if (!o)
+			o = blobmsg_open_table(b, v->package);
+		if (!t)
+			t = blobmsg_open_table(b, v->type);
+
 		avl_for_each_element(&v->rules, vr, avl)
-			json_object_object_add(t, vr->option, json_object_new_string(vr->rule));
+			blobmsg_add_string(b, vr->option, vr->rule);
+		prev = v;
 	}
-	blobmsg_add_object(b, r);
-	json_object_put(r);
+
+	if (t)
+		blobmsg_close_table(b, t);
+	if (o)
+		blobmsg_close_table(b, o);
+}
+
+void
+service_validate_dump_all(struct blob_buf *b, char *p, char *s)
+{
+	struct validate_reply key = { .package = p, .type = s }, *r;
+	char *_p, *_s;
+
+	r = avl_find_element(&validate_replies, &key, r, avl);
+	if (r) {
+		blob_put_raw(b, blob_data(r->reply), blob_len(r->reply));
+		return;
+	}
+
+	blob_buf_init(&validate_buf, 0);
+	validate_render(&validate_buf, p, s);
+	blob_put_raw(b, blob_data(validate_buf.head), blob_len(validate_buf.head));
+
+	if (validate_replies.count >= VALIDATE_REPLIES_MAX)
+		validate_replies_flush();
+
+	r = calloc_a(sizeof(*r), &_p, p ? strlen(p) + 1 : 0, &_s, s ? strlen(s) + 1 : 0);
+	if (!r)
+		return;
+
+	r->reply = blob_memdup(validate_buf.head);
+	if (!r->reply) {
+		free(r);
+		return;
+	}
+
+	r->package = p ? strcpy(_p, p) : NULL;
+	r->type = s ? strcpy(_s, s) : NULL;
+	r->avl.key = r;
+	avl_insert(&validate_replies, &r->avl);
 }
 
 void
@@ -91,6 +204,28 @@ service_validate_dump(struct blob_buf *b, struct service *s)
 	blobmsg_close_array(b, i);
 }
 
+/* in the format of the "validate" attribute of a service set call */
+void
+service_validate_dump_config(struct blob_buf *b, struct service *s)
+{
+	struct validate *v;
+	void *i = blobmsg_open_array(b, "validate");
+
+	list_for_each_entry(v, &s->validators, list) {
+		struct vrule *vr;
+		void *k, *j = blobmsg_open_table(b, NULL);
+
+		blobmsg_add_string(b, "package", v->package);
+		blobmsg_add_string(b, "type", v->type);
+		k = blobmsg_open_table(b, "data");
+		avl_for_each_element(&v->rules, vr, avl)
+			blobmsg_add_string(b, vr->option, vr->rule);
+		blobmsg_close_table(b, k);
+		blobmsg_close_table(b, j);
+	}
+	blobmsg_close_array(b, i);
+}
+
 void
 service_validate_del(struct service *s)
 {
@@ -109,6 +244,7 @@ service_validate_del(struct service *s)
 		list_del(&v->list);
 		free(v);
 	}
+	validate_replies_flush();
 }
 
 void
@@ -130,16 +266,18 @@ service_validate_add(struct service *s, struct blob_attr *msg)
 		return;
 
 	v->type = type;
-	v->avl.key = v->package = package;
+	v->package = package;
+	v->avl.key = v;
 	strcpy(v->package, blobmsg_get_string(tb[SERVICE_VAL_PACKAGE]));
 	strcpy(v->type, blobmsg_get_string(tb[SERVICE_VAL_TYPE]));
 
-	list_add(&v->list, &s->validators);
 	if (avl_insert(&validators, &v->avl)) {
 		free(v);
 		return;
 	}
+	list_add(&v->list, &s->validators);
 	avl_init(&v->rules, avl_strcmp, false, NULL);
+	validate_replies_flush();
 
 	blobmsg_for_each_attr(cur, tb[SERVICE_VAL_DATA], rem) {
 		char *option;
@@ -159,5 +297,6 @@ service_validate_add(struct service *s, struct blob_attr *msg)
 void
 service_validate_init(void)
 {
-	avl_init(&validators, avl_strcmp, true, NULL);
+	avl_init(&validators, validate_cmp, true, NULL);
+	avl_init(&validate_replies, validate_reply_cmp, false, NULL);
 }
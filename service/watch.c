@@ -19,6 +19,12 @@
 
 #include "../procd.h"
 
+/*
+ * Watched object names are hashed into WATCH_HASH_SIZE chains, an
+ * ubus.object.add event only has to look at the chain of its path.
+ */
+#define WATCH_HASH_SIZE		64
+
 struct watch_object {
 	struct list_head list;
 
@@ -28,40 +34,90 @@ struct watch_object {
 
 static struct ubus_event_handler watch_event;
 static struct ubus_subscriber watch_subscribe;
-static LIST_HEAD(watch_objects);
+static struct list_head watch_objects[WATCH_HASH_SIZE];
+static struct ubus_context *watch_ctx;
+
+static struct list_head *
+watch_hash(const char *name)
+{
+	unsigned int h = 5381;
+	int i;
+
+	if (!watch_objects[0].next)
+		for (i = 0; i < WATCH_HASH_SIZE; i++)
+			INIT_LIST_HEAD(&watch_objects[i]);
+
+	while (*name)
+		h = h * 33 + *name++;
+
+	return &watch_objects[h % WATCH_HASH_SIZE];
+}
+
+static bool
+watch_find(const char *name)
+{
+	struct list_head *head = watch_hash(name);
+	struct watch_object *o;
+
+	list_for_each_entry(o, head, list)
+		if (!strcmp(o->name, name))
+			return true;
+
+	return false;
+}
+
+static void
+watch_subscribe_id(struct ubus_context *ctx, const char *path, uint32_t id)
+{
+	if (ubus_subscribe(ctx, &watch_subscribe, id))
+		ERROR("failed to subscribe %s (%08x)\n", path, id);
+	else
+		DEBUG(3, "subscribed to %s\n", path);
+}
 
 static void watch_subscribe_cb(struct ubus_context *ctx, struct ubus_event_handler *ev,
 		const char *type, struct blob_attr *msg)
 {
-	static const struct blobmsg_policy policy = {
-		"path", BLOBMSG_TYPE_STRING
+	enum {
+		WATCH_ATTR_ID,
+		WATCH_ATTR_PATH,
+		__WATCH_ATTR_MAX
 	};
-	struct watch_object *o;
-	struct blob_attr *attr;
+	static const struct blobmsg_policy policy[__WATCH_ATTR_MAX] = {
+		[WATCH_ATTR_ID] = { "id", BLOBMSG_TYPE_INT32 },
+		[WATCH_ATTR_PATH] = { "path", BLOBMSG_TYPE_STRING },
+	};
+	struct blob_attr *tb[__WATCH_ATTR_MAX];
 	const char *path;
+	uint32_t id;
 
 	DEBUG(3, "ubus event %s\n", type);
 	if (strcmp(type, "ubus.object.add") != 0)
 		return;
 
-	blobmsg_parse(&policy, 1, &attr, blob_data(msg), blob_len(msg));
-	if (!attr)
+	blobmsg_parse(policy, __WATCH_ATTR_MAX, tb, blob_data(msg), blob_len(msg));
+	if (!tb[WATCH_ATTR_PATH])
 		return;
 
-	path = blobmsg_data(attr);
+	path = blobmsg_data(tb[WATCH_ATTR_PATH]);
 	DEBUG(3, "ubus path %s\n", path);
 
-	list_for_each_entry(o, &watch_objects, list) {
-		unsigned int id;
+	if (!watch_find(path))
+		return;
 
-		if (strcmp(o->name, path))
-			continue;
-		if (ubus_lookup_id(ctx, path, &id))
-			continue;
-		if (!ubus_subscribe(ctx, &watch_subscribe, id))
-			return;
-		ERROR("failed to subscribe %d\n", id);
-	}
+	if (tb[WATCH_ATTR_ID])
+		id = blobmsg_get_u32(tb[WATCH_ATTR_ID]);
+	else if (ubus_lookup_id(ctx, path, &id))
+		return;
+
+	watch_subscribe_id(ctx, path, id);
+}
+
+static void
+watch_lookup_cb(struct ubus_context *ctx, struct ubus_object_data *obj, void *priv)
+{
+	if (watch_find(obj->path))
+		watch_subscribe_id(ctx, obj->path, obj->id);
 }
 
 void
@@ -70,23 +126,39 @@ watch_add(const char *_name, void *id)
 	int len = strlen(_name);
 	char *name;
 	struct watch_object *o = calloc_a(sizeof(*o), &name, len + 1);
+	bool known;
+	uint32_t obj;
+
+	if (!o)
+		return;
 
+	known = watch_find(_name);
 	o->name = name;
 	strcpy(name, _name);
 	o->id = id;
-	list_add(&o->list, &watch_objects);
+	list_add(&o->list, watch_hash(name));
+
+	/* the object may already be there, the add event will not come again */
+	if (!known && watch_ctx && !ubus_lookup_id(watch_ctx, name, &obj))
+		watch_subscribe_id(watch_ctx, name, obj);
 }
 
 void
 watch_del(void *id)
 {
 	struct watch_object *t, *n;
-
-	list_for_each_entry_safe(t, n, &watch_objects, list) {
-		if (t->id != id)
-			continue;
-		list_del(&t->list);
-		free(t);
+	int i;
+
+	for (i = 0; i < WATCH_HASH_SIZE; i++) {
+		if (!watch_objects[i].next)
+			break;
+
+		list_for_each_entry_safe(t, n, &watch_objects[i], list) {
+			if (t->id != id)
+				continue;
+			list_del(&t->list);
+			free(t);
+		}
 	}
 }
 
@@ -116,4 +188,9 @@ watch_ubus(struct ubus_context *ctx)
 		ERROR("failed to register ubus subscriber\n");
 	if (ubus_register_event_handler(ctx, &watch_event, "ubus.object.add"))
 		ERROR("failed to add ubus event handler\n");
+
+	/* subscribe to everything that was watched before we (re)connected */
+	watch_ctx = ctx;
+	if (ubus_lookup(ctx, NULL, watch_lookup_cb, NULL))
+		ERROR("failed to look up ubus objects\n");
 }
@@ -0,0 +1,424 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "procd.h"
+#include "spawn.h"
+#include "libc-compat.h"
+
+#define SPAWN_STACK_SIZE	(32 * 1024)
+
+#ifndef IOPRIO_WHO_PROCESS
+#define IOPRIO_WHO_PROCESS	1
+#endif
+
+extern char **environ;
+
+struct spawn_ctx {
+	struct spawn_opts *o;
+	char **envp;
+	sigset_t sigmask;
+	volatile int err;
+
+	/* CLOEXEC status pipe, only used when falling back to fork */
+	int status_fd;
+
+	/* "LISTEN_PID=" entry of envp, the child fills in its own pid */
+	char *listen_pid;
+};
+
+/*
+ * The child shares the memory of procd until it calls exec, so it must not
+ * allocate memory or write to anything but its own stack and ctx->err.
+ * procd is blocked in clone() until then, which also allows a single stack.
+ */
+static char spawn_stack[SPAWN_STACK_SIZE] __attribute__((aligned(16)));
+
+void spawn_opts_init(struct spawn_opts *o)
+{
+	memset(o, 0, sizeof(*o));
+	o->fd[0] = o->fd[1] = o->fd[2] = SPAWN_FD_INHERIT;
+	o->cgroup_fd = -1;
+	o->sched_policy = -1;
+	o->ioprio = -1;
+}
+
+void spawn_opts_free(struct spawn_opts *o)
+{
+	int i;
+
+	for (i = 0; i < o->env.n_env; i++)
+		free(o->env.env[i]);
+	free(o->env.env);
+	o->env.env = NULL;
+	o->env.n_env = 0;
+}
+
+int spawn_env_add(struct spawn_env *e, const char *prefix, const char *name, const char *val)
+{
+	char **env, *str;
+
+	if (asprintf(&str, "%s%s=%s", prefix ? prefix : "", name, val) < 0)
+		return -1;
+
+	env = realloc(e->env, (e->n_env + 2) * sizeof(*env));
+	if (!env) {
+		free(str);
+		return -1;
+	}
+
+	env[e->n_env++] = str;
+	env[e->n_env] = NULL;
+	e->env = env;
+
+	return 0;
+}
+
+int spawn_limit_add(struct spawn_opts *o, int resource, const struct rlimit *rlim)
+{
+	if (o->n_limits >= SPAWN_MAX_LIMITS)
+		return -1;
+
+	o->limits[o->n_limits].resource = resource;
+	o->limits[o->n_limits].rlim = *rlim;
+	o->n_limits++;
+
+	return 0;
+}
+
+static bool env_overridden(struct spawn_env *e, const char *var)
+{
+	int len = strcspn(var, "=");
+	int i;
+
+	for (i = 0; i < e->n_env; i++)
+		if (!strncmp(e->env[i], var, len) && e->env[i][len] == '=')
+			return true;
+
+	return false;
+}
+
+static char **spawn_build_env(struct spawn_env *e)
+{
+	char **envp;
+	int i, n = 0;
+
+	if (!e->n_env)
+		return environ;
+
+	for (i = 0; environ[i]; i++)
+		;
+
+	envp = calloc(i + e->n_env + 1, sizeof(*envp));
+	if (!envp)
+		return NULL;
+
+	for (i = 0; environ[i]; i++)
+		if (!env_overridden(e, environ[i]))
+			envp[n++] = environ[i];
+
+	for (i = 0; i < e->n_env; i++)
+		envp[n++] = e->env[i];
+
+	return envp;
+}
+
+/*
+ * Move the listening sockets to 3 .. 3 + n - 1 without clobbering each
+ * other, the copies above that range are close-on-exec, or closed by
+ * spawn_close_fds() without an exec.
+ */
+static void spawn_listen_fds(struct spawn_ctx *ctx)
+{
+	struct spawn_opts *o = ctx->o;
+	int top = SPAWN_LISTEN_FDS_START + o->n_listen_fds;
+	int tmp[o->n_listen_fds];
+	int i;
+
+	for (i = 0; i < o->n_listen_fds; i++)
+		tmp[i] = fcntl(o->listen_fds[i], F_DUPFD_CLOEXEC, top);
+
+	for (i = 0; i < o->n_listen_fds; i++)
+		if (tmp[i] >= 0)
+			dup2(tmp[i], SPAWN_LISTEN_FDS_START + i);
+
+	if (ctx->listen_pid)
+		snprintf(ctx->listen_pid, sizeof("LISTEN_PID=") + 10, "LISTEN_PID=%d", getpid());
+}
+
+static bool spawn_fd_kept(struct spawn_opts *o, int fd)
+{
+	int i;
+
+	if (fd < SPAWN_LISTEN_FDS_START + o->n_listen_fds)
+		return true;
+
+	for (i = 0; i < o->n_keep_fds; i++)
+		if (o->keep_fds[i] == fd)
+			return true;
+
+	return false;
+}
+
+/*
+ * A launched child never execs, so CLOEXEC does not fire. Everything of
+ * procd it would otherwise hold for as long as it lives is closed here:
+ * ubus, the uevent socket, the watchdog and the sockets and pipes of the
+ * other instances.
+ */
+static void spawn_close_fds(struct spawn_opts *o)
+{
+	struct dirent *e;
+	DIR *dir;
+	int fd;
+
+	dir = opendir("/proc/self/fd");
+	if (!dir)
+		return;
+
+	while ((e = readdir(dir)) != NULL) {
+		if (e->d_name[0] < '0' || e->d_name[0] > '9')
+			continue;
+
+		fd = atoi(e->d_name);
+		if (fd != dirfd(dir) && !spawn_fd_kept(o, fd))
+			close(fd);
+	}
+	closedir(dir);
+}
+
+static int spawn_child(void *arg)
+{
+	struct spawn_ctx *ctx = arg;
+	struct spawn_opts *o = ctx->o;
+	struct sigaction sa = { .sa_handler = SIG_DFL };
+	struct sigaction old;
+	int fd[3], i, null = -1;
+
+	/*
+	 * the fds and timers of procd are not ours to poll. Before any fd is
+	 * set up, uloop closes its own by number and those may be in 0 .. 3 + n.
+	 */
+	if (o->launch)
+		uloop_done();
+
+	/* the handlers of procd must not run in here */
+	for (i = 1; i < _NSIG; i++)
+		if (!sigaction(i, NULL, &old) && old.sa_handler != SIG_IGN)
+			sigaction(i, &sa, NULL);
+
+	/* "0" moves the writer, so everything it execs starts in the group */
+	if (o->cgroup_fd >= 0)
+		ignore(write(o->cgroup_fd, "0", 1));
+
+	if (o->setsid)
+		setsid();
+
+	memcpy(fd, o->fd, sizeof(fd));
+	if (o->tty) {
+		int tty = open(o->tty, O_RDWR);
+
+		if (tty >= 0)
+			fd[0] = fd[1] = fd[2] = tty;
+	}
+
+	for (i = 0; i < 3; i++) {
+		if (fd[i] == SPAWN_FD_INHERIT)
+			continue;
+
+		if (fd[i] == SPAWN_FD_NULL) {
+			if (null < 0)
+				null = open("/dev/null", O_RDWR);
+			fd[i] = null;
+		}
+
+		if (fd[i] >= 0 && fd[i] != i)
+			dup2(fd[i], i);
+	}
+
+	for (i = 0; i < 3; i++)
+		if (fd[i] > STDERR_FILENO)
+			close(fd[i]);
+	if (null > STDERR_FILENO)
+		close(null);
+
+	if (o->n_listen_fds)
+		spawn_listen_fds(ctx);
+
+	for (i = 0; i < o->n_keep_fds; i++)
+		fcntl(o->keep_fds[i], F_SETFD, 0);
+
+	if (o->setsid && (o->tty || o->ctty)) {
+		ioctl(STDIN_FILENO, TIOCSCTTY, 1);
+		tcsetpgrp(STDIN_FILENO, getpid());
+	}
+
+	if (o->nice)
+		setpriority(PRIO_PROCESS, 0, o->nice);
+
+	if (o->affinity)
+		sched_setaffinity(0, o->affinity_size, o->affinity);
+
+	if (o->sched_policy >= 0) {
+		struct sched_param param = { .sched_priority = o->sched_priority };
+
+		sched_setscheduler(0, o->sched_policy, &param);
+	}
+
+	if (o->ioprio >= 0)
+		syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, o->ioprio);
+
+	for (i = 0; i < o->n_limits; i++)
+		setrlimit(o->limits[i].resource, &o->limits[i].rlim);
+
+	if (o->gid && setgid(o->gid))
+		goto error;
+	if (o->uid && setuid(o->uid))
+		goto error;
+
+	sigprocmask(SIG_SETMASK, &ctx->sigmask, NULL);
+
+	if (o->launch) {
+		spawn_close_fds(o);
+		environ = ctx->envp;
+		_exit(o->launch(o->argv));
+	}
+
+	execvpe(o->argv[0], o->argv, ctx->envp);
+
+error:
+	ctx->err = errno;
+	if (ctx->status_fd >= 0)
+		ignore(write(ctx->status_fd, (const void *) &ctx->err, sizeof(int)));
+	_exit(127);
+}
+
+static uint64_t spawn_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * fork() returns before the child execs, wait for the status pipe to be
+ * closed by exec or for the errno of the failed exec.
+ */
+static pid_t spawn_fork(struct spawn_ctx *ctx)
+{
+	int status[2], err, len;
+	pid_t pid;
+
+	if (pipe2(status, O_CLOEXEC))
+		status[0] = status[1] = -1;
+
+	ctx->status_fd = status[1];
+	pid = fork();
+	if (!pid)
+		spawn_child(ctx);
+
+	if (status[0] < 0)
+		return pid;
+
+	close(status[1]);
+	if (pid > 0) {
+		do {
+			len = read(status[0], &err, sizeof(err));
+		} while (len < 0 && errno == EINTR);
+
+		if (len == sizeof(err))
+			ctx->err = err;
+	}
+	close(status[0]);
+
+	return pid;
+}
+
+/*
+ * Start a child described by o, using clone(CLONE_VM | CLONE_VFORK), so no
+ * page tables need to be copied. Returns the pid, or -1 with errno set if
+ * the child could not be created or failed to exec. The failed child is
+ * reaped here.
+ */
+pid_t procd_spawn(struct spawn_opts *o)
+{
+	struct spawn_ctx ctx = { .o = o, .status_fd = -1 };
+	uint64_t start;
+	sigset_t all;
+	pid_t pid;
+
+	if (!o->argv || !o->argv[0])
+		return -1;
+
+	if (o->n_listen_fds) {
+		char n[8];
+
+		snprintf(n, sizeof(n), "%d", o->n_listen_fds);
+		if (spawn_env_add(&o->env, NULL, "LISTEN_FDS", n) ||
+		    spawn_env_add(&o->env, NULL, "LISTEN_PID", "0000000000"))
+			return -1;
+		ctx.listen_pid = o->env.env[o->env.n_env - 1];
+	}
+
+	ctx.envp = spawn_build_env(&o->env);
+	if (!ctx.envp)
+		return -1;
+
+	sigfillset(&all);
+	sigprocmask(SIG_BLOCK, &all, &ctx.sigmask);
+
+	start = spawn_now_us();
+	if (o->launch) {
+		pid = spawn_fork(&ctx);
+	} else {
+		pid = clone(spawn_child, spawn_stack + SPAWN_STACK_SIZE,
+			CLONE_VM | CLONE_VFORK | SIGCHLD, &ctx);
+		if (pid < 0 && (errno == ENOSYS || errno == EINVAL))
+			pid = spawn_fork(&ctx);
+	}
+	o->exec_us = spawn_now_us() - start;
+
+	sigprocmask(SIG_SETMASK, &ctx.sigmask, NULL);
+
+	if (ctx.envp != environ)
+		free(ctx.envp);
+
+	if (pid < 0) {
+		ERROR("Failed to spawn %s: %s\n", o->argv[0], strerror(errno));
+	} else if (ctx.err) {
+		ERROR("Failed to execute %s: %s\n", o->argv[0], strerror(ctx.err));
+		/* the child exited already, or is about to */
+		while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+			;
+		errno = ctx.err;
+		pid = -1;
+	}
+
+	return pid;
+}
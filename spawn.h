@@ -0,0 +1,105 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __PROCD_SPAWN_H
+#define __PROCD_SPAWN_H
+
+#include <sys/types.h>
+#include <sys/resource.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* values for spawn_opts.fd[] besides a real file descriptor */
+#define SPAWN_FD_NULL		-1
+#define SPAWN_FD_INHERIT	-2
+
+#define SPAWN_MAX_LIMITS	16
+#define SPAWN_LISTEN_FDS_START	3
+
+/* see ioprio_set(2) */
+#define SPAWN_IOPRIO_CLASS_SHIFT	13
+#define SPAWN_IOPRIO(class, data)	(((class) << SPAWN_IOPRIO_CLASS_SHIFT) | (data))
+
+struct spawn_limit {
+	int resource;
+	struct rlimit rlim;
+};
+
+struct spawn_env {
+	char **env;
+	int n_env;
+};
+
+/*
+ * Everything that is applied to a child between clone and exec. Use
+ * spawn_opts_init() to get the defaults, which inherit stdio, the
+ * environment and the credentials of procd.
+ */
+struct spawn_opts {
+	char * const *argv;
+
+	/* NAME=value entries added to or replacing the inherited environment */
+	struct spawn_env env;
+
+	/* stdin, stdout and stderr of the child */
+	int fd[3];
+
+	/* start a new session, with tty as stdio and controlling terminal */
+	bool setsid;
+	const char *tty;
+	/* make the inherited stdin the controlling terminal when there is no tty */
+	bool ctty;
+
+	int nice;
+	uid_t uid;
+	gid_t gid;
+
+	/* a cpu_set_t for sched_setaffinity(), NULL to inherit */
+	const void *affinity;
+	size_t affinity_size;
+
+	/* SCHED_* policy or -1 to inherit, and an ioprio value or -1 */
+	int sched_policy;
+	int sched_priority;
+	int ioprio;
+
+	struct spawn_limit limits[SPAWN_MAX_LIMITS];
+	int n_limits;
+
+	/* open cgroup.procs the child moves itself into, -1 for none */
+	int cgroup_fd;
+
+	/* passed as fd 3 onwards, with LISTEN_FDS/LISTEN_PID as sd_listen_fds() wants */
+	const int *listen_fds;
+	int n_listen_fds;
+
+	/*
+	 * run in the child instead of exec'ing argv, its return value is the
+	 * exit code. The child is forked then, as it may allocate memory.
+	 */
+	int (*launch)(char * const *argv);
+
+	/* inherited by the child at their current number */
+	const int *keep_fds;
+	int n_keep_fds;
+
+	/* set by procd_spawn(), time from clone to a successful exec */
+	uint32_t exec_us;
+};
+
+void spawn_opts_init(struct spawn_opts *o);
+void spawn_opts_free(struct spawn_opts *o);
+int spawn_env_add(struct spawn_env *e, const char *prefix, const char *name, const char *val);
+int spawn_limit_add(struct spawn_opts *o, int resource, const struct rlimit *rlim);
+pid_t procd_spawn(struct spawn_opts *o);
+
+#endif
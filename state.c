@@ -19,12 +19,17 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <signal.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <dirent.h>
 
 #include "procd.h"
 #include "syslog.h"
 #include "plug/hotplug.h"
 #include "watchdog.h"
 #include "service/service.h"
+#include "service/instance.h"
 #include "utils/utils.h"
 
 enum {
@@ -41,6 +46,139 @@ enum {
 static int state = STATE_NONE;
 static int reboot_event;
 
+/*
+ * Shutdown runs the K* scripts, then stops whatever procd instances are left
+ * in reverse start class order, each class in parallel. Everything has to be
+ * done within the shutdown deadline, after which the remaining processes are
+ * simply killed. Halting only waits as long as processes are still around.
+ */
+#define SHUTDOWN_TIMEOUT	30
+#define HALT_TERM_TIMEOUT	1000
+#define HALT_KILL_TIMEOUT	1000
+#define HALT_POLL		10
+
+static struct uloop_timeout shutdown_timer;
+static int shutdown_class;
+
+static void state_enter(void);
+
+static const char * const state_names[__STATE_MAX] = {
+	[STATE_NONE] = "none",
+	[STATE_EARLY] = "early",
+	[STATE_UBUS] = "ubus",
+	[STATE_INIT] = "init",
+	[STATE_RUNNING] = "running",
+	[STATE_SHUTDOWN] = "shutdown",
+	[STATE_HALT] = "halt",
+};
+
+/* CLOCK_BOOTTIME ms of every state entry and of named points in between */
+#define BOOT_MARKS	16
+
+struct boot_mark {
+	const char *name;
+	uint32_t time;
+};
+
+static uint32_t state_time[__STATE_MAX];
+static struct boot_mark boot_marks[BOOT_MARKS];
+static int n_boot_marks;
+
+static uint32_t boot_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void boot_kmsg(const char *kind, const char *name, uint32_t time)
+{
+	char buf[96];
+	int fd, len;
+
+	fd = open("/dev/kmsg", O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	len = snprintf(buf, sizeof(buf), "<6>procd: boot %s=%s t=%u.%03u\n",
+		       kind, name, time / 1000, time % 1000);
+	if (write(fd, buf, len) < 0)
+		DEBUG(4, "failed to write boot marker\n");
+	close(fd);
+}
+
+/* name must be a string constant */
+void procd_boot_mark(const char *name)
+{
+	uint32_t now = boot_now();
+
+	if (n_boot_marks < BOOT_MARKS) {
+		boot_marks[n_boot_marks].name = name;
+		boot_marks[n_boot_marks].time = now;
+		n_boot_marks++;
+	}
+	boot_kmsg("mark", name, now);
+}
+
+static const char *boot_mark_find(const char *name, uint32_t *time)
+{
+	int i;
+
+	for (i = 0; i < n_boot_marks; i++) {
+		if (strcmp(boot_marks[i].name, name))
+			continue;
+		*time = boot_marks[i].time;
+		return name;
+	}
+
+	return NULL;
+}
+
+static void boot_phase_add(struct blob_buf *b, const char *name, uint32_t start, uint32_t end)
+{
+	if (start && end >= start)
+		blobmsg_add_u32(b, name, end - start);
+}
+
+void procd_state_dump(struct blob_buf *b)
+{
+	uint32_t coldplug = 0, sysinit = 0;
+	void *c;
+	int i;
+
+	blobmsg_add_string(b, "state", state_names[state]);
+
+	c = blobmsg_open_table(b, "states");
+	for (i = STATE_EARLY; i < __STATE_MAX; i++)
+		if (state_time[i])
+			blobmsg_add_u32(b, state_names[i], state_time[i]);
+	blobmsg_close_table(b, c);
+
+	/* durations in ms of the phases on the boot critical path */
+	boot_mark_find("coldplug", &coldplug);
+	boot_mark_find("sysinit", &sysinit);
+	c = blobmsg_open_table(b, "phases");
+	boot_phase_add(b, "early", state_time[STATE_EARLY], coldplug);
+	boot_phase_add(b, "coldplug", coldplug, state_time[STATE_UBUS]);
+	boot_phase_add(b, "ubus_wait", state_time[STATE_UBUS], state_time[STATE_INIT]);
+	boot_phase_add(b, "inittab", state_time[STATE_INIT], sysinit);
+	boot_phase_add(b, "sysinit", sysinit, state_time[STATE_RUNNING]);
+	if (state_time[STATE_RUNNING])
+		blobmsg_add_u32(b, "total", state_time[STATE_RUNNING]);
+	blobmsg_close_table(b, c);
+
+	c = blobmsg_open_array(b, "marks");
+	for (i = 0; i < n_boot_marks; i++) {
+		void *m = blobmsg_open_table(b, NULL);
+
+		blobmsg_add_string(b, "name", boot_marks[i].name);
+		blobmsg_add_u32(b, "time", boot_marks[i].time);
+		blobmsg_close_table(b, m);
+	}
+	blobmsg_close_array(b, c);
+}
+
 static void set_stdio(const char* tty)
 {
 	if (chdir("/dev") ||
@@ -93,15 +231,102 @@ static void set_console(void)
 		set_stdio(tty);
 }
 
+static void shutdown_halt(void)
+{
+	uloop_timeout_cancel(&shutdown_timer);
+	state = STATE_HALT;
+	state_enter();
+}
+
+static void shutdown_timeout_cb(struct uloop_timeout *t)
+{
+	ERROR("Shutdown deadline expired, killing remaining processes\n");
+	shutdown_halt();
+}
+
+static void shutdown_class_done(void)
+{
+	if (shutdown_class > START_CRITICAL) {
+		service_stop_all(--shutdown_class, shutdown_class_done);
+		return;
+	}
+
+	shutdown_halt();
+}
+
+static void shutdown_instances(void)
+{
+	/* services only exist once we got to the ubus state */
+	if (!state_time[STATE_UBUS]) {
+		shutdown_halt();
+		return;
+	}
+
+	LOG("- stopping services -\n");
+	shutdown_class = START_IDLE;
+	service_stop_all(shutdown_class, shutdown_class_done);
+}
+
+static void shutdown_start(void)
+{
+	char line[16];
+	int timeout = SHUTDOWN_TIMEOUT;
+
+	if (get_cmdline_val("procd.shutdown_timeout", line, sizeof(line)) && atoi(line) > 0)
+		timeout = atoi(line);
+
+	shutdown_timer.cb = shutdown_timeout_cb;
+	uloop_timeout_set(&shutdown_timer, timeout * 1000);
+}
+
+/* any process left apart from us, kernel threads and zombies have no exe */
+static bool halt_pending(void)
+{
+	char path[32], exe[8];
+	struct dirent *e;
+	pid_t self = getpid();
+	bool found = false;
+	DIR *dir;
+
+	dir = opendir("/proc");
+	if (!dir)
+		return false;
+
+	while (!found && (e = readdir(dir)) != NULL) {
+		pid_t pid = atoi(e->d_name);
+
+		if (pid <= 1 || pid == self)
+			continue;
+
+		snprintf(path, sizeof(path), "/proc/%d/exe", pid);
+		found = readlink(path, exe, sizeof(exe)) >= 0;
+	}
+	closedir(dir);
+
+	return found;
+}
+
+static void halt_wait(int timeout)
+{
+	uint32_t start = boot_now();
+
+	while (halt_pending() && boot_now() - start < timeout)
+		usleep(HALT_POLL * 1000);
+}
+
 static void state_enter(void)
 {
 	char ubus_cmd[] = "/sbin/ubusd";
 
+	state_time[state] = boot_now();
+	boot_kmsg("state", state_names[state], state_time[state]);
+
 	switch (state) {
 	case STATE_EARLY:
 		LOG("- early -\n");
 		watchdog_init(0);
 		hotplug("/etc/hotplug.json");
+		procd_boot_mark("coldplug");
 		procd_coldplug();
 		break;
 
@@ -121,6 +346,7 @@ static void state_enter(void)
 		procd_inittab_run("respawn");
 		procd_inittab_run("askconsole");
 		procd_inittab_run("askfirst");
+		procd_boot_mark("sysinit");
 		procd_inittab_run("sysinit");
 
 		// switch to syslog log channel
@@ -129,34 +355,36 @@ static void state_enter(void)
 
 	case STATE_RUNNING:
 		LOG("- init complete -\n");
+		service_boot_done();
 		break;
 
 	case STATE_SHUTDOWN:
 		/* Redirect output to the console for the users' benefit */
 		set_console();
 		LOG("- shutdown -\n");
+		shutdown_start();
 		procd_inittab_run("shutdown");
 		sync();
 		break;
 
 	case STATE_HALT:
-		// To prevent killed processes from interrupting the sleep
+		// Let the kernel reap whatever gets killed from now on
 		signal(SIGCHLD, SIG_IGN);
 		LOG("- SIGTERM processes -\n");
 		kill(-1, SIGTERM);
 		sync();
-		sleep(1);
+		halt_wait(HALT_TERM_TIMEOUT);
 		LOG("- SIGKILL processes -\n");
 		kill(-1, SIGKILL);
 		sync();
-		sleep(1);
+		halt_wait(HALT_KILL_TIMEOUT);
 		if (reboot_event == RB_POWER_OFF)
 			LOG("- power down -\n");
 		else
 			LOG("- reboot -\n");
 
-		/* Allow time for last message to reach serial console, etc */
-		sleep(1);
+		/* Make sure the last message reached the serial console */
+		tcdrain(STDERR_FILENO);
 
 		/* We have to fork here, since the kernel calls do_exit(EXIT_SUCCESS)
 		 * in linux/kernel/sys.c, which can cause the machine to panic when
@@ -178,6 +406,12 @@ static void state_enter(void)
 
 void procd_state_next(void)
 {
+	/* the shutdown scripts are done */
+	if (state == STATE_SHUTDOWN) {
+		shutdown_instances();
+		return;
+	}
+
 	DEBUG(4, "Change state %d -> %d\n", state, state + 1);
 	state++;
 	state_enter();
@@ -189,6 +423,37 @@ void procd_state_ubus_connect(void)
 		procd_state_next();
 }
 
+bool procd_state_running(void)
+{
+	return state == STATE_RUNNING;
+}
+
+/*
+ * Picks up the boot timeline of procd_state_dump() after procd_reexec(),
+ * the services are restored at this point already.
+ */
+void procd_state_resume(struct blob_attr *boot)
+{
+	static const struct blobmsg_policy states_attr = { "states", BLOBMSG_TYPE_TABLE };
+	struct blob_attr *states = NULL, *cur;
+	int rem, i;
+
+	if (boot)
+		blobmsg_parse(&states_attr, 1, &states, blobmsg_data(boot), blobmsg_data_len(boot));
+
+	if (states) {
+		blobmsg_for_each_attr(cur, states, rem)
+			for (i = STATE_EARLY; i < __STATE_MAX; i++)
+				if (!strcmp(blobmsg_name(cur), state_names[i]))
+					state_time[i] = blobmsg_get_u32(cur);
+	}
+
+	state = STATE_RUNNING;
+	boot_kmsg("state", "resume", boot_now());
+	LOG("- resume -\n");
+	ulog_open(ULOG_SYSLOG, LOG_DAEMON, "procd");
+}
+
 void procd_shutdown(int event)
 {
 	if (state >= STATE_SHUTDOWN)
@@ -14,10 +14,12 @@
 
 #include <sys/utsname.h>
 #include <sys/sysinfo.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -25,7 +27,11 @@
 #include <libubox/uloop.h>
 
 #include "procd.h"
+#include "profiler.h"
 #include "watchdog.h"
+#include "rcS.h"
+#include "plug/hotplug.h"
+#include "utils/slab.h"
 
 static struct blob_buf b;
 static int notify;
@@ -33,50 +39,71 @@ static struct ubus_context *_ctx;
 
 int upgrade_running = 0;
 
-static int system_board(struct ubus_context *ctx, struct ubus_object *obj,
-                 struct ubus_request_data *req, const char *method,
-                 struct blob_attr *msg)
+/*
+ * Apart from the kernel and the hostname the board reply is static, it is
+ * parsed once and again only after inotify reported a change to one of its
+ * sources. /proc/cpuinfo and the device tree do not change at runtime.
+ */
+static struct blob_buf board;
+static bool board_valid;
+static struct uloop_fd board_inotify = { .fd = -1 };
+static int board_wd_etc = -1;
+static int board_wd_tmp = -1;
+static int board_wd_sysinfo = -1;
+
+/* "system" and the "model" fallback, in one pass over /proc/cpuinfo */
+static void board_cpuinfo(char *system, char *machine, int len)
 {
-	void *c;
 	char line[256];
-	char *key, *val, *next;
-	struct utsname utsname;
+	char *key, *val, *end;
 	FILE *f;
 
-	blob_buf_init(&b, 0);
+	*system = *machine = 0;
+	if ((f = fopen("/proc/cpuinfo", "r")) == NULL)
+		return;
 
-	if (uname(&utsname) >= 0)
+	while ((!*system || !*machine) && fgets(line, sizeof(line), f))
 	{
-		blobmsg_add_string(&b, "kernel", utsname.release);
-		blobmsg_add_string(&b, "hostname", utsname.nodename);
-	}
+		key = strtok(line, "\t:");
+		val = strtok(NULL, "\t\n");
 
-	if ((f = fopen("/proc/cpuinfo", "r")) != NULL)
-	{
-		while(fgets(line, sizeof(line), f))
+		if (!key || !val)
+			continue;
+
+		if (!*system &&
+		    (!strcasecmp(key, "system type") ||
+		     !strcasecmp(key, "processor") ||
+		     !strcasecmp(key, "model name")))
 		{
-			key = strtok(line, "\t:");
-			val = strtok(NULL, "\t\n");
+			strtoul(val + 2, &end, 0);
 
-			if (!key || !val)
-				continue;
+			if (end == (val + 2) || *end != 0)
+				snprintf(system, len, "%s", val + 2);
+		}
+		else if (!*machine &&
+			 (!strcasecmp(key, "machine") ||
+			  !strcasecmp(key, "hardware")))
+		{
+			snprintf(machine, len, "%s", val + 2);
+		}
+	}
 
-			if (!strcasecmp(key, "system type") ||
-			    !strcasecmp(key, "processor") ||
-			    !strcasecmp(key, "model name"))
-			{
-				strtoul(val + 2, &key, 0);
+	fclose(f);
+}
 
-				if (key == (val + 2) || *key != 0)
-				{
-					blobmsg_add_string(&b, "system", val + 2);
-					break;
-				}
-			}
-		}
+static void board_build(void)
+{
+	void *c;
+	char line[256];
+	char system[256], machine[256];
+	char *key, *val, *next;
+	FILE *f;
 
-		fclose(f);
-	}
+	blob_buf_init(&board, 0);
+
+	board_cpuinfo(system, machine, sizeof(system));
+	if (*system)
+		blobmsg_add_string(&board, "system", system);
 
 	if ((f = fopen("/tmp/sysinfo/model", "r")) != NULL ||
 	    (f = fopen("/proc/device-tree/model", "r")) != NULL)
@@ -86,35 +113,19 @@ static int system_board(struct ubus_context *ctx, struct ubus_object *obj,
 			val = strtok(line, "\t\n");
 
 			if (val)
-				blobmsg_add_string(&b, "model", val);
+				blobmsg_add_string(&board, "model", val);
 		}
 
 		fclose(f);
 	}
-	else if ((f = fopen("/proc/cpuinfo", "r")) != NULL)
+	else if (*machine)
 	{
-		while(fgets(line, sizeof(line), f))
-		{
-			key = strtok(line, "\t:");
-			val = strtok(NULL, "\t\n");
-
-			if (!key || !val)
-				continue;
-
-			if (!strcasecmp(key, "machine") ||
-			    !strcasecmp(key, "hardware"))
-			{
-				blobmsg_add_string(&b, "model", val + 2);
-				break;
-			}
-		}
-
-		fclose(f);
+		blobmsg_add_string(&board, "model", machine);
 	}
 
 	if ((f = fopen("/etc/openwrt_release", "r")) != NULL)
 	{
-		c = blobmsg_open_table(&b, "release");
+		c = blobmsg_open_table(&board, "release");
 
 		while (fgets(line, sizeof(line), f))
 		{
@@ -143,7 +154,7 @@ static int system_board(struct ubus_context *ctx, struct ubus_object *obj,
 			else
 				continue;
 
-			dest = blobmsg_alloc_string_buffer(&b, key, strlen(val));
+			dest = blobmsg_alloc_string_buffer(&board, key, strlen(val));
 			if (!dest) {
 				ERROR("Failed to allocate blob.\n");
 				continue;
@@ -169,31 +180,154 @@ static int system_board(struct ubus_context *ctx, struct ubus_object *obj,
 					break;
 				}
 			}
-			blobmsg_add_string_buffer(&b);
+			blobmsg_add_string_buffer(&board);
 		}
 
-		blobmsg_close_array(&b, c);
+		blobmsg_close_array(&board, c);
 
 		fclose(f);
 	}
 
+	board_valid = true;
+}
+
+static void board_watch_sysinfo(void)
+{
+	board_wd_sysinfo = inotify_add_watch(board_inotify.fd, "/tmp/sysinfo",
+		IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_ONLYDIR);
+
+	/* /tmp is only watched until sysinfo shows up */
+	if (board_wd_sysinfo >= 0 && board_wd_tmp >= 0) {
+		inotify_rm_watch(board_inotify.fd, board_wd_tmp);
+		board_wd_tmp = -1;
+	}
+}
+
+static void board_inotify_cb(struct uloop_fd *fd, unsigned int events)
+{
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	int len, i;
+
+	while ((len = read(fd->fd, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < len; i += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *) &buf[i];
+
+			if (ev->wd == board_wd_sysinfo && (ev->mask & IN_IGNORED)) {
+				board_wd_sysinfo = -1;
+				board_valid = false;
+			} else if (ev->wd == board_wd_sysinfo) {
+				if (ev->len && !strcmp(ev->name, "model"))
+					board_valid = false;
+			} else if (ev->wd == board_wd_tmp) {
+				if (ev->len && !strcmp(ev->name, "sysinfo"))
+					board_watch_sysinfo();
+			} else if (ev->wd == board_wd_etc) {
+				if (ev->len && !strcmp(ev->name, "openwrt_release"))
+					board_valid = false;
+			}
+		}
+	}
+
+	if (board_wd_sysinfo < 0 && board_wd_tmp < 0)
+		board_wd_tmp = inotify_add_watch(fd->fd, "/tmp", IN_CREATE | IN_MOVED_TO);
+}
+
+static void board_watch(void)
+{
+	/* ubus reconnects register the object again */
+	if (board_inotify.fd >= 0)
+		return;
+
+	board_inotify.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (board_inotify.fd < 0)
+		return;
+
+	board_wd_etc = inotify_add_watch(board_inotify.fd, "/etc",
+		IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+
+	board_watch_sysinfo();
+	if (board_wd_sysinfo < 0)
+		board_wd_tmp = inotify_add_watch(board_inotify.fd, "/tmp", IN_CREATE | IN_MOVED_TO);
+
+	board_inotify.cb = board_inotify_cb;
+	uloop_fd_add(&board_inotify, ULOOP_READ);
+}
+
+static int system_board(struct ubus_context *ctx, struct ubus_object *obj,
+                 struct ubus_request_data *req, const char *method,
+                 struct blob_attr *msg)
+{
+	PROF_SCOPE();
+	struct utsname utsname;
+
+	/* without inotify every call has to look again */
+	if (!board_valid || board_inotify.fd < 0)
+		board_build();
+
+	blob_buf_init(&b, 0);
+
+	if (uname(&utsname) >= 0)
+	{
+		blobmsg_add_string(&b, "kernel", utsname.release);
+		blobmsg_add_string(&b, "hostname", utsname.nodename);
+	}
+
+	blob_put_raw(&b, blob_data(board.head), blob_len(board.head));
 	ubus_send_reply(ctx, req, b.head);
 
 	return UBUS_STATUS_OK;
 }
 
+/* one read() into a fixed buffer, /proc/meminfo is well below its size */
+static int system_meminfo(uint64_t *available, uint64_t *cached)
+{
+	static char buf[4096];
+	char *line, *next;
+	int fd, len, found = 0;
+
+	fd = open("/proc/meminfo", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buf[len] = 0;
+
+	for (line = buf; line && found < 2; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = 0;
+
+		if (!strncmp(line, "MemAvailable:", 13)) {
+			*available = strtoull(line + 13, NULL, 10) * 1024;
+			found++;
+		} else if (!strncmp(line, "Cached:", 7)) {
+			*cached = strtoull(line + 7, NULL, 10) * 1024;
+			found++;
+		}
+	}
+
+	return found == 2 ? 0 : -1;
+}
+
 static int system_info(struct ubus_context *ctx, struct ubus_object *obj,
                 struct ubus_request_data *req, const char *method,
                 struct blob_attr *msg)
 {
+	PROF_SCOPE();
 	void *c;
 	time_t now;
-	struct tm *tm;
+	struct tm tm;
 	struct sysinfo info;
+	uint64_t available, cached;
 
 	now = time(NULL);
 
-	if (!(tm = localtime(&now)))
+	if (!localtime_r(&now, &tm))
 		return UBUS_STATUS_UNKNOWN_ERROR;
 
 	if (sysinfo(&info))
@@ -202,7 +336,7 @@ static int system_info(struct ubus_context *ctx, struct ubus_object *obj,
 	blob_buf_init(&b, 0);
 
 	blobmsg_add_u32(&b, "uptime",    info.uptime);
-	blobmsg_add_u32(&b, "localtime", mktime(tm));
+	blobmsg_add_u32(&b, "localtime", mktime(&tm));
 
 	c = blobmsg_open_array(&b, "load");
 	blobmsg_add_u32(&b, NULL, info.loads[0]);
@@ -215,6 +349,10 @@ static int system_info(struct ubus_context *ctx, struct ubus_object *obj,
 	blobmsg_add_u64(&b, "free",     info.mem_unit * info.freeram);
 	blobmsg_add_u64(&b, "shared",   info.mem_unit * info.sharedram);
 	blobmsg_add_u64(&b, "buffered", info.mem_unit * info.bufferram);
+	if (!system_meminfo(&available, &cached)) {
+		blobmsg_add_u64(&b, "available", available);
+		blobmsg_add_u64(&b, "cached", cached);
+	}
 	blobmsg_close_table(&b, c);
 
 	c = blobmsg_open_table(&b, "swap");
@@ -231,6 +369,7 @@ static int system_upgrade(struct ubus_context *ctx, struct ubus_object *obj,
 			struct ubus_request_data *req, const char *method,
 			struct blob_attr *msg)
 {
+	PROF_SCOPE();
 	upgrade_running = 1;
 	return 0;
 }
@@ -239,6 +378,7 @@ enum {
 	WDT_FREQUENCY,
 	WDT_TIMEOUT,
 	WDT_STOP,
+	WDT_LAG_LIMIT,
 	__WDT_MAX
 };
 
@@ -246,12 +386,14 @@ static const struct blobmsg_policy watchdog_policy[__WDT_MAX] = {
 	[WDT_FREQUENCY] = { .name = "frequency", .type = BLOBMSG_TYPE_INT32 },
 	[WDT_TIMEOUT] = { .name = "timeout", .type = BLOBMSG_TYPE_INT32 },
 	[WDT_STOP] = { .name = "stop", .type = BLOBMSG_TYPE_BOOL },
+	[WDT_LAG_LIMIT] = { .name = "lag_limit", .type = BLOBMSG_TYPE_INT32 },
 };
 
 static int watchdog_set(struct ubus_context *ctx, struct ubus_object *obj,
 			struct ubus_request_data *req, const char *method,
 			struct blob_attr *msg)
 {
+	PROF_SCOPE();
 	struct blob_attr *tb[__WDT_MAX];
 	const char *status;
 
@@ -282,6 +424,10 @@ static int watchdog_set(struct ubus_context *ctx, struct ubus_object *obj,
 	if (tb[WDT_STOP])
 		watchdog_set_stopped(blobmsg_get_bool(tb[WDT_STOP]));
 
+	/* ms the timer may fire late before a tick is not petted, 0 is off */
+	if (tb[WDT_LAG_LIMIT])
+		watchdog_lag_limit(blobmsg_get_u32(tb[WDT_LAG_LIMIT]));
+
 	if (watchdog_fd() == NULL)
 		status = "offline";
 	else if (watchdog_get_stopped())
@@ -293,8 +439,95 @@ static int watchdog_set(struct ubus_context *ctx, struct ubus_object *obj,
 	blobmsg_add_string(&b, "status", status);
 	blobmsg_add_u32(&b, "timeout", watchdog_timeout(0));
 	blobmsg_add_u32(&b, "frequency", watchdog_frequency(0));
+	watchdog_dump(&b);
+	ubus_send_reply(ctx, req, b.head);
+
+	return 0;
+}
+
+#ifdef PROCD_PROFILER
+enum {
+	PROFILE_RESET,
+	PROFILE_SLOW_US,
+	__PROFILE_MAX
+};
+
+static const struct blobmsg_policy profile_policy[__PROFILE_MAX] = {
+	[PROFILE_RESET] = { .name = "reset", .type = BLOBMSG_TYPE_BOOL },
+	[PROFILE_SLOW_US] = { .name = "slow_us", .type = BLOBMSG_TYPE_INT32 },
+};
+
+/* slow_us logs every profiled call that took longer, 0 turns it off */
+static int system_profile(struct ubus_context *ctx, struct ubus_object *obj,
+			struct ubus_request_data *req, const char *method,
+			struct blob_attr *msg)
+{
+	struct blob_attr *tb[__PROFILE_MAX];
+
+	blobmsg_parse(profile_policy, __PROFILE_MAX, tb, blob_data(msg), blob_len(msg));
+	if (tb[PROFILE_SLOW_US])
+		prof_slow_threshold(blobmsg_get_u32(tb[PROFILE_SLOW_US]));
+
+	blob_buf_init(&b, 0);
+	prof_dump(&b);
 	ubus_send_reply(ctx, req, b.head);
 
+	if (tb[PROFILE_RESET] && blobmsg_get_bool(tb[PROFILE_RESET]))
+		prof_reset();
+
+	return 0;
+}
+#endif
+
+enum {
+	HEARTBEAT_NAME,
+	HEARTBEAT_TIMEOUT,
+	HEARTBEAT_HEALTHY,
+	HEARTBEAT_REMOVE,
+	__HEARTBEAT_MAX
+};
+
+static const struct blobmsg_policy heartbeat_policy[__HEARTBEAT_MAX] = {
+	[HEARTBEAT_NAME] = { .name = "name", .type = BLOBMSG_TYPE_STRING },
+	[HEARTBEAT_TIMEOUT] = { .name = "timeout", .type = BLOBMSG_TYPE_INT32 },
+	[HEARTBEAT_HEALTHY] = { .name = "healthy", .type = BLOBMSG_TYPE_BOOL },
+	[HEARTBEAT_REMOVE] = { .name = "remove", .type = BLOBMSG_TYPE_BOOL },
+};
+
+/*
+ * The first heartbeat of a name registers it with a timeout in ms, from
+ * then on the watchdog is only petted while it keeps coming in time and
+ * reports healthy.
+ */
+static int watchdog_heartbeat_cb(struct ubus_context *ctx, struct ubus_object *obj,
+			struct ubus_request_data *req, const char *method,
+			struct blob_attr *msg)
+{
+	PROF_SCOPE();
+	struct blob_attr *tb[__HEARTBEAT_MAX];
+	const char *name;
+	bool healthy = true;
+
+	if (!msg)
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	blobmsg_parse(heartbeat_policy, __HEARTBEAT_MAX, tb, blob_data(msg), blob_len(msg));
+	if (!tb[HEARTBEAT_NAME])
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	name = blobmsg_get_string(tb[HEARTBEAT_NAME]);
+	if (tb[HEARTBEAT_REMOVE] && blobmsg_get_bool(tb[HEARTBEAT_REMOVE])) {
+		watchdog_heartbeat_del(name);
+		return 0;
+	}
+
+	if (tb[HEARTBEAT_HEALTHY])
+		healthy = blobmsg_get_bool(tb[HEARTBEAT_HEALTHY]);
+
+	if (watchdog_heartbeat(name, tb[HEARTBEAT_TIMEOUT] ?
+			       blobmsg_get_u32(tb[HEARTBEAT_TIMEOUT]) : 0, healthy))
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
 	return 0;
 }
 
@@ -313,6 +546,7 @@ static int proc_signal(struct ubus_context *ctx, struct ubus_object *obj,
 			struct ubus_request_data *req, const char *method,
 			struct blob_attr *msg)
 {
+	PROF_SCOPE();
 	struct blob_attr *tb[__SIGNAL_MAX];
 
 	if (!msg)
@@ -327,6 +561,86 @@ static int proc_signal(struct ubus_context *ctx, struct ubus_object *obj,
 	return 0;
 }
 
+enum {
+	TIMELINE_BOOTCHART,
+	__TIMELINE_MAX
+};
+
+static const struct blobmsg_policy timeline_policy[__TIMELINE_MAX] = {
+	[TIMELINE_BOOTCHART] = { .name = "bootchart", .type = BLOBMSG_TYPE_STRING },
+};
+
+static int system_timeline(struct ubus_context *ctx, struct ubus_object *obj,
+			struct ubus_request_data *req, const char *method,
+			struct blob_attr *msg)
+{
+	PROF_SCOPE();
+	struct blob_attr *tb[__TIMELINE_MAX];
+
+	blobmsg_parse(timeline_policy, __TIMELINE_MAX, tb, blob_data(msg), blob_len(msg));
+	if (tb[TIMELINE_BOOTCHART] &&
+	    rcS_timeline_bootchart(blobmsg_get_string(tb[TIMELINE_BOOTCHART])))
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	blob_buf_init(&b, 0);
+	rcS_timeline_dump(&b);
+	ubus_send_reply(ctx, req, b.head);
+
+	return 0;
+}
+
+enum {
+	HOTPLUG_RELOAD,
+	__HOTPLUG_MAX
+};
+
+static const struct blobmsg_policy hotplug_policy[__HOTPLUG_MAX] = {
+	[HOTPLUG_RELOAD] = { .name = "reload", .type = BLOBMSG_TYPE_BOOL },
+};
+
+static int system_hotplug(struct ubus_context *ctx, struct ubus_object *obj,
+			struct ubus_request_data *req, const char *method,
+			struct blob_attr *msg)
+{
+	PROF_SCOPE();
+	struct blob_attr *tb[__HOTPLUG_MAX];
+
+	blobmsg_parse(hotplug_policy, __HOTPLUG_MAX, tb, blob_data(msg), blob_len(msg));
+	if (tb[HOTPLUG_RELOAD] && blobmsg_get_bool(tb[HOTPLUG_RELOAD]))
+		hotplug_reload();
+
+	blob_buf_init(&b, 0);
+	hotplug_dump_stats(&b);
+	coldplug_dump_stats(&b);
+	slab_dump(&b);
+	ubus_send_reply(ctx, req, b.head);
+
+	return 0;
+}
+
+static int system_reexec(struct ubus_context *ctx, struct ubus_object *obj,
+			struct ubus_request_data *req, const char *method,
+			struct blob_attr *msg)
+{
+	PROF_SCOPE();
+	if (procd_reexec())
+		return UBUS_STATUS_NOT_SUPPORTED;
+
+	return 0;
+}
+
+static int system_boot(struct ubus_context *ctx, struct ubus_object *obj,
+			struct ubus_request_data *req, const char *method,
+			struct blob_attr *msg)
+{
+	PROF_SCOPE();
+	blob_buf_init(&b, 0);
+	procd_state_dump(&b);
+	ubus_send_reply(ctx, req, b.head);
+
+	return 0;
+}
+
 enum {
 	NAND_PATH,
 	__NAND_MAX
@@ -356,6 +670,7 @@ static int nand_set(struct ubus_context *ctx, struct ubus_object *obj,
 			struct ubus_request_data *req, const char *method,
 			struct blob_attr *msg)
 {
+	PROF_SCOPE();
 	struct blob_attr *tb[__NAND_MAX];
 
 	if (!msg)
@@ -382,7 +697,15 @@ static const struct ubus_method system_methods[] = {
 	UBUS_METHOD_NOARG("info",  system_info),
 	UBUS_METHOD_NOARG("upgrade", system_upgrade),
 	UBUS_METHOD("watchdog", watchdog_set, watchdog_policy),
+	UBUS_METHOD("heartbeat", watchdog_heartbeat_cb, heartbeat_policy),
+#ifdef PROCD_PROFILER
+	UBUS_METHOD("profile", system_profile, profile_policy),
+#endif
 	UBUS_METHOD("signal", proc_signal, signal_policy),
+	UBUS_METHOD("timeline", system_timeline, timeline_policy),
+	UBUS_METHOD("hotplug", system_hotplug, hotplug_policy),
+	UBUS_METHOD_NOARG("boot", system_boot),
+	UBUS_METHOD_NOARG("reexec", system_reexec),
 
 	/* must remain at the end as it ia not always loaded */
 	UBUS_METHOD("nandupgrade", nand_set, nand_policy),
@@ -421,6 +744,8 @@ void ubus_init_system(struct ubus_context *ctx)
 		system_object.n_methods -= 1;
 
 	_ctx = ctx;
+	board_watch();
+	board_build();
 	ret = ubus_add_object(ctx, &system_object);
 	if (ret)
 		ERROR("Failed to add object: %s\n", ubus_strerror(ret));
@@ -11,7 +11,7 @@
  * GNU General Public License for more details.
  */
 
-#define _GNU_SOURCE
+#define _GNU_SOURCE 1
 #include <sys/ptrace.h>
 #include <sys/types.h>
 #include <signal.h>
@@ -22,6 +22,7 @@
 #include <dlfcn.h>
 
 #include "../preload.h"
+#include "../jail/seccomp-filter.h"
 
 #define ERROR(fmt, ...) do { \
 	fprintf(stderr,"perload-jail: "fmt, ## __VA_ARGS__); \
@@ -29,12 +30,54 @@
 
 static main_t __main__;
 
+/*
+ * Let the listed syscalls through and stop in the tracer for any other,
+ * this has to happen after the tracer enabled PTRACE_O_TRACESECCOMP.
+ */
+static void install_trace_filter(const char *known)
+{
+	struct sock_fprog prog;
+	int n = 0, *nrs;
+	char *p = (char *) known;
+
+	nrs = calloc(strlen(known) / 2 + 1, sizeof(*nrs));
+	if (!nrs)
+		return;
+
+	while (*p) {
+		nrs[n++] = strtol(p, &p, 10);
+		if (*p == ',')
+			p++;
+		else if (*p)
+			break;
+	}
+
+	if (seccomp_filter_tree(nrs, n, SECCOMP_RET_TRACE, &prog)) {
+		free(nrs);
+		return;
+	}
+
+	if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) ||
+	    prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog))
+		ERROR("failed to install the trace filter\n");
+
+	free(prog.filter);
+	free(nrs);
+}
+
 static int __preload_main__(int argc, char **argv, char **envp)
 {
+	char *known = getenv("UTRACE_SECCOMP");
+
 	unsetenv("LD_PRELOAD");
 	ptrace(PTRACE_TRACEME);
 	kill(getpid(), SIGSTOP);
 
+	if (known) {
+		install_trace_filter(known);
+		unsetenv("UTRACE_SECCOMP");
+	}
+
 	return (*__main__)(argc, argv, envp);
 }
 
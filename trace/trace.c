@@ -23,15 +23,16 @@
 #include <errno.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 
-#include <libubox/uloop.h>
+#include <libubox/avl.h>
 #include <libubox/blobmsg.h>
 #include <libubox/blobmsg_json.h>
+#include <libubox/utils.h>
 
 #include "../syscall-names.h"
 
 #define _offsetof(a, b) __builtin_offsetof(a,b)
-#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
 #ifdef __amd64__
 #define reg_syscall_nr	_offsetof(struct user, regs.orig_rax)
@@ -57,24 +58,68 @@
 	fprintf(stderr, "utrace: "fmt, ## __VA_ARGS__); \
 } while (0)
 
-static struct uloop_process tracer;
+#ifndef PTRACE_EVENT_SECCOMP
+#define PTRACE_EVENT_SECCOMP	7
+#endif
+#ifndef PTRACE_O_TRACESECCOMP
+#define PTRACE_O_TRACESECCOMP	(1 << PTRACE_EVENT_SECCOMP)
+#endif
+
+#define PROF_BUCKETS	128
+#define PROF_THREADS	10
+
+/*
+ * Latency histogram of a syscall in us, 4 log-linear buckets per power of
+ * two, so percentiles are accurate to 25%.
+ */
+struct syscall_prof {
+	uint32_t count;
+	uint64_t total;
+	uint32_t max;
+	uint32_t hist[PROF_BUCKETS];
+};
+
+/* every process and thread of the traced service */
+struct tracee {
+	struct avl_node avl;
+	struct list_head list;
+	pid_t pid;
+	bool in_syscall;
+	int nr;
+	uint64_t entry;
+	uint32_t syscalls;
+	char comm[16];
+};
+
+static struct avl_tree tracees;
+static LIST_HEAD(retired);
+static struct syscall_prof **prof;
+static int profile;
 static int *syscall_count;
 static struct blob_buf b;
 static int syscall_max;
-static int in_syscall;
+static int use_seccomp;
 static int debug;
 
 static int max_syscall = ARRAY_SIZE(syscall_names);
 
-static void set_syscall(const char *name, int val)
+static int find_syscall(const char *name)
 {
 	int i;
 
 	for (i = 0; i < max_syscall; i++)
-		if (syscall_names[i] && !strcmp(syscall_names[i], name)) {
-			syscall_count[i] = val;
-			return;
-		}
+		if (syscall_names[i] && !strcmp(syscall_names[i], name))
+			return i;
+
+	return -1;
+}
+
+static void set_syscall(const char *name, int val)
+{
+	int i = find_syscall(name);
+
+	if (i >= 0)
+		syscall_count[i] = val;
 }
 
 static void print_syscalls(int policy, const char *json)
@@ -121,36 +166,339 @@ static void print_syscalls(int policy, const char *json)
 
 }
 
-static void tracer_cb(struct uloop_process *c, int ret)
+static int tracee_cmp(const void *k1, const void *k2, void *ptr)
+{
+	return *(const pid_t *) k1 - *(const pid_t *) k2;
+}
+
+static void tracee_comm(struct tracee *t)
+{
+	char path[32];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%d/comm", t->pid);
+	fp = fopen(path, "r");
+	if (!fp)
+		return;
+
+	if (fgets(t->comm, sizeof(t->comm), fp))
+		t->comm[strcspn(t->comm, "\n")] = 0;
+	fclose(fp);
+}
+
+static struct tracee *tracee_get(pid_t pid)
+{
+	struct tracee *t;
+
+	t = avl_find_element(&tracees, &pid, t, avl);
+	if (t)
+		return t;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+
+	t->pid = pid;
+	t->avl.key = &t->pid;
+	avl_insert(&tracees, &t->avl);
+	if (profile)
+		tracee_comm(t);
+	if (debug)
+		fprintf(stderr, "tracing %d\n", pid);
+
+	return t;
+}
+
+static void tracee_del(struct tracee *t)
+{
+	avl_delete(&tracees, &t->avl);
+	/* keep the counters of busy threads around for the profile */
+	if (profile && t->syscalls)
+		list_add_tail(&t->list, &retired);
+	else
+		free(t);
+}
+
+static uint64_t prof_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int prof_bucket(uint32_t us)
+{
+	int e;
+
+	if (us < 4)
+		return us;
+
+	e = 31 - __builtin_clz(us);
+	return 4 * (e - 1) + ((us >> (e - 2)) & 3);
+}
+
+static uint32_t prof_bucket_value(int bucket)
+{
+	if (bucket < 4)
+		return bucket;
+
+	return (uint32_t) (4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+static void prof_enter(struct tracee *t, int nr)
+{
+	t->syscalls++;
+	t->nr = nr;
+	t->entry = prof_now();
+}
+
+static void prof_exit(struct tracee *t)
+{
+	struct syscall_prof *p;
+	uint64_t us;
+
+	if (t->nr < 0 || t->nr >= syscall_max || !t->entry)
+		return;
+
+	p = prof[t->nr];
+	if (!p) {
+		p = prof[t->nr] = calloc(1, sizeof(*p));
+		if (!p)
+			return;
+	}
+
+	us = prof_now() - t->entry;
+	if (us > UINT32_MAX)
+		us = UINT32_MAX;
+
+	p->count++;
+	p->total += us;
+	if (us > p->max)
+		p->max = us;
+	p->hist[prof_bucket(us)]++;
+	t->entry = 0;
+}
+
+static int count_syscall(pid_t pid)
 {
-	if (WIFSTOPPED(ret) && WSTOPSIG(ret) & 0x80) {
-		if (!in_syscall) {
-			int syscall = ptrace(PTRACE_PEEKUSER, c->pid, reg_syscall_nr);
+	int syscall = ptrace(PTRACE_PEEKUSER, pid, reg_syscall_nr);
+
+	if (syscall >= 0 && syscall < syscall_max) {
+		if (debug && !syscall_count[syscall])
+			fprintf(stderr, "%d: %s()\n", pid, syscall_names[syscall]);
+		syscall_count[syscall]++;
+	} else if (debug) {
+		fprintf(stderr, "syscal(%d)\n", syscall);
+	}
 
-			if (syscall < syscall_max) {
-				syscall_count[syscall]++;
-				if (debug)
-					fprintf(stderr, "%s()\n", syscall_names[syscall]);
-			} else if (debug) {
-				fprintf(stderr, "syscal(%d)\n", syscall);
+	return syscall;
+}
+
+/*
+ * Without seccomp every tracee stops on entry and exit of each syscall.
+ * In seccomp mode the tracee only stops on syscalls its filter does not
+ * let through, so it gets resumed with PTRACE_CONT and runs at full speed
+ * otherwise. Forks, vforks and threads are traced as well.
+ */
+static void trace_loop(void)
+{
+	int restart = use_seccomp ? PTRACE_CONT : PTRACE_SYSCALL;
+
+	while (!avl_is_empty(&tracees)) {
+		struct tracee *t;
+		unsigned long msg;
+		int status, sig = 0, event;
+		pid_t pid;
+
+		pid = waitpid(-1, &status, __WALL);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		t = tracee_get(pid);
+		if (!t)
+			continue;
+
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			tracee_del(t);
+			continue;
+		}
+
+		if (!WIFSTOPPED(status))
+			continue;
+
+		event = status >> 16;
+		switch (event) {
+		case PTRACE_EVENT_SECCOMP:
+			count_syscall(pid);
+			t->syscalls++;
+			break;
+		case PTRACE_EVENT_EXEC:
+			if (profile)
+				tracee_comm(t);
+			break;
+		case PTRACE_EVENT_FORK:
+		case PTRACE_EVENT_VFORK:
+		case PTRACE_EVENT_CLONE:
+			if (!ptrace(PTRACE_GETEVENTMSG, pid, 0, &msg))
+				tracee_get(msg);
+			break;
+		case 0:
+			if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+				if (!t->in_syscall)
+					prof_enter(t, count_syscall(pid));
+				else if (profile)
+					prof_exit(t);
+				t->in_syscall = !t->in_syscall;
+			} else if (WSTOPSIG(status) != SIGSTOP && WSTOPSIG(status) != SIGTRAP) {
+				/* pass on real signals */
+				sig = WSTOPSIG(status);
 			}
+			break;
 		}
-		in_syscall = !in_syscall;
-	} else if (WIFEXITED(ret)) {
-		uloop_end();
+
+		ptrace(restart, pid, 0, sig);
+	}
+}
+
+static uint32_t prof_percentile(struct syscall_prof *p, int pct)
+{
+	uint32_t want = ((uint64_t) p->count * pct + 99) / 100;
+	uint32_t sum = 0;
+	int i;
+
+	for (i = 0; i < PROF_BUCKETS; i++) {
+		sum += p->hist[i];
+		if (sum >= want)
+			return prof_bucket_value(i);
+	}
+
+	return p->max;
+}
+
+static void prof_add_thread(struct tracee **top, struct tracee *t)
+{
+	int i, j;
+
+	for (i = 0; i < PROF_THREADS; i++)
+		if (!top[i] || top[i]->syscalls < t->syscalls)
+			break;
+
+	if (i == PROF_THREADS)
 		return;
+
+	for (j = PROF_THREADS - 1; j > i; j--)
+		top[j] = top[j - 1];
+	top[i] = t;
+}
+
+/*
+ * Call counts and the time between syscall entry and exit as seen by the
+ * tracer, which includes the cost of the ptrace stops themselves.
+ */
+static void print_profile(const char *file)
+{
+	struct tracee *top[PROF_THREADS] = { 0 }, *t;
+	struct blob_buf pb = { 0 };
+	void *c, *e;
+	FILE *fp;
+	int i;
+
+	blob_buf_init(&pb, 0);
+	c = blobmsg_open_table(&pb, "syscalls");
+	for (i = 0; i < syscall_max; i++) {
+		struct syscall_prof *p = prof[i];
+
+		if (!p || !syscall_names[i])
+			continue;
+
+		e = blobmsg_open_table(&pb, syscall_names[i]);
+		blobmsg_add_u32(&pb, "count", p->count);
+		blobmsg_add_u64(&pb, "total_us", p->total);
+		blobmsg_add_u32(&pb, "p50_us", prof_percentile(p, 50));
+		blobmsg_add_u32(&pb, "p99_us", prof_percentile(p, 99));
+		blobmsg_add_u32(&pb, "max_us", p->max);
+		blobmsg_close_table(&pb, e);
+	}
+	blobmsg_close_table(&pb, c);
+
+	avl_for_each_element(&tracees, t, avl)
+		prof_add_thread(top, t);
+	list_for_each_entry(t, &retired, list)
+		prof_add_thread(top, t);
+
+	c = blobmsg_open_array(&pb, "threads");
+	for (i = 0; i < PROF_THREADS && top[i]; i++) {
+		e = blobmsg_open_table(&pb, NULL);
+		blobmsg_add_u32(&pb, "pid", top[i]->pid);
+		blobmsg_add_string(&pb, "comm", top[i]->comm);
+		blobmsg_add_u32(&pb, "syscalls", top[i]->syscalls);
+		blobmsg_close_table(&pb, e);
+	}
+	blobmsg_close_array(&pb, c);
+
+	fp = fopen(file, "w");
+	if (fp) {
+		fprintf(fp, "%s", blobmsg_format_json_indent(pb.head, true, 0));
+		fclose(fp);
+		INFO("saving syscall profile to %s\n", file);
+	} else {
+		ERROR("failed to open %s\n", file);
+	}
+	blob_buf_free(&pb);
+}
+
+/* syscalls of a previous trace do not need to stop the tracee again */
+static char *load_baseline(const char *file)
+{
+	static const struct blobmsg_policy policy = { "whitelist", BLOBMSG_TYPE_ARRAY };
+	struct blob_attr *tb, *cur;
+	char *list, *p;
+	int rem, nr;
+
+	blob_buf_init(&b, 0);
+	if (!blobmsg_add_json_from_file(&b, file)) {
+		ERROR("failed to load %s\n", file);
+		return NULL;
+	}
+
+	blobmsg_parse(&policy, 1, &tb, blob_data(b.head), blob_len(b.head));
+	if (!tb) {
+		ERROR("%s is missing the syscall table\n", file);
+		return NULL;
+	}
+
+	p = list = calloc(blobmsg_data_len(tb) / 4 + 16, 8);
+	if (!list)
+		return NULL;
+
+	blobmsg_for_each_attr(cur, tb, rem) {
+		if (blobmsg_type(cur) != BLOBMSG_TYPE_STRING)
+			continue;
+
+		nr = find_syscall(blobmsg_get_string(cur));
+		if (nr < 0)
+			continue;
+
+		syscall_count[nr]++;
+		p += sprintf(p, "%s%d", p == list ? "" : ",", nr);
 	}
-	ptrace(PTRACE_SYSCALL, c->pid, 0, 0);
-	uloop_process_add(&tracer);
+
+	return list;
 }
 
-int main(int argc, char **argv, char **envp)
+int main(int argc, char **argv)
 {
-	char *json = NULL;
+	char *json = NULL, *baseline = NULL, *known = "";
 	int status, ch, policy = EPERM;
+	int options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEFORK |
+		PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC;
 	pid_t child;
 
-	while ((ch = getopt(argc, argv, "f:p:")) != -1) {
+	while ((ch = getopt(argc, argv, "f:p:sw:P")) != -1) {
 		switch (ch) {
 		case 'f':
 			json = optarg;
@@ -158,6 +506,16 @@ int main(int argc, char **argv, char **envp)
 		case 'p':
 			policy = atoi(optarg);
 			break;
+		case 's':
+			use_seccomp = 1;
+			break;
+		case 'P':
+			profile = 1;
+			break;
+		case 'w':
+			use_seccomp = 1;
+			baseline = optarg;
+			break;
 		}
 	}
 
@@ -171,25 +529,29 @@ int main(int argc, char **argv, char **envp)
 		debug = 1;
 	unsetenv("TRACE_DEBUG");
 
+	syscall_max = ARRAY_SIZE(syscall_names);
+	syscall_count = calloc(syscall_max, sizeof(int));
+	prof = calloc(syscall_max, sizeof(*prof));
+	if (baseline) {
+		known = load_baseline(baseline);
+		if (!known)
+			return -1;
+	}
+
 	child = fork();
 
 	if (child == 0) {
 		char **_argv = calloc(argc + 1, sizeof(char *));
-		char **_envp;
-		char preload[] = "LD_PRELOAD=/lib/libpreload-trace.so";
-		int envc = 1;
 		int ret;
 
 		memcpy(_argv, argv, argc * sizeof(char *));
 
-		while (envp[envc++])
-			;
+		setenv("LD_PRELOAD", "/lib/libpreload-trace.so", 1);
+		/* the preload lib installs a filter tracing everything not listed */
+		if (use_seccomp)
+			setenv("UTRACE_SECCOMP", known, 1);
 
-		_envp = calloc(envc, sizeof(char *));
-		memcpy(&_envp[1], _envp, envc * sizeof(char *));
-		*envp = preload;
-
-		ret = execve(_argv[0], _argv, envp);
+		ret = execve(_argv[0], _argv, environ);
 		ERROR("failed to exec %s: %s\n", _argv[0], strerror(errno));
 		return ret;
 	}
@@ -197,23 +559,20 @@ int main(int argc, char **argv, char **envp)
 	if (child < 0)
 		return -1;
 
-	syscall_max = ARRAY_SIZE(syscall_names);
-	syscall_count = calloc(syscall_max, sizeof(int));
 	waitpid(child, &status, 0);
 	if (!WIFSTOPPED(status)) {
 		ERROR("failed to start %s\n", *argv);
 		return -1;
 	}
 
-	ptrace(PTRACE_SETOPTIONS, child, 0, PTRACE_O_TRACESYSGOOD);
-	ptrace(PTRACE_SYSCALL, child, 0, 0);
+	if (use_seccomp)
+		options |= PTRACE_O_TRACESECCOMP;
 
-	uloop_init();
-	tracer.pid = child;
-	tracer.cb = tracer_cb;
-	uloop_process_add(&tracer);
-	uloop_run();
-	uloop_done();
+	avl_init(&tracees, tracee_cmp, false, NULL);
+	tracee_get(child);
+	ptrace(PTRACE_SETOPTIONS, child, 0, options);
+	ptrace(use_seccomp ? PTRACE_CONT : PTRACE_SYSCALL, child, 0, 0);
+	trace_loop();
 
 	if (!json)
 		if (asprintf(&json, "/tmp/%s.%u.json", basename(*argv), child) < 0)
@@ -221,5 +580,12 @@ int main(int argc, char **argv, char **envp)
 
 	print_syscalls(policy, json);
 
+	if (profile && json) {
+		char *path;
+
+		if (asprintf(&path, "%s.profile", json) >= 0)
+			print_profile(path);
+	}
+
 	return 0;
 }
@@ -12,31 +12,125 @@
  * GNU General Public License for more details.
  */
 
+#include <sys/inotify.h>
 #include <sys/resource.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
+#include <libgen.h>
+#include <limits.h>
 
 #include "procd.h"
 
+/* reconnect backoff in ms, reset whenever the socket shows up */
+#define UBUS_RETRY_MIN	10
+#define UBUS_RETRY_MAX	1000
+
 char *ubus_socket = NULL;
 static struct ubus_context *ctx;
 static struct uloop_timeout ubus_timer;
+static struct uloop_fd ubus_inotify = { .fd = -1 };
+static int ubus_retry;
+
+static const char *
+ubus_socket_path(void)
+{
+	return ubus_socket ? ubus_socket : UBUS_UNIX_SOCKET;
+}
+
+static void
+ubus_watch_stop(void)
+{
+	if (ubus_inotify.fd < 0)
+		return;
+
+	uloop_fd_delete(&ubus_inotify);
+	close(ubus_inotify.fd);
+	ubus_inotify.fd = -1;
+}
+
+static void
+ubus_inotify_cb(struct uloop_fd *fd, unsigned int events)
+{
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	char path[PATH_MAX];
+	const char *name;
+	struct inotify_event *ev;
+	bool found = false;
+	int len, i;
+
+	snprintf(path, sizeof(path), "%s", ubus_socket_path());
+	name = basename(path);
+
+	while ((len = read(fd->fd, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < len; i += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *) &buf[i];
+			if (ev->len && !strcmp(ev->name, name))
+				found = true;
+		}
+	}
+
+	if (!found)
+		return;
+
+	DEBUG(2, "ubus socket appeared\n");
+	ubus_retry = UBUS_RETRY_MIN;
+	uloop_timeout_set(&ubus_timer, 0);
+}
+
+/* get woken up as soon as ubusd creates its socket */
+static void
+ubus_watch_start(void)
+{
+	char path[PATH_MAX];
+
+	if (ubus_inotify.fd >= 0)
+		return;
+
+	ubus_inotify.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ubus_inotify.fd < 0)
+		return;
+
+	snprintf(path, sizeof(path), "%s", ubus_socket_path());
+	if (inotify_add_watch(ubus_inotify.fd, dirname(path), IN_CREATE | IN_MOVED_TO) < 0) {
+		close(ubus_inotify.fd);
+		ubus_inotify.fd = -1;
+		return;
+	}
+
+	ubus_inotify.cb = ubus_inotify_cb;
+	uloop_fd_add(&ubus_inotify, ULOOP_READ);
+}
+
+static void
+ubus_retry_later(void)
+{
+	uloop_timeout_set(&ubus_timer, ubus_retry);
+	ubus_retry *= 2;
+	if (ubus_retry > UBUS_RETRY_MAX)
+		ubus_retry = UBUS_RETRY_MAX;
+}
 
 static void
 ubus_reconnect_cb(struct uloop_timeout *timeout)
 {
-	if (!ubus_reconnect(ctx, ubus_socket))
+	if (!ubus_reconnect(ctx, ubus_socket)) {
+		DEBUG(2, "Reconnected to ubus, id=%08x\n", ctx->local_id);
+		ubus_watch_stop();
 		ubus_add_uloop(ctx);
-	else
-		uloop_timeout_set(timeout, 2000);
+	} else {
+		ubus_retry_later();
+	}
 }
 
 static void
 ubus_disconnect_cb(struct ubus_context *ctx)
 {
 	ubus_timer.cb = ubus_reconnect_cb;
-	uloop_timeout_set(&ubus_timer, 2000);
+	ubus_retry = UBUS_RETRY_MIN;
+	ubus_watch_start();
+	ubus_retry_later();
 }
 
 static void
@@ -46,10 +140,11 @@ ubus_connect_cb(struct uloop_timeout *timeout)
 
 	if (!ctx) {
 		DEBUG(4, "Connection to ubus failed\n");
-		uloop_timeout_set(&ubus_timer, 1000);
+		ubus_retry_later();
 		return;
 	}
 
+	ubus_watch_stop();
 	ctx->connection_lost = ubus_disconnect_cb;
 	ubus_init_service(ctx);
 	ubus_init_system(ctx);
@@ -64,5 +159,7 @@ void
 procd_connect_ubus(void)
 {
 	ubus_timer.cb = ubus_connect_cb;
-	uloop_timeout_set(&ubus_timer, 1000);
+	ubus_retry = UBUS_RETRY_MIN;
+	ubus_watch_start();
+	uloop_timeout_set(&ubus_timer, 0);
 }
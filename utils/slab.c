@@ -0,0 +1,311 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libubox/list.h>
+#include <libubox/utils.h>
+#include <libubox/blobmsg.h>
+
+#include "slab.h"
+
+/* objects of 128 bytes up to 2 kB, header included, larger ones are malloced */
+#define SLAB_MIN_SHIFT	7
+#define SLAB_CLASSES	5
+#define SLAB_PAGE_OBJS	16
+
+struct slab_class;
+
+struct slab_page {
+	struct list_head list;
+	struct slab_class *cls;
+	void *free;
+	unsigned int used;
+	char data[] __attribute__((aligned(8)));
+};
+
+/* in front of every object, NULL for the ones that did not fit a class */
+union slab_hdr {
+	struct slab_page *page;
+	uint64_t align;
+};
+
+struct slab_blob {
+	unsigned int refs;
+	uint32_t pad;
+	struct blob_attr attr[];
+};
+
+struct slab_stats {
+	unsigned int used;
+	unsigned int used_max;
+	unsigned int pages;
+	unsigned int pages_max;
+	uint64_t allocs;
+};
+
+struct slab_class {
+	size_t size;
+	struct list_head partial;
+	struct list_head full;
+	/* one empty page is kept around so that a single event does not map one */
+	struct slab_page *spare;
+	struct slab_stats stats;
+};
+
+static struct slab_class classes[SLAB_CLASSES];
+static struct slab_stats large;
+static uint64_t shared;
+
+static void
+slab_init(void)
+{
+	int i;
+
+	for (i = 0; i < SLAB_CLASSES; i++) {
+		classes[i].size = 1 << (SLAB_MIN_SHIFT + i);
+		INIT_LIST_HEAD(&classes[i].partial);
+		INIT_LIST_HEAD(&classes[i].full);
+	}
+}
+
+static void
+slab_stats_inc(struct slab_stats *s)
+{
+	s->allocs++;
+	if (++s->used > s->used_max)
+		s->used_max = s->used;
+}
+
+static struct slab_page *
+slab_page_new(struct slab_class *cls)
+{
+	struct slab_page *page;
+	char *obj;
+	int i;
+
+	page = malloc(sizeof(*page) + SLAB_PAGE_OBJS * cls->size);
+	if (!page)
+		return NULL;
+
+	page->cls = cls;
+	page->used = 0;
+	page->free = NULL;
+	for (i = SLAB_PAGE_OBJS - 1; i >= 0; i--) {
+		obj = page->data + i * cls->size;
+		*(void **) obj = page->free;
+		page->free = obj;
+	}
+	list_add(&page->list, &cls->partial);
+
+	if (++cls->stats.pages > cls->stats.pages_max)
+		cls->stats.pages_max = cls->stats.pages;
+
+	return page;
+}
+
+void *
+slab_alloc(size_t size)
+{
+	size_t len = size + sizeof(union slab_hdr);
+	struct slab_class *cls = NULL;
+	struct slab_page *page;
+	union slab_hdr *hdr;
+	int i;
+
+	if (!classes[0].size)
+		slab_init();
+
+	for (i = 0; i < SLAB_CLASSES; i++) {
+		if (len <= classes[i].size) {
+			cls = &classes[i];
+			break;
+		}
+	}
+
+	if (!cls) {
+		hdr = calloc(1, len);
+		if (!hdr)
+			return NULL;
+		hdr->page = NULL;
+		slab_stats_inc(&large);
+		return hdr + 1;
+	}
+
+	if (list_empty(&cls->partial) && !slab_page_new(cls))
+		return NULL;
+
+	page = list_first_entry(&cls->partial, struct slab_page, list);
+	if (page == cls->spare)
+		cls->spare = NULL;
+
+	hdr = page->free;
+	page->free = *(void **) hdr;
+	if (!page->free)
+		list_move(&page->list, &cls->full);
+	page->used++;
+	slab_stats_inc(&cls->stats);
+
+	hdr->page = page;
+	memset(hdr + 1, 0, size);
+
+	return hdr + 1;
+}
+
+void
+slab_free(void *ptr)
+{
+	union slab_hdr *hdr;
+	struct slab_page *page;
+	struct slab_class *cls;
+
+	if (!ptr)
+		return;
+
+	hdr = (union slab_hdr *) ptr - 1;
+	page = hdr->page;
+	if (!page) {
+		large.used--;
+		free(hdr);
+		return;
+	}
+
+	cls = page->cls;
+	cls->stats.used--;
+
+	if (!page->free)
+		list_move(&page->list, &cls->partial);
+	*(void **) hdr = page->free;
+	page->free = hdr;
+
+	if (--page->used)
+		return;
+
+	if (!cls->spare) {
+		cls->spare = page;
+		return;
+	}
+
+	list_del(&page->list);
+	cls->stats.pages--;
+	free(page);
+}
+
+struct blob_attr *
+slab_blob_dup(const struct blob_attr *attr)
+{
+	struct slab_blob *sb;
+
+	sb = slab_alloc(sizeof(*sb) + blob_pad_len(attr));
+	if (!sb)
+		return NULL;
+
+	sb->refs = 1;
+	memcpy(sb->attr, attr, blob_pad_len(attr));
+
+	return sb->attr;
+}
+
+struct blob_attr *
+slab_blob_get(struct blob_attr *attr)
+{
+	struct slab_blob *sb;
+
+	if (!attr)
+		return NULL;
+
+	sb = container_of(attr, struct slab_blob, attr[0]);
+	sb->refs++;
+	shared++;
+
+	return attr;
+}
+
+void
+slab_blob_put(struct blob_attr *attr)
+{
+	struct slab_blob *sb;
+
+	if (!attr)
+		return;
+
+	sb = container_of(attr, struct slab_blob, attr[0]);
+	if (!--sb->refs)
+		slab_free(sb);
+}
+
+void
+slab_event_begin(struct slab_event *ev, const struct blob_attr *src)
+{
+	ev->src = src;
+	ev->copy = NULL;
+}
+
+struct blob_attr *
+slab_event_ref(struct slab_event *ev, struct blob_attr *attr)
+{
+	if (!ev || attr != ev->src)
+		return slab_blob_dup(attr);
+
+	if (!ev->copy) {
+		ev->copy = slab_blob_dup(attr);
+		if (!ev->copy)
+			return NULL;
+	}
+
+	return slab_blob_get(ev->copy);
+}
+
+void
+slab_event_end(struct slab_event *ev)
+{
+	slab_blob_put(ev->copy);
+	ev->copy = NULL;
+	ev->src = NULL;
+}
+
+static void
+slab_dump_stats(struct blob_buf *b, const char *name, struct slab_stats *s)
+{
+	void *c = blobmsg_open_table(b, name);
+
+	blobmsg_add_u32(b, "used", s->used);
+	blobmsg_add_u32(b, "used_max", s->used_max);
+	if (s != &large) {
+		blobmsg_add_u32(b, "pages", s->pages);
+		blobmsg_add_u32(b, "pages_max", s->pages_max);
+	}
+	blobmsg_add_u64(b, "allocs", s->allocs);
+	blobmsg_close_table(b, c);
+}
+
+void
+slab_dump(struct blob_buf *b)
+{
+	char name[8];
+	void *c;
+	int i;
+
+	if (!classes[0].size)
+		slab_init();
+
+	c = blobmsg_open_table(b, "slab");
+	for (i = 0; i < SLAB_CLASSES; i++) {
+		snprintf(name, sizeof(name), "%zu", classes[i].size);
+		slab_dump_stats(b, name, &classes[i].stats);
+	}
+	slab_dump_stats(b, "large", &large);
+	blobmsg_add_u64(b, "shared", shared);
+	blobmsg_close_table(b, c);
+}
@@ -0,0 +1,46 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __PROCD_SLAB_H
+#define __PROCD_SLAB_H
+
+#include <libubox/blob.h>
+
+/*
+ * Size class pools for the short lived records of the event paths, a
+ * queued hotplug command, a trigger job, a button timer. Memory given back
+ * is reused for the next event instead of fragmenting the heap, and pages
+ * that run empty are returned to it.
+ */
+void *slab_alloc(size_t size);
+void slab_free(void *ptr);
+
+/* refcounted blob copies, shared by all consumers of one event */
+struct blob_attr *slab_blob_dup(const struct blob_attr *attr);
+struct blob_attr *slab_blob_get(struct blob_attr *attr);
+void slab_blob_put(struct blob_attr *attr);
+
+/*
+ * The event currently being dispatched. Consumers asking for a copy of it
+ * all get a reference to the same one, made on first use.
+ */
+struct slab_event {
+	const struct blob_attr *src;
+	struct blob_attr *copy;
+};
+
+struct blob_attr *slab_event_ref(struct slab_event *ev, struct blob_attr *attr);
+void slab_event_begin(struct slab_event *ev, const struct blob_attr *src);
+void slab_event_end(struct slab_event *ev);
+
+void slab_dump(struct blob_buf *b);
+
+#endif
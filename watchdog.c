@@ -19,8 +19,10 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include <time.h>
 #include <unistd.h>
 
+#include <libubox/avl-cmp.h>
 #include <libubox/uloop.h>
 
 #include "procd.h"
@@ -28,10 +30,47 @@
 
 #define WDT_PATH	"/dev/watchdog"
 
+/* lag histogram buckets: < 1ms, < 2ms, < 4ms ... and everything above */
+#define WDT_LAG_BUCKETS	14
+
+/*
+ * Clients that have to check in at least every timeout ms for the watchdog
+ * to be petted, a client can also declare itself unhealthy right away.
+ */
+struct wdt_heartbeat {
+	struct avl_node avl;
+	uint32_t last;
+	uint32_t timeout;
+	bool healthy;
+	bool failed;
+};
+
 static struct uloop_timeout wdt_timeout;
 static int wdt_fd = -1;
 static int wdt_frequency = 5;
 
+/* how late the timer fired, 0 for a tick that was not scheduled */
+static uint32_t wdt_expected;
+static uint32_t wdt_lag_limit;
+static struct {
+	uint32_t last;
+	uint32_t max;
+	uint64_t total;
+	uint32_t ticks;
+	uint32_t skipped;
+	uint32_t hist[WDT_LAG_BUCKETS];
+} wdt_lag;
+
+static struct avl_tree wdt_heartbeats;
+
+static uint32_t watchdog_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 void watchdog_ping(void)
 {
 	DEBUG(4, "Ping\n");
@@ -39,20 +78,164 @@ void watchdog_ping(void)
 		ERROR("WDT failed to write: %s\n", strerror(errno));
 }
 
+static void watchdog_lag_add(uint32_t lag)
+{
+	int i = 0;
+
+	while (i < WDT_LAG_BUCKETS - 1 && lag >= (1U << i))
+		i++;
+
+	wdt_lag.hist[i]++;
+	wdt_lag.last = lag;
+	wdt_lag.total += lag;
+	wdt_lag.ticks++;
+	if (lag > wdt_lag.max)
+		wdt_lag.max = lag;
+}
+
+static bool watchdog_healthy(uint32_t now, uint32_t lag)
+{
+	struct wdt_heartbeat *hb;
+	bool ret = true;
+
+	if (wdt_lag_limit && lag > wdt_lag_limit) {
+		ERROR("WDT not petted, procd is %ums late\n", lag);
+		ret = false;
+	}
+
+	if (!wdt_heartbeats.comp)
+		return ret;
+
+	avl_for_each_element(&wdt_heartbeats, hb, avl) {
+		bool failed = !hb->healthy || now - hb->last > hb->timeout;
+
+		/* only log the transition, the skipped ticks are counted */
+		if (failed && !hb->failed)
+			ERROR("WDT not petted, %s is %s\n", (char *) hb->avl.key,
+			      hb->healthy ? "not responding" : "unhealthy");
+		hb->failed = failed;
+		if (failed)
+			ret = false;
+	}
+
+	return ret;
+}
+
 static void watchdog_timeout_cb(struct uloop_timeout *t)
 {
-	watchdog_ping();
+	uint32_t now = watchdog_now();
+	uint32_t lag = 0;
+
+	if (wdt_expected) {
+		lag = now > wdt_expected ? now - wdt_expected : 0;
+		watchdog_lag_add(lag);
+	}
+
+	if (watchdog_healthy(now, lag))
+		watchdog_ping();
+	else
+		wdt_lag.skipped++;
+
+	wdt_expected = now + wdt_frequency * 1000;
 	uloop_timeout_set(t, wdt_frequency * 1000);
 }
 
 void watchdog_set_stopped(bool val)
 {
+	wdt_expected = 0;
 	if (val)
 		uloop_timeout_cancel(&wdt_timeout);
 	else
 		watchdog_timeout_cb(&wdt_timeout);
 }
 
+uint32_t watchdog_lag_limit(int limit)
+{
+	if (limit >= 0)
+		wdt_lag_limit = limit;
+
+	return wdt_lag_limit;
+}
+
+int watchdog_heartbeat(const char *name, uint32_t timeout, bool healthy)
+{
+	struct wdt_heartbeat *hb;
+	char *key;
+
+	if (!wdt_heartbeats.comp)
+		avl_init(&wdt_heartbeats, avl_strcmp, false, NULL);
+
+	hb = avl_find_element(&wdt_heartbeats, name, hb, avl);
+	if (!hb) {
+		if (!timeout)
+			return -1;
+
+		hb = calloc_a(sizeof(*hb), &key, strlen(name) + 1);
+		if (!hb)
+			return -1;
+
+		hb->avl.key = strcpy(key, name);
+		avl_insert(&wdt_heartbeats, &hb->avl);
+		DEBUG(2, "Watchdog heartbeat %s registered\n", name);
+	}
+
+	if (timeout)
+		hb->timeout = timeout;
+	hb->healthy = healthy;
+	hb->last = watchdog_now();
+
+	return 0;
+}
+
+void watchdog_heartbeat_del(const char *name)
+{
+	struct wdt_heartbeat *hb;
+
+	if (!wdt_heartbeats.comp)
+		return;
+
+	hb = avl_find_element(&wdt_heartbeats, name, hb, avl);
+	if (!hb)
+		return;
+
+	avl_delete(&wdt_heartbeats, &hb->avl);
+	free(hb);
+}
+
+void watchdog_dump(struct blob_buf *b)
+{
+	struct wdt_heartbeat *hb;
+	uint32_t now = watchdog_now();
+	void *c, *a;
+	int i;
+
+	c = blobmsg_open_table(b, "lag");
+	blobmsg_add_u32(b, "limit", wdt_lag_limit);
+	blobmsg_add_u32(b, "ticks", wdt_lag.ticks);
+	blobmsg_add_u32(b, "skipped", wdt_lag.skipped);
+	blobmsg_add_u32(b, "last_ms", wdt_lag.last);
+	blobmsg_add_u32(b, "max_ms", wdt_lag.max);
+	blobmsg_add_u32(b, "avg_ms", wdt_lag.ticks ? wdt_lag.total / wdt_lag.ticks : 0);
+	a = blobmsg_open_array(b, "histogram");
+	for (i = 0; i < WDT_LAG_BUCKETS; i++)
+		blobmsg_add_u32(b, NULL, wdt_lag.hist[i]);
+	blobmsg_close_array(b, a);
+	blobmsg_close_table(b, c);
+
+	if (!wdt_heartbeats.comp || avl_is_empty(&wdt_heartbeats))
+		return;
+
+	c = blobmsg_open_table(b, "heartbeats");
+	avl_for_each_element(&wdt_heartbeats, hb, avl) {
+		a = blobmsg_open_table(b, hb->avl.key);
+		blobmsg_add_u32(b, "timeout", hb->timeout);
+		blobmsg_add_u32(b, "age_ms", now - hb->last);
+		blobmsg_add_u8(b, "healthy", !hb->failed && hb->healthy);
+		blobmsg_close_table(b, a);
+	}
+	blobmsg_close_table(b, c);
+}
+
 bool watchdog_get_stopped(void)
 {
 	return !wdt_timeout.pending;
@@ -15,6 +15,8 @@
 #ifndef __PROCD_WATCHDOG_H
 #define __PROCD_WATCHDOG_H
 
+#include <libubox/blobmsg.h>
+
 void watchdog_init(int preinit);
 char* watchdog_fd(void);
 int watchdog_timeout(int timeout);
@@ -23,5 +25,9 @@ void watchdog_set_stopped(bool val);
 bool watchdog_get_stopped(void);
 void watchdog_no_cloexec(void);
 void watchdog_ping(void);
+uint32_t watchdog_lag_limit(int limit);
+int watchdog_heartbeat(const char *name, uint32_t timeout, bool healthy);
+void watchdog_heartbeat_del(const char *name);
+void watchdog_dump(struct blob_buf *b);
 
 #endif